@@ -6,6 +6,14 @@ defmodule JSockDClient.JsServerManager do
   use GenServer
   require Logger
 
+  # Maps command source to the hash that jsockd reported for it, so that the
+  # socket processes can send the hash in place of the source.
+  @command_hashes_table :jsockd_client_command_hashes
+
+  # Clients that generate commands dynamically would otherwise remember hashes
+  # without limit.
+  @max_command_hashes 1024
+
   @impl true
   def init(
         opts = %{
@@ -23,6 +31,8 @@ defmodule JSockDClient.JsServerManager do
       ) do
     n_threads = n_threads || :erlang.system_info(:logical_processors_online)
 
+    :ets.new(@command_hashes_table, [:set, :public, :named_table, read_concurrency: true])
+
     uid = :crypto.strong_rand_bytes(16) |> Base.encode16()
 
     tmp = System.tmp_dir()
@@ -254,6 +264,8 @@ defmodule JSockDClient.JsServerManager do
 
   defp start_socket_thread(sock) do
     spawn_link(fn ->
+      use_hashes? = enable_command_hashes(sock)
+
       loop = fn loop ->
         receive do
           {:send, message_uuid, function, argument, from, opts, reply_pid} ->
@@ -265,10 +277,12 @@ defmodule JSockDClient.JsServerManager do
               raise "Function or argument contains null byte: #{inspect(function)}, #{inspect(argument)}"
             end
 
-            :ok = :socket.send(sock, [message_uuid, "\x00", function, "\x00", argument, "\x00"])
+            query = if use_hashes?, do: hashed_query(function), else: function
+
+            :ok = :socket.send(sock, [message_uuid, "\x00", query, "\x00", argument, "\x00"])
 
             reply =
-              recv_loop(sock, message_uuid, from, opts, reply_pid)
+              recv_loop(sock, message_uuid, function, query, argument, opts)
 
             send(reply_pid, {:send_reply, from, reply})
         end
@@ -280,38 +294,71 @@ defmodule JSockDClient.JsServerManager do
     end)
   end
 
-  defp recv_loop(sock, message_uuid, from, opts, reply_pid, acc \\ []) do
-    {:ok, data} = :socket.recv(sock, 0)
-    acc = [data | acc]
+  # Asks jsockd to report the hash of each command sent as source. Returns false
+  # if jsockd doesn't support command hashes.
+  defp enable_command_hashes(sock) do
+    :ok = :socket.send(sock, "?commandhashes\x00")
+    # An older jsockd responds with 'bad command'.
+    {reply, ""} = recv_record(sock, "")
+    reply == "commandhashes"
+  end
 
-    cond do
-      String.ends_with?(data, "\n") ->
-        reply = Enum.reverse(acc) |> Enum.join()
-        [uuid, contents] = String.split(reply, " ", parts: 2)
+  defp hashed_query(function) do
+    case :ets.lookup(@command_hashes_table, function) do
+      [{_, hash}] -> "#" <> hash
+      [] -> function
+    end
+  end
 
-        if uuid != message_uuid do
-          raise "Mismatched message UUID received: expected #{inspect(message_uuid)}, got #{inspect(uuid)}"
-        end
+  defp remember_command_hash(function, hash) do
+    # Not worth it for commands shorter than their hash.
+    if byte_size(function) > byte_size(hash) + 1 do
+      if :ets.info(@command_hashes_table, :size) >= @max_command_hashes do
+        :ets.delete_all_objects(@command_hashes_table)
+      end
 
-        recv_loop_inner(
-          sock,
-          String.replace_trailing(contents, "\n", ""),
-          message_uuid,
-          from,
-          opts,
-          reply_pid
-        )
+      :ets.insert(@command_hashes_table, {function, hash})
+    end
+  end
 
-      String.contains?(data, "\n") ->
-        raise "Unexpected data received: #{inspect(acc)}"
+  # Returns the next record (without its newline) and any data received after
+  # it, as jsockd may send several records at once (e.g. a command_hash record
+  # followed by the response).
+  defp recv_record(sock, buf) do
+    case String.split(buf, "\n", parts: 2) do
+      [record, rest] ->
+        {record, rest}
+
+      [_] ->
+        {:ok, data} = :socket.recv(sock, 0)
+        recv_record(sock, buf <> data)
+    end
+  end
+
+  defp recv_loop(sock, message_uuid, function, query, argument, opts, buf \\ "") do
+    {reply, buf} = recv_record(sock, buf)
+    [uuid, contents] = String.split(reply, " ", parts: 2)
 
-      true ->
-        recv_loop(sock, message_uuid, from, opts, reply_pid, acc)
+    if uuid != message_uuid do
+      raise "Mismatched message UUID received: expected #{inspect(message_uuid)}, got #{inspect(uuid)}"
     end
+
+    recv_loop_inner(sock, contents, message_uuid, function, query, argument, opts, buf)
   end
 
-  defp recv_loop_inner(sock, data, message_uuid, from, opts, reply_pid) do
+  defp recv_loop_inner(sock, data, message_uuid, function, query, argument, opts, buf) do
     case data do
+      "command_hash " <> hash ->
+        remember_command_hash(function, hash)
+        recv_loop(sock, message_uuid, function, query, argument, opts, buf)
+
+      "unknown_command " <> _ when query != function ->
+        # jsockd no longer has the command whose hash was sent, so send the
+        # source instead.
+        :ets.delete(@command_hashes_table, function)
+        :ok = :socket.send(sock, [message_uuid, "\x00", function, "\x00", argument, "\x00"])
+        recv_loop(sock, message_uuid, function, function, argument, opts, buf)
+
       "exception " <> except ->
         {:error, Jason.decode!(except)}
 
@@ -335,7 +382,36 @@ defmodule JSockDClient.JsServerManager do
 
         :ok = :socket.send(sock, [message_uuid, "\x00", response, "\x00"])
 
-        recv_loop(sock, message_uuid, from, opts, reply_pid)
+        recv_loop(sock, message_uuid, function, query, argument, opts, buf)
+
+      "messages " <> msgs ->
+        response =
+          try do
+            msgs = Jason.decode!(msgs, opts[:json_decode_opts] || [])
+
+            # Without a batch handler, the messages are handled one at a time.
+            Jason.encode!(
+              cond do
+                opts[:batch_message_handler] ->
+                  opts[:batch_message_handler].(msgs)
+
+                opts[:message_handler] ->
+                  Enum.map(msgs, opts[:message_handler])
+
+                true ->
+                  Enum.map(msgs, fn _ -> nil end)
+              end
+            )
+          rescue
+            e ->
+              # Ignore any error response from :socket.send as we're about to raise anyway
+              :socket.send(sock, [message_uuid, "\x00internal_error\x00"])
+              reraise e, __STACKTRACE__
+          end
+
+        :ok = :socket.send(sock, [message_uuid, "\x00", response, "\x00"])
+
+        recv_loop(sock, message_uuid, function, query, argument, opts, buf)
     end
   end
 
@@ -14,6 +14,7 @@ defmodule JSockDClient do
   Optional keyword arguments:
 
     * `message_handler` is a function that receives a message and returns a value that can be serialized via `Jason.encode!(message, jason_encode_opts)`.
+    * `batch_message_handler` is a function that receives the list of messages sent by `JSockD.sendMessages` and returns a list with one response for each message. If it is not given, the messages are passed to `message_handler` one at a time.
     * `jason_encode_opts` is a keyword list of options passed to `Jason.encode!/2` when serializing the response from the `message_handler`.
 
   The first argument passed to the JavaScript function is the precompiled bytecode module.
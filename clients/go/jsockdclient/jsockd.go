@@ -52,16 +52,31 @@ const JSockDVersion = "0.1.5"
 
 const chanBufferSize = 64
 
+// Sent followed by a command's hash in place of its source.
+const commandHashPrefix = "#"
+
+// The number of command hashes remembered (see hashedQuery). Clients that
+// generate commands dynamically would otherwise remember hashes without limit.
+const maxCommandHashes = 1024
+
 var logLineRegex = regexp.MustCompile(`(\*|\$) jsockd ([^ ]+) \[([^][]+)\] (.*)`)
 
 var nextCommandId uint64
 
+// ErrOverloaded is returned when the JSockD server rejects a command without
+// executing it because too many commands are queued (see the -q and -qt server
+// options). The command can be retried later.
+var ErrOverloaded = errors.New("jsockd server overloaded")
+
 type command struct {
 	id             string
 	query          string
 	paramJson      string
 	responseChan   chan RawResponse
 	messageHandler func(jsonMessage string) (string, error)
+	// Handles the arrays of messages sent by JSockD.sendMessages. If nil, the
+	// messages are passed to messageHandler one at a time.
+	batchMessageHandler func(jsonMessages string) (string, error)
 }
 
 // RawResponse represents the raw response to a command sent to the JSockD
@@ -69,7 +84,10 @@ type command struct {
 type RawResponse struct {
 	// True iff the command raised an exception. When true, ResultJson is the
 	// JSON blob sent by the server containing information about the error.
-	Exception  bool
+	Exception bool
+	// True iff the server rejected the command without executing it. When
+	// true, ResultJson is a JSON string giving the reason.
+	Overloaded bool
 	ResultJson string
 }
 
@@ -106,6 +124,10 @@ type jSockDInternalClient struct {
 	lastRestart        time.Time
 	quit               atomic.Bool
 	process            *os.Process
+	// Maps command source to the hash that the server reported for it, so
+	// that the hash can be sent in place of the source.
+	commandHashes      map[string]string
+	commandHashesMutex sync.Mutex
 }
 
 const messageHandlerInternalError = "internal_error"
@@ -235,12 +257,13 @@ func initJSockDClient(config Config, jsockdExec string) (*JSockDClient, error) {
 
 	connChans := make([]chan command, readyCount)
 	iclient := &jSockDInternalClient{
-		conns:        conns,
-		connChans:    connChans,
-		config:       config,
-		cmd:          cmd,
-		socketTmpdir: socketTmpdir,
-		process:      cmd.Process,
+		conns:         conns,
+		connChans:     connChans,
+		config:        config,
+		cmd:           cmd,
+		socketTmpdir:  socketTmpdir,
+		process:       cmd.Process,
+		commandHashes: make(map[string]string),
 	}
 
 	client := &JSockDClient{}
@@ -285,7 +308,7 @@ func initJSockDClient(config Config, jsockdExec string) (*JSockDClient, error) {
 // response. The parameter is serialized to JSON via json.Marshal and the result
 // is deserialized from JSON via json.Unmarshal.
 func SendCommand[ResponseT any](client *JSockDClient, query string, jsonParam any) (Response[ResponseT], error) {
-	return sendCommand[ResponseT](client.iclient.Load(), query, jsonParam, nil)
+	return sendCommand[ResponseT](client.iclient.Load(), query, jsonParam, nil, nil)
 }
 
 // SendCommandWithMessageHandler is like SendCommand but with a message
@@ -298,27 +321,44 @@ func SendCommand[ResponseT any](client *JSockDClient, query string, jsonParam an
 // Note that messageHandler, when called, will execute in a different
 // goroutine to the one that called SendCommandWithMessageHandler. This
 // goroutine is guaranteed to have finished executing by the time
-// SendCommandWithMessageHandler returns.
+// SendCommandWithMessageHandler returns. Messages sent by the command via
+// JSockD.sendMessageAsync are handled concurrently, each in its own
+// goroutine.
 func SendCommandWithMessageHandler[ResponseT any, MessageT any, MessageResponseT any](client *JSockDClient, query string, jsonParam any, messageHandler func(message MessageT) (MessageResponseT, error)) (Response[ResponseT], error) {
+	return SendCommandWithMessageHandlers[ResponseT](client, query, jsonParam, messageHandler, nil)
+}
+
+// SendCommandWithMessageHandlers is like SendCommandWithMessageHandler but
+// with an additional handler for the arrays of messages that a command sends
+// in one round trip via JSockD.sendMessages. batchMessageHandler must return
+// one response for each message, in the same order. If batchMessageHandler
+// is nil, the messages are passed to messageHandler one at a time.
+func SendCommandWithMessageHandlers[ResponseT any, MessageT any, MessageResponseT any](client *JSockDClient, query string, jsonParam any, messageHandler func(message MessageT) (MessageResponseT, error), batchMessageHandler func(messages []MessageT) ([]MessageResponseT, error)) (Response[ResponseT], error) {
+	var msgHandlerErrMutex sync.Mutex
 	var msgHandlerErr error
-	wrappedHandler := func(jsonMessage string) (string, error) {
-		var message MessageT
-		msgHandlerErr = json.Unmarshal([]byte(jsonMessage), &message)
-		if msgHandlerErr != nil {
-			return "", msgHandlerErr
-		}
-		var response MessageResponseT
-		response, msgHandlerErr = messageHandler(message)
-		if msgHandlerErr != nil {
-			return "", msgHandlerErr
-		}
-		j, msgHandlerErr := json.Marshal(response)
-		if msgHandlerErr != nil {
-			return "", msgHandlerErr
+	wrap := func(handle func(jsonMessage string) (string, error)) func(jsonMessage string) (string, error) {
+		return func(jsonMessage string) (string, error) {
+			response, err := handle(jsonMessage)
+			if err != nil {
+				msgHandlerErrMutex.Lock()
+				if msgHandlerErr == nil {
+					msgHandlerErr = err
+				}
+				msgHandlerErrMutex.Unlock()
+			}
+			return response, err
 		}
-		return string(j), nil
 	}
-	res, err := sendCommand[ResponseT](client.iclient.Load(), query, jsonParam, wrappedHandler)
+	wrappedHandler := wrap(func(jsonMessage string) (string, error) {
+		return callTypedMessageHandler(jsonMessage, messageHandler)
+	})
+	var wrappedBatchHandler func(jsonMessages string) (string, error)
+	if batchMessageHandler != nil {
+		wrappedBatchHandler = wrap(func(jsonMessages string) (string, error) {
+			return callTypedMessageHandler(jsonMessages, batchMessageHandler)
+		})
+	}
+	res, err := sendCommand[ResponseT](client.iclient.Load(), query, jsonParam, wrappedHandler, wrappedBatchHandler)
 	if err != nil && msgHandlerErr != nil {
 		return Response[ResponseT]{}, fmt.Errorf("message handler error: %w; command error: %v", msgHandlerErr, err)
 	}
@@ -331,12 +371,28 @@ func SendCommandWithMessageHandler[ResponseT any, MessageT any, MessageResponseT
 	return res, nil
 }
 
-func sendCommand[ResponseT any](iclient *jSockDInternalClient, query string, jsonParam any, messageHandler func(jsonMessage string) (string, error)) (Response[ResponseT], error) {
+func callTypedMessageHandler[MessageT any, MessageResponseT any](jsonMessage string, messageHandler func(message MessageT) (MessageResponseT, error)) (string, error) {
+	var message MessageT
+	if err := json.Unmarshal([]byte(jsonMessage), &message); err != nil {
+		return "", err
+	}
+	response, err := messageHandler(message)
+	if err != nil {
+		return "", err
+	}
+	j, err := json.Marshal(response)
+	if err != nil {
+		return "", err
+	}
+	return string(j), nil
+}
+
+func sendCommand[ResponseT any](iclient *jSockDInternalClient, query string, jsonParam any, messageHandler func(jsonMessage string) (string, error), batchMessageHandler func(jsonMessages string) (string, error)) (Response[ResponseT], error) {
 	j, err := json.Marshal(jsonParam)
 	if err != nil {
 		return Response[ResponseT]{}, fmt.Errorf("json marshal: %w", err)
 	}
-	rawResp, err := sendRawCommand(iclient, query, string(j), messageHandler)
+	rawResp, err := sendRawCommand(iclient, query, string(j), messageHandler, batchMessageHandler)
 	if err != nil {
 		return Response[ResponseT]{RawResponse: rawResp}, err
 	}
@@ -357,7 +413,7 @@ func sendCommand[ResponseT any](iclient *jSockDInternalClient, query string, jso
 // SendRawCommand sends a command to the JSockD server and returns the
 // response. JSON values are passed and returned as strings.
 func SendRawCommand(client *JSockDClient, query string, jsonParam string) (RawResponse, error) {
-	return sendRawCommand(client.iclient.Load(), query, jsonParam, nil)
+	return sendRawCommand(client.iclient.Load(), query, jsonParam, nil, nil)
 }
 
 // SendRawCommandWithMessageHandler is like SendRawCommand but with a message
@@ -369,13 +425,26 @@ func SendRawCommand(client *JSockDClient, query string, jsonParam string) (RawRe
 // Note that messageHandler, when called, will execute in a different
 // goroutine to the one that called SendRawCommandWithMessageHandler. This
 // goroutine is guaranteed to have finished executing by the time
-// SendRawCommandWithMessageHandler returns.
+// SendRawCommandWithMessageHandler returns. Messages sent by the
+// command via JSockD.sendMessageAsync are handled concurrently, each in its
+// own goroutine.
 func SendRawCommandWithMessageHandler(client *JSockDClient, query string, jsonParam string, messageHandler func(jsonMessage string) (string, error)) (RawResponse, error) {
 	iclient := client.iclient.Load()
-	return sendRawCommand(iclient, query, jsonParam, messageHandler)
+	return sendRawCommand(iclient, query, jsonParam, messageHandler, nil)
 }
 
-func sendRawCommand(iclient *jSockDInternalClient, query string, jsonParam string, messageHandler func(jsonMessage string) (string, error)) (RawResponse, error) {
+// SendRawCommandWithMessageHandlers is like SendRawCommandWithMessageHandler
+// but with an additional handler for the arrays of messages that a command
+// sends in one round trip via JSockD.sendMessages. batchMessageHandler
+// receives a JSON-encoded array of messages and should return a JSON-encoded
+// array with one response for each message. If batchMessageHandler is nil,
+// the messages are passed to messageHandler one at a time.
+func SendRawCommandWithMessageHandlers(client *JSockDClient, query string, jsonParam string, messageHandler func(jsonMessage string) (string, error), batchMessageHandler func(jsonMessages string) (string, error)) (RawResponse, error) {
+	iclient := client.iclient.Load()
+	return sendRawCommand(iclient, query, jsonParam, messageHandler, batchMessageHandler)
+}
+
+func sendRawCommand(iclient *jSockDInternalClient, query string, jsonParam string, messageHandler func(jsonMessage string) (string, error), batchMessageHandler func(jsonMessages string) (string, error)) (RawResponse, error) {
 	if fe := getFatalError(iclient); fe != nil {
 		return RawResponse{}, fe
 	}
@@ -385,11 +454,12 @@ func sendRawCommand(iclient *jSockDInternalClient, query string, jsonParam strin
 
 	cmdId := atomic.AddUint64(&nextCommandId, 1)
 	cmd := command{
-		id:             strconv.FormatUint(cmdId, 10),
-		query:          query,
-		paramJson:      jsonParam,
-		responseChan:   make(chan RawResponse),
-		messageHandler: messageHandler,
+		id:                  strconv.FormatUint(cmdId, 10),
+		query:               query,
+		paramJson:           jsonParam,
+		responseChan:        make(chan RawResponse),
+		messageHandler:      messageHandler,
+		batchMessageHandler: batchMessageHandler,
 	}
 	nconns := len(iclient.conns)
 	if nconns == 0 {
@@ -400,6 +470,9 @@ func sendRawCommand(iclient *jSockDInternalClient, query string, jsonParam strin
 
 	select {
 	case resp := <-cmd.responseChan:
+		if resp.Overloaded {
+			return resp, ErrOverloaded
+		}
 		return resp, nil
 	case <-time.After(time.Duration(iclient.config.TimeoutUs) * time.Microsecond):
 		return RawResponse{}, errors.New("timeout waiting for response")
@@ -455,13 +528,18 @@ func (client *JSockDClient) Close() error {
 func connHandler(conn net.Conn, cmdChan chan command, iclient *jSockDInternalClient) {
 	defer conn.Close()
 
+	// The server may send several records at once (e.g. a command_hash record
+	// followed by the response), so they're all read through one buffer.
+	r := bufio.NewReader(conn)
+
+	useHashes, err := enableCommandHashes(conn, r)
+	if err != nil {
+		setFatalError(iclient, err)
+		return
+	}
+
 	for cmd := range cmdChan {
-		_, err := conn.Write(fmt.Appendf(nil, "%s\x00%s\x00%s\x00", cmd.id, cmd.query, cmd.paramJson))
-		if err != nil {
-			setFatalError(iclient, err)
-			return
-		}
-		rec, err := readRecord(conn)
+		rec, err := sendQuery(conn, r, cmd, iclient, useHashes)
 		if err != nil {
 			setFatalError(iclient, err)
 			return
@@ -480,51 +558,200 @@ func connHandler(conn net.Conn, cmdChan chan command, iclient *jSockDInternalCli
 			cmd.responseChan <- RawResponse{Exception: true, ResultJson: rest}
 		} else if rest, ok := strings.CutPrefix(parts[1], "ok "); ok {
 			cmd.responseChan <- RawResponse{Exception: false, ResultJson: rest}
-		} else if rest, ok := strings.CutPrefix(parts[1], "message "); ok {
-			for {
-				response := "null"
-				err := errors.New("internal error: no message handler")
-				if cmd.messageHandler != nil {
-					response, err = cmd.messageHandler(strings.TrimSuffix(rest, "\n"))
-				}
+		} else if rest, ok := strings.CutPrefix(parts[1], "overloaded "); ok {
+			cmd.responseChan <- RawResponse{Overloaded: true, ResultJson: rest}
+		} else if strings.HasPrefix(parts[1], "message ") || strings.HasPrefix(parts[1], "messages ") || strings.HasPrefix(parts[1], "async_message ") {
+			if !handleMessages(conn, r, cmd, iclient, parts[1]) {
+				return
+			}
+		} else {
+			setFatalError(iclient, fmt.Errorf("malformed command response from JSockD: %q", rec))
+			return
+		}
+	}
+}
+
+// enableCommandHashes asks the server to report the hash of each command sent
+// as source. It returns false if the server doesn't support command hashes.
+func enableCommandHashes(conn net.Conn, r *bufio.Reader) (bool, error) {
+	if _, err := conn.Write([]byte("?commandhashes\x00")); err != nil {
+		return false, err
+	}
+	rec, err := readRecord(r)
+	if err != nil {
+		return false, err
+	}
+	// An older server responds with 'bad command'.
+	return rec == "commandhashes\n", nil
+}
+
+// sendQuery sends a command and returns the first record of its response. If
+// the server no longer has the command whose hash was sent, the command is
+// sent again with its source.
+func sendQuery(conn net.Conn, r *bufio.Reader, cmd command, iclient *jSockDInternalClient, useHashes bool) (string, error) {
+	query := cmd.query
+	if useHashes {
+		query = hashedQuery(iclient, cmd.query)
+	}
+	for {
+		if _, err := conn.Write(fmt.Appendf(nil, "%s\x00%s\x00%s\x00", cmd.id, query, cmd.paramJson)); err != nil {
+			return "", err
+		}
+		rec, err := readRecord(r)
+		if err != nil {
+			return "", err
+		}
+		if hash, ok := strings.CutPrefix(rec, cmd.id+" command_hash "); ok {
+			rememberCommandHash(iclient, cmd.query, strings.TrimSuffix(hash, "\n"))
+			if rec, err = readRecord(r); err != nil {
+				return "", err
+			}
+		}
+		if strings.HasPrefix(rec, cmd.id+" unknown_command ") && query != cmd.query {
+			forgetCommandHash(iclient, cmd.query)
+			query = cmd.query
+			continue
+		}
+		return rec, nil
+	}
+}
+
+// hashedQuery returns the hash to send in place of the command source if the
+// server has reported one for it, or else the source.
+func hashedQuery(iclient *jSockDInternalClient, query string) string {
+	iclient.commandHashesMutex.Lock()
+	defer iclient.commandHashesMutex.Unlock()
+	if hash, ok := iclient.commandHashes[query]; ok {
+		return commandHashPrefix + hash
+	}
+	return query
+}
+
+func rememberCommandHash(iclient *jSockDInternalClient, query, hash string) {
+	// Not worth it for commands shorter than their hash.
+	if len(query) <= len(commandHashPrefix)+len(hash) {
+		return
+	}
+	iclient.commandHashesMutex.Lock()
+	defer iclient.commandHashesMutex.Unlock()
+	if len(iclient.commandHashes) >= maxCommandHashes {
+		clear(iclient.commandHashes)
+	}
+	iclient.commandHashes[query] = hash
+}
+
+func forgetCommandHash(iclient *jSockDInternalClient, query string) {
+	iclient.commandHashesMutex.Lock()
+	defer iclient.commandHashesMutex.Unlock()
+	delete(iclient.commandHashes, query)
+}
+
+// handleMessages responds to the messages sent by a command until the
+// command's final response arrives. It returns false if the connection should
+// no longer be used.
+func handleMessages(conn net.Conn, r *bufio.Reader, cmd command, iclient *jSockDInternalClient, resp string) bool {
+	var writeMutex sync.Mutex
+	var wg sync.WaitGroup
+	defer wg.Wait()
+
+	write := func(id, response string) error {
+		writeMutex.Lock()
+		defer writeMutex.Unlock()
+		_, err := conn.Write(fmt.Appendf(nil, "%s\x00%s\x00", id, response))
+		return err
+	}
+	handle := func(message string) (string, error) {
+		if cmd.messageHandler == nil {
+			return "null", errors.New("internal error: no message handler")
+		}
+		return cmd.messageHandler(strings.TrimSuffix(message, "\n"))
+	}
+	handleBatch := func(messages string) (string, error) {
+		if cmd.batchMessageHandler != nil {
+			return cmd.batchMessageHandler(strings.TrimSuffix(messages, "\n"))
+		}
+		var jsonMessages []json.RawMessage
+		if err := json.Unmarshal([]byte(messages), &jsonMessages); err != nil {
+			return "null", err
+		}
+		responses := make([]json.RawMessage, len(jsonMessages))
+		for i, m := range jsonMessages {
+			response, err := handle(string(m))
+			if err != nil {
+				return "null", err
+			}
+			responses[i] = json.RawMessage(response)
+		}
+		j, err := json.Marshal(responses)
+		return string(j), err
+	}
+
+	for {
+		if rest, ok := strings.CutPrefix(resp, "message "); ok {
+			response, err := handle(rest)
+			if err != nil {
+				setFatalError(iclient, fmt.Errorf("message handler error: %w", err))
+				_ = write(cmd.id, messageHandlerInternalError)
+				return false
+			}
+			if err = write(cmd.id, response); err != nil {
+				setFatalError(iclient, err)
+				return false
+			}
+		} else if rest, ok := strings.CutPrefix(resp, "messages "); ok {
+			response, err := handleBatch(rest)
+			if err != nil {
+				setFatalError(iclient, fmt.Errorf("message handler error: %w", err))
+				_ = write(cmd.id, messageHandlerInternalError)
+				return false
+			}
+			if err = write(cmd.id, response); err != nil {
+				setFatalError(iclient, err)
+				return false
+			}
+		} else if rest, ok := strings.CutPrefix(resp, "async_message "); ok {
+			// The server sends the command's final response only once every
+			// async message has had a response, so the handlers can run
+			// concurrently with reading the next record.
+			n, message, found := strings.Cut(rest, " ")
+			if !found {
+				setFatalError(iclient, fmt.Errorf("malformed async message from JSockD: %q", resp))
+				return false
+			}
+			wg.Add(1)
+			go func() {
+				defer wg.Done()
+				response, err := handle(message)
 				if err != nil {
 					setFatalError(iclient, fmt.Errorf("message handler error: %w", err))
-					_, _ = conn.Write(fmt.Appendf(nil, "%s\x00%s\x00", cmd.id, messageHandlerInternalError))
-					return
+					response = messageHandlerInternalError
 				}
-				_, err = conn.Write(fmt.Appendf(nil, "%s\x00%s\x00", cmd.id, response))
-				if err != nil {
+				if err = write(cmd.id+" "+n, response); err != nil {
 					setFatalError(iclient, err)
-					return
-				}
-				mresp, err := readRecord(conn)
-				if err != nil {
-					setFatalError(iclient, err)
-					return
-				}
-				parts = strings.SplitN(mresp, " ", 2)
-				if parts[0] != cmd.id {
-					setFatalError(iclient, fmt.Errorf("mismatched command id in message response: got %q, wanted %q", parts[0], cmd.id))
-					return
 				}
-				var ok bool
-				if rest, ok = strings.CutPrefix(parts[1], "ok "); ok {
-					cmd.responseChan <- RawResponse{Exception: false, ResultJson: strings.TrimSuffix(rest, "\n")}
-					break
-				} else if rest, ok = strings.CutPrefix(parts[1], "exception "); ok {
-					cmd.responseChan <- RawResponse{Exception: true, ResultJson: strings.TrimSuffix(rest, "\n")}
-					return
-				} else if rest, ok = strings.CutPrefix(parts[1], "message "); ok {
-					continue
-				} else {
-					setFatalError(iclient, fmt.Errorf("malformed message response from JSockD: %q", mresp))
-					return
-				}
-			}
+			}()
+		} else if rest, ok := strings.CutPrefix(resp, "ok "); ok {
+			cmd.responseChan <- RawResponse{Exception: false, ResultJson: strings.TrimSuffix(rest, "\n")}
+			return true
+		} else if rest, ok := strings.CutPrefix(resp, "exception "); ok {
+			cmd.responseChan <- RawResponse{Exception: true, ResultJson: strings.TrimSuffix(rest, "\n")}
+			return false
 		} else {
-			setFatalError(iclient, fmt.Errorf("malformed command response from JSockD: %q", rec))
-			return
+			setFatalError(iclient, fmt.Errorf("malformed message response from JSockD: %q", resp))
+			return false
 		}
+
+		mresp, err := readRecord(r)
+		if err != nil {
+			setFatalError(iclient, err)
+			return false
+		}
+		parts := strings.SplitN(mresp, " ", 2)
+		if parts[0] != cmd.id || len(parts) != 2 {
+			setFatalError(iclient, fmt.Errorf("mismatched command id in message response: got %q, wanted %q", parts[0], cmd.id))
+			return false
+		}
+		resp = parts[1]
 	}
 }
 
@@ -607,8 +834,7 @@ func streamStderrLogs(stderr io.Reader, config Config) {
 	}
 }
 
-func readRecord(conn net.Conn) (string, error) {
-	r := bufio.NewReader(conn)
+func readRecord(r *bufio.Reader) (string, error) {
 	record, err := r.ReadString('\n')
 	if err != nil {
 		return "", err
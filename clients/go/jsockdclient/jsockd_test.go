@@ -71,6 +71,39 @@ func TestSendRawCommand(t *testing.T) {
 			t.Fatalf("Unexpected result: %s", response.ResultJson)
 		}
 	})
+	t.Run("command with batched messages", func(t *testing.T) {
+		config := DefaultConfig()
+		config.SkipJSockDVersionCheck = true
+		config.NThreads = 1
+		client, err := InitJSockDClient(config, getJSockDPath(t))
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer client.Close()
+		nBatches := 0
+		response, err := SendCommandWithMessageHandlers[[]string](client, "(m, p) => JSockD.sendMessages(p)", []int{1, 2, 3}, func(message int) (string, error) {
+			return "", fmt.Errorf("Unexpected unbatched message: %d", message)
+		}, func(messages []int) ([]string, error) {
+			nBatches++
+			responses := make([]string, len(messages))
+			for i, m := range messages {
+				responses[i] = fmt.Sprintf("ack-%d", m)
+			}
+			return responses, nil
+		})
+		if err != nil {
+			t.Fatal(err)
+		}
+		if response.Exception {
+			t.Fatalf("Exception: %s", response.RawResponse.ResultJson)
+		}
+		if nBatches != 1 {
+			t.Fatalf("Expected one batch, got %d", nBatches)
+		}
+		if strings.Join(response.Result, ",") != "ack-1,ack-2,ack-3" {
+			t.Fatalf("Unexpected result: %v", response.Result)
+		}
+	})
 	t.Run("bad command", func(t *testing.T) {
 		config := DefaultConfig()
 		config.SkipJSockDVersionCheck = true
@@ -140,6 +173,52 @@ func TestSendCommand(t *testing.T) {
 	})
 }
 
+func TestSendCommandByHash(t *testing.T) {
+	config := DefaultConfig()
+	config.SkipJSockDVersionCheck = true
+	config.NThreads = 1
+	client, err := InitJSockDClient(config, getJSockDPath(t))
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer client.Close()
+
+	query := "(m, p) => ({ sum: p.reduce((a, b) => a + b, 0), count: p.length })"
+	type result struct {
+		Sum   int `json:"sum"`
+		Count int `json:"count"`
+	}
+	for range 3 {
+		resp, err := SendCommand[result](client, query, []int{1, 2, 3})
+		if err != nil {
+			t.Fatal(err)
+		}
+		if resp.Result != (result{Sum: 6, Count: 3}) {
+			t.Fatalf("Unexpected result: %+v", resp.Result)
+		}
+	}
+	iclient := client.iclient.Load()
+	if hashedQuery(iclient, query) == query {
+		t.Fatal("Expected the command's hash to be remembered")
+	}
+
+	// As if the server had evicted the command.
+	iclient.commandHashesMutex.Lock()
+	bogusHash := strings.Repeat("0", len(iclient.commandHashes[query]))
+	iclient.commandHashes[query] = bogusHash
+	iclient.commandHashesMutex.Unlock()
+	resp, err := SendCommand[result](client, query, []int{4})
+	if err != nil {
+		t.Fatal(err)
+	}
+	if resp.Result != (result{Sum: 4, Count: 1}) {
+		t.Fatalf("Unexpected result: %+v", resp.Result)
+	}
+	if hashedQuery(iclient, query) == commandHashPrefix+bogusHash {
+		t.Fatal("Expected the command's hash to be reported again")
+	}
+}
+
 var jsockdPath string
 var jsockdPathMutex sync.Mutex
 var jsockdDirPath string
@@ -47,6 +47,11 @@ JSOCKD_VERSION = "0.1.5"
 
 # Protocol tokens
 _MESSAGE_HANDLER_INTERNAL_ERROR = "internal_error"
+_COMMAND_HASH_PREFIX = "#"
+
+# The number of command hashes remembered (see _hashed_query). Clients that
+# generate commands dynamically would otherwise remember hashes without limit.
+_MAX_COMMAND_HASHES = 1024
 
 _LOG_LINE_RE = re.compile(r"(\*|\$) jsockd ([^ ]+) \[([^][]+)\] (.*)")
 
@@ -128,6 +133,7 @@ class _Command:
     param_json: str
     response_q: "queue.Queue[RawResponse]"
     message_handler: Optional[Callable[[str], str]]
+    batch_message_handler: Optional[Callable[[str], str]] = None
 
 
 @dataclasses.dataclass(slots=True)
@@ -147,6 +153,10 @@ class _Client:
     last_restart_time: float
     restart_guard: threading.Lock
     auto_downloaded_exec: Optional[str]
+    # Maps command source to the hash that the server reported for it, so that
+    # the hash can be sent in place of the source.
+    command_hashes: dict[str, str] = field(default_factory=dict)
+    command_hashes_lock: threading.Lock = field(default_factory=threading.Lock)
 
 
 def _stream_stderr_logs(stderr: io.TextIOBase, config: Config) -> None:
@@ -246,6 +256,75 @@ def _read_record(fp: io.BufferedReader) -> str:
         raise JSockDClientError(f"decode record: {e}") from e
 
 
+def _hashed_query(iclient: _Client, query: str) -> str:
+    """
+    Returns the hash to send in place of the command source if the server has
+    reported one for it, or else the source."""
+    with iclient.command_hashes_lock:
+        h = iclient.command_hashes.get(query)
+    if h is None:
+        return query
+    return _COMMAND_HASH_PREFIX + h
+
+
+def _remember_command_hash(iclient: _Client, query: str, h: str) -> None:
+    # Not worth it for commands shorter than their hash.
+    if len(query) <= len(h) + len(_COMMAND_HASH_PREFIX):
+        return
+    with iclient.command_hashes_lock:
+        if len(iclient.command_hashes) >= _MAX_COMMAND_HASHES:
+            iclient.command_hashes.clear()
+        iclient.command_hashes[query] = h
+
+
+def _forget_command_hash(iclient: _Client, query: str) -> None:
+    with iclient.command_hashes_lock:
+        iclient.command_hashes.pop(query, None)
+
+
+def _enable_command_hashes(rfile: io.BufferedReader, wfile: io.BufferedWriter) -> bool:
+    wfile.write(b"?commandhashes\x00")
+    wfile.flush()
+    # An older server responds with 'bad command'.
+    return _read_record(rfile) == "commandhashes\n"
+
+
+def _send_command(
+    rfile: io.BufferedReader,
+    wfile: io.BufferedWriter,
+    cmd: _Command,
+    iclient: _Client,
+    use_hashes: bool,
+) -> str:
+    """
+    Sends the command and returns its first response record (without the
+    command ID), resending the source if the server no longer has the command
+    whose hash was sent."""
+    query = _hashed_query(iclient, cmd.query) if use_hashes else cmd.query
+    while True:
+        wfile.write(f"{cmd.id}\x00{query}\x00{cmd.param_json}\x00".encode("utf-8"))
+        wfile.flush()
+        rest = _read_response(rfile, cmd)
+        if rest.startswith("command_hash "):
+            _remember_command_hash(
+                iclient, cmd.query, rest[len("command_hash ") :].rstrip("\n")
+            )
+            rest = _read_response(rfile, cmd)
+        if rest.startswith("unknown_command ") and query != cmd.query:
+            _forget_command_hash(iclient, cmd.query)
+            query = cmd.query
+            continue
+        return rest
+
+
+def _read_response(rfile: io.BufferedReader, cmd: _Command) -> str:
+    rec = _read_record(rfile)
+    parts = rec.split(" ", 1)
+    if len(parts) != 2 or parts[0] != cmd.id:
+        raise JSockDClientError(f"malformed or mismatched response: {rec!r}")
+    return parts[1]
+
+
 def _conn_handler(
     conn: socket.socket,
     cmd_q: "queue.Queue[Optional[_Command]]",
@@ -254,6 +333,11 @@ def _conn_handler(
     try:
         rfile = conn.makefile("rb")
         wfile = conn.makefile("wb")
+        try:
+            use_hashes = _enable_command_hashes(rfile, wfile)
+        except Exception as e:
+            _set_fatal_error(iclient, e)
+            return
         while not iclient.quit_event.is_set():
             try:
                 cmd = cmd_q.get(timeout=0.1)
@@ -262,29 +346,13 @@ def _conn_handler(
             if cmd is None:
                 break
 
-            payload = f"{cmd.id}\x00{cmd.query}\x00{cmd.param_json}\x00".encode("utf-8")
-            try:
-                wfile.write(payload)
-                wfile.flush()
-            except Exception as e:
-                _set_fatal_error(iclient, e)
-                return
-
             try:
-                rec = _read_record(rfile)
+                rest = _send_command(rfile, wfile, cmd, iclient, use_hashes)
             except Exception as e:
                 _set_fatal_error(iclient, e)
                 return
 
-            parts = rec.split(" ", 1)
-            if len(parts) != 2 or parts[0] != cmd.id:
-                _set_fatal_error(
-                    iclient,
-                    JSockDClientError(f"malformed or mismatched response: {rec!r}"),
-                )
-                return
-
-            rest = parts[1]
+            rec = f"{cmd.id} {rest}"
             if rest.startswith("exception "):
                 cmd.response_q.put(
                     RawResponse(
@@ -300,22 +368,16 @@ def _conn_handler(
                     )
                 )
                 continue
-            elif rest.startswith("message "):
+            elif rest.startswith("message ") or rest.startswith("messages "):
                 # Handle message exchange loop
-                message_rest = rest[len("message ") :]
+                message_rest = rest
                 while True:
                     response_json = "null"
-                    handler_err: Optional[BaseException] = JSockDClientError(
-                        "no message handler"
-                    )
-                    if cmd.message_handler is not None:
-                        try:
-                            response_json = cmd.message_handler(
-                                message_rest.rstrip("\n")
-                            )
-                            handler_err = None
-                        except BaseException as e:
-                            handler_err = e
+                    handler_err: Optional[BaseException] = None
+                    try:
+                        response_json = _handle_message(cmd, message_rest)
+                    except BaseException as e:
+                        handler_err = e
                     if handler_err is not None:
                         _set_fatal_error(
                             iclient,
@@ -366,8 +428,10 @@ def _conn_handler(
                             )
                         )
                         break
-                    elif mparts[1].startswith("message "):
-                        message_rest = mparts[1][len("message ") :]
+                    elif mparts[1].startswith("message ") or mparts[1].startswith(
+                        "messages "
+                    ):
+                        message_rest = mparts[1]
                         continue
                     else:
                         _set_fatal_error(
@@ -392,6 +456,24 @@ def _conn_handler(
             pass
 
 
+def _handle_message(cmd: _Command, rest: str) -> str:
+    """
+    Returns the JSON response to a `message` record, or to a `messages` record
+    (an array of messages sent in one round trip by JSockD.sendMessages)."""
+    if rest.startswith("messages "):
+        messages_json = rest[len("messages ") :].rstrip("\n")
+        if cmd.batch_message_handler is not None:
+            return cmd.batch_message_handler(messages_json)
+        responses = [
+            _handle_message(cmd, "message " + json.dumps(m, separators=(",", ":")))
+            for m in json.loads(messages_json)
+        ]
+        return "[" + ",".join(responses) + "]"
+    if cmd.message_handler is None:
+        raise JSockDClientError("no message handler")
+    return cmd.message_handler(rest[len("message ") :].rstrip("\n"))
+
+
 def _get_fatal_error(iclient: _Client) -> Optional[BaseException]:
     with iclient.fatal_error_lock:
         return iclient.fatal_error
@@ -787,9 +869,15 @@ class JSockDClient:
         query: str,
         json_param: str,
         message_handler: Optional[Callable[[str], str]] = None,
+        batch_message_handler: Optional[Callable[[str], str]] = None,
     ) -> RawResponse:
         """
-        Send a raw JSON command to JSockD."""
+        Send a raw JSON command to JSockD.
+
+        batch_message_handler receives the JSON-encoded array of messages sent
+        by JSockD.sendMessages and should return a JSON-encoded array with one
+        response for each message. If it is None, the messages are passed to
+        message_handler one at a time."""
         ic = self._iclient
         fe = _get_fatal_error(ic)
         if fe:
@@ -805,6 +893,7 @@ class JSockDClient:
             param_json=json_param,
             response_q=resp_q,
             message_handler=message_handler,
+            batch_message_handler=batch_message_handler,
         )
         nconns = len(ic.cmd_queues)
         if nconns == 0:
@@ -828,30 +917,44 @@ class JSockDClient:
         query: str,
         json_param: Any,
         message_handler: Optional[Callable[[Any], Any]] = None,
+        batch_message_handler: Optional[Callable[[list[Any]], list[Any]]] = None,
     ) -> Response[Any]:
         """
-        Send a command to JSockD with JSON marshalling/unmarshalling handled by json.dumps and json.loads."""
+        Send a command to JSockD with JSON marshalling/unmarshalling handled by json.dumps and json.loads.
+
+        batch_message_handler receives the list of messages sent by
+        JSockD.sendMessages and should return a list with one response for
+        each message. If it is None, the messages are passed to message_handler
+        one at a time."""
         msg_handler_err: list[Optional[BaseException]] = [None]
 
-        def _wrapped(json_message: str) -> str:
-            try:
-                message = json.loads(json_message)
-            except Exception as e:
-                msg_handler_err[0] = e
-                raise
-            try:
-                response = message_handler(message) if message_handler else None
-            except Exception as e:
-                msg_handler_err[0] = e
-                raise
-            try:
-                return json.dumps(response, separators=(",", ":"))
-            except Exception as e:
-                msg_handler_err[0] = e
-                raise
+        def _wrap(handler: Optional[Callable[[Any], Any]]) -> Callable[[str], str]:
+            def _wrapped(json_message: str) -> str:
+                try:
+                    message = json.loads(json_message)
+                except Exception as e:
+                    msg_handler_err[0] = e
+                    raise
+                try:
+                    response = handler(message) if handler else None
+                except Exception as e:
+                    msg_handler_err[0] = e
+                    raise
+                try:
+                    return json.dumps(response, separators=(",", ":"))
+                except Exception as e:
+                    msg_handler_err[0] = e
+                    raise
+
+            return _wrapped
 
         payload = json.dumps(json_param, separators=(",", ":"))
-        raw = self.send_raw_command(query, payload, _wrapped)
+        raw = self.send_raw_command(
+            query,
+            payload,
+            _wrap(message_handler),
+            _wrap(batch_message_handler) if batch_message_handler else None,
+        )
         if msg_handler_err[0] is not None:
             raise JSockDClientError(f"message handler error: {msg_handler_err[0]}")
         if raw.exception:
@@ -2,7 +2,7 @@ import os
 import platform
 import sys
 from pathlib import Path
-from typing import Iterator, Optional
+from typing import Any, Iterator, Optional
 
 import pytest
 
@@ -107,6 +107,23 @@ def test_send_raw_command_with_message_handler(client: JSockDClient):
     assert response.result_json == '"ack-2"'
 
 
+def test_send_command_with_batch_message_handler(client: JSockDClient):
+    batches: list[list[Any]] = []
+
+    def on_messages(messages: list[Any]) -> list[Any]:
+        batches.append(messages)
+        return [f"ack-{m}" for m in messages]
+
+    response = client.send_command(
+        "(m, p) => JSockD.sendMessages(p)",
+        [1, 2, 3],
+        batch_message_handler=on_messages,
+    )
+    assert batches == [[1, 2, 3]]
+    assert not response.exception
+    assert response.result == ["ack-1", "ack-2", "ack-3"]
+
+
 def test_send_raw_command_bad(client: JSockDClient):
     result = client.send_raw_command("(m, p) => p.foo()", "99")
     assert result.exception
@@ -123,3 +140,19 @@ def test_send_command_bad(client: JSockDClient):
     result = client.send_command("(m, p) => p.foo()", 99)
     assert result.exception
     assert "errorMessage" in result.raw_response.result_json
+
+
+def test_send_command_by_hash(client: JSockDClient):
+    query = "(m, p) => ({ sum: p.reduce((a, b) => a + b, 0), count: p.length })"
+    for _ in range(3):
+        result = client.send_command(query, [1, 2, 3])
+        assert result.result == {"sum": 6, "count": 3}
+    iclient = client._iclient
+    assert query in iclient.command_hashes
+
+    # As if the server had evicted the command.
+    with iclient.command_hashes_lock:
+        iclient.command_hashes[query] = "0" * len(iclient.command_hashes[query])
+    result = client.send_command(query, [4])
+    assert result.result == {"sum": 4, "count": 1}
+    assert iclient.command_hashes[query] != "0" * len(iclient.command_hashes[query])
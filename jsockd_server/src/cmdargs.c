@@ -3,6 +3,7 @@
 #include "hex.h"
 #include <errno.h>
 #include <libgen.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -11,15 +12,86 @@ const char EVAL_INPUT_STDIN_SENTINEL[1] = {'\0'};
 static int n_flags_set(const CmdArgs *cmdargs) {
   return (cmdargs->es6_module_bytecode_file != NULL) +
          (cmdargs->source_map_file != NULL) + (cmdargs->n_sockets != 0) +
+         (cmdargs->n_shared_runtimes != 0) +
+         (cmdargs->n_cpu_affinity != 0 || cmdargs->cpu_affinity_auto) +
+         (cmdargs->n_class_weights != 0) +
+         (cmdargs->max_queued_commands != 0) +
+         (cmdargs->max_queue_wait_us != 0) +
+         (cmdargs->n_spare_runtimes != 0) + (cmdargs->prefork == true) +
+         (cmdargs->max_cached_commands != 0) +
+         (cmdargs->max_cached_bytecode_bytes != 0) +
+         (cmdargs->command_cache_dir != NULL) +
+         (cmdargs->named_commands_only == true) +
          (cmdargs->socket_sep_char_set == true) + (cmdargs->version == true) +
          (cmdargs->max_command_runtime_us != 0) +
          (cmdargs->max_idle_time_set == true) +
          (cmdargs->key_file_prefix != NULL) +
          (cmdargs->private_key_file != NULL) +
          (cmdargs->mod_to_compile != NULL) +
+         (cmdargs->commands_manifest_file != NULL) +
          (cmdargs->compile_opts != COMPILE_OPTS_NONE) + (cmdargs->eval == true);
 }
 
+// Parses a list such as '0,2,4-7' into 'cpus'. Returns the number of CPUs, or
+// -1 if the list is invalid or has more than 'max_cpus' entries.
+static int parse_cpu_list(const char *list, int *cpus, int max_cpus) {
+  int n = 0;
+  const char *p = list;
+  for (;;) {
+    errno = 0;
+    char *endptr = NULL;
+    long long int first = strtoll(p, &endptr, 10);
+    long long int last = first;
+    if (errno == 0 && endptr != p && *endptr == '-') {
+      p = endptr + 1;
+      last = strtoll(p, &endptr, 10);
+    }
+    if (errno != 0 || endptr == p || first < 0 || last < first ||
+        last > MAX_CPU_INDEX)
+      return -1;
+    for (long long int cpu = first; cpu <= last; ++cpu) {
+      if (n == max_cpus)
+        return -1;
+      cpus[n++] = (int)cpu;
+    }
+    if (*endptr == '\0')
+      return n;
+    if (*endptr != ',')
+      return -1;
+    p = endptr + 1;
+  }
+}
+
+// Parses a list such as '8:2,1' of '<weight>[:<reserved>]' entries. Returns the
+// number of entries, or -1 if the list is invalid or has more than
+// 'max_entries' entries.
+static int parse_class_weights(const char *list, int *weights, int *reserved,
+                               int max_entries) {
+  int n = 0;
+  const char *p = list;
+  for (;;) {
+    errno = 0;
+    char *endptr = NULL;
+    long long int w = strtoll(p, &endptr, 10);
+    long long int r = 0;
+    if (errno == 0 && endptr != p && *endptr == ':') {
+      p = endptr + 1;
+      r = strtoll(p, &endptr, 10);
+    }
+    if (errno != 0 || endptr == p || w <= 0 || w > INT_MAX || r < 0 ||
+        r > MAX_THREADS || n == max_entries)
+      return -1;
+    weights[n] = (int)w;
+    reserved[n] = (int)r;
+    ++n;
+    if (*endptr == '\0')
+      return n;
+    if (*endptr != ',')
+      return -1;
+    p = endptr + 1;
+  }
+}
+
 static int parse_cmd_args_helper(int argc, char **argv,
                                  void (*errlog)(const char *fmt, ...),
                                  CmdArgs *cmdargs) {
@@ -107,6 +179,197 @@ static int parse_cmd_args_helper(int argc, char **argv,
         errlog("Error: -s requires at least one argument (socket file)\n");
         return -1;
       }
+    } else if (0 == strcmp(argv[i], "-r")) {
+      ++i;
+      if (i >= argc) {
+        errlog("Error: -r requires an argument (number of QuickJS runtimes "
+               "shared between all sockets)\n");
+        return -1;
+      }
+      if (cmdargs->n_shared_runtimes != 0) {
+        errlog("Error: -r can be specified at most once\n");
+        return -1;
+      }
+      // Either a fixed number of runtimes or a range '<min>:<max>'.
+      errno = 0;
+      char *endptr = NULL;
+      long long int min = strtoll(argv[i], &endptr, 10);
+      long long int max = min;
+      if (errno == 0 && endptr && *endptr == ':')
+        max = strtoll(endptr + 1, &endptr, 10);
+      if (errno != 0 || !endptr || *endptr != '\0' || min <= 0 ||
+          max > MAX_THREADS || max < min) {
+        errlog("Error: -r requires a valid integer argument > 0 and <= %i, or "
+               "a range <min>:<max> of such integers\n",
+               MAX_THREADS);
+        return -1;
+      }
+      cmdargs->n_shared_runtimes = (int)min;
+      cmdargs->max_shared_runtimes = (int)max;
+    } else if (0 == strcmp(argv[i], "-a")) {
+      ++i;
+      if (i >= argc) {
+        errlog("Error: -a requires an argument (list of CPUs, or 'auto')\n");
+        return -1;
+      }
+      if (cmdargs->n_cpu_affinity != 0 || cmdargs->cpu_affinity_auto) {
+        errlog("Error: -a can be specified at most once\n");
+        return -1;
+      }
+      if (0 == strcmp(argv[i], "auto")) {
+        cmdargs->cpu_affinity_auto = true;
+      } else {
+        cmdargs->n_cpu_affinity =
+            parse_cpu_list(argv[i], cmdargs->cpu_affinity, MAX_THREADS);
+        if (cmdargs->n_cpu_affinity <= 0) {
+          cmdargs->n_cpu_affinity = 0;
+          errlog("Error: -a requires 'auto' or a comma-separated list of at "
+                 "most %i CPU numbers or ranges (e.g. 0,2,4-7)\n",
+                 MAX_THREADS);
+          return -1;
+        }
+      }
+    } else if (0 == strcmp(argv[i], "-w")) {
+      ++i;
+      if (i >= argc) {
+        errlog("Error: -w requires an argument (list of priority class "
+               "weights)\n");
+        return -1;
+      }
+      if (cmdargs->n_class_weights != 0) {
+        errlog("Error: -w can be specified at most once\n");
+        return -1;
+      }
+      int n = parse_class_weights(argv[i], cmdargs->class_weight,
+                                  cmdargs->class_reserved, MAX_THREADS);
+      if (n <= 0) {
+        errlog("Error: -w requires a comma-separated list of "
+               "<weight>[:<reserved_runtimes>] entries with weight > 0 (e.g. "
+               "8:2,1)\n");
+        return -1;
+      }
+      cmdargs->n_class_weights = n;
+    } else if (0 == strcmp(argv[i], "-p")) {
+      ++i;
+      if (i >= argc) {
+        errlog("Error: -p requires an argument (number of spare runtimes)\n");
+        return -1;
+      }
+      if (cmdargs->n_spare_runtimes != 0) {
+        errlog("Error: -p can be specified at most once\n");
+        return -1;
+      }
+      errno = 0;
+      char *endptr = NULL;
+      long long int v = strtoll(argv[i], &endptr, 10);
+      if (errno != 0 || !endptr || *endptr != '\0' || v <= 0 ||
+          v > MAX_SPARE_RUNTIMES) {
+        errlog("Error: -p requires an integer argument > 0 and <= %i\n",
+               MAX_SPARE_RUNTIMES);
+        return -1;
+      }
+      cmdargs->n_spare_runtimes = (int)v;
+    } else if (0 == strcmp(argv[i], "-f")) {
+      if (cmdargs->prefork) {
+        errlog("Error: -f can be specified at most once\n");
+        return -1;
+      }
+      cmdargs->prefork = true;
+    } else if (0 == strcmp(argv[i], "-cn")) {
+      ++i;
+      if (i >= argc) {
+        errlog("Error: -cn requires an argument (max number of cached "
+               "commands)\n");
+        return -1;
+      }
+      if (cmdargs->max_cached_commands != 0) {
+        errlog("Error: -cn can be specified at most once\n");
+        return -1;
+      }
+      errno = 0;
+      char *endptr = NULL;
+      long long int v = strtoll(argv[i], &endptr, 10);
+      if (errno != 0 || !endptr || *endptr != '\0' || v <= 0 ||
+          v > (1LL << MAX_CACHED_FUNCTIONS_HASH_BITS)) {
+        errlog("Error: -cn requires an integer argument > 0 and <= %lli\n",
+               1LL << MAX_CACHED_FUNCTIONS_HASH_BITS);
+        return -1;
+      }
+      cmdargs->max_cached_commands = (int)v;
+    } else if (0 == strcmp(argv[i], "-cb")) {
+      ++i;
+      if (i >= argc) {
+        errlog("Error: -cb requires an argument (max total size of cached "
+               "command bytecode in bytes)\n");
+        return -1;
+      }
+      if (cmdargs->max_cached_bytecode_bytes != 0) {
+        errlog("Error: -cb can be specified at most once\n");
+        return -1;
+      }
+      errno = 0;
+      char *endptr = NULL;
+      long long int v = strtoll(argv[i], &endptr, 10);
+      if (errno != 0 || !endptr || *endptr != '\0' || v <= 0) {
+        errlog("Error: -cb requires a valid integer argument > 0\n");
+        return -1;
+      }
+      cmdargs->max_cached_bytecode_bytes = (uint64_t)v;
+    } else if (0 == strcmp(argv[i], "-cd")) {
+      ++i;
+      if (i >= argc) {
+        errlog("Error: -cd requires an argument (command cache directory)\n");
+        return -1;
+      }
+      if (cmdargs->command_cache_dir) {
+        errlog("Error: -cd can be specified at most once\n");
+        return -1;
+      }
+      cmdargs->command_cache_dir = argv[i];
+    } else if (0 == strcmp(argv[i], "-nc")) {
+      if (cmdargs->named_commands_only) {
+        errlog("Error: -nc can be specified at most once\n");
+        return -1;
+      }
+      cmdargs->named_commands_only = true;
+    } else if (0 == strcmp(argv[i], "-q")) {
+      ++i;
+      if (i >= argc) {
+        errlog("Error: -q requires an argument (max number of queued "
+               "commands)\n");
+        return -1;
+      }
+      if (cmdargs->max_queued_commands != 0) {
+        errlog("Error: -q can be specified at most once\n");
+        return -1;
+      }
+      errno = 0;
+      char *endptr = NULL;
+      long long int v = strtoll(argv[i], &endptr, 10);
+      if (errno != 0 || !endptr || *endptr != '\0' || v <= 0 || v > INT_MAX) {
+        errlog("Error: -q requires a valid integer argument > 0\n");
+        return -1;
+      }
+      cmdargs->max_queued_commands = (int)v;
+    } else if (0 == strcmp(argv[i], "-qt")) {
+      ++i;
+      if (i >= argc) {
+        errlog("Error: -qt requires an argument (max queue wait time in "
+               "microseconds)\n");
+        return -1;
+      }
+      if (cmdargs->max_queue_wait_us != 0) {
+        errlog("Error: -qt can be specified at most once\n");
+        return -1;
+      }
+      errno = 0;
+      char *endptr = NULL;
+      long long int v = strtoll(argv[i], &endptr, 10);
+      if (errno != 0 || !endptr || *endptr != '\0' || v <= 0) {
+        errlog("Error: -qt requires a valid integer argument > 0\n");
+        return -1;
+      }
+      cmdargs->max_queue_wait_us = (uint64_t)v;
     } else if (0 == strcmp(argv[i], "-sm")) {
       ++i;
       if (i >= argc) {
@@ -175,6 +438,18 @@ static int parse_cmd_args_helper(int argc, char **argv,
       cmdargs->mod_to_compile = argv[i];
       ++i;
       cmdargs->mod_output_file = argv[i];
+    } else if (0 == strcmp(argv[i], "-cm")) {
+      if (cmdargs->commands_manifest_file != NULL) {
+        errlog("Error: -cm can be specified at most once\n");
+        return -1;
+      }
+      ++i;
+      if (i >= argc) {
+        errlog("Error: -cm requires an argument (named commands manifest "
+               "file)\n");
+        return -1;
+      }
+      cmdargs->commands_manifest_file = argv[i];
     } else if (0 == strcmp(argv[i], "-ss") || 0 == strcmp(argv[i], "-sd")) {
       if (cmdargs->compile_opts != COMPILE_OPTS_NONE) {
         errlog("Error: -ss and -sd are mutually exclusive and can be specified "
@@ -234,7 +509,7 @@ static int parse_cmd_args_helper(int argc, char **argv,
     return -1;
   }
 
-  if (cmdargs->private_key_file && !(n_flags == 2 && cmdargs->mod_to_compile)) {
+  if (cmdargs->private_key_file && !cmdargs->mod_to_compile) {
     errlog("Error: -pk (private key file) option must be used with the -c "
            "option.\n");
     return -1;
@@ -245,12 +520,19 @@ static int parse_cmd_args_helper(int argc, char **argv,
     return -1;
   }
 
+  if (cmdargs->commands_manifest_file && !cmdargs->mod_to_compile) {
+    errlog("Error: -cm (named commands manifest) option must be used with the "
+           "-c option.\n");
+    return -1;
+  }
+
   if (cmdargs->mod_to_compile) {
     if (1 < n_flags - (cmdargs->private_key_file != NULL) -
-                (cmdargs->compile_opts != COMPILE_OPTS_NONE)) {
+                (cmdargs->compile_opts != COMPILE_OPTS_NONE) -
+                (cmdargs->commands_manifest_file != NULL)) {
       errlog(
           "Error: -c (compile module) must be used only with -pk (private key "
-          "file) and -ss or -sd flags.\n");
+          "file), -cm (named commands manifest) and -ss or -sd flags.\n");
       return -1;
     }
   }
@@ -270,6 +552,46 @@ static int parse_cmd_args_helper(int argc, char **argv,
     return -1;
   }
 
+  if (cmdargs->named_commands_only && !cmdargs->es6_module_bytecode_file) {
+    errlog("Error: -nc (named commands only) can only be used with -m (ES6 "
+           "module bytecode file)\n");
+    return -1;
+  }
+
+  if (cmdargs->n_class_weights != 0) {
+    if (cmdargs->n_shared_runtimes == 0) {
+      errlog("Error: -w can only be used with -r\n");
+      return -1;
+    }
+    if (cmdargs->n_class_weights > cmdargs->n_sockets) {
+      errlog("Error: -w has more entries than there are sockets\n");
+      return -1;
+    }
+    int total_reserved = 0;
+    for (int i = 0; i < cmdargs->n_class_weights; ++i)
+      total_reserved += cmdargs->class_reserved[i];
+    if (total_reserved >= cmdargs->n_shared_runtimes) {
+      errlog("Error: the runtimes reserved by -w must total less than the "
+             "(minimum) number of runtimes given by -r\n");
+      return -1;
+    }
+  }
+
+  if ((cmdargs->max_queued_commands != 0 || cmdargs->max_queue_wait_us != 0) &&
+      cmdargs->n_shared_runtimes == 0) {
+    errlog("Error: -q and -qt can only be used with -r\n");
+    return -1;
+  }
+
+  // Each worker process creates its runtime by forking the parent, so there's
+  // no runtime creation to pin to a CPU or to do ahead of time.
+  if (cmdargs->prefork &&
+      (cmdargs->n_shared_runtimes != 0 || cmdargs->n_cpu_affinity != 0 ||
+       cmdargs->cpu_affinity_auto || cmdargs->n_spare_runtimes != 0)) {
+    errlog("Error: -f cannot be used with -r, -a or -p\n");
+    return -1;
+  }
+
   if (cmdargs->max_command_runtime_us == 0)
     cmdargs->max_command_runtime_us = DEFAULT_MAX_COMMAND_RUNTIME_US;
 
@@ -281,10 +603,15 @@ int parse_cmd_args(int argc, char **argv, void (*errlog)(const char *fmt, ...),
   if (parse_cmd_args_helper(argc, argv, errlog, cmdargs) < 0) {
     const char *cmdname = argc > 0 ? basename(argv[0]) : "jsockd";
     errlog("Usage: %s [-m <module_bytecode_file>] [-sm <source_map_file>] [-b "
-           "XX] [-t <max_command_runtime_us>] [-i <max_idle_time_us>] [-e <JS "
-           "expression>] -s <socket1_path> [<socket2_path> ...]\n       %s -c "
-           "<module_to_compile> <output_file> [-pk <private_key_file>] [-ss | "
-           "-sd]\n       "
+           "XX] [-t <max_command_runtime_us>] [-i <max_idle_time_us>] [-r "
+           "<n_shared_runtimes>[:<max_shared_runtimes>]] [-a <cpu_list> | "
+           "auto] [-w <class_weights>] [-q <max_queued_commands>] [-qt "
+           "<max_queue_wait_us>] [-p <n_spare_runtimes>] [-f] [-cn "
+           "<max_cached_commands>] [-cb <max_cached_bytecode_bytes>] [-cd "
+           "<command_cache_dir>] [-nc] [-e <JS expression>] -s <socket1_path> "
+           "[<socket2_path> ...]\n       %s -c "
+           "<module_to_compile> <output_file> [-pk <private_key_file>] [-cm "
+           "<commands_manifest_file>] [-ss | -sd]\n       "
            "%s -k <key_file_prefix>\n",
            cmdname, cmdname, cmdname);
     return -1;
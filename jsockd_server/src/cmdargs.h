@@ -16,6 +16,35 @@ typedef struct {
   const char *socket_path[MAX_THREADS];
   const char *source_map_file;
   int n_sockets;
+  // With -r <min>:<max>, n_shared_runtimes is the minimum. Otherwise the two
+  // are equal.
+  int n_shared_runtimes;
+  int max_shared_runtimes;
+  // CPUs to pin runtime threads to (-a). Runtime thread i is pinned to
+  // cpu_affinity[i % n_cpu_affinity]. With -a auto, the list is built at
+  // startup from the CPUs that the process may run on.
+  int cpu_affinity[MAX_THREADS];
+  int n_cpu_affinity;
+  bool cpu_affinity_auto;
+  // Priority class weights and reserved runtimes (-w), one per socket in the
+  // order given to -s. Sockets beyond the last entry share the last class.
+  int class_weight[MAX_THREADS];
+  int class_reserved[MAX_THREADS];
+  int n_class_weights;
+  // Admission control limits (-q and -qt), or 0 for no limit.
+  int max_queued_commands;
+  uint64_t max_queue_wait_us;
+  // The number of spare runtimes to keep ready (-p), or 0.
+  int n_spare_runtimes;
+  // Serve each socket from a forked worker process rather than a thread (-f).
+  bool prefork;
+  // Command cache capacity (-cn and -cb), or 0 for the default.
+  int max_cached_commands;
+  uint64_t max_cached_bytecode_bytes;
+  // Directory for the on-disk command cache (-cd), or NULL.
+  const char *command_cache_dir;
+  // Run only the named commands in the module file (-nc).
+  bool named_commands_only;
   unsigned char socket_sep_char;
   bool socket_sep_char_set;
   bool version;
@@ -26,6 +55,8 @@ typedef struct {
   const char *private_key_file;
   const char *mod_to_compile;
   const char *mod_output_file;
+  // JSON manifest of named commands to compile into the module file (-cm).
+  const char *commands_manifest_file;
   CompileOpts compile_opts;
   bool eval;
   const char *eval_input;
@@ -2,12 +2,19 @@
 #define CONFIG_H_
 
 #define MAX_THREADS 256
+// Highest CPU number accepted by -a.
+#define MAX_CPU_INDEX 4095
 #define MESSAGE_UUID_MAX_BYTES 32
+// A command sent as this character followed by the hash that the server
+// reported for it (see ?commandhashes) runs the cached command.
+#define COMMAND_HASH_PREFIX '#'
 #define DEFAULT_MAX_COMMAND_RUNTIME_US 250000
 #define DEFAULT_MAX_IDLE_TIME_US 30000000
 
-// This is the interval at which threads pause IO on the UNIX socket to check
-// for exceptional conditions (e.g. SIGINT).
+// Threads wait for I/O without a timeout unless they have a deadline (e.g. for
+// idle runtime shutdown). They're woken by the shutdown pipe on exceptional
+// conditions (e.g. SIGINT). This is the interval at which a thread checks back
+// when its deadline has passed but it can't act on it yet.
 #define SOCKET_POLL_TIMEOUT_MS 100
 
 // check memory usage every 100 commands
@@ -17,13 +24,57 @@
 // the interpreter state.
 #define MEMORY_INCREASE_MAX_COUNT 3
 
+// By default, up to 2^bits commands are cached. The debug build caches fewer
+// so that collisions are more likely in testing.
 #define CACHED_FUNCTIONS_HASH_BITS_RELEASE 10
 #define CACHED_FUNCTIONS_HASH_BITS_DEBUG 6
+// The maximum number of cached commands (-cn) is 2^this.
+#define MAX_CACHED_FUNCTIONS_HASH_BITS 20
+// The default limit on the total size of cached command bytecode (-cb).
+#define DEFAULT_MAX_CACHED_BYTECODE_BYTES (64 * 1024 * 1024)
+
+// The number of evaluated command functions that each runtime keeps, so that
+// its most recently used commands needn't be read from bytecode and evaluated
+// again.
+#define LIVE_FUNCTION_CACHE_SIZE 32
 
 #define ERROR_MSG_MAX_BYTES (1024 * 10)
 
 #define INPUT_BUF_BYTES (1024 * 1024)
 
+// The maximum number of messages sent by JSockD.sendMessageAsync that a
+// command can have awaiting a response at once.
+#define MAX_ASYNC_MESSAGES 64
+
+// Capacity of the lock-free queue of connections with a complete command
+// waiting for a runtime thread in shared-listener mode (must be a power of 2).
+// The dispatcher thread holds on to any further connections until there's
+// room.
+#define DISPATCH_READY_QUEUE_CAPACITY 1024
+
+// In shared-listener mode, stop reading from a connection once this many
+// pipelined commands are queued on it (unless a message response is awaited).
+#define DISPATCH_MAX_PIPELINED_COMMANDS 64
+
+// With an elastic pool of shared runtimes (-r <min>:<max>), another runtime is
+// started if a command waits this long for one.
+#define DISPATCH_POOL_GROW_WAIT_US 2000
+
+// The maximum number of spare runtimes (-p).
+#define MAX_SPARE_RUNTIMES 16
+
+// The maximum number of writes and removals waiting for the on-disk command
+// cache's writer thread (-cd). Further ones are dropped until it catches up.
+#define DISK_CACHE_MAX_QUEUED_OPS 256
+
+// The time allowed for the runtime threads, or the worker processes with -f,
+// to become ready (see thread_ready_timeout_ns in main.c): a base time, plus a
+// time per MiB of module bytecode for each runtime that a CPU has to create,
+// up to a maximum.
+#define READY_TIMEOUT_BASE_MS 10000
+#define READY_TIMEOUT_PER_MODULE_MIB_MS 1000
+#define READY_TIMEOUT_MAX_MS 120000
+
 #define VERSION_STRING_SIZE 128
 
 #define PUBLIC_KEY_FILE_SUFFIX ".pubkey"
@@ -0,0 +1,53 @@
+#ifdef __linux__
+#define _GNU_SOURCE // make the sched_setaffinity API available
+#endif
+#include "cpu_affinity.h"
+#include <errno.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#ifdef __linux__
+
+int cpu_affinity_allowed_cpus(int *cpus, int max_cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (0 != sched_getaffinity(0, sizeof(set), &set))
+    return -1;
+  int n = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && n < max_cpus; ++cpu) {
+    if (CPU_ISSET(cpu, &set))
+      cpus[n++] = cpu;
+  }
+  return n;
+}
+
+int cpu_affinity_pin_current_thread(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  // On Linux, a pid of 0 refers to the calling thread rather than to the whole
+  // process.
+  return sched_setaffinity(0, sizeof(set), &set);
+}
+
+#else
+
+int cpu_affinity_allowed_cpus(int *cpus, int max_cpus) {
+  (void)cpus;
+  (void)max_cpus;
+  errno = ENOSYS;
+  return -1;
+}
+
+int cpu_affinity_pin_current_thread(int cpu) {
+  (void)cpu;
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef CPU_AFFINITY_H_
+#define CPU_AFFINITY_H_
+
+// CPU affinity is supported only on Linux. Elsewhere these functions fail with
+// errno set to ENOSYS.
+
+// Writes the CPUs that the process may run on to 'cpus' in ascending order and
+// returns the number written (at most 'max_cpus'), or -1 on error.
+int cpu_affinity_allowed_cpus(int *cpus, int max_cpus);
+// Restricts the calling thread to 'cpu'. Returns 0 on success or -1 on error.
+int cpu_affinity_pin_current_thread(int cpu);
+
+#endif
@@ -16,6 +16,12 @@ static const char *allowed_modules[] = {"os", "std"};
 JSValue load_binary_module(JSContext *ctx, const uint8_t *buf, size_t buf_len) {
   JSValue obj, val;
 
+  // JS_READ_OBJ_ROM_DATA would let the function bytecode point into 'buf'
+  // rather than being copied, but it requires the atoms in the bytecode to
+  // already be atoms of this runtime. A file written by JS_WriteObject holds
+  // indices into its own atom table, which are translated to the runtime's
+  // atoms as the bytecode is copied, so each runtime needs its own copy.
+  // Prefork mode (-f) shares the loaded module between workers instead.
   obj = JS_ReadObject(ctx, buf, buf_len, JS_READ_OBJ_BYTECODE);
   if (JS_IsException(obj))
     return obj;
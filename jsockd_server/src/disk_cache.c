@@ -0,0 +1,470 @@
+#include "disk_cache.h"
+#include "config.h"
+#include "hex.h"
+#include "log.h"
+#include "mmap_file.h"
+#include "utils.h"
+#include <dirent.h>
+#include <ed25519/sha512.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File layout (integers are little-endian):
+//
+//   magic          8 bytes ("JSOCKDC1")
+//   version      128 bytes (NUL padded)
+//   module hash   16 bytes
+//   uid           16 bytes
+//   size           8 bytes (of the bytecode)
+//   bytecode    size bytes
+//   MAC           64 bytes (HMAC-SHA512 of everything above)
+
+#define DISK_CACHE_MAGIC "JSOCKDC1"
+#define DISK_CACHE_MAGIC_SIZE 8
+#define DISK_CACHE_UID_SIZE 16
+#define DISK_CACHE_HEADER_SIZE                                                 \
+  (DISK_CACHE_MAGIC_SIZE + VERSION_STRING_SIZE + DISK_CACHE_UID_SIZE * 2 + 8)
+#define DISK_CACHE_MAC_SIZE 64
+#define SHA512_BLOCK_SIZE 128
+
+// A queued write or, if 'remove' is set, removal. The module hash is taken when
+// the write is queued, as the module may be reloaded before it's written.
+typedef struct DiskCacheOp {
+  struct DiskCacheOp *next;
+  bool remove;
+  HashCacheUid uid;
+  HashCacheUid module_hash;
+  size_t bytecode_size;
+  uint8_t bytecode[];
+} DiskCacheOp;
+
+static void put_u64(uint8_t *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i)
+    p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; ++i)
+    v |= (uint64_t)p[i] << (i * 8);
+  return v;
+}
+
+static void put_uid(uint8_t *p, HashCacheUid uid) {
+  put_u64(p, (uint64_t)uid);
+#ifdef HASH_CACHE_USE_128_BIT_UIDS
+  put_u64(p + 8, (uint64_t)(uid >> 64));
+#else
+  put_u64(p + 8, 0);
+#endif
+}
+
+static HashCacheUid get_uid(const uint8_t *p) {
+  HashCacheUid uid = get_u64(p);
+#ifdef HASH_CACHE_USE_128_BIT_UIDS
+  uid |= (HashCacheUid)get_u64(p + 8) << 64;
+#endif
+  return uid;
+}
+
+static void hmac_sha512(const uint8_t key[DISK_CACHE_KEY_SIZE],
+                        const uint8_t *header, const uint8_t *bytecode,
+                        size_t bytecode_size,
+                        uint8_t out[DISK_CACHE_MAC_SIZE]) {
+  uint8_t pad[SHA512_BLOCK_SIZE];
+  uint8_t inner[DISK_CACHE_MAC_SIZE];
+  sha512_context ctx;
+
+  memset(pad, 0x36, sizeof(pad));
+  for (int i = 0; i < DISK_CACHE_KEY_SIZE; ++i)
+    pad[i] ^= key[i];
+  sha512_init(&ctx);
+  sha512_update(&ctx, pad, sizeof(pad));
+  sha512_update(&ctx, header, DISK_CACHE_HEADER_SIZE);
+  sha512_update(&ctx, bytecode, bytecode_size);
+  sha512_final(&ctx, inner);
+
+  memset(pad, 0x5c, sizeof(pad));
+  for (int i = 0; i < DISK_CACHE_KEY_SIZE; ++i)
+    pad[i] ^= key[i];
+  sha512_init(&ctx);
+  sha512_update(&ctx, pad, sizeof(pad));
+  sha512_update(&ctx, inner, sizeof(inner));
+  sha512_final(&ctx, out);
+}
+
+static bool macs_equal(const uint8_t *a, const uint8_t *b) {
+  uint8_t diff = 0;
+  for (int i = 0; i < DISK_CACHE_MAC_SIZE; ++i)
+    diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+static void write_header(const DiskCache *dc, HashCacheUid module_hash,
+                         HashCacheUid uid, size_t bytecode_size,
+                         uint8_t header[DISK_CACHE_HEADER_SIZE]) {
+  uint8_t *p = header;
+  memcpy(p, DISK_CACHE_MAGIC, DISK_CACHE_MAGIC_SIZE);
+  p += DISK_CACHE_MAGIC_SIZE;
+  memcpy(p, dc->version, VERSION_STRING_SIZE);
+  p += VERSION_STRING_SIZE;
+  put_uid(p, module_hash);
+  p += DISK_CACHE_UID_SIZE;
+  put_uid(p, uid);
+  p += DISK_CACHE_UID_SIZE;
+  put_u64(p, (uint64_t)bytecode_size);
+}
+
+int disk_cache_init(DiskCache *dc, const char *dir, const char *hex_key,
+                    const char *version) {
+  memset(dc, 0, sizeof(*dc));
+  dc->dir = dir;
+
+  if (!hex_key || strlen(hex_key) != DISK_CACHE_KEY_SIZE * 2) {
+    jsockd_logf(LOG_ERROR | LOG_INTERACTIVE,
+                "The command cache key in JSOCKD_COMMAND_CACHE_KEY must be %d "
+                "hex digits\n",
+                DISK_CACHE_KEY_SIZE * 2);
+    return -1;
+  }
+  for (const char *cp = hex_key; *cp; ++cp) {
+    if (hex_digit((uint8_t)*cp) < 0) {
+      jsockd_logf(LOG_ERROR | LOG_INTERACTIVE,
+                  "The command cache key in JSOCKD_COMMAND_CACHE_KEY is not "
+                  "valid hex\n");
+      return -1;
+    }
+  }
+  hex_decode(dc->key, DISK_CACHE_KEY_SIZE, hex_key);
+
+  if (strlen(version) >= VERSION_STRING_SIZE) {
+    jsockd_logf(LOG_ERROR, "Version string too long for the command cache\n");
+    return -1;
+  }
+  strcpy(dc->version, version);
+  mutex_init(&dc->mutex);
+  int r = pthread_cond_init(&dc->cond, NULL);
+  if (r != 0) {
+    jsockd_logf(LOG_ERROR, "Error initializing command cache: %s\n",
+                strerror(r));
+    return -1;
+  }
+
+  if (0 != mkdir(dir, 0700) && errno != EEXIST) {
+    jsockd_logf(LOG_ERROR | LOG_INTERACTIVE,
+                "Error creating command cache directory %s: %s\n", dir,
+                strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+void disk_cache_set_module(DiskCache *dc, const uint8_t *module_bytecode,
+                           size_t module_bytecode_size) {
+  HashCacheUid hash = 0;
+  if (module_bytecode)
+    hash = get_hash_cache_uid(module_bytecode, module_bytecode_size);
+  atomic_store_explicit(&dc->module_hash, hash, memory_order_relaxed);
+}
+
+static int file_path(const DiskCache *dc, HashCacheUid uid, char *path,
+                     size_t path_size) {
+  if (snprintf(path, path_size,
+               "%s/" HASH_CACHE_UID_FORMAT_SPECIFIER DISK_CACHE_FILE_SUFFIX,
+               dc->dir, HASH_CACHE_UID_FORMAT_ARGS(uid)) >= (int)path_size) {
+    jsockd_logf(LOG_WARN, "Command cache directory path is too long\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int write_file(DiskCache *dc, HashCacheUid module_hash,
+                      HashCacheUid uid, const uint8_t *bytecode,
+                      size_t bytecode_size) {
+  uint8_t header[DISK_CACHE_HEADER_SIZE];
+  uint8_t mac[DISK_CACHE_MAC_SIZE];
+  write_header(dc, module_hash, uid, bytecode_size, header);
+  hmac_sha512(dc->key, header, bytecode, bytecode_size, mac);
+
+  char tmp_path[PATH_MAX];
+  char path[PATH_MAX];
+  if (0 != file_path(dc, uid, path, sizeof(path)))
+    return -1;
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s/.tmp-XXXXXX", dc->dir) >=
+      (int)sizeof(tmp_path)) {
+    jsockd_logf(LOG_WARN, "Command cache directory path is too long\n");
+    return -1;
+  }
+
+  // Written to a temporary file and renamed so that a concurrent (or
+  // crashed) writer never leaves a partial file under the final name.
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    jsockd_logf(LOG_WARN, "Error creating command cache file in %s: %s\n",
+                dc->dir, strerror(errno));
+    return -1;
+  }
+  if (0 != write_all(fd, (const char *)header, sizeof(header)) ||
+      0 != write_all(fd, (const char *)bytecode, bytecode_size) ||
+      0 != write_all(fd, (const char *)mac, sizeof(mac))) {
+    jsockd_logf(LOG_WARN, "Error writing command cache file %s: %s\n",
+                tmp_path, strerror(errno));
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+  }
+  if (0 != close(fd) || 0 != rename(tmp_path, path)) {
+    jsockd_logf(LOG_WARN, "Error writing command cache file %s: %s\n", path,
+                strerror(errno));
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+int disk_cache_write(DiskCache *dc, HashCacheUid uid, const uint8_t *bytecode,
+                     size_t bytecode_size) {
+  return write_file(
+      dc, atomic_load_explicit(&dc->module_hash, memory_order_relaxed), uid,
+      bytecode, bytecode_size);
+}
+
+int disk_cache_remove(DiskCache *dc, HashCacheUid uid) {
+  char path[PATH_MAX];
+  if (0 != file_path(dc, uid, path, sizeof(path)))
+    return -1;
+  // The write may have been dropped, or may have failed.
+  if (0 != unlink(path) && errno != ENOENT) {
+    jsockd_logf(LOG_WARN, "Error removing command cache file %s: %s\n", path,
+                strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Returns a pointer to the bytecode within 'mapping', or NULL if the file is
+// corrupt, has been tampered with, or was written for a different version or
+// module.
+static const uint8_t *validate_file(const DiskCache *dc, const uint8_t *mapping,
+                                    size_t mapping_size, HashCacheUid *out_uid,
+                                    size_t *out_bytecode_size) {
+  if (mapping_size < DISK_CACHE_HEADER_SIZE + DISK_CACHE_MAC_SIZE)
+    return NULL;
+  const uint8_t *p = mapping;
+  if (0 != memcmp(p, DISK_CACHE_MAGIC, DISK_CACHE_MAGIC_SIZE))
+    return NULL;
+  p += DISK_CACHE_MAGIC_SIZE;
+  if (0 != memcmp(p, dc->version, VERSION_STRING_SIZE))
+    return NULL;
+  p += VERSION_STRING_SIZE;
+  if (get_uid(p) !=
+      atomic_load_explicit(&dc->module_hash, memory_order_relaxed))
+    return NULL;
+  p += DISK_CACHE_UID_SIZE;
+  HashCacheUid uid = get_uid(p);
+  p += DISK_CACHE_UID_SIZE;
+  uint64_t bytecode_size = get_u64(p);
+  if (bytecode_size !=
+      mapping_size - DISK_CACHE_HEADER_SIZE - DISK_CACHE_MAC_SIZE)
+    return NULL;
+
+  const uint8_t *bytecode = mapping + DISK_CACHE_HEADER_SIZE;
+  uint8_t mac[DISK_CACHE_MAC_SIZE];
+  hmac_sha512(dc->key, mapping, bytecode, bytecode_size, mac);
+  if (!macs_equal(mac, bytecode + bytecode_size))
+    return NULL;
+
+  *out_uid = uid;
+  *out_bytecode_size = bytecode_size;
+  return bytecode;
+}
+
+int disk_cache_load(DiskCache *dc, DiskCacheAddFunc add, void *data) {
+  DIR *dir = opendir(dc->dir);
+  if (!dir) {
+    jsockd_logf(LOG_ERROR, "Error opening command cache directory %s: %s\n",
+                dc->dir, strerror(errno));
+    return -1;
+  }
+
+  int n_loaded = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    size_t name_len = strlen(ent->d_name);
+    size_t suffix_len = strlen(DISK_CACHE_FILE_SUFFIX);
+    if (ent->d_name[0] == '.' || name_len <= suffix_len ||
+        0 != strcmp(ent->d_name + name_len - suffix_len,
+                    DISK_CACHE_FILE_SUFFIX))
+      continue;
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", dc->dir, ent->d_name) >=
+        (int)sizeof(path))
+      continue;
+
+    size_t mapping_size;
+    int mmap_errno;
+    const uint8_t *mapping = mmap_file(path, &mapping_size, &mmap_errno);
+    if (!mapping) {
+      jsockd_logf(LOG_WARN, "Error opening command cache file %s: %s\n", path,
+                  strerror(mmap_errno));
+      continue;
+    }
+
+    HashCacheUid uid;
+    size_t bytecode_size;
+    const uint8_t *bytecode =
+        validate_file(dc, mapping, mapping_size, &uid, &bytecode_size);
+    if (!bytecode) {
+      // Most likely left over from a previous version or module, so it will
+      // never be valid again.
+      jsockd_logf(LOG_DEBUG,
+                  "Removing stale or invalid command cache file %s\n", path);
+      munmap_or_warn(mapping, mapping_size);
+      unlink(path);
+      continue;
+    }
+
+    if (add(uid, mapping, mapping_size, bytecode, bytecode_size, data)) {
+      ++n_loaded;
+    } else {
+      // There's no room for it in the command cache, so it's removed just as
+      // if it had been evicted.
+      munmap_or_warn(mapping, mapping_size);
+      unlink(path);
+    }
+  }
+
+  closedir(dir);
+  return n_loaded;
+}
+
+static void queue_op(DiskCache *dc, DiskCacheOp *op) {
+  op->next = NULL;
+  mutex_lock(&dc->mutex);
+  if (dc->n_queued >= DISK_CACHE_MAX_QUEUED_OPS) {
+    mutex_unlock(&dc->mutex);
+    jsockd_log(LOG_DEBUG, "Command cache writer is behind; dropping update\n");
+    free(op);
+    return;
+  }
+  if (dc->tail)
+    dc->tail->next = op;
+  else
+    dc->head = op;
+  dc->tail = op;
+  dc->n_queued++;
+  pthread_cond_signal(&dc->cond);
+  mutex_unlock(&dc->mutex);
+}
+
+void disk_cache_queue_write(DiskCache *dc, HashCacheUid uid,
+                            const uint8_t *bytecode, size_t bytecode_size) {
+  DiskCacheOp *op = malloc(sizeof(DiskCacheOp) + bytecode_size);
+  if (!op) {
+    jsockd_log(LOG_WARN, "Error allocating command cache write\n");
+    return;
+  }
+  op->remove = false;
+  op->uid = uid;
+  op->module_hash =
+      atomic_load_explicit(&dc->module_hash, memory_order_relaxed);
+  op->bytecode_size = bytecode_size;
+  memcpy(op->bytecode, bytecode, bytecode_size);
+  queue_op(dc, op);
+}
+
+void disk_cache_queue_remove(DiskCache *dc, HashCacheUid uid) {
+  DiskCacheOp *op = malloc(sizeof(DiskCacheOp));
+  if (!op) {
+    jsockd_log(LOG_WARN, "Error allocating command cache removal\n");
+    return;
+  }
+  op->remove = true;
+  op->uid = uid;
+  op->bytecode_size = 0;
+  queue_op(dc, op);
+}
+
+// Called with the mutex held.
+static DiskCacheOp *pop_op(DiskCache *dc) {
+  DiskCacheOp *op = dc->head;
+  if (!op)
+    return NULL;
+  dc->head = op->next;
+  if (!dc->head)
+    dc->tail = NULL;
+  dc->n_queued--;
+  return op;
+}
+
+static void run_op(DiskCache *dc, DiskCacheOp *op) {
+  if (op->remove)
+    disk_cache_remove(dc, op->uid);
+  else
+    write_file(dc, op->module_hash, op->uid, op->bytecode, op->bytecode_size);
+  free(op);
+}
+
+void disk_cache_flush(DiskCache *dc) {
+  for (;;) {
+    mutex_lock(&dc->mutex);
+    DiskCacheOp *op = pop_op(dc);
+    mutex_unlock(&dc->mutex);
+    if (!op)
+      return;
+    run_op(dc, op);
+  }
+}
+
+static void *writer_thread_func(void *data) {
+  DiskCache *dc = (DiskCache *)data;
+  mutex_lock(&dc->mutex);
+  for (;;) {
+    DiskCacheOp *op = pop_op(dc);
+    if (op) {
+      mutex_unlock(&dc->mutex);
+      run_op(dc, op);
+      mutex_lock(&dc->mutex);
+    } else if (dc->stop) {
+      break;
+    } else {
+      pthread_cond_wait(&dc->cond, &dc->mutex);
+    }
+  }
+  mutex_unlock(&dc->mutex);
+  return NULL;
+}
+
+int disk_cache_start_writer(DiskCache *dc) {
+  dc->stop = false;
+  int r = pthread_create(&dc->writer, NULL, writer_thread_func, dc);
+  if (r != 0) {
+    jsockd_logf(LOG_ERROR, "Error creating command cache writer thread: %s\n",
+                strerror(r));
+    return -1;
+  }
+  dc->writer_started = true;
+  return 0;
+}
+
+void disk_cache_stop_writer(DiskCache *dc) {
+  if (!dc->writer_started) {
+    disk_cache_flush(dc);
+    return;
+  }
+  mutex_lock(&dc->mutex);
+  dc->stop = true;
+  pthread_cond_signal(&dc->cond);
+  mutex_unlock(&dc->mutex);
+  if (0 != pthread_join(dc->writer, NULL))
+    jsockd_logf(LOG_ERROR, "Error joining command cache writer thread: %s\n",
+                strerror(errno));
+  dc->writer_started = false;
+}
@@ -0,0 +1,81 @@
+#ifndef DISK_CACHE_H_
+#define DISK_CACHE_H_
+
+#include "config.h"
+#include "hash_cache.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The on-disk command cache (see -cd). The bytecode of each compiled command
+// is written to its own file in the cache directory, so that a restarted
+// server can map it back in rather than compiling the command again. Each file
+// is authenticated with an HMAC-SHA512 keyed by JSOCKD_COMMAND_CACHE_KEY, as
+// loading bytecode that has been tampered with is as unsafe as loading an
+// unsigned module. Files written by a different version of jsockd or with a
+// different module are ignored and removed.
+//
+// The server writes files from a background thread (see
+// disk_cache_start_writer), and removes the file for each entry evicted from
+// the in-memory command cache, so that the directory holds no more than the
+// in-memory cache does (see -cn and -cb).
+
+#define DISK_CACHE_KEY_SIZE 32
+#define DISK_CACHE_FILE_SUFFIX ".jsockdc"
+
+typedef struct {
+  const char *dir;
+  uint8_t key[DISK_CACHE_KEY_SIZE];
+  char version[VERSION_STRING_SIZE];
+  // A hash of the module bytecode (see disk_cache_set_module).
+  _Atomic(HashCacheUid) module_hash;
+  // Writes and removals waiting for the writer thread, in order. Protected by
+  // 'mutex'.
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct DiskCacheOp *head;
+  struct DiskCacheOp *tail;
+  int n_queued;
+  bool stop;
+  bool writer_started;
+  pthread_t writer;
+} DiskCache;
+
+// Called for each valid file by disk_cache_load. The bytecode is within
+// 'mapping', and the callee takes ownership of the mapping if it returns true.
+typedef bool (*DiskCacheAddFunc)(HashCacheUid uid, const uint8_t *mapping,
+                                 size_t mapping_size, const uint8_t *bytecode,
+                                 size_t bytecode_size, void *data);
+
+// Creates the directory if it doesn't exist. Returns -1 if 'hex_key' isn't a
+// valid key or the directory can't be created.
+int disk_cache_init(DiskCache *dc, const char *dir, const char *hex_key,
+                    const char *version);
+// Sets the module that files are written for and loaded with. May be called
+// concurrently with disk_cache_write.
+void disk_cache_set_module(DiskCache *dc, const uint8_t *module_bytecode,
+                           size_t module_bytecode_size);
+int disk_cache_write(DiskCache *dc, HashCacheUid uid, const uint8_t *bytecode,
+                     size_t bytecode_size);
+int disk_cache_remove(DiskCache *dc, HashCacheUid uid);
+// Returns the number of files passed to 'add', or -1 if the directory can't be
+// read. Files for which 'add' returns false are removed, as are invalid files.
+int disk_cache_load(DiskCache *dc, DiskCacheAddFunc add, void *data);
+
+// Queue a write (of a copy of 'bytecode') or a removal for the writer thread,
+// so that the caller doesn't wait for the file system. The operation is
+// dropped if DISK_CACHE_MAX_QUEUED_OPS are already waiting.
+void disk_cache_queue_write(DiskCache *dc, HashCacheUid uid,
+                            const uint8_t *bytecode, size_t bytecode_size);
+void disk_cache_queue_remove(DiskCache *dc, HashCacheUid uid);
+// Carries out the queued operations on the calling thread. Must not be called
+// once the writer thread has been started.
+void disk_cache_flush(DiskCache *dc);
+// The writer thread doesn't survive a fork, so in prefork mode (-f) each
+// worker process starts its own.
+int disk_cache_start_writer(DiskCache *dc);
+// Carries out the operations still queued and joins the writer thread.
+void disk_cache_stop_writer(DiskCache *dc);
+
+#endif
@@ -0,0 +1,1201 @@
+#include "dispatch.h"
+#include "config.h"
+#include "globals.h"
+#include "log.h"
+#include "utils.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Each line of a record is stored as a RecordLineHeader followed by the line
+// itself and a zero terminator.
+typedef struct {
+  size_t len;
+  bool truncated;
+} RecordLineHeader;
+
+static bool should_stop(Dispatcher *d) {
+  return atomic_load_explicit(&d->stop, memory_order_acquire) ||
+         atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire);
+}
+
+static void wake_dispatcher(Dispatcher *d) {
+  // Under load, runtime threads hand back records faster than the dispatcher
+  // goes around its loop, so only the first wakeup since the dispatcher last
+  // drained the pipe needs a write.
+  if (atomic_exchange_explicit(&d->wake_pending, true, memory_order_seq_cst))
+    return;
+  const char c = 0;
+  // If the pipe is full then the dispatcher has plenty of wakeups pending
+  // already, so EAGAIN can be ignored.
+  while (-1 == write(d->wake_pipe[1], &c, sizeof(c)) && errno == EINTR)
+    ;
+}
+
+static void drain_wake_pipe(Dispatcher *d) {
+  char buf[64];
+  for (;;) {
+    ssize_t n = read(d->wake_pipe[0], buf, sizeof(buf));
+    // A short read means the pipe is empty, so don't go back for an EAGAIN.
+    if (n == (ssize_t)sizeof(buf) || (n < 0 && errno == EINTR))
+      continue;
+    break;
+  }
+  // Cleared only after draining, so that a wakeup which finds the flag still
+  // set is sure to be seen when the dispatcher next picks up the state shared
+  // with the runtime threads.
+  atomic_store_explicit(&d->wake_pending, false, memory_order_seq_cst);
+}
+
+static int set_nonblocking(int fd, bool nonblocking) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1)
+    return -1;
+  return fcntl(fd, F_SETFL,
+               nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+}
+
+int dispatcher_init(Dispatcher *d, const int *listener_fds, int n_listeners) {
+  memset(d, 0, sizeof(*d));
+  d->wake_pipe[0] = -1;
+  d->wake_pipe[1] = -1;
+  atomic_init(&d->stop, false);
+  atomic_init(&d->wake_pending, false);
+  atomic_init(&d->n_sleeping, 0);
+  atomic_init(&d->n_active_runtimes, 0);
+  atomic_init(&d->n_starting_runtimes, 0);
+  atomic_init(&d->n_queued, 0);
+  atomic_init(&d->n_executing, 0);
+  atomic_init(&d->n_rejected, 0);
+  if (0 != mpmc_queue_init(&d->ready, DISPATCH_READY_QUEUE_CAPACITY)) {
+    jsockd_log(LOG_ERROR, "Error allocating dispatcher ready queue\n");
+    return -1;
+  }
+  mutex_init(&d->mutex);
+  if (0 != cond_init_monotonic(&d->cond)) {
+    jsockd_log(LOG_ERROR, "Error initializing dispatcher condition variable\n");
+    pthread_mutex_destroy(&d->mutex);
+    mpmc_queue_destroy(&d->ready);
+    return -1;
+  }
+  if (0 != cond_init_monotonic(&d->park_cond)) {
+    jsockd_log(LOG_ERROR, "Error initializing dispatcher condition variable\n");
+    pthread_cond_destroy(&d->cond);
+    pthread_mutex_destroy(&d->mutex);
+    mpmc_queue_destroy(&d->ready);
+    return -1;
+  }
+
+  if (0 != pipe(d->wake_pipe) || 0 != set_nonblocking(d->wake_pipe[0], true) ||
+      0 != set_nonblocking(d->wake_pipe[1], true)) {
+    jsockd_logf(LOG_ERROR, "Error creating dispatcher wake pipe: %s\n",
+                strerror(errno));
+    dispatcher_destroy(d);
+    return -1;
+  }
+
+  // The listening sockets are non-blocking so that the dispatcher thread
+  // can't get stuck in accept if a client disconnects after poll returns.
+  d->n_listeners = n_listeners;
+  if (n_listeners > 0) {
+    d->listener_fds = malloc(sizeof(int) * n_listeners);
+    memcpy(d->listener_fds, listener_fds, sizeof(int) * n_listeners);
+  }
+  for (int i = 0; i < n_listeners; ++i) {
+    if (0 != set_nonblocking(listener_fds[i], true)) {
+      jsockd_logf(LOG_ERROR, "Error setting O_NONBLOCK on shared socket: %s\n",
+                  strerror(errno));
+      dispatcher_destroy(d);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+Conn *conn_new(int fd, int listener_index) {
+  Conn *c = calloc(1, sizeof(Conn));
+  if (!c)
+    return NULL;
+  c->fd = fd;
+  c->listener_index = listener_index;
+  c->line_buf.buf = malloc(INPUT_BUF_BYTES);
+  c->line_buf.size = INPUT_BUF_BYTES;
+  if (!c->line_buf.buf) {
+    free(c);
+    return NULL;
+  }
+  atomic_init(&c->n_awaiting_replies, 0);
+  mutex_init(&c->write_mutex);
+  return c;
+}
+
+static Record *record_new(Conn *c) {
+  Record *r = calloc(1, sizeof(Record));
+  if (!r)
+    return NULL;
+  atomic_init(&r->awaiting_reply, false);
+  mutex_init(&r->reply_mutex);
+  if (0 != cond_init_monotonic(&r->reply_cond)) {
+    pthread_mutex_destroy(&r->reply_mutex);
+    free(r);
+    return NULL;
+  }
+  r->conn = c;
+  return r;
+}
+
+static void record_free(Record *r) {
+  free(r->data);
+  free(r->reply);
+  pthread_cond_destroy(&r->reply_cond);
+  pthread_mutex_destroy(&r->reply_mutex);
+  free(r);
+}
+
+static void free_record_list(Record *r) {
+  while (r) {
+    Record *next = r->next;
+    record_free(r);
+    r = next;
+  }
+}
+
+void conn_close(Conn *conn) {
+  if (!conn)
+    return;
+  jsockd_logf(LOG_DEBUG, "Closing connection fd=%i\n", conn->fd);
+  if (conn->fd >= 0)
+    close(conn->fd);
+  free(conn->line_buf.buf);
+  if (conn->building)
+    record_free(conn->building);
+  free_record_list(conn->pending_head);
+  free_record_list(conn->in_flight);
+  free_record_list(conn->spare);
+  pthread_mutex_destroy(&conn->write_mutex);
+  free(conn);
+}
+
+static int grow_buf(char **buf, size_t *capacity, size_t needed) {
+  if (needed <= *capacity)
+    return 0;
+  size_t new_capacity = MAX(needed, *capacity * 2);
+  char *new_buf = realloc(*buf, new_capacity);
+  if (!new_buf)
+    return -1;
+  *buf = new_buf;
+  *capacity = new_capacity;
+  return 0;
+}
+
+static int record_append_line(Conn *c, const char *line, size_t len,
+                              bool truncated) {
+  if (!c->building) {
+    if (c->spare) {
+      c->building = c->spare;
+      c->spare = c->spare->next;
+      c->n_spare--;
+    } else {
+      c->building = record_new(c);
+      if (!c->building)
+        return -1;
+    }
+    clock_gettime(MONOTONIC_CLOCK, &c->building->received_time);
+  }
+  Record *r = c->building;
+  size_t needed = r->len + sizeof(RecordLineHeader) + len + 1;
+  if (0 != grow_buf(&r->data, &r->capacity, needed))
+    return -1;
+  RecordLineHeader h = {.len = len, .truncated = truncated};
+  memcpy(r->data + r->len, &h, sizeof(h));
+  memcpy(r->data + r->len + sizeof(h), line, len);
+  r->data[r->len + sizeof(h) + len] = '\0';
+  r->len = needed;
+  return 0;
+}
+
+static void finish_record(Conn *c) {
+  Record *r = c->building;
+  c->building = NULL;
+  r->next = NULL;
+  if (c->pending_tail)
+    c->pending_tail->next = r;
+  else
+    c->pending_head = r;
+  c->pending_tail = r;
+  c->n_pending++;
+}
+
+// Keeps a few record buffers for reuse rather than reallocating them for every
+// command.
+static void recycle_record(Conn *c, Record *r) {
+  if (c->n_spare >= 4) {
+    record_free(r);
+    return;
+  }
+  r->len = 0;
+  r->pos = 0;
+  r->barrier = false;
+  r->close_requested = false;
+  r->next = c->spare;
+  c->spare = r;
+  c->n_spare++;
+}
+
+int record_replay(Record *record,
+                  int (*line_handler)(const char *line, size_t line_len,
+                                      void *data, bool truncated),
+                  void *line_handler_data) {
+  while (record->pos < record->len) {
+    RecordLineHeader h;
+    memcpy(&h, record->data + record->pos, sizeof(h));
+    int r = line_handler(record->data + record->pos + sizeof(h), h.len,
+                         line_handler_data, h.truncated);
+    if (r < 0)
+      return r;
+    record->pos += sizeof(h) + h.len + 1;
+  }
+  return 0;
+}
+
+// Responses are routed to the record's mailbox until the runtime thread
+// collects them, so that further async message responses can be appended.
+static bool reply_state_is_awaited(ReplyState state) {
+  return state == REPLY_AWAITED || state == REPLY_RECEIVED;
+}
+
+// Must be called with reply_mutex held.
+static void set_reply_state(Record *record, ReplyState state) {
+  bool was_awaited = reply_state_is_awaited(record->reply_state);
+  bool is_awaited = reply_state_is_awaited(state);
+  record->reply_state = state;
+  if (was_awaited == is_awaited)
+    return;
+  atomic_store_explicit(&record->awaiting_reply, is_awaited,
+                        memory_order_release);
+  atomic_fetch_add_explicit(&record->conn->n_awaiting_replies,
+                            is_awaited ? 1 : -1, memory_order_acq_rel);
+}
+
+void record_expect_reply(Record *record, const char *uuid, size_t uuid_len) {
+  mutex_lock(&record->reply_mutex);
+  assert(uuid_len <= sizeof(record->awaited_uuid));
+  memcpy(record->awaited_uuid, uuid, uuid_len);
+  record->awaited_uuid_len = uuid_len;
+  // Don't lose async message responses that haven't been collected yet.
+  if (record->reply_state != REPLY_RECEIVED)
+    set_reply_state(record, REPLY_AWAITED);
+  mutex_unlock(&record->reply_mutex);
+  // The dispatcher thread may have stopped reading from the connection
+  // because too many pipelined commands are queued on it.
+  wake_dispatcher(record->conn->dispatcher);
+}
+
+ReplyState record_wait_for_reply(Record *record, char *buf, size_t buf_size,
+                                 size_t *len, int timeout_ms,
+                                 bool more_expected) {
+  mutex_lock(&record->reply_mutex);
+  if (record->reply_state == REPLY_AWAITED)
+    cond_timedwait_ms(&record->reply_cond, &record->reply_mutex, timeout_ms);
+  ReplyState state = record->reply_state;
+  if (state == REPLY_RECEIVED) {
+    if (record->reply_len > buf_size) {
+      state = REPLY_TOO_BIG;
+    } else {
+      memcpy(buf, record->reply, record->reply_len);
+      *len = record->reply_len;
+    }
+    record->reply_len = 0;
+  }
+  if (state == REPLY_RECEIVED && more_expected)
+    set_reply_state(record, REPLY_AWAITED);
+  else if (state != REPLY_AWAITED)
+    set_reply_state(record, REPLY_NONE);
+  mutex_unlock(&record->reply_mutex);
+  return state;
+}
+
+void record_cancel_reply(Record *record) {
+  mutex_lock(&record->reply_mutex);
+  set_reply_state(record, REPLY_NONE);
+  mutex_unlock(&record->reply_mutex);
+}
+
+static Record *find_awaiting_record(Conn *c, const char *line, size_t len) {
+  if (0 == atomic_load_explicit(&c->n_awaiting_replies, memory_order_acquire))
+    return NULL;
+  for (Record *r = c->in_flight; r; r = r->next) {
+    if (!atomic_load_explicit(&r->awaiting_reply, memory_order_acquire))
+      continue;
+    mutex_lock(&r->reply_mutex);
+    size_t n = r->awaited_uuid_len;
+    bool match = reply_state_is_awaited(r->reply_state) &&
+                 (len == n || (len > n && line[n] == ' ')) &&
+                 0 == memcmp(line, r->awaited_uuid, n);
+    mutex_unlock(&r->reply_mutex);
+    if (match)
+      return r;
+  }
+  return NULL;
+}
+
+// Responses to async messages are appended to any that haven't yet been
+// collected by the runtime thread.
+static void deliver_reply(Conn *c, Record *r, const char *json,
+                          size_t json_len, bool truncated) {
+  mutex_lock(&r->reply_mutex);
+  if (reply_state_is_awaited(r->reply_state)) {
+    size_t start = r->reply_state == REPLY_RECEIVED ? r->reply_len : 0;
+    size_t len = start + c->reply_id_len + 1 + json_len + 1;
+    if (truncated || 0 != grow_buf(&r->reply, &r->reply_capacity, len)) {
+      set_reply_state(r, REPLY_TOO_BIG);
+    } else {
+      char *p = r->reply + start;
+      memcpy(p, c->reply_id, c->reply_id_len);
+      p[c->reply_id_len] = g_cmd_args.socket_sep_char;
+      memcpy(p + c->reply_id_len + 1, json, json_len);
+      r->reply[len - 1] = g_cmd_args.socket_sep_char;
+      r->reply_len = len;
+      set_reply_state(r, REPLY_RECEIVED);
+    }
+    pthread_cond_signal(&r->reply_cond);
+  }
+  mutex_unlock(&r->reply_mutex);
+}
+
+static void deliver_reply_eof(Conn *c) {
+  for (Record *r = c->in_flight; r; r = r->next) {
+    mutex_lock(&r->reply_mutex);
+    if (reply_state_is_awaited(r->reply_state)) {
+      set_reply_state(r, REPLY_EOF);
+      pthread_cond_signal(&r->reply_cond);
+    }
+    mutex_unlock(&r->reply_mutex);
+  }
+}
+
+// Tracks the command parser state in line_handler (main.c) closely enough to
+// know when a connection's input reaches a point where the parser is back in
+// its initial state. The lines up to that point form a record which can be
+// executed by any runtime thread.
+//
+// A message response ('<id><sep><json><sep>') can arrive between records while
+// a command on the connection is waiting for it. The ID can't be mistaken for
+// the start of a new command, as command IDs are unique.
+static int frame_line(const char *line, size_t len, void *data,
+                      bool truncated) {
+  Conn *c = (Conn *)data;
+
+  if (c->reply_record) {
+    deliver_reply(c, c->reply_record, line, len, truncated);
+    c->reply_record = NULL;
+    return 0;
+  }
+  if (c->frame_line_n == 0 && !truncated && len <= sizeof(c->reply_id) &&
+      (c->reply_record = find_awaiting_record(c, line, len))) {
+    memcpy(c->reply_id, line, len);
+    c->reply_id_len = len;
+    return 0;
+  }
+
+  if (0 != record_append_line(c, line, len, truncated)) {
+    jsockd_log(LOG_ERROR, "Error allocating command record\n");
+    return LINE_BUF_READ_EOF;
+  }
+
+  if (!truncated && line[0] == '?') {
+    // Commands beginning with '?' don't advance the parser, except for ?reset,
+    // which returns it to its initial state. After ?quit, the server is going
+    // to exit, so there's no point waiting for the rest of the command.
+    c->building->barrier = true;
+    if (!strcmp(line, "?reset") || !strcmp(line, "?quit"))
+      c->frame_line_n = 0;
+    if (c->frame_line_n == 0)
+      finish_record(c);
+    return 0;
+  }
+
+  if (++c->frame_line_n == 3) {
+    c->frame_line_n = 0;
+    finish_record(c);
+  }
+  return 0;
+}
+
+// Read errors are treated in the same way as the client closing the
+// connection: they affect only that connection.
+static int conn_read(char *buf, size_t n, void *data) {
+  Conn *c = (Conn *)data;
+  ssize_t r;
+  while (-1 == (r = read(c->fd, buf, n)) && errno == EINTR)
+    ;
+  if (r < 0) {
+    jsockd_logf(LOG_WARN, "Error reading from connection fd=%i: %s\n", c->fd,
+                strerror(errno));
+    return 0;
+  }
+  return (int)r;
+}
+
+int conn_frame_input(Conn *c) {
+  int r = line_buf_read(&c->line_buf, g_cmd_args.socket_sep_char, conn_read, c,
+                        frame_line, c);
+  return r < 0 ? LINE_BUF_READ_EOF : 0;
+}
+
+Record *conn_take_record(Conn *c) {
+  Record *r = c->pending_head;
+  if (!r)
+    return NULL;
+  c->pending_head = r->next;
+  if (!c->pending_head)
+    c->pending_tail = NULL;
+  c->n_pending--;
+  return r;
+}
+
+void conn_recycle_record(Conn *c, Record *r) { recycle_record(c, r); }
+
+// Puts a record taken by conn_take_record back at the head of the queue.
+static void requeue_record(Conn *c, Record *r) {
+  r->next = c->pending_head;
+  c->pending_head = r;
+  if (!c->pending_tail)
+    c->pending_tail = r;
+  c->n_pending++;
+}
+
+int dispatcher_add_conn(Dispatcher *d, int fd, int listener_index) {
+  Conn *c = conn_new(fd, listener_index);
+  if (!c)
+    return -1;
+  mutex_lock(&d->mutex);
+  c->next = d->added;
+  d->added = c;
+  mutex_unlock(&d->mutex);
+  wake_dispatcher(d);
+  return 0;
+}
+
+void dispatcher_return(Dispatcher *d, Record *record) {
+  atomic_fetch_sub_explicit(&d->n_executing, 1, memory_order_relaxed);
+  mutex_lock(&d->mutex);
+  record->next_handoff = d->returned;
+  d->returned = record;
+  mutex_unlock(&d->mutex);
+  wake_dispatcher(d);
+}
+
+// Closes the connection if it can't be registered.
+static int register_conn(Dispatcher *d, Conn *conn) {
+  if (d->n_conns == d->conns_capacity) {
+    int new_capacity = d->conns_capacity ? d->conns_capacity * 2 : 16;
+    Conn **new_conns = realloc(d->conns, sizeof(Conn *) * new_capacity);
+    if (!new_conns) {
+      jsockd_logf(LOG_ERROR, "Error registering connection fd=%i\n",
+                  conn->fd);
+      conn_close(conn);
+      return -1;
+    }
+    d->conns = new_conns;
+    d->conns_capacity = new_capacity;
+  }
+  conn->dispatcher = d;
+  conn->registered = true;
+  conn->index = d->n_conns;
+  d->conns[d->n_conns++] = conn;
+  return 0;
+}
+
+static void unregister_and_close_conn(Dispatcher *d, Conn *conn) {
+  assert(d->conns[conn->index] == conn);
+  Conn *last = d->conns[--d->n_conns];
+  d->conns[conn->index] = last;
+  last->index = conn->index;
+  conn_close(conn);
+}
+
+static void wake_runtime_thread(Dispatcher *d) {
+  // A runtime thread increments n_sleeping before checking the queue for the
+  // last time, so it's either seen the new item or is counted here.
+  if (atomic_load_explicit(&d->n_sleeping, memory_order_seq_cst) > 0) {
+    mutex_lock(&d->mutex);
+    pthread_cond_signal(&d->cond);
+    mutex_unlock(&d->mutex);
+  }
+}
+
+static void push_overflow(Dispatcher *d, Record *r) {
+  r->next_handoff = NULL;
+  if (d->overflow_tail)
+    d->overflow_tail->next_handoff = r;
+  else
+    d->overflow_head = r;
+  d->overflow_tail = r;
+}
+
+static void flush_overflow(Dispatcher *d) {
+  while (d->overflow_head && mpmc_queue_push(&d->ready, d->overflow_head)) {
+    d->overflow_head = d->overflow_head->next_handoff;
+    if (!d->overflow_head)
+      d->overflow_tail = NULL;
+    wake_runtime_thread(d);
+  }
+}
+
+static void push_ready(Dispatcher *d, Record *r) {
+  // Keep FIFO order if earlier records are still waiting for room.
+  if (d->overflow_head || !mpmc_queue_push(&d->ready, r))
+    push_overflow(d, r);
+  else
+    wake_runtime_thread(d);
+}
+
+static void class_append(DispatchClass *k, Record *r) {
+  r->next_handoff = NULL;
+  if (k->tail)
+    k->tail->next_handoff = r;
+  else
+    k->head = r;
+  k->tail = r;
+}
+
+static Record *class_pop(DispatchClass *k) {
+  Record *r = k->head;
+  k->head = r->next_handoff;
+  if (!k->head)
+    k->tail = NULL;
+  return r;
+}
+
+static int n_runtimes(Dispatcher *d) {
+  return atomic_load_explicit(&d->n_active_runtimes, memory_order_relaxed);
+}
+
+// A class may take a free runtime only if enough would be left over for the
+// unused reservations of the other classes.
+static bool class_may_use_runtime(Dispatcher *d, DispatchClass *k) {
+  int n_free = n_runtimes(d) - d->n_outstanding;
+  int reserved_for_others = 0;
+  for (int i = 0; i < d->n_classes; ++i) {
+    DispatchClass *o = &d->classes[i];
+    if (o != k)
+      reserved_for_others += MAX(0, o->reserved - o->n_outstanding);
+  }
+  return n_free - 1 >= reserved_for_others;
+}
+
+// Weighted round robin: each time a class's turn comes round, it may hand
+// over up to 'weight' records before the next class gets a turn.
+static DispatchClass *next_class(Dispatcher *d) {
+  for (int visited = 0; visited <= d->n_classes; ++visited) {
+    DispatchClass *k = &d->classes[d->class_turn];
+    if (k->head && k->credit > 0 && class_may_use_runtime(d, k)) {
+      k->credit--;
+      return k;
+    }
+    d->class_turn = (d->class_turn + 1) % d->n_classes;
+    k = &d->classes[d->class_turn];
+    k->credit = k->head ? k->weight : 0;
+  }
+  return NULL;
+}
+
+static void request_runtime_start(Dispatcher *d);
+
+// With priority classes, records are held in their class's queue until a
+// runtime is free, and are then handed over in weighted round robin order.
+// The ready queue therefore stays short, and the choice of which class goes
+// next is made as late as possible.
+static void schedule_classes(Dispatcher *d) {
+  if (d->n_classes == 0)
+    return;
+  for (;;) {
+    if (d->n_outstanding >= n_runtimes(d)) {
+      for (int i = 0; i < d->n_classes; ++i) {
+        if (d->classes[i].head) {
+          request_runtime_start(d);
+          break;
+        }
+      }
+      return;
+    }
+    DispatchClass *k = next_class(d);
+    if (!k)
+      return;
+    k->n_outstanding++;
+    d->n_outstanding++;
+    push_ready(d, class_pop(k));
+  }
+}
+
+static bool can_dispatch(Conn *c, Record *r) {
+  if (c->closing || c->barrier_in_flight)
+    return false;
+  // 'multiplexed' may only be read once it's known that no ?multiplex command
+  // is executing.
+  if (!c->multiplexed || r->barrier)
+    return c->n_in_flight == 0;
+  return true;
+}
+
+static void close_conn_when_idle(Dispatcher *d, Conn *c) {
+  c->closing = true;
+  free_record_list(c->pending_head);
+  c->pending_head = c->pending_tail = NULL;
+  c->n_pending = 0;
+  if (c->n_in_flight == 0)
+    unregister_and_close_conn(d, c);
+}
+
+// Returns the record's first line, or NULL if it was truncated.
+static const char *record_first_line(const Record *r, size_t *len) {
+  RecordLineHeader h;
+  memcpy(&h, r->data, sizeof(h));
+  if (h.truncated)
+    return NULL;
+  *len = h.len;
+  return r->data + sizeof(h);
+}
+
+// Returned by write_response, and passed on by its callers, if the response
+// can't be written yet because a runtime thread is writing to the same
+// (multiplexed) connection.
+#define RESPONSE_BUSY 2
+
+// Writes a response for a record that isn't executed in the usual way. The
+// dispatcher thread mustn't block on a client that isn't reading its
+// responses, so it passes 'block' = false, and the response is then either
+// written in full or not at all. A runtime thread may hold the write mutex
+// for as long as the client doesn't read, so in that case the mutex isn't
+// waited for either, and RESPONSE_BUSY is returned. Otherwise, returns 0 if
+// the response was written or -1 if it couldn't be.
+static int write_response(Conn *c, const char *buf, size_t len, bool block) {
+  bool ok;
+  if (block) {
+    mutex_lock(&c->write_mutex);
+    ok = 0 == write_all(c->fd, buf, len);
+  } else {
+    if (!mutex_trylock(&c->write_mutex))
+      return RESPONSE_BUSY;
+    ssize_t n;
+    while (-1 == (n = send(c->fd, buf, len, MSG_DONTWAIT)) && errno == EINTR)
+      ;
+    ok = n == (ssize_t)len;
+  }
+  mutex_unlock(&c->write_mutex);
+  if (!ok) {
+    jsockd_logf(LOG_WARN, "Error writing response to connection fd=%i\n",
+                c->fd);
+    return -1;
+  }
+  return 0;
+}
+
+// Responds '<id> overloaded "<reason>"' to the command in the record. Returns
+// 1 if the command was rejected, 0 if it can't be rejected (in which case it
+// should be executed as usual), -1 if the response couldn't be written, or
+// RESPONSE_BUSY.
+static int reject_record(Dispatcher *d, Record *r, const char *reason,
+                         bool block) {
+  size_t id_len;
+  const char *id = record_first_line(r, &id_len);
+  if (!id)
+    return 0;
+  // The ID may be followed by the command's budget.
+  const char *space = memchr(id, ' ', id_len);
+  if (space)
+    id_len = (size_t)(space - id);
+  char buf[MESSAGE_UUID_MAX_BYTES + 64];
+  int len = snprintf(buf, sizeof(buf), "%.*s overloaded \"%s\"\n",
+                     (int)MIN(id_len, MESSAGE_UUID_MAX_BYTES), id, reason);
+  assert(len > 0 && (size_t)len < sizeof(buf));
+  int w = write_response(r->conn, buf, (size_t)len, block);
+  if (w != 0)
+    return w;
+  atomic_fetch_add_explicit(&d->n_rejected, 1, memory_order_relaxed);
+  return 1;
+}
+
+// True if more than 'max_queued' records would be waiting for a runtime
+// thread once the idle runtime threads have taken their share.
+static bool too_many_queued(Dispatcher *d) {
+  if (d->max_queued == 0)
+    return false;
+  int idle = n_runtimes(d) -
+             atomic_load_explicit(&d->n_executing, memory_order_relaxed);
+  return atomic_load_explicit(&d->n_queued, memory_order_relaxed) -
+             MAX(0, idle) >=
+         d->max_queued;
+}
+
+static int write_load(Dispatcher *d, Conn *c) {
+  char buf[192];
+  int len = snprintf(
+      buf, sizeof(buf),
+      "{\"queued\":%i,\"executing\":%i,\"runtimes\":%i,\"max_runtimes\":%i,"
+      "\"rejected\":%" PRIuFAST64 "}\n",
+      atomic_load_explicit(&d->n_queued, memory_order_relaxed),
+      atomic_load_explicit(&d->n_executing, memory_order_relaxed),
+      n_runtimes(d), d->max_runtimes,
+      atomic_load_explicit(&d->n_rejected, memory_order_relaxed));
+  assert(len > 0 && (size_t)len < sizeof(buf));
+  int w = write_response(c, buf, (size_t)len, false);
+  return w == 0 ? 1 : w;
+}
+
+// Answers ?load, and rejects commands when too many are queued, without
+// involving a runtime thread. Returns 1 if the record has been dealt with, 0
+// if it should be handed over, -1 if the connection should be closed, or
+// RESPONSE_BUSY if the record should be tried again later.
+static int answer_without_runtime(Dispatcher *d, Record *r) {
+  if (r->barrier) {
+    size_t len;
+    const char *line = record_first_line(r, &len);
+    if (!line || len != sizeof("?load") - 1 || 0 != memcmp(line, "?load", len))
+      return 0;
+    return write_load(d, r->conn);
+  }
+  if (!too_many_queued(d))
+    return 0;
+  return reject_record(d, r, "too many commands queued", false);
+}
+
+// Hands over as many of the connection's pending records as can currently
+// execute.
+static void dispatch_pending(Dispatcher *d, Conn *c) {
+  while (c->pending_head && can_dispatch(c, c->pending_head)) {
+    Record *r = conn_take_record(c);
+
+    // Unless the connection is multiplexed, nothing else on it is executing,
+    // so a response written here is in order.
+    int answered = answer_without_runtime(d, r);
+    if (answered == RESPONSE_BUSY) {
+      // The runtime thread writing to the connection returns its record when
+      // it's done, and the connection's pending records are dispatched again
+      // then.
+      requeue_record(c, r);
+      return;
+    }
+    if (answered != 0) {
+      recycle_record(c, r);
+      if (answered < 0) {
+        close_conn_when_idle(d, c);
+        return;
+      }
+      continue;
+    }
+
+    r->pos = 0;
+    if (d->max_runtimes > d->min_runtimes || d->max_queue_wait_us != 0)
+      clock_gettime(MONOTONIC_CLOCK, &r->ready_time);
+    r->next = c->in_flight;
+    c->in_flight = r;
+    c->n_in_flight++;
+    if (r->barrier)
+      c->barrier_in_flight = true;
+
+    atomic_fetch_add_explicit(&d->n_queued, 1, memory_order_relaxed);
+    if (d->n_classes > 0)
+      class_append(&d->classes[MIN(c->listener_index, d->n_classes - 1)], r);
+    else
+      push_ready(d, r);
+  }
+}
+
+static void handle_returned_record(Dispatcher *d, Record *r) {
+  Conn *c = r->conn;
+  if (d->n_classes > 0) {
+    d->classes[MIN(c->listener_index, d->n_classes - 1)].n_outstanding--;
+    d->n_outstanding--;
+  }
+  Record **p = &c->in_flight;
+  while (*p != r)
+    p = &(*p)->next;
+  *p = r->next;
+  c->n_in_flight--;
+  if (r->barrier)
+    c->barrier_in_flight = false;
+
+  bool close_requested = r->close_requested;
+  recycle_record(c, r);
+
+  if (close_requested || c->closing || (c->eof && !c->pending_head))
+    close_conn_when_idle(d, c);
+  else
+    dispatch_pending(d, c);
+}
+
+static void handle_readable_conn(Dispatcher *d, Conn *c) {
+  int r = line_buf_read(&c->line_buf, g_cmd_args.socket_sep_char, conn_read, c,
+                        frame_line, c);
+  if (r >= 0) {
+    dispatch_pending(d, c);
+    return;
+  }
+  // EOF. Any partially received command is discarded, but complete commands
+  // that were pipelined before EOF are still executed.
+  c->eof = true;
+  deliver_reply_eof(c);
+  if (c->n_in_flight == 0 && !c->pending_head)
+    unregister_and_close_conn(d, c);
+}
+
+static bool should_poll_conn(Conn *c) {
+  if (c->eof || c->closing)
+    return false;
+  return c->n_pending < DISPATCH_MAX_PIPELINED_COMMANDS ||
+         atomic_load_explicit(&c->n_awaiting_replies, memory_order_acquire) >
+             0;
+}
+
+static void accept_conn(Dispatcher *d, int listener_index) {
+  int fd = accept(d->listener_fds[listener_index], NULL, NULL);
+  if (fd < 0) {
+    // The client may have given up between poll and accept; that's not an
+    // error condition for the server as a whole.
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+        errno != ECONNABORTED)
+      jsockd_logf(LOG_ERROR, "accept failed on shared UNIX socket: %s\n",
+                  strerror(errno));
+    return;
+  }
+  // On BSD-derived systems, accepted sockets inherit O_NONBLOCK from the
+  // listening socket. The runtime threads expect blocking I/O when writing
+  // responses.
+  if (0 != set_nonblocking(fd, false)) {
+    jsockd_logf(LOG_ERROR, "Error clearing O_NONBLOCK on connection: %s\n",
+                strerror(errno));
+    close(fd);
+    return;
+  }
+  jsockd_logf(LOG_DEBUG, "Accepted connection fd=%i on shared socket %i\n", fd,
+              listener_index);
+  Conn *c = conn_new(fd, listener_index);
+  if (!c) {
+    jsockd_log(LOG_ERROR, "Error allocating connection\n");
+    close(fd);
+    return;
+  }
+  register_conn(d, c);
+}
+
+static int grow_poll_arrays(struct pollfd **pfds, Conn ***polled,
+                            int *capacity, int new_capacity) {
+  struct pollfd *new_pfds =
+      realloc(*pfds, sizeof(struct pollfd) * new_capacity);
+  if (!new_pfds)
+    return -1;
+  *pfds = new_pfds;
+  Conn **new_polled = realloc(*polled, sizeof(Conn *) * new_capacity);
+  if (!new_polled)
+    return -1;
+  *polled = new_polled;
+  *capacity = new_capacity;
+  return 0;
+}
+
+void dispatcher_run(Dispatcher *d) {
+  struct pollfd *pfds = NULL;
+  Conn **polled = NULL;
+  int pfds_capacity = 0;
+  bool logged_poll_array_error = false;
+
+  while (!should_stop(d)) {
+    mutex_lock(&d->mutex);
+    Record *returned = d->returned;
+    Conn *added = d->added;
+    d->returned = NULL;
+    d->added = NULL;
+    mutex_unlock(&d->mutex);
+    while (added) {
+      Conn *next = added->next;
+      register_conn(d, added);
+      added = next;
+    }
+    while (returned) {
+      Record *next = returned->next_handoff;
+      handle_returned_record(d, returned);
+      returned = next;
+    }
+
+    schedule_classes(d);
+    flush_overflow(d);
+
+    int n_pfds = 2 + d->n_listeners + d->n_conns;
+    if (n_pfds > pfds_capacity &&
+        0 != grow_poll_arrays(&pfds, &polled, &pfds_capacity, n_pfds * 2)) {
+      if (pfds_capacity < 2 + d->n_listeners) {
+        jsockd_log(LOG_ERROR, "Error allocating poll array in dispatcher\n");
+        set_interrupted_or_error();
+        break;
+      }
+      if (!logged_poll_array_error)
+        jsockd_logf(LOG_ERROR,
+                    "Error growing poll array in dispatcher; polling %i of "
+                    "%i connections and not accepting new ones\n",
+                    pfds_capacity - 2 - d->n_listeners, d->n_conns);
+      logged_poll_array_error = true;
+    } else {
+      logged_poll_array_error = false;
+    }
+    // If the arrays couldn't be grown, the connections that don't fit wait
+    // until others close, and no new connections are accepted until then.
+    int max_polled = pfds_capacity - 2 - d->n_listeners;
+    bool accepting = d->n_conns < max_polled;
+    pfds[0] = (struct pollfd){.fd = d->wake_pipe[0], .events = POLLIN};
+    for (int i = 0; i < d->n_listeners; ++i)
+      pfds[1 + i] = (struct pollfd){
+          .fd = accepting ? d->listener_fds[i] : -1, .events = POLLIN};
+    int n_polled = 0;
+    for (int i = 0; i < d->n_conns && n_polled < max_polled; ++i) {
+      if (!should_poll_conn(d->conns[i]))
+        continue;
+      polled[n_polled] = d->conns[i];
+      pfds[1 + d->n_listeners + n_polled] = (struct pollfd){
+          .fd = d->conns[i]->fd, .events = POLLIN | POLLPRI};
+      ++n_polled;
+    }
+    n_pfds = 1 + d->n_listeners + n_polled;
+    // Nothing that the dispatcher does is time-based, so it sleeps until there
+    // is I/O, a wakeup from a runtime thread, or a shutdown.
+    pfds[n_pfds++] =
+        (struct pollfd){.fd = g_shutdown_pipe[0], .events = POLLIN};
+
+    int r = poll(pfds, n_pfds, -1);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      jsockd_logf(LOG_ERROR, "poll failed in dispatcher: %s\n",
+                  strerror(errno));
+      set_interrupted_or_error();
+      break;
+    }
+    if (r == 0)
+      continue;
+
+    if (pfds[0].revents)
+      drain_wake_pipe(d);
+
+    for (int i = 0; i < d->n_listeners; ++i) {
+      if (pfds[1 + i].revents & POLLIN)
+        accept_conn(d, i);
+    }
+
+    // Read from readable connections, including those with commands
+    // executing, and hand over any new records to the runtime threads.
+    for (int i = 0; i < n_polled; ++i) {
+      if (pfds[1 + d->n_listeners + i].revents)
+        handle_readable_conn(d, polled[i]);
+    }
+    schedule_classes(d);
+  }
+
+  free(pfds);
+  free(polled);
+
+  // Wake up any runtime threads waiting on the ready queue so that they can
+  // exit.
+  dispatcher_stop(d);
+}
+
+// Asks a parked runtime thread to start if the record just taken was kept
+// waiting, or if there are more records waiting and no idle runtime threads.
+static void maybe_grow_pool(Dispatcher *d, Record *r) {
+  if (d->max_runtimes <= d->min_runtimes)
+    return;
+  int n = atomic_load_explicit(&d->n_active_runtimes, memory_order_relaxed);
+  if (n >= d->max_runtimes ||
+      atomic_load_explicit(&d->n_starting_runtimes, memory_order_relaxed) > 0)
+    return;
+  bool backlog =
+      !mpmc_queue_is_empty(&d->ready) &&
+      atomic_load_explicit(&d->n_sleeping, memory_order_relaxed) == 0;
+  if (!backlog) {
+    struct timespec now;
+    if (0 != clock_gettime(MONOTONIC_CLOCK, &now) ||
+        ns_time_diff(&now, &r->ready_time) <
+            DISPATCH_POOL_GROW_WAIT_US * 1000LL)
+      return;
+  }
+  request_runtime_start(d);
+}
+
+// Runtimes are started one at a time, so that a burst of commands doesn't
+// immediately take the pool to its maximum size.
+static void request_runtime_start(Dispatcher *d) {
+  if (d->max_runtimes <= d->min_runtimes ||
+      atomic_load_explicit(&d->n_starting_runtimes, memory_order_relaxed) > 0)
+    return;
+  int n = atomic_load_explicit(&d->n_active_runtimes, memory_order_relaxed);
+  if (n >= d->max_runtimes ||
+      !atomic_compare_exchange_strong_explicit(&d->n_active_runtimes, &n,
+                                               n + 1, memory_order_relaxed,
+                                               memory_order_relaxed))
+    return;
+  atomic_fetch_add_explicit(&d->n_starting_runtimes, 1, memory_order_relaxed);
+  jsockd_logf(LOG_DEBUG, "Starting a parked runtime (%i active)\n", n + 1);
+  mutex_lock(&d->mutex);
+  d->n_start_requests++;
+  pthread_cond_signal(&d->park_cond);
+  mutex_unlock(&d->mutex);
+}
+
+static Record *take_record(Dispatcher *d, int timeout_ms) {
+  if (should_stop(d))
+    return NULL;
+  Record *r = mpmc_queue_pop(&d->ready);
+  if (r)
+    return r;
+
+  mutex_lock(&d->mutex);
+  atomic_fetch_add_explicit(&d->n_sleeping, 1, memory_order_seq_cst);
+  r = mpmc_queue_pop(&d->ready);
+  if (!r && !should_stop(d))
+    cond_timedwait_ms(&d->cond, &d->mutex, timeout_ms);
+  atomic_fetch_sub_explicit(&d->n_sleeping, 1, memory_order_relaxed);
+  mutex_unlock(&d->mutex);
+
+  if (!r && !should_stop(d))
+    r = mpmc_queue_pop(&d->ready);
+  return r;
+}
+
+static bool waited_too_long(Dispatcher *d, Record *r) {
+  if (d->max_queue_wait_us == 0 || r->barrier)
+    return false;
+  struct timespec now;
+  return 0 == clock_gettime(MONOTONIC_CLOCK, &now) &&
+         ns_time_diff(&now, &r->ready_time) >
+             (int64_t)d->max_queue_wait_us * 1000LL;
+}
+
+Record *dispatcher_take(Dispatcher *d, int timeout_ms) {
+  Record *r;
+  while ((r = take_record(d, timeout_ms))) {
+    atomic_fetch_sub_explicit(&d->n_queued, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&d->n_executing, 1, memory_order_relaxed);
+    if (!waited_too_long(d, r))
+      break;
+    // The response is written on this thread, as it would be if the command
+    // were executed.
+    int rejected = reject_record(d, r, "queued for too long", true);
+    if (rejected == 0)
+      break;
+    r->close_requested = rejected < 0;
+    dispatcher_return(d, r);
+  }
+  if (r)
+    maybe_grow_pool(d, r);
+  return r;
+}
+
+void dispatcher_stop(Dispatcher *d) {
+  atomic_store_explicit(&d->stop, true, memory_order_release);
+  mutex_lock(&d->mutex);
+  pthread_cond_broadcast(&d->cond);
+  pthread_cond_broadcast(&d->park_cond);
+  mutex_unlock(&d->mutex);
+  wake_dispatcher(d);
+}
+
+// Must be called only after the dispatcher thread and all runtime threads have
+// been joined.
+void dispatcher_destroy(Dispatcher *d) {
+  // Every connection is either in 'conns' or (if added but not yet picked up
+  // by the dispatcher thread) in 'added'. Every record belongs to a
+  // connection.
+  for (Conn *c = d->added; c;) {
+    Conn *next = c->next;
+    conn_close(c);
+    c = next;
+  }
+  d->added = NULL;
+  d->returned = NULL;
+  for (int i = 0; i < d->n_conns; ++i)
+    conn_close(d->conns[i]);
+  free(d->conns);
+  d->conns = NULL;
+  d->n_conns = 0;
+  d->overflow_head = d->overflow_tail = NULL;
+  free(d->classes);
+  d->classes = NULL;
+  d->n_classes = 0;
+  if (d->ready.cells)
+    mpmc_queue_destroy(&d->ready);
+  free(d->listener_fds);
+  d->listener_fds = NULL;
+  if (d->wake_pipe[0] != -1)
+    close(d->wake_pipe[0]);
+  if (d->wake_pipe[1] != -1)
+    close(d->wake_pipe[1]);
+  d->wake_pipe[0] = d->wake_pipe[1] = -1;
+  pthread_cond_destroy(&d->cond);
+  pthread_cond_destroy(&d->park_cond);
+  pthread_mutex_destroy(&d->mutex);
+}
+
+void dispatcher_set_pool_size(Dispatcher *d, int min, int max) {
+  assert(min > 0 && min <= max);
+  d->min_runtimes = min;
+  d->max_runtimes = max;
+  atomic_store_explicit(&d->n_active_runtimes, min, memory_order_relaxed);
+}
+
+bool dispatcher_try_retire(Dispatcher *d) {
+  int n = atomic_load_explicit(&d->n_active_runtimes, memory_order_relaxed);
+  while (n > d->min_runtimes) {
+    if (atomic_compare_exchange_weak_explicit(&d->n_active_runtimes, &n, n - 1,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed))
+      return true;
+  }
+  return false;
+}
+
+bool dispatcher_park(Dispatcher *d, int timeout_ms) {
+  bool start = false;
+  mutex_lock(&d->mutex);
+  if (d->n_start_requests == 0 && !should_stop(d))
+    cond_timedwait_ms(&d->park_cond, &d->mutex, timeout_ms);
+  if (d->n_start_requests > 0 && !should_stop(d)) {
+    d->n_start_requests--;
+    start = true;
+  }
+  mutex_unlock(&d->mutex);
+  return start;
+}
+
+void dispatcher_runtime_started(Dispatcher *d) {
+  atomic_fetch_sub_explicit(&d->n_starting_runtimes, 1, memory_order_relaxed);
+}
+
+int dispatcher_set_classes(Dispatcher *d, const int *weights,
+                           const int *reserved, int n_classes) {
+  assert(n_classes > 0);
+  d->classes = calloc(n_classes, sizeof(DispatchClass));
+  if (!d->classes)
+    return -1;
+  for (int i = 0; i < n_classes; ++i) {
+    assert(weights[i] > 0 && reserved[i] >= 0);
+    d->classes[i].weight = weights[i];
+    d->classes[i].reserved = reserved[i];
+  }
+  d->n_classes = n_classes;
+  return 0;
+}
+
+void dispatcher_set_limits(Dispatcher *d, int max_queued,
+                           uint64_t max_queue_wait_us) {
+  assert(max_queued >= 0);
+  d->max_queued = max_queued;
+  d->max_queue_wait_us = max_queue_wait_us;
+}
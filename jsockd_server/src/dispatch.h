@@ -0,0 +1,282 @@
+#ifndef DISPATCH_H_
+#define DISPATCH_H_
+
+#include "config.h"
+#include "line_buf.h"
+#include "mpmc_queue.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// States of the message response mailbox in a record.
+typedef enum {
+  REPLY_NONE,
+  REPLY_AWAITED,
+  REPLY_RECEIVED,
+  REPLY_TOO_BIG,
+  REPLY_EOF
+} ReplyState;
+
+struct Conn;
+struct Dispatcher;
+
+// A record is the run of lines that takes the command parser from its initial
+// state back to its initial state (usually a three line command or a single
+// '?' command). Each line is stored with its length and truncation flag (see
+// dispatch.c). In shared-listener mode, records are the unit of work that the
+// dispatcher thread hands to the runtime threads.
+typedef struct Record {
+  struct Conn *conn;
+  char *data;
+  size_t len;
+  size_t capacity;
+  size_t pos;
+  // True if the record contains a '?' command. The responses to '?' commands
+  // aren't tagged with a command ID, so such a record is executed only when
+  // nothing else on the connection is executing.
+  bool barrier;
+  // Set by the runtime thread before handing the record back if the
+  // connection should be closed (e.g. following a write error).
+  bool close_requested;
+  // Accessed only by the dispatcher thread (pending and in-flight lists).
+  struct Record *next;
+  // Used for the dispatcher's 'returned' and overflow lists.
+  struct Record *next_handoff;
+  // When the dispatcher thread read the first line of the record. A command's
+  // budget (see handle_line_1_message_uid in main.c) runs from this point.
+  struct timespec received_time;
+  // When the record was queued for a runtime thread (elastic pool or queue
+  // wait limit only).
+  struct timespec ready_time;
+  // Mailbox for message responses, which are read by the dispatcher thread
+  // while the runtime thread waits in send_message.
+  pthread_mutex_t reply_mutex;
+  pthread_cond_t reply_cond;
+  atomic_bool awaiting_reply;
+  ReplyState reply_state;
+  char awaited_uuid[MESSAGE_UUID_MAX_BYTES];
+  size_t awaited_uuid_len;
+  char *reply;
+  size_t reply_len;
+  size_t reply_capacity;
+} Record;
+
+// A client connection accepted on one of the listening sockets. Each
+// connection has its own line buffer, so a partially received command stays
+// with the connection (rather than with the runtime thread) between commands.
+// 'listener_index' is the index of the socket in g_cmd_args.socket_path.
+typedef struct Conn {
+  int fd;
+  int listener_index;
+  LineBuf line_buf;
+  // The fields below are used only in shared-listener mode, except for those
+  // used to frame the input into records (see conn_frame_input).
+  struct Dispatcher *dispatcher;
+  // Held while writing a response or message, as in multiplexed mode several
+  // runtime threads may be executing commands from the connection at once.
+  pthread_mutex_t write_mutex;
+  // Set by the ?multiplex command. Commands on a multiplexed connection are
+  // executed concurrently and may complete in any order.
+  bool multiplexed;
+  // Set by the ?commandhashes command. The server then reports the hash of
+  // each command sent on the connection as source, so that the client can
+  // send the hash in its place (see handle_line_2_query in main.c).
+  bool command_hashes;
+  // The number of records on this connection with a message response
+  // awaited.
+  atomic_int n_awaiting_replies;
+  // Accessed only by the dispatcher thread.
+  int frame_line_n;
+  Record *reply_record;
+  // The first line of the message response being received ('<id>' or, for
+  // an async message, '<id> <n>').
+  char reply_id[MESSAGE_UUID_MAX_BYTES + 12];
+  size_t reply_id_len;
+  bool registered;
+  bool eof;
+  bool closing;
+  int index;
+  Record *building;
+  Record *pending_head;
+  Record *pending_tail;
+  int n_pending;
+  Record *in_flight;
+  int n_in_flight;
+  bool barrier_in_flight;
+  Record *spare;
+  int n_spare;
+  struct Conn *next;
+} Conn;
+
+// Returns NULL if allocation fails. The connection takes ownership of 'fd'.
+Conn *conn_new(int fd, int listener_index);
+// Closes the connection's fd and frees it.
+void conn_close(Conn *conn);
+
+// Reads once from the connection and frames the input into records, as the
+// dispatcher thread does. This is for runtime threads that serve their own
+// connections (see serve_conn in main.c). Complete records are appended to
+// the connection's pending list, while a partially received command stays in
+// the connection's line buffer and 'building' record until the rest arrives.
+// Returns LINE_BUF_READ_EOF if the connection was closed or couldn't be read
+// from, and 0 otherwise.
+int conn_frame_input(Conn *c);
+// Removes and returns the first pending record, or returns NULL if there is
+// none.
+Record *conn_take_record(Conn *c);
+// Returns a record taken with conn_take_record once it has been executed.
+void conn_recycle_record(Conn *c, Record *r);
+
+// Passes each line of the record to 'line_handler', in the same way as
+// line_buf_replay. If 'line_handler' returns a negative value, replay stops
+// and that value is returned; calling record_replay again resumes from the
+// same line. Returns 0 once the whole record has been replayed.
+int record_replay(Record *record,
+                  int (*line_handler)(const char *line, size_t line_len,
+                                      void *data, bool truncated),
+                  void *line_handler_data);
+// Called by a runtime thread before it sends a message to the client, so that
+// the dispatcher thread routes the response with the given ID (optionally
+// followed by a space and an async message number) to the record's mailbox
+// rather than treating it as a new command.
+void record_expect_reply(Record *record, const char *uuid, size_t uuid_len);
+// Waits up to 'timeout_ms' for the response. On REPLY_RECEIVED, the response
+// ('<id><sep><json><sep>') is copied to 'buf'. Returns REPLY_AWAITED on
+// timeout, in which case the caller should either wait again or call
+// record_cancel_reply. Responses to async messages have '<id> <n>' as their
+// first line, and several of them may be copied to 'buf' at once. If
+// 'more_expected' is true, the record goes on awaiting responses after one
+// has been received.
+ReplyState record_wait_for_reply(Record *record, char *buf, size_t buf_size,
+                                 size_t *len, int timeout_ms,
+                                 bool more_expected);
+void record_cancel_reply(Record *record);
+
+// A priority class (see dispatcher_set_classes). Accessed only by the
+// dispatcher thread.
+typedef struct {
+  int weight;
+  // The number of runtimes kept free for this class, which other classes may
+  // not use.
+  int reserved;
+  // Records waiting for a runtime, linked by 'next_handoff'.
+  Record *head;
+  Record *tail;
+  // Records handed over to runtimes and not yet returned.
+  int n_outstanding;
+  // Records that the class may still hand over in its current turn.
+  int credit;
+} DispatchClass;
+
+// In shared-listener mode, a single dispatcher thread acts as an I/O reactor
+// for the listening sockets and for all client connections. It reads from
+// readable connections and splits the input into records. Records are queued
+// per connection, so a client can pipeline commands: while one command
+// executes, the dispatcher keeps reading and framing the ones behind it.
+// Records ready for execution are pushed onto a lock-free ready queue, from
+// which any free runtime thread can take them. The runtime thread replays the
+// record through the line handler, writes the response, and hands the record
+// back. By default, one record per connection executes at a time, which
+// keeps responses in order; on a multiplexed connection, any number can.
+typedef struct Dispatcher {
+  // Records waiting for a runtime thread.
+  MpmcQueue ready;
+  // Number of runtime threads waiting on 'cond' for the ready queue to
+  // become non-empty.
+  atomic_int n_sleeping;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // Records handed back by runtime threads, and connections added via
+  // dispatcher_add_conn, which the dispatcher thread has not yet picked up.
+  // Protected by 'mutex'.
+  Record *returned;
+  Conn *added;
+  // Written to by runtime threads to wake the dispatcher thread. A byte is
+  // written only if 'wake_pending' was clear.
+  int wake_pipe[2];
+  atomic_bool wake_pending;
+  atomic_bool stop;
+  int n_listeners;
+  int *listener_fds;
+  // The fields below are accessed only by the dispatcher thread, which owns
+  // all the connections in 'conns'.
+  Conn **conns;
+  int n_conns;
+  int conns_capacity;
+  // Records that didn't fit in the ready queue.
+  Record *overflow_head;
+  Record *overflow_tail;
+  // Elastic runtime pool (see dispatcher_set_pool_size). 'n_active_runtimes'
+  // includes parked threads that have been asked to start, and
+  // 'n_starting_runtimes' counts those which haven't yet created their
+  // runtime.
+  int min_runtimes;
+  int max_runtimes;
+  atomic_int n_active_runtimes;
+  atomic_int n_starting_runtimes;
+  // Parked runtime threads wait on 'park_cond' for 'n_start_requests' to
+  // become non-zero. Protected by 'mutex'.
+  pthread_cond_t park_cond;
+  int n_start_requests;
+  // Priority classes, indexed by listener index. Accessed only by the
+  // dispatcher thread.
+  DispatchClass *classes;
+  int n_classes;
+  int class_turn;
+  int n_outstanding;
+  // Admission control (see dispatcher_set_limits). 'n_queued' counts records
+  // waiting for a runtime thread to take them, and 'n_executing' those taken
+  // and not yet handed back.
+  int max_queued;
+  uint64_t max_queue_wait_us;
+  atomic_int n_queued;
+  atomic_int n_executing;
+  atomic_uint_fast64_t n_rejected;
+} Dispatcher;
+
+int dispatcher_init(Dispatcher *d, const int *listener_fds, int n_listeners);
+void dispatcher_run(Dispatcher *d);
+int dispatcher_add_conn(Dispatcher *d, int fd, int listener_index);
+Record *dispatcher_take(Dispatcher *d, int timeout_ms);
+void dispatcher_return(Dispatcher *d, Record *record);
+void dispatcher_stop(Dispatcher *d);
+void dispatcher_destroy(Dispatcher *d);
+
+// Makes the pool of runtime threads elastic, with between 'min' and 'max'
+// active. The caller starts 'max' runtime threads, of which all but the first
+// 'min' should start out parked. When records are kept waiting because every
+// active runtime is busy, dispatcher_take asks a parked thread to start. An
+// active thread that has been idle for a while calls dispatcher_try_retire.
+void dispatcher_set_pool_size(Dispatcher *d, int min, int max);
+// Returns true if the calling runtime thread should free its runtime and
+// park, which is the case only if more than the minimum number of runtime
+// threads are active.
+bool dispatcher_try_retire(Dispatcher *d);
+// Waits up to 'timeout_ms' for a request to start. Returns true if the calling
+// parked thread should create its runtime, after which it must call
+// dispatcher_runtime_started and then start taking records.
+bool dispatcher_park(Dispatcher *d, int timeout_ms);
+void dispatcher_runtime_started(Dispatcher *d);
+
+// Assigns the connections on each listening socket to a priority class, with
+// the given weight and number of reserved runtimes. Connections on listeners
+// beyond the last class belong to the last class. Records are then handed to
+// runtimes only as runtimes become free, in weighted round robin order across
+// the classes that have records waiting. Must be called after
+// dispatcher_set_pool_size and before dispatcher_run.
+int dispatcher_set_classes(Dispatcher *d, const int *weights,
+                           const int *reserved, int n_classes);
+
+// Sets admission control limits (0 for no limit). A command is rejected with
+// an 'overloaded' response, rather than executed, if it arrives when more than
+// 'max_queued' commands are waiting for a runtime, or if it waits for a
+// runtime for longer than 'max_queue_wait_us'. '?' commands are never
+// rejected. The dispatcher answers ?load itself with the current queue length
+// and the number of commands executing and rejected, so that clients can query
+// the load without waiting for a runtime.
+void dispatcher_set_limits(Dispatcher *d, int max_queued,
+                           uint64_t max_queue_wait_us);
+
+#endif
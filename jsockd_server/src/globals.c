@@ -1,7 +1,9 @@
 #include "cmdargs.h"
 #include "config.h"
+#include "named_commands.h"
 #include "threadstate.h"
 #include "wait_group.h"
+#include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -14,6 +16,9 @@ atomic_int g_sig_triggered = 0;
 
 const uint8_t *g_module_bytecode = NULL;
 size_t g_module_bytecode_size = 0;
+NamedCommandsSet *g_named_commands = NULL;
+pthread_rwlock_t g_module_bytecode_lock = PTHREAD_RWLOCK_INITIALIZER;
+atomic_int g_module_generation = 0;
 
 atomic_int g_n_threads = 0;
 
@@ -23,6 +28,7 @@ size_t g_source_map_size = 0;
 atomic_int g_source_map_load_count = 0;
 
 atomic_bool g_interrupted_or_error = false;
+int g_shutdown_pipe[2] = {-1, -1};
 
 CmdArgs g_cmd_args;
 
@@ -33,5 +39,5 @@ const char *g_log_prefix = NULL;
 bool g_interactive_logging_mode = false;
 
 #ifdef CMAKE_BUILD_TYPE_DEBUG
-int g_debug_hash_bits = CACHED_FUNCTIONS_HASH_BITS_DEBUG;
+int g_debug_hash_bits = 0;
 #endif
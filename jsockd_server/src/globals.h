@@ -2,8 +2,10 @@
 #define GLOBALS_H_
 
 #include "cmdargs.h"
+#include "named_commands.h"
 #include "threadstate.h"
 #include "wait_group.h"
+#include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -19,8 +21,15 @@ extern const uint8_t g_shims_module_bytecode[];
 
 extern atomic_int g_sig_triggered;
 
+// The module bytecode (see -m) can be replaced while the server is running
+// (see reload_module_bytecode in main.c), so it's read with
+// g_module_bytecode_lock held for reading. Each replacement increments
+// g_module_generation. g_named_commands holds the module's named commands.
 extern const uint8_t *g_module_bytecode;
 extern size_t g_module_bytecode_size;
+extern NamedCommandsSet *g_named_commands;
+extern pthread_rwlock_t g_module_bytecode_lock;
+extern atomic_int g_module_generation;
 
 extern atomic_int g_n_threads;
 
@@ -30,6 +39,10 @@ extern size_t g_source_map_size;
 extern atomic_int g_source_map_load_count;
 
 extern atomic_bool g_interrupted_or_error;
+// Becomes readable once g_interrupted_or_error is set (see
+// set_interrupted_or_error), so that threads waiting for I/O can include it in
+// their poll set rather than waking periodically to check.
+extern int g_shutdown_pipe[2];
 
 extern CmdArgs g_cmd_args;
 
@@ -40,6 +53,7 @@ extern const char *g_log_prefix;
 extern bool g_interactive_logging_mode;
 
 #ifdef CMAKE_BUILD_TYPE_DEBUG
+// Overrides the command cache's number of hash bits if nonzero.
 extern int g_debug_hash_bits;
 #endif
 
@@ -1,5 +1,6 @@
 #include "hash_cache.h"
 #include "config.h"
+#include "hex.h"
 #include "utils.h"
 #include <memory.h>
 #include <stdatomic.h>
@@ -37,6 +38,54 @@ HashCacheUid get_hash_cache_uid(const void *data, size_t len) {
 #endif
 }
 
+bool parse_hash_cache_uid(const char *hex, size_t len, HashCacheUid *out) {
+  if (len != sizeof(HashCacheUid) * 2)
+    return false;
+  HashCacheUid uid = 0;
+  for (size_t i = 0; i < len; ++i) {
+    int8_t d = hex_digit((uint8_t)hex[i]);
+    if (d < 0)
+      return false;
+    uid = (uid << 4) | (HashCacheUid)d;
+  }
+  *out = uid;
+  return true;
+}
+
+// Replaces the entry in a bucket that isn't in use. Returns false if another
+// thread started using the bucket first. Otherwise, the caller holds a
+// reference to the bucket.
+static bool replace_bucket(HashCacheBucket *bucket, HashCacheUid uid,
+                           void *object, size_t object_offset,
+                           size_t object_size,
+                           void (*cleanup)(HashCacheBucket *)) {
+  int32_t expected0int = 0;
+  if (!atomic_compare_exchange_strong_explicit(&bucket->refcount,
+                                               &expected0int, 1,
+                                               memory_order_relaxed,
+                                               memory_order_relaxed))
+    return false;
+
+  // Make odd
+  atomic_fetch_add_explicit(&bucket->update_count, 1, memory_order_relaxed);
+
+  // This is the only code path that updates a bucket, so because of the atomic
+  // compare/exchange, we know that no other thread is currently updating the
+  // bucket of interest.
+  HashCacheUid existing_uid =
+      atomic_load_explicit(&bucket->uid, memory_order_relaxed);
+  if (existing_uid && cleanup)
+    cleanup(bucket);
+  if (object)
+    memcpy((void *)((char *)bucket + object_offset), object, object_size);
+  atomic_store_explicit(&bucket->referenced, false, memory_order_relaxed);
+  atomic_store_explicit(&bucket->uid, uid, memory_order_release);
+
+  // Make even
+  atomic_fetch_add_explicit(&bucket->update_count, 1, memory_order_release);
+  return true;
+}
+
 HashCacheBucket *add_to_hash_cache_(HashCacheBucket *buckets,
                                     size_t bucket_size, int n_bits,
                                     HashCacheUid uid, void *object,
@@ -52,35 +101,84 @@ HashCacheBucket *add_to_hash_cache_(HashCacheBucket *buckets,
     size_t j = i % n_buckets; // wrap around if we reach the end
     HashCacheBucket *bucket =
         (HashCacheBucket *)((char *)buckets + j * bucket_size);
-    int32_t expected0int = 0;
-
-    // The bucket has a refcount of zero, so we can clean it up and then reuse
-    // it.
-    if (atomic_compare_exchange_strong_explicit(
-            &bucket->refcount, &expected0int, 1, memory_order_relaxed,
-            memory_order_relaxed)) {
-      // Make odd
-      atomic_fetch_add_explicit(&bucket->update_count, 1, memory_order_relaxed);
-
-      // This is the only code path that updates a bucket, so because of the
-      // atomic compare/exchange, we know that no other thread is currently
-      // updating the bucket of interest.
-      HashCacheUid existing_uid =
-          atomic_load_explicit(&bucket->uid, memory_order_relaxed);
-      if (existing_uid && cleanup)
-        cleanup(bucket);
-      memcpy((void *)((char *)bucket + object_offset), object, object_size);
-      atomic_store_explicit(&bucket->uid, uid, memory_order_release);
-
-      // Make even
-      atomic_fetch_add_explicit(&bucket->update_count, 1, memory_order_release);
-
+    if (0 == atomic_load_explicit(&bucket->uid, memory_order_relaxed) &&
+        replace_bucket(bucket, uid, object, object_offset, object_size,
+                       cleanup))
       return bucket;
+  }
+
+  // Otherwise, the buckets within reach form a small CLOCK: an entry that
+  // hasn't been retrieved since it was added or last passed over is replaced
+  // in preference to a recently used one. New entries start out unreferenced,
+  // so commands that are only used once don't push out the hot ones.
+  HashCacheBucket *second_chance = NULL;
+  for (size_t i = bucket_i; i < bucket_i + bucket_look_forward; ++i) {
+    size_t j = i % n_buckets; // wrap around if we reach the end
+    HashCacheBucket *bucket =
+        (HashCacheBucket *)((char *)buckets + j * bucket_size);
+
+    if (0 != atomic_load_explicit(&bucket->refcount, memory_order_relaxed))
+      continue;
+    if (atomic_exchange_explicit(&bucket->referenced, false,
+                                 memory_order_relaxed)) {
+      if (!second_chance)
+        second_chance = bucket;
+      continue;
     }
+    if (replace_bucket(bucket, uid, object, object_offset, object_size,
+                       cleanup))
+      return bucket;
   }
+
+  // Every bucket within reach that isn't in use holds a recently used entry.
+  // They've now lost their second chance, so the first of them is replaced.
+  if (second_chance && replace_bucket(second_chance, uid, object,
+                                      object_offset, object_size, cleanup))
+    return second_chance;
   return NULL;
 }
 
+bool evict_from_hash_cache_(HashCacheBucket *buckets, size_t bucket_size,
+                            int n_bits, atomic_size_t *hand,
+                            void (*cleanup)(HashCacheBucket *)) {
+  size_t n_buckets = HASH_CACHE_BUCKET_ARRAY_SIZE_FROM_HASH_BITS(n_bits);
+  // The hand goes round at most once. Entries that it passes over lose their
+  // second chance, so if every entry that isn't in use was recently used, the
+  // first of them is evicted (as in add_to_hash_cache_).
+  HashCacheBucket *second_chance = NULL;
+  for (size_t n = 0; n < n_buckets; ++n) {
+    size_t j =
+        atomic_fetch_add_explicit(hand, 1, memory_order_relaxed) % n_buckets;
+    HashCacheBucket *bucket =
+        (HashCacheBucket *)((char *)buckets + j * bucket_size);
+
+    if (0 == atomic_load_explicit(&bucket->uid, memory_order_relaxed) ||
+        0 != atomic_load_explicit(&bucket->refcount, memory_order_relaxed))
+      continue;
+    if (atomic_exchange_explicit(&bucket->referenced, false,
+                                 memory_order_relaxed)) {
+      if (!second_chance)
+        second_chance = bucket;
+      continue;
+    }
+    // An empty bucket is left behind (uid 0 never matches a lookup).
+    if (replace_bucket(bucket, 0, NULL, 0, 0, cleanup)) {
+      atomic_fetch_add_explicit(&bucket->refcount, -1, memory_order_release);
+      return true;
+    }
+  }
+  // The entry may have been evicted by another thread meanwhile, in which case
+  // the bucket is now empty and there's nothing to do.
+  if (second_chance &&
+      0 != atomic_load_explicit(&second_chance->uid, memory_order_relaxed) &&
+      replace_bucket(second_chance, 0, NULL, 0, 0, cleanup)) {
+    atomic_fetch_add_explicit(&second_chance->refcount, -1,
+                              memory_order_release);
+    return true;
+  }
+  return false;
+}
+
 HashCacheBucket *get_hash_cache_entry_(HashCacheBucket *buckets,
                                        size_t bucket_size, int n_bits,
                                        HashCacheUid uid) {
@@ -130,12 +228,36 @@ HashCacheBucket *get_hash_cache_entry_(HashCacheBucket *buckets,
         continue;
       }
 
+      // Only written when it changes, so that retrieving a hot entry doesn't
+      // keep invalidating the cache line on other CPUs.
+      if (!atomic_load_explicit(&bucket->referenced, memory_order_relaxed))
+        atomic_store_explicit(&bucket->referenced, true, memory_order_relaxed);
       return bucket;
     }
   }
   return NULL;
 }
 
+bool hash_cache_has_other_entry_(HashCacheBucket *buckets, size_t bucket_size,
+                                 int n_bits, HashCacheUid uid,
+                                 const HashCacheBucket *exclude) {
+  if (uid == 0)
+    return false;
+
+  size_t bucket_i = get_cache_bucket(uid, n_bits);
+  size_t n_buckets = HASH_CACHE_BUCKET_ARRAY_SIZE_FROM_HASH_BITS(n_bits);
+  const size_t bucket_look_forward = get_bucket_look_forward(n_bits);
+  for (size_t i = bucket_i; i < bucket_i + bucket_look_forward; ++i) {
+    size_t j = i % n_buckets; // wrap around if we reach the end
+    HashCacheBucket *bucket =
+        (HashCacheBucket *)((char *)buckets + j * bucket_size);
+    if (bucket != exclude &&
+        uid == atomic_load_explicit(&bucket->uid, memory_order_relaxed))
+      return true;
+  }
+  return false;
+}
+
 void decrement_hash_cache_bucket_refcount(HashCacheBucket *bucket) {
   atomic_fetch_add_explicit(&bucket->refcount, -1, memory_order_relaxed);
 }
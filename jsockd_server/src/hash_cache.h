@@ -55,6 +55,9 @@ typedef struct {
   // of interest.
   int32_t _Atomic refcount;
   int32_t _Atomic update_count;
+  // Set when the entry is retrieved and cleared when eviction passes over it,
+  // so that recently used entries get a second chance (the CLOCK algorithm).
+  atomic_bool referenced;
 } HashCacheBucket;
 
 #ifdef HASH_CACHE_USE_128_BIT_UIDS
@@ -79,6 +82,9 @@ _Static_assert(sizeof(HashCacheBucket) % 16 == 0,
 
 size_t get_cache_bucket(HashCacheUid uid, int n_bits);
 HashCacheUid get_hash_cache_uid(const void *data, size_t size);
+// Parses a UID formatted with HASH_CACHE_UID_FORMAT_SPECIFIER (in either
+// case). Returns false if 'hex' isn't exactly that many hex digits.
+bool parse_hash_cache_uid(const char *hex, size_t len, HashCacheUid *out);
 HashCacheBucket *add_to_hash_cache_(HashCacheBucket *buckets,
                                     size_t bucket_size, int n_bits,
                                     HashCacheUid uid, void *object,
@@ -87,6 +93,12 @@ HashCacheBucket *add_to_hash_cache_(HashCacheBucket *buckets,
 HashCacheBucket *get_hash_cache_entry_(HashCacheBucket *buckets,
                                        size_t bucket_size, int n_bits,
                                        HashCacheUid uid);
+bool evict_from_hash_cache_(HashCacheBucket *buckets, size_t bucket_size,
+                            int n_bits, atomic_size_t *hand,
+                            void (*cleanup)(HashCacheBucket *));
+bool hash_cache_has_other_entry_(HashCacheBucket *buckets, size_t bucket_size,
+                                 int n_bits, HashCacheUid uid,
+                                 const HashCacheBucket *exclude);
 void decrement_hash_cache_bucket_refcount(HashCacheBucket *bucket);
 
 #define add_to_hash_cache(buckets, n_bits, uid, data_ptr, cleanup)             \
@@ -99,4 +111,18 @@ void decrement_hash_cache_bucket_refcount(HashCacheBucket *bucket);
   ((TYPEOF((buckets)[0]) *)get_hash_cache_entry_(                              \
       &((buckets)[0].bucket), sizeof((buckets)[0]), (n_bits), (uid)))
 
+// Evicts one entry that isn't in use, preferring one that hasn't been
+// retrieved since the clock hand last passed it. The shared clock hand '*hand'
+// goes round at most once. Returns false if every entry is empty or in use.
+#define evict_from_hash_cache(buckets, n_bits, hand, cleanup)                  \
+  evict_from_hash_cache_(&((buckets)[0].bucket), sizeof((buckets)[0]),         \
+                         (n_bits), (hand), (cleanup))
+
+// True if a bucket other than 'exclude' holds an entry for 'uid', as can
+// happen if two threads add the same entry at once. Takes no reference, so
+// the answer may be out of date by the time it's used.
+#define hash_cache_has_other_entry(buckets, n_bits, uid, exclude)              \
+  hash_cache_has_other_entry_(&((buckets)[0].bucket), sizeof((buckets)[0]),    \
+                              (n_bits), (uid), (exclude))
+
 #endif
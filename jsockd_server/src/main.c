@@ -1,16 +1,23 @@
 #include "backtrace.h"
 #include "cmdargs.h"
 #include "config.h"
+#include "cpu_affinity.h"
+#include "disk_cache.h"
+#include "dispatch.h"
 #include "fchmod.h"
 #include "globals.h"
 #include "hash_cache.h"
 #include "hex.h"
 #include "line_buf.h"
 #include "log.h"
+#include "messages.h"
 #include "mmap_file.h"
 #include "modcompiler.h"
+#include "named_commands.h"
+#include "prefork.h"
 #include "quickjs-libc.h"
 #include "quickjs.h"
+#include "spare_pool.h"
 #include "threadstate.h"
 #include "utils.h"
 #include "verify_bytecode.h"
@@ -40,57 +47,182 @@
 #include <time.h>
 #include <unistd.h>
 
-// Testing scenarios with collisions is less labor intensive if we use a smaller
-// number of bits in the debug build.
-#define CACHED_FUNCTION_MAX_HASH_BITS                                          \
-  (CMAKE_BUILD_TYPE_IS_DEBUG ? CACHED_FUNCTIONS_HASH_BITS_DEBUG                \
-                             : CACHED_FUNCTIONS_HASH_BITS_RELEASE)
+// The capacity of the command cache is set at startup (see -cn, -cb and
+// init_cached_functions), so the buckets are allocated then. calloc's
+// alignment is enough for native 128-bit atomic instructions on the platforms
+// that use them (see hash_cache.h).
+static CachedFunctionBucket *g_cached_function_buckets;
+static int g_cached_function_hash_bits;
+static size_t g_max_cached_bytecode_bytes;
+static atomic_size_t g_cached_bytecode_bytes;
+static atomic_size_t g_cached_function_clock_hand;
+static atomic_int g_n_cached_functions;
+// The on-disk command cache (-cd), if enabled.
+static DiskCache g_disk_cache;
+static bool g_disk_cache_enabled;
+
+#define CACHED_FUNCTIONS_N_BUCKETS                                             \
+  HASH_CACHE_BUCKET_ARRAY_SIZE_FROM_HASH_BITS(g_cached_function_hash_bits)
+
+static int init_cached_functions(void) {
+  // Testing scenarios with collisions is less labor intensive if we use a
+  // smaller number of bits in the debug build.
+  int bits = CMAKE_BUILD_TYPE_IS_DEBUG ? CACHED_FUNCTIONS_HASH_BITS_DEBUG
+                                       : CACHED_FUNCTIONS_HASH_BITS_RELEASE;
+  if (g_cmd_args.max_cached_commands != 0) {
+    // Rounded up to a power of 2.
+    for (bits = 1; (1 << bits) < g_cmd_args.max_cached_commands; ++bits)
+      ;
+  }
 #ifdef CMAKE_BUILD_TYPE_DEBUG
-#define CACHED_FUNCTION_HASH_BITS g_debug_hash_bits
-#else
-#define CACHED_FUNCTION_HASH_BITS CACHED_FUNCTIONS_HASH_BITS_RELEASE
+  if (g_debug_hash_bits != 0)
+    bits = g_debug_hash_bits;
 #endif
-#define CACHED_FUNCTIONS_N_BUCKETS                                             \
-  HASH_CACHE_BUCKET_ARRAY_SIZE_FROM_HASH_BITS(CACHED_FUNCTION_MAX_HASH_BITS)
+  g_cached_function_hash_bits = bits;
+  g_max_cached_bytecode_bytes = g_cmd_args.max_cached_bytecode_bytes != 0
+                                    ? g_cmd_args.max_cached_bytecode_bytes
+                                    : DEFAULT_MAX_CACHED_BYTECODE_BYTES;
+  g_cached_function_buckets =
+      calloc(CACHED_FUNCTIONS_N_BUCKETS, sizeof(CachedFunctionBucket));
+  if (!g_cached_function_buckets) {
+    jsockd_logf(LOG_ERROR, "Error allocating command cache: %s\n",
+                strerror(errno));
+    return -1;
+  }
+  return 0;
+}
 
-// 16-byte align may be required for use of native
-// 128-bit atomic instructions.
-_Alignas(16) static CachedFunctionBucket
-    g_cached_function_buckets[CACHED_FUNCTIONS_N_BUCKETS];
-static atomic_int g_n_cached_functions;
+static void free_cached_function_bytecode(CachedFunction *cf) {
+  if (cf->mapping)
+    munmap_or_warn(cf->mapping, cf->mapping_size);
+  else
+    free((void *)cf->bytecode);
+  cf->bytecode = NULL;
+  cf->mapping = NULL;
+}
 
 static void cleanup_unused_hash_cache_bucket(HashCacheBucket *b) {
-  jsockd_logf(LOG_DEBUG, "Freeing bytecode %p\n",
-              (const void *)((CachedFunctionBucket *)b)->payload.bytecode);
-  free((void *)(((CachedFunctionBucket *)b)->payload.bytecode));
-  ((CachedFunctionBucket *)b)->payload.bytecode = NULL;
+  CachedFunction *cf = &((CachedFunctionBucket *)b)->payload;
+  jsockd_logf(LOG_DEBUG, "Freeing bytecode %p\n", (const void *)cf->bytecode);
+  free_cached_function_bytecode(cf);
+  atomic_fetch_sub_explicit(&g_cached_bytecode_bytes, cf->bytecode_size,
+                            memory_order_relaxed);
+  // The on-disk cache holds only what the command cache does. The file is
+  // kept if the command is also in another bucket (see
+  // hash_cache_has_other_entry). If both buckets are evicted at once, the file
+  // may then be left behind, which is harmless, as it's still valid.
+  if (g_disk_cache_enabled) {
+    HashCacheUid uid = atomic_load_explicit(&b->uid, memory_order_relaxed);
+    if (!hash_cache_has_other_entry(g_cached_function_buckets,
+                                    g_cached_function_hash_bits, uid, b))
+      disk_cache_queue_remove(&g_disk_cache, uid);
+  }
 }
 
 static CachedFunctionBucket *add_cached_function(HashCacheUid uid,
-                                                 const uint8_t *bytecode,
-                                                 size_t bytecode_size) {
-  assert(bytecode);
+                                                 const CachedFunction *cf) {
+  assert(cf->bytecode);
+  const size_t bytecode_size = cf->bytecode_size;
 
-  CachedFunction to_add = {
-      .bytecode = bytecode,
-      .bytecode_size = bytecode_size,
-  };
+  if (bytecode_size > g_max_cached_bytecode_bytes) {
+    jsockd_logf(LOG_DEBUG, "Not caching %zu bytes of bytecode\n",
+                bytecode_size);
+    return NULL;
+  }
+  // The slot is found first, so that nothing is evicted to make room for a
+  // function that then isn't cached.
+  CachedFunction to_add = *cf;
   CachedFunctionBucket *b =
-      add_to_hash_cache(g_cached_function_buckets, CACHED_FUNCTION_HASH_BITS,
+      add_to_hash_cache(g_cached_function_buckets, g_cached_function_hash_bits,
                         uid, &to_add, cleanup_unused_hash_cache_bucket);
   if (!b) {
     jsockd_log(LOG_INFO, "No empty slot for cached function\n");
     return NULL;
   }
+  atomic_fetch_add_explicit(&g_cached_bytecode_bytes, bytecode_size,
+                            memory_order_relaxed);
+
+  // The new entry is in use, so it isn't evicted here. Eviction fails only if
+  // every other entry is in use too, and the total then stays over the limit
+  // until a later addition. Concurrent additions can also take the total
+  // briefly over the limit.
+  while (atomic_load_explicit(&g_cached_bytecode_bytes, memory_order_relaxed) >
+         g_max_cached_bytecode_bytes) {
+    if (!evict_from_hash_cache(
+            g_cached_function_buckets, g_cached_function_hash_bits,
+            &g_cached_function_clock_hand, cleanup_unused_hash_cache_bucket)) {
+      jsockd_log(LOG_INFO, "Command cache over -cb limit while in use\n");
+      break;
+    }
+  }
   return b;
 }
 
-static CachedFunction *get_cached_function(HashCacheUid uid) {
-  CachedFunctionBucket *b = get_hash_cache_entry(
-      g_cached_function_buckets, CACHED_FUNCTION_HASH_BITS, uid);
-  if (b)
-    return &((CachedFunctionBucket *)b)->payload;
-  return NULL;
+// The caller holds a reference to the returned bucket (see
+// cached_function_in_use).
+static CachedFunctionBucket *get_cached_function(HashCacheUid uid) {
+  return get_hash_cache_entry(g_cached_function_buckets,
+                              g_cached_function_hash_bits, uid);
+}
+
+static bool add_cached_function_from_disk(HashCacheUid uid,
+                                          const uint8_t *mapping,
+                                          size_t mapping_size,
+                                          const uint8_t *bytecode,
+                                          size_t bytecode_size, void *data) {
+  (void)data;
+  CachedFunction cf = {
+      .bytecode = bytecode,
+      .bytecode_size = bytecode_size,
+      .mapping = mapping,
+      .mapping_size = mapping_size,
+  };
+  CachedFunctionBucket *b = add_cached_function(uid, &cf);
+  if (!b)
+    return false;
+  // add_cached_function returns with a reference held.
+  decrement_hash_cache_bucket_refcount(&b->bucket);
+  return true;
+}
+
+static int init_disk_cache(void) {
+  if (!g_cmd_args.command_cache_dir)
+    return 0;
+  if (0 != disk_cache_init(&g_disk_cache, g_cmd_args.command_cache_dir,
+                           getenv("JSOCKD_COMMAND_CACHE_KEY"),
+                           STRINGIFY(VERSION)))
+    return -1;
+  g_disk_cache_enabled = true;
+  return 0;
+}
+
+// Fills the command cache from the on-disk cache once the module has been
+// loaded. Safe to call while commands are being served, as entries are added
+// just as if they had been compiled.
+static void load_disk_cache(void) {
+  if (!g_disk_cache_enabled)
+    return;
+  disk_cache_set_module(&g_disk_cache, g_module_bytecode,
+                        g_module_bytecode_size);
+  int n = disk_cache_load(&g_disk_cache, add_cached_function_from_disk, NULL);
+  if (n >= 0)
+    jsockd_logf(LOG_INFO, "Loaded %i commands from the command cache\n", n);
+  // Removes the files of any entries evicted while loading. This is done here
+  // rather than by the writer thread, as in prefork mode (-f) the cache is
+  // loaded before forking.
+  disk_cache_flush(&g_disk_cache);
+}
+
+// Without the writer thread, the command cache still works, but the files are
+// only updated (as far as the queue allows) at shutdown.
+static void start_disk_cache_writer(void) {
+  if (g_disk_cache_enabled && 0 != disk_cache_start_writer(&g_disk_cache))
+    jsockd_log(LOG_WARN, "Continuing without a command cache writer thread\n");
+}
+
+static void stop_disk_cache_writer(void) {
+  if (g_disk_cache_enabled)
+    disk_cache_stop_writer(&g_disk_cache);
 }
 
 static void init_socket_state(SocketState *ss,
@@ -100,6 +232,9 @@ static void init_socket_state(SocketState *ss,
   ss->streamfd = -1;
   ss->stream_io_err = 0;
   memset(&ss->addr, 0, sizeof(ss->addr));
+  ss->conn = NULL;
+  ss->record = NULL;
+  ss->reload_request = NULL;
 }
 
 static void cleanup_socket_state(SocketState *socket_state) {
@@ -165,9 +300,20 @@ static int lb_read(char *buf, size_t n, void *data) {
   }
 }
 
+static int reload_module_bytecode(const char *filename);
+typedef struct ReloadRequest ReloadRequest;
+static ReloadRequest *new_reload_request(const char *path);
+static void queue_reload_request(ReloadRequest *req, Record *record);
+static int reload_and_wait(const char *path);
+
 static const int EXIT_ON_QUIT_COMMAND = -999;
 static const int TRAMPOLINE = -9999;
 
+// Used only in shared-listener mode (-r).
+static Dispatcher g_dispatcher;
+static pthread_t g_dispatcher_thread;
+static SocketState *g_listener_socket_states;
+
 static int initialize_and_listen_on_unix_socket(SocketState *socket_state) {
   socket_state->sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
   if (socket_state->sockfd < 0) {
@@ -246,11 +392,107 @@ static int command_loop_line_handler_wrapper(const char *line, size_t len,
   return lh->line_handler(line, len, lh->ts, truncated);
 }
 
+static void reinit_shut_down_thread_state(ThreadState *ts) {
+  jsockd_log(LOG_DEBUG, "Re-initializing shut down thread state\n");
+  assert(REPLACEMENT_THREAD_STATE_NONE ==
+         atomic_load_explicit(&ts->replacement_thread_state,
+                              memory_order_acquire));
+  ThreadState *spare = spare_pool_take();
+  if (spare) {
+    jsockd_logf(LOG_DEBUG, "Using spare runtime on thread %i\n",
+                ts->thread_index);
+    SocketState *socket_state = ts->socket_state;
+    int thread_index = ts->thread_index;
+    memcpy(ts, spare, sizeof(*ts));
+    free(spare);
+    rebind_thread_state(ts, socket_state, thread_index);
+    return;
+  }
+  init_thread_state(ts, ts->socket_state, ts->thread_index);
+  register_thread_state_runtime(ts->rt, ts);
+}
+
+// Reads what is available on 'conn' and executes each command that has been
+// received in full. A partially received command stays with the connection
+// (see conn_frame_input), so the thread goes on serving its other connections
+// while it waits for the rest. Returns 0 if the connection should be kept
+// open, LINE_BUF_READ_EOF if it should be closed, EXIT_ON_QUIT_COMMAND
+// following a ?quit command, or -1 on an error that should terminate the
+// thread.
+static int serve_conn(ThreadState *ts, Conn *conn,
+                      int (*line_handler)(const char *line, size_t len,
+                                          ThreadState *data, bool truncated)) {
+  CommandLoopLineHandler louslh = {.ts = ts, .line_handler = line_handler};
+
+  int exit_value = conn_frame_input(conn);
+  if (exit_value < 0 || !conn->pending_head)
+    return exit_value;
+
+  ts->socket_state->unix_socket_filename =
+      g_cmd_args.socket_path[conn->listener_index];
+  ts->socket_state->streamfd = conn->fd;
+  ts->socket_state->stream_io_err = 0;
+  ts->socket_state->conn = conn;
+
+  if (ts->rt == NULL)
+    reinit_shut_down_thread_state(ts);
+
+  Record *record;
+  while (exit_value == 0 && (record = conn_take_record(conn))) {
+    do {
+      JS_UpdateStackTop(ts->rt);
+      exit_value =
+          record_replay(record, command_loop_line_handler_wrapper, &louslh);
+    } while (exit_value == TRAMPOLINE);
+    conn_recycle_record(conn, record);
+
+    if (exit_value == 0 && ts->socket_state->stream_io_err) {
+      // Error writing a response. The client has presumably gone away.
+      exit_value = LINE_BUF_READ_EOF;
+    }
+    // As in serve_record, this happens only if the command was cut short by
+    // an error.
+    if (ts->line_n != 0) {
+      cleanup_command_state(ts);
+      ts->line_n = 0;
+      ts->truncated = false;
+    }
+  }
+
+  ts->socket_state->streamfd = -1;
+  ts->socket_state->conn = NULL;
+  return exit_value;
+}
+
+static int add_conn(Conn ***conns, int *n_conns, int *conns_capacity,
+                    Conn *conn) {
+  if (*n_conns == *conns_capacity) {
+    int new_capacity = *conns_capacity ? *conns_capacity * 2 : 8;
+    Conn **new_conns = realloc(*conns, sizeof(Conn *) * new_capacity);
+    if (!new_conns)
+      return -1;
+    *conns = new_conns;
+    *conns_capacity = new_capacity;
+  }
+  (*conns)[(*n_conns)++] = conn;
+  return 0;
+}
+
+// Each thread listens on its own socket, but can serve any number of
+// connections accepted on it, multiplexed with poll. The thread (and the
+// server) exits once the last open connection on the socket is closed, so a
+// client that opens a single connection per socket can still shut the server
+// down by closing it.
 static void command_loop(ThreadState *ts,
                          int (*line_handler)(const char *line, size_t len,
                                              ThreadState *data, bool truncated),
-                         void (*tick_handler)(ThreadState *ts)) {
-  CommandLoopLineHandler louslh = {.ts = ts, .line_handler = line_handler};
+                         int (*tick_handler)(ThreadState *ts)) {
+  Conn **conns = NULL;
+  int n_conns = 0;
+  int conns_capacity = 0;
+  bool accepted_any = false;
+  struct pollfd *pfds = NULL;
+  int pfds_capacity = 0;
 
   if (0 != initialize_and_listen_on_unix_socket(ts->socket_state)) {
     jsockd_log(LOG_ERROR, "Error initializing UNIX socket\n");
@@ -266,83 +508,104 @@ static void command_loop(ThreadState *ts,
   }
 
   ts->socket_state->streamfd = -1;
-  for (;;) {
-  accept_loop:
-    switch (poll_fd(ts->socket_state->sockfd, SOCKET_POLL_TIMEOUT_MS)) {
-    case READY:
-      break;
-    case GO_AROUND:
-      goto accept_loop;
-    case SIG_INTERRUPT_OR_ERROR: {
-      goto error_no_inc;
-    } break;
+  while (!accepted_any || n_conns > 0) {
+    int timeout_ms = accepted_any ? tick_handler(ts) : -1;
+
+    int n_pfds = 2 + n_conns;
+    if (n_pfds > pfds_capacity) {
+      struct pollfd *new_pfds =
+          realloc(pfds, sizeof(struct pollfd) * n_pfds * 2);
+      if (!new_pfds) {
+        jsockd_log(LOG_ERROR, "Error allocating poll set\n");
+        ts->exit_status = -1;
+        goto error_no_inc;
+      }
+      pfds = new_pfds;
+      pfds_capacity = n_pfds * 2;
     }
-
-    socklen_t streamfd_size = sizeof(struct sockaddr);
-    ts->socket_state->streamfd =
-        accept(ts->socket_state->sockfd,
-               (struct sockaddr *)&ts->socket_state->addr, &streamfd_size);
-    if (ts->socket_state->streamfd < 0) {
-      jsockd_logf(LOG_ERROR, "accept failed on UNIX socket: %s\n",
-                  strerror(errno));
-      ts->exit_status = -1;
+    pfds[0] =
+        (struct pollfd){.fd = ts->socket_state->sockfd, .events = POLLIN};
+    for (int i = 0; i < n_conns; ++i)
+      pfds[1 + i] =
+          (struct pollfd){.fd = conns[i]->fd, .events = POLLIN | POLLPRI};
+    pfds[n_pfds - 1] =
+        (struct pollfd){.fd = g_shutdown_pipe[0], .events = POLLIN};
+
+    int r = poll(pfds, n_pfds, timeout_ms);
+    if (atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire))
       goto error_no_inc;
-    }
-    jsockd_logf(LOG_DEBUG, "Accepted on ts->socket thread %i\n",
-                ts->thread_index);
-    if (0 != clock_gettime(MONOTONIC_CLOCK, &ts->last_active_time)) {
-      jsockd_logf(LOG_ERROR, "Error getting time after accept: %s",
+    if (r < 0 && errno != EINTR) {
+      jsockd_logf(LOG_ERROR, "poll failed on UNIX socket: %s\n",
                   strerror(errno));
       ts->exit_status = -1;
       goto error_no_inc;
     }
-    break;
-  }
-
-  JS_UpdateStackTop(ts->rt);
-
-  LineBuf line_buf = {.buf = ts->input_buf, .size = INPUT_BUF_BYTES};
-
-  for (;;) {
-  read_loop:
-    tick_handler(ts);
-
-    switch (poll_fd(ts->socket_state->streamfd, SOCKET_POLL_TIMEOUT_MS)) {
-    case READY:
-      break;
-    case GO_AROUND:
-      goto read_loop;
-    case SIG_INTERRUPT_OR_ERROR:
-      goto error_no_inc;
-    }
+    if (r <= 0)
+      continue;
 
-    if (ts->rt == NULL) {
-      jsockd_log(LOG_DEBUG, "Re-initializing shut down thread state\n");
-      assert(REPLACEMENT_THREAD_STATE_NONE ==
-             atomic_load_explicit(&ts->replacement_thread_state,
-                                  memory_order_acquire));
-      init_thread_state(ts, ts->socket_state, ts->thread_index);
-      register_thread_state_runtime(ts->rt, ts);
+    if (pfds[0].revents) {
+      socklen_t streamfd_size = sizeof(struct sockaddr);
+      int fd = accept(ts->socket_state->sockfd,
+                      (struct sockaddr *)&ts->socket_state->addr,
+                      &streamfd_size);
+      if (fd < 0 && errno != EINTR && errno != ECONNABORTED) {
+        jsockd_logf(LOG_ERROR, "accept failed on UNIX socket: %s\n",
+                    strerror(errno));
+        ts->exit_status = -1;
+        goto error_no_inc;
+      }
+      if (fd >= 0) {
+        Conn *conn = conn_new(fd, ts->thread_index);
+        if (!conn || 0 != add_conn(&conns, &n_conns, &conns_capacity, conn)) {
+          jsockd_log(LOG_ERROR, "Error allocating connection\n");
+          if (conn)
+            conn_close(conn);
+          else
+            close(fd);
+          ts->exit_status = -1;
+          goto error_no_inc;
+        }
+        accepted_any = true;
+        jsockd_logf(LOG_DEBUG, "Accepted on ts->socket thread %i (fd=%i)\n",
+                    ts->thread_index, fd);
+        if (0 != clock_gettime(MONOTONIC_CLOCK, &ts->last_active_time)) {
+          jsockd_logf(LOG_ERROR, "Error getting time after accept: %s",
+                      strerror(errno));
+          ts->exit_status = -1;
+          goto error_no_inc;
+        }
+      }
     }
 
-    int exit_value =
-        line_buf_read(&line_buf, g_cmd_args.socket_sep_char, lb_read,
-                      &ts->socket_state->streamfd,
-                      command_loop_line_handler_wrapper, (void *)&louslh);
-    while (exit_value == TRAMPOLINE) {
-      JS_UpdateStackTop(ts->rt);
-      exit_value =
-          line_buf_replay(&line_buf, g_cmd_args.socket_sep_char,
-                          command_loop_line_handler_wrapper, (void *)&louslh);
+    // Only the first n_pfds - 2 connections were polled, as a new connection
+    // may have been accepted since.
+    int j = 0;
+    for (int i = 0; i < n_conns; ++i) {
+      Conn *conn = conns[i];
+      if (i >= n_pfds - 2 || !pfds[1 + i].revents) {
+        conns[j++] = conn;
+        continue;
+      }
+      int sr = serve_conn(ts, conn, line_handler);
+      if (sr == 0) {
+        conns[j++] = conn;
+        continue;
+      }
+      conn_close(conn);
+      if (sr != LINE_BUF_READ_EOF) {
+        if (sr != EXIT_ON_QUIT_COMMAND)
+          ts->exit_status = -1;
+        for (++i; i < n_conns; ++i)
+          conns[j++] = conns[i];
+        n_conns = j;
+        goto error_no_inc;
+      }
     }
-
-    if (exit_value < 0 && exit_value != LINE_BUF_READ_EOF &&
-        exit_value != EXIT_ON_QUIT_COMMAND)
-      ts->exit_status = -1;
-    if (exit_value < 0)
-      goto error_no_inc; // EOF or error
+    n_conns = j;
   }
 
+  goto error_no_inc; // last connection closed
+
 error:
   // Increment the wait group to indicate that this
   // thread is ready, so that all threads can be
@@ -354,8 +617,10 @@ error:
                           "wait group in "
                           "error condition\n");
 error_no_inc:
-  if (ts->socket_state->streamfd >= 0)
-    close(ts->socket_state->streamfd);
+  for (int i = 0; i < n_conns; ++i)
+    conn_close(conns[i]);
+  free(conns);
+  free(pfds);
   if (ts->socket_state->sockfd >= 0)
     close(ts->socket_state->sockfd);
   // indicate they're closed so we don't try to close
@@ -363,7 +628,200 @@ error_no_inc:
   ts->socket_state->streamfd = -1;
   ts->socket_state->sockfd = -1;
 
-  atomic_store_explicit(&g_interrupted_or_error, true, memory_order_release);
+  set_interrupted_or_error();
+}
+
+// Executes a complete record that the dispatcher thread has read from a
+// connection. Returns 0 on success, LINE_BUF_READ_EOF if the connection should
+// be closed, EXIT_ON_QUIT_COMMAND following a ?quit command, or -1 on an error
+// that should terminate the thread.
+static int serve_record(ThreadState *ts, Record *record,
+                        int (*line_handler)(const char *line, size_t len,
+                                            ThreadState *data,
+                                            bool truncated)) {
+  CommandLoopLineHandler louslh = {.ts = ts, .line_handler = line_handler};
+  Conn *conn = record->conn;
+
+  ts->socket_state->unix_socket_filename =
+      g_cmd_args.socket_path[conn->listener_index];
+  ts->socket_state->streamfd = conn->fd;
+  ts->socket_state->stream_io_err = 0;
+  ts->socket_state->conn = conn;
+  ts->socket_state->record = record;
+
+  if (ts->rt == NULL)
+    reinit_shut_down_thread_state(ts);
+  JS_UpdateStackTop(ts->rt);
+
+  int exit_value;
+  while (TRAMPOLINE ==
+         (exit_value = record_replay(record, command_loop_line_handler_wrapper,
+                                     &louslh)))
+    JS_UpdateStackTop(ts->rt);
+
+  if (exit_value == 0 && ts->socket_state->stream_io_err) {
+    // Error writing a response. The client has presumably gone away.
+    exit_value = LINE_BUF_READ_EOF;
+  }
+  // The dispatcher splits the input at points where the parser is back in its
+  // initial state, so this shouldn't happen unless the command was cut short
+  // by an error.
+  if (ts->line_n != 0) {
+    cleanup_command_state(ts);
+    ts->line_n = 0;
+    ts->truncated = false;
+  }
+
+  ts->socket_state->streamfd = -1;
+  ts->socket_state->conn = NULL;
+  ts->socket_state->record = NULL;
+  return exit_value;
+}
+
+// With an elastic pool, runtime threads beyond the minimum start out parked
+// (see dispatcher_set_pool_size), without a runtime.
+static bool starts_parked(int thread_index) {
+  return g_cmd_args.n_shared_runtimes != 0 &&
+         thread_index >= g_cmd_args.n_shared_runtimes;
+}
+
+// Returns true if the thread has not executed a command for at least
+// 'max_idle_time_us' and could safely shut down its runtime.
+static bool idle_for_us(ThreadState *ts, uint64_t max_idle_time_us) {
+  if (max_idle_time_us == 0 || ts->line_n != 0)
+    return false;
+  struct timespec now;
+  if (0 != clock_gettime(MONOTONIC_CLOCK, &now)) {
+    jsockd_logf(LOG_ERROR,
+                "Error getting time in idle check "
+                "thread %i: %s\n",
+                ts->thread_index, strerror(errno));
+    return false;
+  }
+  uint64_t ns_diff = ns_time_diff(&now, &ts->last_active_time);
+  return ns_diff / 1000ULL >= max_idle_time_us &&
+         REPLACEMENT_THREAD_STATE_NONE ==
+             atomic_load_explicit(&ts->replacement_thread_state,
+                                  memory_order_acquire);
+}
+
+// Returns the poll timeout after which the thread will have been idle for
+// 'max_idle_time_us' if nothing happens in the meantime, or -1 if there's no
+// such deadline. Threads therefore sleep until there's work to do, rather than
+// waking periodically to check whether they've been idle for long enough.
+static int idle_timeout_ms(ThreadState *ts, uint64_t max_idle_time_us) {
+  if (max_idle_time_us == 0 || ts->line_n != 0)
+    return -1;
+  struct timespec now;
+  if (0 != clock_gettime(MONOTONIC_CLOCK, &now))
+    return SOCKET_POLL_TIMEOUT_MS;
+  int64_t remaining_us = (int64_t)max_idle_time_us -
+                         ns_time_diff(&now, &ts->last_active_time) / 1000LL;
+  // The deadline may have passed while the runtime is being replaced (see
+  // idle_for_us), in which case check back shortly.
+  if (remaining_us <= 0)
+    return SOCKET_POLL_TIMEOUT_MS;
+  return (int)MIN((remaining_us + 999) / 1000, INT_MAX);
+}
+
+// Combines poll timeouts, where -1 means no timeout.
+static int min_timeout_ms(int a, int b) {
+  if (a < 0)
+    return b;
+  if (b < 0)
+    return a;
+  return MIN(a, b);
+}
+
+// How long a runtime in an elastic pool (see -r) can stay idle before it's
+// retired.
+static uint64_t retire_idle_time_us(void) {
+  return g_cmd_args.max_idle_time_set ? g_cmd_args.max_idle_time_us
+                                      : DEFAULT_MAX_IDLE_TIME_US;
+}
+
+// The equivalent of command_loop for shared-listener mode (-r). Rather than
+// owning a socket, the thread repeatedly takes a record (a complete command)
+// from the dispatcher, executes it, and then hands the record back so that the
+// dispatcher can hand over the next command on the connection. Any idle
+// runtime can therefore pick up the next command on any connection, and socket
+// reads and command framing happen on the dispatcher thread rather than on the
+// runtime threads.
+static void shared_command_loop(
+    ThreadState *ts,
+    int (*line_handler)(const char *line, size_t len, ThreadState *data,
+                        bool truncated),
+    int (*tick_handler)(ThreadState *ts)) {
+  if (0 != wait_group_inc(&g_thread_ready_wait_group, 1)) {
+    jsockd_log(LOG_ERROR, "Error incrementing thread ready "
+                          "wait group\n");
+    ts->exit_status = -1;
+    goto done;
+  }
+
+  bool parked = starts_parked(ts->thread_index);
+
+  for (;;) {
+    if (parked) {
+      bool start = dispatcher_park(&g_dispatcher, -1);
+      if (atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire))
+        break;
+      if (!start)
+        continue;
+      // Create the runtime now, so that it's ready by the time this thread
+      // takes a record.
+      jsockd_logf(LOG_DEBUG, "Starting runtime on thread %i\n",
+                  ts->thread_index);
+      if (ts->rt == NULL)
+        reinit_shut_down_thread_state(ts);
+      clock_gettime(MONOTONIC_CLOCK, &ts->last_active_time);
+      dispatcher_runtime_started(&g_dispatcher);
+      parked = false;
+    }
+
+    int timeout_ms = tick_handler(ts);
+    if (g_dispatcher.max_runtimes > g_dispatcher.min_runtimes)
+      timeout_ms = min_timeout_ms(timeout_ms,
+                                  idle_timeout_ms(ts, retire_idle_time_us()));
+
+    Record *record = dispatcher_take(&g_dispatcher, timeout_ms);
+    if (atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire))
+      break;
+    if (!record) {
+      if (idle_for_us(ts, retire_idle_time_us()) &&
+          dispatcher_try_retire(&g_dispatcher)) {
+        jsockd_logf(LOG_DEBUG, "Retiring runtime on thread %i\n",
+                    ts->thread_index);
+        cleanup_thread_state(ts);
+        parked = true;
+      }
+      continue;
+    }
+
+    int r = serve_record(ts, record, line_handler);
+    // The dispatcher thread owns the connection, so the record is always handed
+    // back (rather than the connection being closed here) even if the
+    // connection is no longer usable.
+    record->close_requested = r == LINE_BUF_READ_EOF;
+    ReloadRequest *reload_request = ts->socket_state->reload_request;
+    ts->socket_state->reload_request = NULL;
+    if (reload_request && r == 0) {
+      // The reload thread hands the record back.
+      queue_reload_request(reload_request, record);
+    } else {
+      free(reload_request);
+      dispatcher_return(&g_dispatcher, record);
+    }
+    if (r == 0 || r == LINE_BUF_READ_EOF)
+      continue;
+    if (r != EXIT_ON_QUIT_COMMAND)
+      ts->exit_status = -1;
+    break;
+  }
+
+done:
+  set_interrupted_or_error();
+  dispatcher_stop(&g_dispatcher);
 }
 
 static const uint8_t *compile_buf(JSContext *ctx, const char *buf, int buf_len,
@@ -461,8 +919,92 @@ static void *reset_thread_state_cleanup_old_runtime_thread(void *data) {
   return NULL;
 }
 
+static void *reset_thread_state_thread(void *data) {
+  ThreadState *ts = (ThreadState *)data;
+  ThreadState *spare = spare_pool_take();
+  if (spare) {
+    jsockd_logf(LOG_DEBUG, "Using spare runtime as replacement on thread %i\n",
+                ts->thread_index);
+    rebind_thread_state(spare, ts->socket_state, ts->thread_index);
+    ts->my_replacement = spare;
+    debug_inc_new_thread_state_count();
+    atomic_store_explicit(&ts->replacement_thread_state,
+                          REPLACEMENT_THREAD_STATE_INIT_COMPLETE,
+                          memory_order_release);
+    return NULL;
+  }
+  ts->my_replacement = (ThreadState *)malloc(sizeof(ThreadState));
+  debug_inc_new_thread_state_count();
+  if (0 != init_thread_state((ThreadState *)ts->my_replacement,
+                             ts->socket_state, ts->thread_index)) {
+    jsockd_log(LOG_ERROR, "Error initializing replacement "
+                          "thread state\n");
+    set_interrupted_or_error();
+    ts->exit_status = 1;
+    return NULL;
+  }
+  atomic_store_explicit(&ts->replacement_thread_state,
+                        REPLACEMENT_THREAD_STATE_INIT_COMPLETE,
+                        memory_order_release);
+  return NULL;
+}
+
+// To avoid latency, a thread state is replaced as follows:
+//     (i) a new thread state is created in a background thread,
+//    (ii) the old and new thread states are swapped the next time we're in
+//         the line_1 handler and the new thread state has finished
+//         initializing, and then
+//   (iii) the old thread state is cleaned up in a background thread.
+static int start_thread_state_replacement(ThreadState *ts) {
+  atomic_store_explicit(&ts->replacement_thread_state,
+                        REPLACEMENT_THREAD_STATE_INIT, memory_order_release);
+  if (0 != pthread_create(&ts->replacement_thread, NULL,
+                          reset_thread_state_thread, (void *)ts)) {
+    jsockd_logf(LOG_ERROR, "pthread_create failed: %s\n", strerror(errno));
+    atomic_store_explicit(&ts->replacement_thread_state,
+                          REPLACEMENT_THREAD_STATE_NONE, memory_order_release);
+    return -1;
+  }
+  return 0;
+}
+
+// Sets the command's deadline from a budget in microseconds, which runs from
+// when the server received the command. A budget that isn't a valid integer
+// > 0 is ignored.
+static void set_command_deadline(ThreadState *ts, const char *budget) {
+  errno = 0;
+  char *endptr = NULL;
+  long long int us = strtoll(budget, &endptr, 10);
+  if (errno != 0 || endptr == budget || *endptr != '\0' || us <= 0 ||
+      us > INT64_MAX / 1000) {
+    jsockd_logf(LOG_WARN, "Ignoring invalid command budget '%s'\n", budget);
+    return;
+  }
+  struct timespec base;
+  if (ts->socket_state->record)
+    base = ts->socket_state->record->received_time;
+  else if (0 != clock_gettime(MONOTONIC_CLOCK, &base))
+    return;
+  int64_t ns = (int64_t)base.tv_nsec + (int64_t)us * 1000LL;
+  ts->command_deadline.tv_sec = base.tv_sec + (time_t)(ns / 1000000000LL);
+  ts->command_deadline.tv_nsec = (long)(ns % 1000000000LL);
+}
+
+static bool deadline_passed_before_start(ThreadState *ts) {
+  struct timespec now;
+  return 0 == clock_gettime(MONOTONIC_CLOCK, &now) &&
+         command_deadline_passed(ts, &now);
+}
+
 static int handle_line_1_message_uid(ThreadState *ts, const char *line,
                                      int len) {
+  // The ID may be followed by a space and the command's budget.
+  const char *space = memchr(line, ' ', len);
+  if (space) {
+    set_command_deadline(ts, space + 1);
+    len = (int)(space - line);
+  }
+
   if (len > MESSAGE_UUID_MAX_BYTES) {
     jsockd_logf(LOG_WARN,
                 "Error: message UUID has length %i "
@@ -517,6 +1059,18 @@ static int handle_line_1_message_uid(ThreadState *ts, const char *line,
     }
     jsockd_log(LOG_DEBUG, "Joined replacement thread [1]\n");
     // We can now continue to process the line
+    rts = REPLACEMENT_THREAD_STATE_NONE;
+  }
+
+  // Following a reload, this command still executes with the old module,
+  // while a runtime with the new module is created in the background.
+  if (rts == REPLACEMENT_THREAD_STATE_NONE &&
+      ts->module_generation !=
+          atomic_load_explicit(&g_module_generation, memory_order_acquire)) {
+    jsockd_logf(LOG_DEBUG, "Replacing runtime on thread %i to reload module\n",
+                ts->thread_index);
+    if (0 != start_thread_state_replacement(ts))
+      return -1;
   }
 
   strncpy(ts->current_uuid, line, len);
@@ -527,23 +1081,84 @@ static int handle_line_1_message_uid(ThreadState *ts, const char *line,
   return 0;
 }
 
+// Looks the command up among those of the module that the runtime loaded,
+// which may not be the current module if there's been a reload.
+static JSValue named_command_func(ThreadState *ts, const char *name, int len) {
+  const NamedCommand *c =
+      ts->named_commands
+          ? find_named_command(&ts->named_commands->nc, name, len)
+          : NULL;
+  if (!c) {
+    jsockd_logf(LOG_DEBUG, "Unknown named command %.*s\n", len, name);
+    ts->command_error = "\"unknown named command\"";
+    return JS_EXCEPTION;
+  }
+  return func_from_bytecode(ts->ctx, c->bytecode, c->bytecode_size);
+}
+
+static void report_command_hash(ThreadState *ts, HashCacheUid uid);
+
 static int handle_line_2_query(ThreadState *ts, const char *line, int len) {
-  const HashCacheUid uid = get_hash_cache_uid(line, len);
-  const CachedFunction *cf = get_cached_function(uid);
+  // Don't bother compiling a command that isn't going to be executed (see
+  // handle_line_3_parameter_helper).
+  if (deadline_passed_before_start(ts)) {
+    ts->line_n++;
+    return 0;
+  }
+
+  const bool named = len > 0 && line[0] == NAMED_COMMAND_PREFIX;
+  const bool by_hash = len > 0 && line[0] == COMMAND_HASH_PREFIX;
+  HashCacheUid uid = 0;
+  if (!by_hash)
+    uid = get_hash_cache_uid(line, len);
+  else if (!parse_hash_cache_uid(line + 1, len - 1, &uid))
+    jsockd_logf(LOG_DEBUG, "Invalid command hash %.*s\n", len, line);
 
 #ifdef CMAKE_BUILD_TYPE_DEBUG
   jsockd_logf(LOG_DEBUG,
               "Computed "
               "UID: " HASH_CACHE_UID_FORMAT_SPECIFIER
               " [bits=%i, bucket=%zu] for %.*s\n",
-              HASH_CACHE_UID_FORMAT_ARGS(uid), CACHED_FUNCTION_HASH_BITS,
-              get_cache_bucket(uid, CACHED_FUNCTION_HASH_BITS), len, line);
+              HASH_CACHE_UID_FORMAT_ARGS(uid), g_cached_function_hash_bits,
+              get_cache_bucket(uid, g_cached_function_hash_bits), len, line);
 #endif
 
-  if (cf) {
+  // Only inline commands have a hash worth reporting, and only if the server
+  // keeps them.
+  const bool report_hash = !named && !by_hash &&
+                           !g_cmd_args.named_commands_only &&
+                           ts->socket_state->conn &&
+                           ts->socket_state->conn->command_hashes;
+
+  // A command that has already been evaluated in this runtime needn't be read
+  // from the bytecode cache.
+  ts->compiled_query = get_live_function(ts, uid);
+  if (!JS_IsUndefined(ts->compiled_query)) {
+    jsockd_log(LOG_DEBUG, "Found live function\n");
+    if (report_hash)
+      report_command_hash(ts, uid);
+    ts->line_n++;
+    return 0;
+  }
+
+  CachedFunctionBucket *cfb = NULL;
+  if (!named && !g_cmd_args.named_commands_only && uid != 0)
+    cfb = get_cached_function(uid);
+  if (named) {
+    ts->compiled_query = named_command_func(ts, line + 1, len - 1);
+  } else if (g_cmd_args.named_commands_only) {
+    ts->compiled_query = JS_EXCEPTION;
+    ts->command_error = "\"only named commands may be run\"";
+  } else if (cfb) {
     jsockd_log(LOG_DEBUG, "Found cached function\n");
-    ts->compiled_query =
-        func_from_bytecode(ts->ctx, cf->bytecode, cf->bytecode_size);
+    ts->cached_function_in_use = cfb;
+    ts->compiled_query = func_from_bytecode(
+        ts->ctx, cfb->payload.bytecode, cfb->payload.bytecode_size);
+  } else if (by_hash) {
+    // Evicted (or never compiled), so the client has to send the source.
+    ts->compiled_query = JS_EXCEPTION;
+    ts->command_error = "\"command not in cache\"";
+    ts->command_unknown = true;
   } else {
     jsockd_log(LOG_DEBUG, "Compiling...\n");
     // We compile and cache the function.
@@ -553,16 +1168,24 @@ static int handle_line_2_query(ThreadState *ts, const char *line, int len) {
     if (!bytecode) {
       ts->compiled_query = JS_EXCEPTION;
     } else {
-      ts->cached_function_in_use =
-          add_cached_function(uid, bytecode, bytecode_size);
+      ts->cached_function_in_use = add_cached_function(
+          uid, &(CachedFunction){.bytecode = bytecode,
+                                 .bytecode_size = bytecode_size});
       if (!ts->cached_function_in_use) {
         assert(ts->dangling_bytecode == NULL);
         jsockd_log(LOG_DEBUG, "Dangling bytecode\n");
         ts->dangling_bytecode = (uint8_t *)bytecode;
+      } else if (g_disk_cache_enabled) {
+        disk_cache_queue_write(&g_disk_cache, uid, bytecode, bytecode_size);
       }
       ts->compiled_query = func_from_bytecode(ts->ctx, bytecode, bytecode_size);
     }
   }
+  if (!JS_IsException(ts->compiled_query)) {
+    add_live_function(ts, uid, ts->compiled_query);
+    if (report_hash && ts->cached_function_in_use)
+      report_command_hash(ts, uid);
+  }
 
   ts->line_n++;
   return 0;
@@ -584,26 +1207,23 @@ static int64_t memusage(const JSMemoryUsage *m) {
   return m->malloc_count + m->malloc_size;
 }
 
-static void *reset_thread_state_thread(void *data) {
-  ThreadState *ts = (ThreadState *)data;
-  ts->my_replacement = (ThreadState *)malloc(sizeof(ThreadState));
-  debug_inc_new_thread_state_count();
-  if (0 != init_thread_state((ThreadState *)ts->my_replacement,
-                             ts->socket_state, ts->thread_index)) {
-    jsockd_log(LOG_ERROR, "Error initializing replacement "
-                          "thread state\n");
-    atomic_store_explicit(&g_interrupted_or_error, true, memory_order_release);
-    ts->exit_status = 1;
-    return NULL;
-  }
-  atomic_store_explicit(&ts->replacement_thread_state,
-                        REPLACEMENT_THREAD_STATE_INIT_COMPLETE,
-                        memory_order_release);
-  return NULL;
+// On a multiplexed connection, other runtime threads may be writing responses
+// at the same time.
+static void lock_stream(ThreadState *ts) {
+  if (ts->socket_state->record)
+    mutex_lock(&ts->socket_state->record->conn->write_mutex);
+}
+
+static void unlock_stream(ThreadState *ts) {
+  if (ts->socket_state->record)
+    mutex_unlock(&ts->socket_state->record->conn->write_mutex);
 }
 
 static void write_to_stream(ThreadState *ts, const char *buf, size_t len) {
-  if (0 != write_all(ts->socket_state->streamfd, buf, len)) {
+  lock_stream(ts);
+  int r = write_all(ts->socket_state->streamfd, buf, len);
+  unlock_stream(ts);
+  if (0 != r) {
     ts->socket_state->stream_io_err = -1;
     jsockd_logf(LOG_ERROR, "Error writing to socket: %s\n", strerror(errno));
     return;
@@ -612,7 +1232,10 @@ static void write_to_stream(ThreadState *ts, const char *buf, size_t len) {
 
 static void writev_to_stream_helper(ThreadState *ts, struct iovec *iov,
                                     int iovcnt) {
-  if (0 != writev_all(ts->socket_state->streamfd, iov, iovcnt)) {
+  lock_stream(ts);
+  int r = writev_all(ts->socket_state->streamfd, iov, iovcnt);
+  unlock_stream(ts);
+  if (0 != r) {
     ts->socket_state->stream_io_err = -1;
     jsockd_logf(LOG_ERROR, "Error writing to socket: %s\n", strerror(errno));
     return;
@@ -631,6 +1254,20 @@ static void write_to_wbuf_wrapper(void *opaque, const char *inp, size_t size) {
 #define write_const_to_stream(ts, str)                                         \
   write_to_stream((ts), (str), sizeof(str) - 1)
 
+// Sent before the command's response, so that the client can send the hash
+// in place of the source from now on.
+static void report_command_hash(ThreadState *ts, HashCacheUid uid) {
+  char buf[sizeof(HashCacheUid) * 2 + 1];
+  snprintf(buf, sizeof(buf), HASH_CACHE_UID_FORMAT_SPECIFIER,
+           HASH_CACHE_UID_FORMAT_ARGS(uid));
+  writev_to_stream(
+      ts,
+      {.iov_base = (void *)ts->current_uuid, .iov_len = ts->current_uuid_len},
+      STRCONST_IOVEC(" command_hash "),
+      {.iov_base = (void *)buf, .iov_len = sizeof(buf) - 1},
+      STRCONST_IOVEC("\n"));
+}
+
 static int handle_line_3_parameter_helper(ThreadState *ts, const char *line,
                                           int len) {
   const JSPrintValueOptions js_print_value_options = {.show_hidden = false,
@@ -639,6 +1276,29 @@ static int handle_line_3_parameter_helper(ThreadState *ts, const char *line,
                                                       .max_string_length = 0,
                                                       .max_item_count = 0};
 
+  // The client has given up on the command, so drop it.
+  if (deadline_passed_before_start(ts)) {
+    jsockd_logf(LOG_DEBUG, "Deadline passed before command %.*s started\n",
+                (int)ts->current_uuid_len, ts->current_uuid);
+    writev_to_stream(
+        ts,
+        {.iov_base = (void *)ts->current_uuid, .iov_len = ts->current_uuid_len},
+        STRCONST_IOVEC(" exception \"deadline exceeded\"\n"));
+    return ts->socket_state->stream_io_err;
+  }
+
+  if (JS_IsException(ts->compiled_query) && ts->command_error) {
+    const char *type =
+        ts->command_unknown ? " unknown_command " : " exception ";
+    writev_to_stream(
+        ts,
+        {.iov_base = (void *)ts->current_uuid, .iov_len = ts->current_uuid_len},
+        {.iov_base = (void *)type, .iov_len = strlen(type)},
+        {.iov_base = (void *)ts->command_error,
+         .iov_len = strlen(ts->command_error)},
+        STRCONST_IOVEC("\n"));
+    return ts->socket_state->stream_io_err;
+  }
   if (JS_IsException(ts->compiled_query)) {
     if (CMAKE_BUILD_TYPE_IS_DEBUG) {
       LogLevel l = LOG_ERROR;
@@ -678,7 +1338,8 @@ static int handle_line_3_parameter_helper(ThreadState *ts, const char *line,
   JSValue argv[] = {ts->compiled_module, parsed_arg};
   JSValue ret = JS_Call(ts->ctx, ts->compiled_query, JS_NULL,
                         sizeof(argv) / sizeof(argv[0]), argv);
-  ret = js_std_await(ts->ctx, ret); // allow return of a promise
+  // Allow return of a promise, and wait for async message responses.
+  ret = await_command_result(ts, ret);
   if (JS_IsException(ret)) {
     jsockd_log(LOG_DEBUG, "Error calling cached function\n");
 
@@ -791,24 +1452,8 @@ static int handle_line_3_parameter_helper(ThreadState *ts, const char *line,
                     "over the last %i commands. "
                     "Resetting interpreter state.\n",
                     MEMORY_INCREASE_MAX_COUNT * MEMORY_CHECK_INTERVAL);
-        // To avoid latency, we do the following:
-        //     (i) create a new thread state in a background thread,
-        //    (ii) swap the old and new thread states the next time we're in
-        //         the line_1 handler and the new thread state has finished
-        //         initializing, and then
-        //   (iii) clean up the old thread state in a background thread.
-        atomic_store_explicit(&ts->replacement_thread_state,
-                              REPLACEMENT_THREAD_STATE_INIT,
-                              memory_order_release);
-        if (0 != pthread_create(&ts->replacement_thread, NULL,
-                                reset_thread_state_thread, (void *)ts)) {
-          jsockd_logf(LOG_ERROR, "pthread_create failed: %s\n",
-                      strerror(errno));
-          atomic_store_explicit(&ts->replacement_thread_state,
-                                REPLACEMENT_THREAD_STATE_NONE,
-                                memory_order_release);
+        if (0 != start_thread_state_replacement(ts))
           return -1;
-        }
 
         ts->memory_increase_count = 0;
 
@@ -831,6 +1476,73 @@ static int handle_line_3_parameter(ThreadState *ts, const char *line, int len) {
   return r;
 }
 
+// The startup timing report (see ?startup). Each runtime thread records the
+// timing of the runtime that it creates at startup before it becomes ready.
+typedef struct {
+  RuntimeInitTiming timing;
+  bool recorded;
+} StartupTiming;
+
+static struct timespec g_start_time;
+static int64_t g_module_load_us;
+static StartupTiming g_startup_timings[MAX_THREADS];
+static _Atomic(const char *) g_startup_report;
+
+static void record_startup_timing(const ThreadState *ts) {
+  g_startup_timings[ts->thread_index].timing = ts->init_timing;
+  g_startup_timings[ts->thread_index].recorded = true;
+}
+
+static const char *format_startup_report(void) {
+  char *buf = NULL;
+  size_t buf_len = 0;
+  FILE *memf = open_memstream(&buf, &buf_len);
+  if (!memf)
+    return NULL;
+  struct timespec now;
+  int64_t ready_us = 0;
+  if (0 == clock_gettime(MONOTONIC_CLOCK, &now))
+    ready_us = ns_time_diff(&now, &g_start_time) / 1000;
+  fprintf(memf,
+          "{\"ready_us\":%" PRId64 ",\"module_load_us\":%" PRId64
+          ",\"runtimes\":[",
+          ready_us, g_module_load_us);
+  const char *sep = "";
+  for (int i = 0; i < MAX_THREADS; ++i) {
+    if (!g_startup_timings[i].recorded)
+      continue;
+    const RuntimeInitTiming *t = &g_startup_timings[i].timing;
+    fprintf(memf,
+            "%s{\"thread\":%i,\"runtime_us\":%" PRId64
+            ",\"shims_us\":%" PRId64 ",\"backtrace_us\":%" PRId64
+            ",\"module_wait_us\":%" PRId64 ",\"module_us\":%" PRId64 "}",
+            sep, i, t->runtime_us, t->shims_us, t->backtrace_us,
+            t->module_wait_us, t->module_us);
+    sep = ",";
+  }
+  fputs("]}", memf);
+  fclose(memf);
+  return buf;
+}
+
+// Called once the runtimes are ready. The report is only ever set once, and is
+// freed by global_cleanup.
+static void publish_startup_report(void) {
+  const char *report = format_startup_report();
+  if (!report) {
+    jsockd_log(LOG_WARN, "Error formatting startup timing report\n");
+    return;
+  }
+  atomic_store_explicit(&g_startup_report, report, memory_order_release);
+}
+
+static void log_startup_report(void) {
+  const char *report =
+      atomic_load_explicit(&g_startup_report, memory_order_acquire);
+  if (report)
+    jsockd_logf(LOG_INFO, "Startup timing: %s\n", report);
+}
+
 static int line_handler(const char *line, size_t len, ThreadState *ts,
                         bool truncated) {
   jsockd_logf(LOG_DEBUG, "LINE %i on %s: %s\n", ts->line_n,
@@ -873,7 +1585,7 @@ static int line_handler(const char *line, size_t len, ThreadState *ts,
   if (!strcmp("?quit", line)) {
     JS_FreeValue(ts->ctx, ts->compiled_query);
     ts->compiled_query = JS_UNDEFINED;
-    atomic_store_explicit(&g_interrupted_or_error, true, memory_order_release);
+    set_interrupted_or_error();
     write_const_to_stream(ts, "quit\n");
     return EXIT_ON_QUIT_COMMAND;
   }
@@ -910,6 +1622,83 @@ static int line_handler(const char *line, size_t len, ThreadState *ts,
     free((void *)memusage_str);
     return 0;
   }
+  if (!strcmp("?startup", line)) {
+    const char *report =
+        atomic_load_explicit(&g_startup_report, memory_order_acquire);
+    if (!report) {
+      write_const_to_stream(ts, "error: startup not complete\n");
+      return 0;
+    }
+    writev_to_stream(ts,
+                     {.iov_base = (void *)report, .iov_len = strlen(report)},
+                     STRCONST_IOVEC("\n"));
+    return 0;
+  }
+  if (!strcmp("?multiplex", line)) {
+    // Records are framed by the dispatcher, so this only makes sense in
+    // shared-listener mode. The dispatcher doesn't read 'multiplexed' while
+    // this command is executing (see can_dispatch in dispatch.c).
+    if (!ts->socket_state->record) {
+      write_const_to_stream(ts, "bad command\n");
+      return 0;
+    }
+    ts->socket_state->record->conn->multiplexed = true;
+    write_const_to_stream(ts, "multiplex\n");
+    return 0;
+  }
+  if (!strcmp("?commandhashes", line)) {
+    // Executes as a barrier in shared-listener mode (like ?multiplex), so no
+    // other command on the connection reads 'command_hashes' meanwhile.
+    ts->socket_state->conn->command_hashes = true;
+    write_const_to_stream(ts, "commandhashes\n");
+    return 0;
+  }
+  if (!strncmp("?reload", line, STRCONST_LEN("?reload")) &&
+      (line[STRCONST_LEN("?reload")] == '\0' ||
+       line[STRCONST_LEN("?reload")] == ' ')) {
+    // '?reload' reloads the file given by -m, and '?reload <path>' the given
+    // file (which subsequent reloads don't remember).
+    const char *path = line[STRCONST_LEN("?reload")] == ' '
+                           ? line + STRCONST_LEN("?reload ")
+                           : g_cmd_args.es6_module_bytecode_file;
+    if (!path || path[0] == '\0') {
+      write_const_to_stream(ts, "error: no module bytecode file to reload\n");
+      return 0;
+    }
+    if (g_cmd_args.prefork) {
+      // The parent process reloads the module for the workers it forks from
+      // now on, and passes the signal on to every worker (see
+      // reload_prefork_template).
+      if (path != g_cmd_args.es6_module_bytecode_file) {
+        write_const_to_stream(ts, "error: ?reload <path> is not supported "
+                                  "with -f\n");
+        return 0;
+      }
+      if (0 != kill(getppid(), SIGHUP)) {
+        jsockd_logf(LOG_ERROR, "Error sending SIGHUP to parent process: %s\n",
+                    strerror(errno));
+        write_const_to_stream(ts, "error: reload failed\n");
+        return 0;
+      }
+      write_const_to_stream(ts, "reload\n");
+      return 0;
+    }
+    if (ts->socket_state->record) {
+      // The reload thread takes the record once the runtime thread is done
+      // with it (see shared_command_loop), and responds when the module has
+      // been reloaded.
+      ts->socket_state->reload_request = new_reload_request(path);
+      if (!ts->socket_state->reload_request)
+        write_const_to_stream(ts, "error: reload failed\n");
+      return 0;
+    }
+    if (0 != reload_and_wait(path)) {
+      write_const_to_stream(ts, "error: reload failed\n");
+      return 0;
+    }
+    write_const_to_stream(ts, "reload\n");
+    return 0;
+  }
 #ifdef CMAKE_BUILD_TYPE_DEBUG
   if (!strcmp("?tsreset", line)) {
     ts->manually_trigger_thread_state_reset = true;
@@ -939,39 +1728,157 @@ static int line_handler(const char *line, size_t len, ThreadState *ts,
   }
 }
 
-static void tick_handler(ThreadState *ts) {
-  if (ts->thread_index == 0 || g_cmd_args.max_idle_time_us == 0 ||
-      ts->line_n != 0 || ts->rt == NULL)
-    return;
-  struct timespec now;
-  if (0 != clock_gettime(MONOTONIC_CLOCK, &now)) {
-    jsockd_logf(LOG_ERROR,
-                "Error getting time in tick_handler "
-                "thread %i: %s\n",
-                ts->thread_index, strerror(errno));
-    return;
-  }
-  uint64_t ns_diff = ns_time_diff(&now, &ts->last_active_time);
-  if (ns_diff / 1000ULL >= g_cmd_args.max_idle_time_us &&
-      REPLACEMENT_THREAD_STATE_NONE ==
-          atomic_load_explicit(&ts->replacement_thread_state,
-                               memory_order_acquire)) {
+// Returns the poll timeout after which it should be called again.
+static int tick_handler(ThreadState *ts) {
+  if (ts->thread_index == 0 || ts->rt == NULL)
+    return -1;
+  if (idle_for_us(ts, g_cmd_args.max_idle_time_us)) {
     jsockd_logf(LOG_DEBUG, "Shutting down QuickJS on thread %s\n",
                 ts->socket_state->unix_socket_filename);
     cleanup_thread_state(ts);
+    return -1;
   }
+  return idle_timeout_ms(ts, g_cmd_args.max_idle_time_us);
+}
+
+static bool cpu_affinity_requested(void) {
+  return g_cmd_args.n_cpu_affinity != 0;
+}
+
+// Creates the calling runtime thread's runtime, unless the runtime already
+// exists (prefork mode) or the thread starts parked, so that the runtimes are
+// created in parallel. With -a, the thread is first pinned to its CPU. Linux
+// places each page on the NUMA node of the CPU that first touches it, so
+// creating the runtime after pinning keeps the runtime's heap local to the CPU
+// that uses it.
+static int init_runtime_thread(ThreadState *ts) {
+  if (cpu_affinity_requested()) {
+    int cpu =
+        g_cmd_args.cpu_affinity[ts->thread_index % g_cmd_args.n_cpu_affinity];
+    if (0 != cpu_affinity_pin_current_thread(cpu))
+      jsockd_logf(LOG_WARN, "Error pinning thread %i to CPU %i: %s\n",
+                  ts->thread_index, cpu, strerror(errno));
+    else
+      jsockd_logf(LOG_DEBUG, "Pinned thread %i to CPU %i\n",
+                  ts->thread_index, cpu);
+  }
+  if (ts->rt || starts_parked(ts->thread_index))
+    return 0;
+  if (0 != init_thread_state(ts, ts->socket_state, ts->thread_index)) {
+    jsockd_logf(LOG_ERROR, "Error initializing thread %i\n", ts->thread_index);
+    return -1;
+  }
+  register_thread_state_runtime(ts->rt, ts);
+  record_startup_timing(ts);
+  return 0;
 }
 
 static void *listen_thread_func(void *data) {
   ThreadState *ts = (ThreadState *)data;
-  command_loop(ts, line_handler, tick_handler);
+  if (0 != init_runtime_thread(ts)) {
+    ts->exit_status = -1;
+    set_interrupted_or_error();
+    // Don't keep main() waiting for this thread to become ready.
+    wait_group_inc(&g_thread_ready_wait_group, 1);
+    return NULL;
+  }
+  if (g_cmd_args.n_shared_runtimes != 0)
+    shared_command_loop(ts, line_handler, tick_handler);
+  else
+    command_loop(ts, line_handler, tick_handler);
   jsockd_log(LOG_DEBUG, "Listen thread terminating...\n");
   return NULL;
 }
 
+static int start_listen_thread(ThreadState *ts, pthread_t *thread) {
+  pthread_attr_t attr;
+  if (0 != pthread_attr_init(&attr)) {
+    jsockd_logf(LOG_ERROR, "pthread_attr_init failed: %s\n", strerror(errno));
+    return -1;
+  }
+  if (0 != pthread_attr_setstacksize(&attr, QUICKS_THREAD_STACK_SIZE)) {
+    jsockd_logf(LOG_ERROR, "pthread_attr_setstacksize failed: %s\n",
+                strerror(errno));
+    pthread_attr_destroy(&attr); // can fail, but no point in
+                                 // checking
+    return -1;
+  }
+  if (0 != pthread_create(thread, &attr, listen_thread_func, ts)) {
+    jsockd_logf(LOG_ERROR, "pthread_create failed; exiting: %s",
+                strerror(errno));
+    pthread_attr_destroy(&attr); // can fail, but no point in
+                                 // checking
+    return -1;
+  }
+  pthread_attr_destroy(&attr); // can fail, but no point in checking
+  return 0;
+}
+
 static pthread_t *g_threads;
 static SocketState *g_socket_states;
 
+static void *dispatcher_thread_func(void *data) {
+  dispatcher_run((Dispatcher *)data);
+  jsockd_log(LOG_DEBUG, "Dispatcher thread terminating...\n");
+  return NULL;
+}
+
+static int start_dispatcher(void) {
+  g_listener_socket_states = calloc(g_cmd_args.n_sockets, sizeof(SocketState));
+  int listener_fds[MAX_THREADS];
+  for (int i = 0; i < g_cmd_args.n_sockets; ++i) {
+    SocketState *ss = &g_listener_socket_states[i];
+    init_socket_state(ss, g_cmd_args.socket_path[i]);
+    if (0 != initialize_and_listen_on_unix_socket(ss)) {
+      jsockd_log(LOG_ERROR, "Error initializing shared UNIX socket\n");
+      return -1;
+    }
+    listener_fds[i] = ss->sockfd;
+  }
+  if (0 != dispatcher_init(&g_dispatcher, listener_fds, g_cmd_args.n_sockets))
+    return -1;
+  dispatcher_set_pool_size(&g_dispatcher, g_cmd_args.n_shared_runtimes,
+                           g_cmd_args.max_shared_runtimes);
+  if (g_cmd_args.n_class_weights != 0 &&
+      0 != dispatcher_set_classes(&g_dispatcher, g_cmd_args.class_weight,
+                                  g_cmd_args.class_reserved,
+                                  g_cmd_args.n_class_weights)) {
+    jsockd_log(LOG_ERROR, "Error allocating priority classes\n");
+    dispatcher_destroy(&g_dispatcher);
+    return -1;
+  }
+  dispatcher_set_limits(&g_dispatcher, g_cmd_args.max_queued_commands,
+                        g_cmd_args.max_queue_wait_us);
+  if (0 != pthread_create(&g_dispatcher_thread, NULL, dispatcher_thread_func,
+                          &g_dispatcher)) {
+    jsockd_logf(LOG_ERROR, "pthread_create failed for dispatcher: %s\n",
+                strerror(errno));
+    dispatcher_destroy(&g_dispatcher);
+    return -1;
+  }
+  return 0;
+}
+
+// Must be called after all the runtime threads have been joined.
+static void stop_dispatcher(void) {
+  if (!g_listener_socket_states)
+    return;
+  dispatcher_stop(&g_dispatcher);
+  if (0 != pthread_join(g_dispatcher_thread, NULL))
+    jsockd_logf(LOG_ERROR, "Error joining dispatcher thread: %s\n",
+                strerror(errno));
+  dispatcher_destroy(&g_dispatcher);
+}
+
+static void cleanup_listener_socket_states(void) {
+  if (!g_listener_socket_states)
+    return;
+  for (int i = 0; i < g_cmd_args.n_sockets; ++i)
+    cleanup_socket_state(&g_listener_socket_states[i]);
+  free(g_listener_socket_states);
+  g_listener_socket_states = NULL;
+}
+
 static const uint8_t *load_module_bytecode(const char *filename,
                                            size_t *out_size) {
   int mmap_errno;
@@ -1056,20 +1963,336 @@ static const uint8_t *load_module_bytecode(const char *filename,
   return module_bytecode;
 }
 
+// The returned set takes over the module bytecode's mapping. If NULL is
+// returned, the caller still owns the mapping.
+static NamedCommandsSet *load_named_commands(const uint8_t *module_bytecode,
+                                             size_t size) {
+  NamedCommands nc;
+  if (0 != parse_named_commands(module_bytecode, size, &nc))
+    return NULL;
+  NamedCommandsSet *set = new_named_commands_set(
+      &nc, module_bytecode, size + ED25519_SIGNATURE_SIZE);
+  free_named_commands(&nc);
+  return set;
+}
+
+// Loads the module bytecode file given by -m (if any) at startup.
+static int load_module_bytecode_file(void) {
+  if (!g_cmd_args.es6_module_bytecode_file)
+    return 0;
+  struct timespec start, end;
+  bool timed = 0 == clock_gettime(MONOTONIC_CLOCK, &start);
+  g_module_bytecode = load_module_bytecode(g_cmd_args.es6_module_bytecode_file,
+                                           &g_module_bytecode_size);
+  if (timed && 0 == clock_gettime(MONOTONIC_CLOCK, &end))
+    g_module_load_us = ns_time_diff(&end, &start) / 1000;
+  // load_module_bytecode will log an error
+  if (!g_module_bytecode)
+    return -1;
+  g_named_commands =
+      load_named_commands(g_module_bytecode, g_module_bytecode_size);
+  if (!g_named_commands) {
+    munmap_or_warn((void *)g_module_bytecode,
+                   g_module_bytecode_size + ED25519_SIGNATURE_SIZE);
+    g_module_bytecode = NULL;
+    g_module_bytecode_size = 0;
+    return -1;
+  }
+  if (g_named_commands->nc.n_commands != 0)
+    jsockd_logf(LOG_INFO, "Module has %i named commands\n",
+                g_named_commands->nc.n_commands);
+  return 0;
+}
+
+// Held for the whole of a reload, so that a SIGHUP and a ?reload can't
+// overlap.
+static pthread_mutex_t g_reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Replaces the module bytecode with the signed bytecode in 'filename'. The
+// module is first loaded into a scratch runtime, so that a module which throws
+// on loading is rejected here and the runtimes keep the old module. Each
+// runtime thread then switches to the new module as described in
+// handle_line_1_message_uid.
+static int reload_module_bytecode_(const char *filename) {
+  size_t size;
+  const uint8_t *bytecode = load_module_bytecode(filename, &size);
+  if (!bytecode)
+    return -1;
+  NamedCommandsSet *named_commands = load_named_commands(bytecode, size);
+  if (!named_commands) {
+    munmap_or_warn((void *)bytecode, size + ED25519_SIGNATURE_SIZE);
+    return -1;
+  }
+
+  // From here on, the set owns the mapping.
+  ThreadState *scratch = calloc(1, sizeof(ThreadState));
+  if (!scratch) {
+    unref_named_commands_set(named_commands);
+    return -1;
+  }
+  int r = init_thread_state_with_module(scratch, NULL, 0, bytecode, size);
+  cleanup_thread_state(scratch);
+  free(scratch);
+  if (r != 0) {
+    jsockd_logf(LOG_ERROR, "Error loading module bytecode %s; not reloading\n",
+                filename);
+    unref_named_commands_set(named_commands);
+    return -1;
+  }
+
+  rwlock_wrlock(&g_module_bytecode_lock);
+  NamedCommandsSet *old_named_commands = g_named_commands;
+  g_module_bytecode = bytecode;
+  g_module_bytecode_size = size;
+  g_named_commands = named_commands;
+  atomic_fetch_add_explicit(&g_module_generation, 1, memory_order_release);
+  // Commands compiled against the new module are then cached on disk under
+  // its hash.
+  if (g_disk_cache_enabled)
+    disk_cache_set_module(&g_disk_cache, bytecode, size);
+  rwlock_unlock(&g_module_bytecode_lock);
+  // Runtimes that loaded the old module keep their own references until
+  // they're replaced, and the old module is unmapped with the last of them.
+  unref_named_commands_set(old_named_commands);
+  spare_pool_refresh();
+  jsockd_logf(LOG_INFO, "Reloaded module bytecode from %s\n", filename);
+  return 0;
+}
+
+static int reload_module_bytecode(const char *filename) {
+  mutex_lock(&g_reload_mutex);
+  int r = reload_module_bytecode_(filename);
+  mutex_unlock(&g_reload_mutex);
+  return r;
+}
+
+// SIGHUP reloads the module bytecode file given by -m. The signal handler
+// just writes to a pipe, and the reload is done on its own thread. So is the
+// reload for ?reload (see line_handler), so that the scratch runtime isn't
+// created on a runtime thread.
+static int g_reload_pipe[2] = {-1, -1};
+static pthread_t g_reload_thread;
+static bool g_reload_thread_started;
+
+static const char RELOAD_PIPE_SIGHUP = 0;
+static const char RELOAD_PIPE_REQUEST = 1;
+
+// A ?reload command waiting for the reload thread. In shared-listener mode,
+// the reload thread writes the response and hands the record back to the
+// dispatcher, so that the runtime thread can get on with other commands.
+// Otherwise the runtime thread waits for the result.
+struct ReloadRequest {
+  struct ReloadRequest *next;
+  const char *path;
+  Record *record;
+  int result;
+  bool done;
+};
+
+static pthread_mutex_t g_reload_requests_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_reload_requests_cond = PTHREAD_COND_INITIALIZER;
+static ReloadRequest *g_reload_requests_head;
+static ReloadRequest *g_reload_requests_tail;
+// Requests are accepted only while the reload thread is running, so every
+// request is finished, if only with an error.
+static bool g_reload_requests_accepted;
+
+static void SIGHUP_handler(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  // EAGAIN just means that there's already a reload pending.
+  while (-1 == write(g_reload_pipe[1], &RELOAD_PIPE_SIGHUP,
+                     sizeof(RELOAD_PIPE_SIGHUP)) &&
+         errno == EINTR)
+    ;
+  errno = saved_errno;
+}
+
+// The request and a copy of 'path' are allocated together.
+static ReloadRequest *new_reload_request(const char *path) {
+  size_t path_size = strlen(path) + 1;
+  ReloadRequest *req = calloc(1, sizeof(ReloadRequest) + path_size);
+  if (!req) {
+    jsockd_log(LOG_ERROR, "Error allocating reload request\n");
+    return NULL;
+  }
+  memcpy(req + 1, path, path_size);
+  req->path = (const char *)(req + 1);
+  return req;
+}
+
+static void finish_reload_request(ReloadRequest *req, int result) {
+  if (req->record) {
+    Conn *conn = req->record->conn;
+    const char *response =
+        result == 0 ? "reload\n" : "error: reload failed\n";
+    mutex_lock(&conn->write_mutex);
+    int r = write_all(conn->fd, response, strlen(response));
+    mutex_unlock(&conn->write_mutex);
+    if (r != 0)
+      req->record->close_requested = true;
+    dispatcher_return(&g_dispatcher, req->record);
+    free(req);
+    return;
+  }
+  mutex_lock(&g_reload_requests_mutex);
+  req->result = result;
+  req->done = true;
+  pthread_cond_broadcast(&g_reload_requests_cond);
+  mutex_unlock(&g_reload_requests_mutex);
+}
+
+static void queue_reload_request(ReloadRequest *req, Record *record) {
+  req->record = record;
+  mutex_lock(&g_reload_requests_mutex);
+  bool accepted = g_reload_requests_accepted;
+  if (accepted) {
+    req->next = NULL;
+    if (g_reload_requests_tail)
+      g_reload_requests_tail->next = req;
+    else
+      g_reload_requests_head = req;
+    g_reload_requests_tail = req;
+  }
+  mutex_unlock(&g_reload_requests_mutex);
+  if (!accepted) {
+    jsockd_log(LOG_ERROR, "Reload thread isn't running; not reloading\n");
+    finish_reload_request(req, -1);
+    return;
+  }
+  // As for SIGHUP, EAGAIN means that the reload thread is going to wake up
+  // anyway.
+  while (-1 == write(g_reload_pipe[1], &RELOAD_PIPE_REQUEST,
+                     sizeof(RELOAD_PIPE_REQUEST)) &&
+         errno == EINTR)
+    ;
+}
+
+static int reload_and_wait(const char *path) {
+  ReloadRequest req = {.path = path};
+  queue_reload_request(&req, NULL);
+  mutex_lock(&g_reload_requests_mutex);
+  while (!req.done)
+    pthread_cond_wait(&g_reload_requests_cond, &g_reload_requests_mutex);
+  mutex_unlock(&g_reload_requests_mutex);
+  return req.result;
+}
+
+static ReloadRequest *take_reload_requests(bool stop_accepting) {
+  mutex_lock(&g_reload_requests_mutex);
+  ReloadRequest *reqs = g_reload_requests_head;
+  g_reload_requests_head = g_reload_requests_tail = NULL;
+  if (stop_accepting)
+    g_reload_requests_accepted = false;
+  mutex_unlock(&g_reload_requests_mutex);
+  return reqs;
+}
+
+static void finish_reload_requests(ReloadRequest *reqs, bool reload) {
+  while (reqs) {
+    ReloadRequest *next = reqs->next;
+    finish_reload_request(reqs,
+                          reload ? reload_module_bytecode(reqs->path) : -1);
+    reqs = next;
+  }
+}
+
+static void *reload_thread_func(void *data) {
+  (void)data;
+  for (;;) {
+    struct pollfd pfds[] = {{.fd = g_reload_pipe[0], .events = POLLIN},
+                            {.fd = g_shutdown_pipe[0], .events = POLLIN}};
+    int r = poll(pfds, 2, -1);
+    if (atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire))
+      break;
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      jsockd_logf(LOG_ERROR, "poll failed in reload thread: %s\n",
+                  strerror(errno));
+      break;
+    }
+    if (!(pfds[0].revents & POLLIN))
+      continue;
+
+    // Several signals in quick succession need only one reload.
+    char buf[64];
+    ssize_t n;
+    bool sighup = false;
+    while ((n = read(g_reload_pipe[0], buf, sizeof(buf))) > 0)
+      sighup = sighup || memchr(buf, RELOAD_PIPE_SIGHUP, (size_t)n);
+    finish_reload_requests(take_reload_requests(false), true);
+    if (!sighup)
+      continue;
+    if (!g_cmd_args.es6_module_bytecode_file) {
+      jsockd_log(LOG_WARN, "Ignoring SIGHUP as no module bytecode file was "
+                           "given (-m)\n");
+      continue;
+    }
+    jsockd_log(LOG_INFO, "SIGHUP received, reloading module bytecode\n");
+    reload_module_bytecode(g_cmd_args.es6_module_bytecode_file);
+  }
+  finish_reload_requests(take_reload_requests(true), false);
+  jsockd_log(LOG_DEBUG, "Reload thread terminating...\n");
+  return NULL;
+}
+
+static int start_reload_thread(void) {
+  // The scratch runtime in reload_module_bytecode needs as much stack as the
+  // runtime threads.
+  pthread_attr_t attr;
+  if (0 != pthread_attr_init(&attr)) {
+    jsockd_logf(LOG_ERROR, "pthread_attr_init failed: %s\n", strerror(errno));
+    return -1;
+  }
+  mutex_lock(&g_reload_requests_mutex);
+  g_reload_requests_accepted = true;
+  mutex_unlock(&g_reload_requests_mutex);
+  int r = pthread_attr_setstacksize(&attr, QUICKS_THREAD_STACK_SIZE);
+  if (r == 0)
+    r = pthread_create(&g_reload_thread, &attr, reload_thread_func, NULL);
+  pthread_attr_destroy(&attr); // can fail, but no point in checking
+  if (r != 0) {
+    jsockd_logf(LOG_ERROR, "Error creating reload thread: %s\n", strerror(r));
+    finish_reload_requests(take_reload_requests(true), false);
+    return -1;
+  }
+  g_reload_thread_started = true;
+  return 0;
+}
+
+// Must be called after g_interrupted_or_error has been set.
+static void stop_reload_thread(void) {
+  if (!g_reload_thread_started)
+    return;
+  if (0 != pthread_join(g_reload_thread, NULL))
+    jsockd_logf(LOG_ERROR, "Error joining reload thread: %s\n",
+                strerror(errno));
+  g_reload_thread_started = false;
+}
+
 static void global_cleanup(void) {
-  for (size_t i = 0; i < CACHED_FUNCTIONS_N_BUCKETS; ++i)
-    free((void *)g_cached_function_buckets[i].payload.bytecode);
+  if (g_cached_function_buckets) {
+    for (size_t i = 0; i < CACHED_FUNCTIONS_N_BUCKETS; ++i)
+      free_cached_function_bytecode(&g_cached_function_buckets[i].payload);
+    free(g_cached_function_buckets);
+    g_cached_function_buckets = NULL;
+  }
+
+  // The set owns the module bytecode's mapping.
+  unref_named_commands_set(g_named_commands);
+  g_named_commands = NULL;
+  g_module_bytecode = NULL;
+  g_module_bytecode_size = 0;
 
   // These can fail, but we're calling this when
   // we're about to exit, so there is no useful error
   // handling to be done.
   wait_group_destroy(&g_thread_ready_wait_group);
 
-  if (g_module_bytecode_size != 0 && g_module_bytecode)
-    munmap_or_warn((void *)g_module_bytecode,
-                   g_module_bytecode_size + ED25519_SIGNATURE_SIZE);
   if (g_source_map_size != 0 && g_source_map)
     munmap_or_warn((void *)g_source_map, g_source_map_size);
+  free((void *)atomic_load_explicit(&g_startup_report, memory_order_acquire));
 }
 
 static void SIGINT_and_SIGTERM_handler(int sig) {
@@ -1079,7 +2302,7 @@ static void SIGINT_and_SIGTERM_handler(int sig) {
     return;
 
   atomic_store_explicit(&g_sig_triggered, sig, memory_order_release);
-  atomic_store_explicit(&g_interrupted_or_error, true, memory_order_release);
+  set_interrupted_or_error();
 }
 
 static void log_to_stderr(const char *fmt, ...) {
@@ -1188,13 +2411,195 @@ cleanup:
   return exit_status;
 }
 
+// The exit status following a clean shutdown, which depends on the signal (if
+// any) that triggered it.
+static int exit_status_after_shutdown(void) {
+  int sig = atomic_load_explicit(&g_sig_triggered, memory_order_acquire);
+  if (!g_interactive_logging_mode && (sig == SIGINT || sig == SIGTERM)) {
+    jsockd_logf(LOG_INFO, "Exiting after %s received\n",
+                sig == SIGINT ? "SIGINT" : "SIGTERM");
+  }
+
+  if (sig != 0 && sig != SIGTERM)
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+// Each runtime thread creates its runtime and loads the module before it's
+// ready. The threads do this in parallel, so the time allowed grows with the
+// size of the module and the number of runtimes that each CPU has to create.
+static uint64_t thread_ready_timeout_ns(int n_threads) {
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_cpus < 1)
+    n_cpus = 1;
+  uint64_t rounds = ((uint64_t)n_threads + (uint64_t)n_cpus - 1) / n_cpus;
+  uint64_t module_mib = g_module_bytecode_size / (1024 * 1024) + 1;
+  uint64_t ms = READY_TIMEOUT_BASE_MS +
+                rounds * module_mib * READY_TIMEOUT_PER_MODULE_MIB_MS;
+  return MIN(ms, READY_TIMEOUT_MAX_MS) * 1000000ULL;
+}
+
+// In prefork mode (-f), the parent process initializes this runtime, and each
+// worker process starts with a copy-on-write copy of it.
+static ThreadState g_prefork_template;
+
+static int create_prefork_template(void) {
+  if (0 != init_thread_state(&g_prefork_template, NULL, 0)) {
+    cleanup_thread_state(&g_prefork_template);
+    return -1;
+  }
+  // Otherwise each worker would collect the garbage left over from loading
+  // the module, touching (and so copying) pages that it could have shared.
+  JS_RunGC(g_prefork_template.rt);
+  return 0;
+}
+
+// The workers are forked with the report already published, so it describes
+// the parent's startup up to the point where the template runtime was ready.
+static int create_startup_prefork_template(void) {
+  if (0 != create_prefork_template())
+    return -1;
+  record_startup_timing(&g_prefork_template);
+  publish_startup_report();
+  return 0;
+}
+
+// 'data' points to the time allowed for the workers to become ready.
+static int run_prefork_worker(int worker_index, void *data) {
+  uint64_t ready_timeout_ns = *(const uint64_t *)data;
+  // SIGHUP must wake this worker's reload thread rather than the parent.
+  close(g_reload_pipe[0]);
+  close(g_reload_pipe[1]);
+  if (0 != self_pipe_init(g_reload_pipe)) {
+    jsockd_logf(LOG_ERROR, "Error creating reload pipe: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  ThreadState *ts = &g_thread_states[worker_index];
+  memcpy(ts, &g_prefork_template, sizeof(*ts));
+  rebind_thread_state(ts, &g_socket_states[worker_index], worker_index);
+
+  pthread_t thread;
+  if (0 != start_listen_thread(ts, &thread)) {
+    destroy_thread_state(ts);
+    return EXIT_FAILURE;
+  }
+  start_disk_cache_writer();
+  if (0 != wait_group_timed_wait(&g_thread_ready_wait_group,
+                                 ready_timeout_ns)) {
+    jsockd_logf(LOG_ERROR,
+                "Error waiting for worker %i to be ready, or timeout\n",
+                worker_index);
+    set_interrupted_or_error();
+  }
+  if (!atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire) &&
+      0 == start_reload_thread())
+    prefork_worker_ready();
+  else
+    set_interrupted_or_error();
+
+  if (0 != pthread_join(thread, NULL))
+    jsockd_logf(LOG_ERROR, "Error joining thread %i: %s\n", worker_index,
+                strerror(errno));
+  else if (REPLACEMENT_THREAD_STATE_NONE !=
+           atomic_load_explicit(&ts->replacement_thread_state,
+                                memory_order_acquire))
+    pthread_join(ts->replacement_thread, NULL);
+  stop_reload_thread();
+  stop_disk_cache_writer();
+
+  int exit_status = ts->exit_status;
+  destroy_thread_state(ts);
+  if (exit_status != 0)
+    return EXIT_FAILURE;
+  return exit_status_after_shutdown();
+}
+
+static void on_prefork_ready(void *data) {
+  (void)data;
+  log_startup_report();
+  printf("READY %i %s\n",
+         atomic_load_explicit(&g_n_threads, memory_order_relaxed),
+         STRINGIFY(VERSION));
+  fflush(stdout);
+}
+
+// Called in the parent on SIGHUP. Workers forked from now on start with the new
+// module, and the existing workers then reload it themselves.
+static int reload_prefork_template(void *data) {
+  (void)data;
+  if (!g_cmd_args.es6_module_bytecode_file) {
+    jsockd_log(LOG_WARN, "Ignoring SIGHUP as no module bytecode file was "
+                         "given (-m)\n");
+    return -1;
+  }
+  jsockd_log(LOG_INFO, "SIGHUP received, reloading module bytecode\n");
+  if (0 != reload_module_bytecode(g_cmd_args.es6_module_bytecode_file))
+    return -1;
+  ThreadState old_template = g_prefork_template;
+  if (0 != create_prefork_template()) {
+    jsockd_log(LOG_ERROR, "Error creating runtime for reloaded module\n");
+    g_prefork_template = old_template;
+    return -1;
+  }
+  cleanup_thread_state(&old_template);
+  return 0;
+}
+
+static int run_prefork(int n_workers) {
+  for (int i = 0; i < n_workers; ++i) {
+    g_thread_state_input_buffers[i] = calloc(INPUT_BUF_BYTES, sizeof(char));
+    init_socket_state(&g_socket_states[i], g_cmd_args.socket_path[i]);
+  }
+
+  int r = -1;
+  if (0 != create_startup_prefork_template()) {
+    jsockd_log(LOG_ERROR, "Error initializing runtime for worker processes\n");
+  } else {
+    // The workers start at the same time, so they're allowed as long as the
+    // same number of runtime threads would be.
+    uint64_t ready_timeout_ns = thread_ready_timeout_ns(n_workers);
+    PreforkConfig config = {
+        .n_workers = n_workers,
+        .run_worker = run_prefork_worker,
+        .on_ready = on_prefork_ready,
+        .on_reload = reload_prefork_template,
+        .reload_fd = g_reload_pipe[0],
+        .ready_timeout_ms = (int)(ready_timeout_ns / 1000000),
+        .data = &ready_timeout_ns};
+    r = prefork_run(&config);
+    cleanup_thread_state(&g_prefork_template);
+  }
+
+  for (int i = 0; i < n_workers; ++i) {
+    cleanup_socket_state(&g_socket_states[i]);
+    free(g_thread_state_input_buffers[i]);
+  }
+  global_cleanup();
+  free(g_thread_states);
+  free(g_threads);
+  free(g_socket_states);
+  if (r != 0)
+    return EXIT_FAILURE;
+  return exit_status_after_shutdown();
+}
+
 int main(int argc, char **argv) {
   struct sigaction sa = {.sa_handler = SIGINT_and_SIGTERM_handler};
   sigaction(SIGINT, &sa, NULL);
   sigaction(SIGTERM, &sa, NULL);
 
+  if (0 != clock_gettime(MONOTONIC_CLOCK, &g_start_time))
+    memset(&g_start_time, 0, sizeof(g_start_time));
+
   set_log_prefix();
 
+  if (0 != shutdown_pipe_init()) {
+    jsockd_logf(LOG_ERROR, "Error creating shutdown pipe: %s\n",
+                strerror(errno));
+    return EXIT_FAILURE;
+  }
+
   if (0 != parse_cmd_args(argc, argv, log_to_stderr, &g_cmd_args)) {
     return EXIT_FAILURE;
   }
@@ -1207,8 +2612,7 @@ int main(int argc, char **argv) {
   if (hash_bits_override != NULL && hash_bits_override[0] != '\0') {
     char *endptr;
     long v = strtol(hash_bits_override, &endptr, 10);
-    if (*endptr != '\0' || v < 1 || v > 64 ||
-        v > CACHED_FUNCTIONS_HASH_BITS_DEBUG || v > INT_MAX) {
+    if (*endptr != '\0' || v < 1 || v > MAX_CACHED_FUNCTIONS_HASH_BITS) {
       jsockd_logf(LOG_ERROR | LOG_INTERACTIVE,
                   "Invalid JSOCKD_DEBUG_HASH_BITS_OVERRIDE "
                   "value: %s\n",
@@ -1239,18 +2643,20 @@ int main(int argc, char **argv) {
   if (g_cmd_args.mod_to_compile) {
     return compile_module_file(
         g_cmd_args.mod_to_compile, g_cmd_args.private_key_file,
-        g_cmd_args.mod_output_file, STRINGIFY(VERSION), strip_flags);
+        g_cmd_args.commands_manifest_file, g_cmd_args.mod_output_file,
+        STRINGIFY(VERSION), strip_flags);
   }
 
   if (g_cmd_args.key_file_prefix)
     return output_key_file(g_cmd_args.key_file_prefix);
 
-  if (g_cmd_args.es6_module_bytecode_file) {
-    g_module_bytecode = load_module_bytecode(
-        g_cmd_args.es6_module_bytecode_file, &g_module_bytecode_size);
-    if (g_module_bytecode == NULL)
-      return EXIT_FAILURE;
+  if (0 != self_pipe_init(g_reload_pipe)) {
+    jsockd_logf(LOG_ERROR, "Error creating reload pipe: %s\n", strerror(errno));
+    return EXIT_FAILURE;
   }
+  struct sigaction hup_sa = {.sa_handler = SIGHUP_handler,
+                             .sa_flags = SA_RESTART};
+  sigaction(SIGHUP, &hup_sa, NULL);
 
   if (g_cmd_args.source_map_file) {
     int mmap_errno;
@@ -1263,80 +2669,141 @@ int main(int argc, char **argv) {
     }
   }
 
-  int n_threads = MIN(g_cmd_args.n_sockets, MAX_THREADS);
-  atomic_store_explicit(&g_n_threads, g_cmd_args.n_sockets,
-                        memory_order_relaxed);
+  // In shared-listener mode, the number of runtimes is independent of the
+  // number of sockets. With an elastic pool, a thread is started for each
+  // potential runtime, but runtimes beyond the minimum are created only when
+  // needed.
+  int n_threads = g_cmd_args.n_shared_runtimes != 0
+                      ? g_cmd_args.max_shared_runtimes
+                      : MIN(g_cmd_args.n_sockets, MAX_THREADS);
+  atomic_store_explicit(&g_n_threads, n_threads, memory_order_relaxed);
+
+  if (g_cmd_args.cpu_affinity_auto) {
+    // Spread the runtime threads over the CPUs in ascending order. Hyperthread
+    // siblings are usually numbered after all the physical cores, so they're
+    // used only once each core has a runtime thread.
+    int n = cpu_affinity_allowed_cpus(g_cmd_args.cpu_affinity, MAX_THREADS);
+    if (n <= 0)
+      jsockd_logf(LOG_WARN, "Error getting CPU affinity; ignoring -a: %s\n",
+                  strerror(errno));
+    else
+      g_cmd_args.n_cpu_affinity = n;
+  }
 
   g_thread_states = calloc(n_threads, sizeof(ThreadState));
   memset(g_thread_states, 0, sizeof(ThreadState) * n_threads);
   g_threads = calloc(n_threads, sizeof(pthread_t));
   g_socket_states = calloc(n_threads, sizeof(SocketState));
 
-  if (0 != wait_group_init(&g_thread_ready_wait_group, n_threads)) {
+  if (0 != init_cached_functions() || 0 != init_disk_cache())
+    goto cleanup_on_error;
+
+  // In prefork mode, each worker process waits for its one runtime thread.
+  if (0 != wait_group_init(&g_thread_ready_wait_group,
+                           g_cmd_args.prefork ? 1 : n_threads)) {
     jsockd_logf(LOG_ERROR, "Error initializing wait group: %s\n",
                 strerror(errno));
-    if (g_module_bytecode_size != 0 && g_module_bytecode)
-      munmap_or_warn((void *)g_module_bytecode,
-                     g_module_bytecode_size + ED25519_SIGNATURE_SIZE);
     goto cleanup_on_error;
   }
 
+  if (g_cmd_args.prefork) {
+    if (0 != load_module_bytecode_file())
+      goto cleanup_on_error;
+    // Loaded before forking so that the workers share the pages.
+    load_disk_cache();
+    return run_prefork(n_threads);
+  }
+
+  if (g_cmd_args.n_shared_runtimes != 0 && 0 != start_dispatcher()) {
+    cleanup_listener_socket_states();
+    goto cleanup_on_error;
+  }
+
+  // The runtime threads create their runtimes in parallel, and in parallel
+  // with the verification of the module bytecode. Holding the lock makes them
+  // wait for the module before loading it (see init_thread_state).
+  rwlock_wrlock(&g_module_bytecode_lock);
+  // Set if startup fails once the runtime threads are running. They're then
+  // shut down and joined in the usual way.
+  bool startup_failed = false;
   int thread_init_n = 0;
   for (thread_init_n = 0; thread_init_n < n_threads; ++thread_init_n) {
     jsockd_logf(LOG_DEBUG, "Creating thread %i\n", thread_init_n);
     g_thread_state_input_buffers[thread_init_n] =
         calloc(INPUT_BUF_BYTES, sizeof(char));
     init_socket_state(&g_socket_states[thread_init_n],
-                      g_cmd_args.socket_path[thread_init_n]);
-    if (0 != init_thread_state(&g_thread_states[thread_init_n],
-                               &g_socket_states[thread_init_n],
-                               thread_init_n)) {
+                      g_cmd_args.n_shared_runtimes != 0
+                          ? g_cmd_args.socket_path[0]
+                          : g_cmd_args.socket_path[thread_init_n]);
+    // The thread creates its own runtime (see init_runtime_thread).
+    if (0 != init_thread_state_without_runtime(&g_thread_states[thread_init_n],
+                                               &g_socket_states[thread_init_n],
+                                               thread_init_n) ||
+        0 != start_listen_thread(&g_thread_states[thread_init_n],
+                                 &g_threads[thread_init_n])) {
       jsockd_logf(LOG_ERROR, "Error initializing thread %i\n", thread_init_n);
-      if (g_module_bytecode_size != 0 && g_module_bytecode)
-        munmap_or_warn((void *)g_module_bytecode,
-                       g_module_bytecode_size + ED25519_SIGNATURE_SIZE);
-      goto thread_init_error;
-    }
-    register_thread_state_runtime(g_thread_states[thread_init_n].rt,
-                                  &g_thread_states[thread_init_n]);
-    pthread_attr_t attr;
-    if (0 != pthread_attr_init(&attr)) {
-      jsockd_logf(LOG_ERROR, "pthread_attr_init failed: %s\n", strerror(errno));
-      goto thread_init_error;
-    }
-    if (0 != pthread_attr_setstacksize(&attr, QUICKS_THREAD_STACK_SIZE)) {
-      jsockd_logf(LOG_ERROR, "pthread_attr_setstacksize failed: %s\n",
-                  strerror(errno));
-      pthread_attr_destroy(&attr); // can fail, but no point in
-                                   // checking
-      goto thread_init_error;
-    }
-    if (0 != pthread_create(&g_threads[thread_init_n], &attr,
-                            listen_thread_func,
-                            &g_thread_states[thread_init_n])) {
-      jsockd_logf(LOG_ERROR, "pthread_create failed; exiting: %s",
-                  strerror(errno));
-      pthread_attr_destroy(&attr); // can fail, but no point in
-                                   // checking
-      goto thread_init_error;
+      free(g_thread_state_input_buffers[thread_init_n]);
+      destroy_thread_state(&g_thread_states[thread_init_n]);
+      break;
     }
-    pthread_attr_destroy(&attr); // can fail, but no point in checking
   }
-
-  // Wait for all threads to be ready
-  if (0 != wait_group_timed_wait(&g_thread_ready_wait_group,
-                                 10000000000 /* 10 sec in ns */)) {
+  if (thread_init_n < n_threads) {
+    // Only the threads already started are joined below.
+    startup_failed = true;
+    set_interrupted_or_error();
+    atomic_store_explicit(&g_n_threads, thread_init_n, memory_order_relaxed);
+  }
+
+  // If the module fails verification, the runtime threads fail to initialize
+  // once the lock is released, and are joined below.
+  if (!atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire) &&
+      0 != load_module_bytecode_file())
+    set_interrupted_or_error();
+  rwlock_unlock(&g_module_bytecode_lock);
+  if (!atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire)) {
+    load_disk_cache();
+    start_disk_cache_writer();
+  }
+
+  // Wait for all threads to be ready. Threads that haven't started don't
+  // count towards the wait group, so there's no waiting for them.
+  if (thread_init_n == n_threads &&
+      0 != wait_group_timed_wait(&g_thread_ready_wait_group,
+                                 thread_ready_timeout_ns(n_threads))) {
     jsockd_logf(LOG_ERROR,
                 "Error waiting for threads to be "
                 "ready, or timeout; "
                 "n_remaining=%i\n",
                 wait_group_n_remaining(&g_thread_ready_wait_group));
-    goto thread_init_error;
+    // The threads are still running, so they're shut down and joined below.
+    startup_failed = true;
+    set_interrupted_or_error();
+  }
+
+  // A runtime thread that fails to create its runtime sets
+  // g_interrupted_or_error, and is then joined below like the others.
+  if (!atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire) &&
+      0 != start_reload_thread()) {
+    startup_failed = true;
+    set_interrupted_or_error();
+  }
+  if (!atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire)) {
+    // Started once the runtime threads are ready, so as not to slow down their
+    // startup. Pinned threads create their own runtimes, so that the runtime's
+    // memory is local to the thread, and have no use for spares.
+    if (g_cmd_args.n_spare_runtimes != 0 && cpu_affinity_requested())
+      jsockd_log(LOG_WARN, "-p has no effect with -a\n");
+    else if (g_cmd_args.n_spare_runtimes != 0 &&
+             0 != spare_pool_start(g_cmd_args.n_spare_runtimes))
+      // Runtimes are then created on demand, as without -p.
+      jsockd_log(LOG_WARN, "Continuing without spare runtimes\n");
+
+    publish_startup_report();
+    log_startup_report();
+    printf("READY %i %s\n", n_threads, STRINGIFY(VERSION));
+    fflush(stdout);
   }
 
-  printf("READY %i %s\n", n_threads, STRINGIFY(VERSION));
-  fflush(stdout);
-
   for (int i = 0; i < atomic_load_explicit(&g_n_threads, memory_order_relaxed);
        ++i) {
     if (0 != pthread_join(g_threads[i], NULL)) {
@@ -1358,6 +2825,13 @@ int main(int argc, char **argv) {
     }
   }
 
+  // The reload thread may be holding records, which it hands back to the
+  // dispatcher before it exits.
+  stop_reload_thread();
+  stop_dispatcher();
+  spare_pool_stop();
+  stop_disk_cache_writer();
+
   jsockd_log(LOG_DEBUG, "All threads joined\n");
 
   for (int i = 0; i < atomic_load_explicit(&g_n_threads, memory_order_relaxed);
@@ -1365,6 +2839,7 @@ int main(int argc, char **argv) {
     destroy_thread_state(&g_thread_states[i]);
     free(g_thread_state_input_buffers[i]);
   }
+  cleanup_listener_socket_states();
   jsockd_log(LOG_DEBUG, "All thread states destroyed\n");
 
   global_cleanup();
@@ -1386,22 +2861,11 @@ int main(int argc, char **argv) {
     if (g_thread_states[i].exit_status != 0)
       return EXIT_FAILURE;
   }
-
-  int sig = atomic_load_explicit(&g_sig_triggered, memory_order_acquire);
-  if (!g_interactive_logging_mode && (sig == SIGINT || sig == SIGTERM)) {
-    jsockd_logf(LOG_INFO, "Exiting after %s received\n",
-                sig == SIGINT ? "SIGINT" : "SIGTERM");
-  }
-
-  if (sig != 0 && sig != SIGTERM)
+  if (startup_failed)
     return EXIT_FAILURE;
-  return EXIT_SUCCESS;
 
-thread_init_error:
-  for (int i = 0; i <= thread_init_n; ++i) {
-    free(g_thread_state_input_buffers[i]);
-    destroy_thread_state(&g_thread_states[i]);
-  }
+  return exit_status_after_shutdown();
+
 cleanup_on_error:
   global_cleanup();
   free(g_thread_states);
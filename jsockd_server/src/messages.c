@@ -1,11 +1,15 @@
 #include "config.h"
+#include "dispatch.h"
 #include "globals.h"
 #include "log.h"
+#include "messages.h"
+#include "quickjs-libc.h"
 #include "quickjs.h"
 #include "threadstate.h"
 #include "utils.h"
 #include <errno.h>
 #include <inttypes.h>
+#include <string.h>
 #include <unistd.h>
 
 static size_t split_uuid(const char *msg, size_t len) {
@@ -50,37 +54,129 @@ static const char *send_message_error_to_string(int err) {
   }
 }
 
-static int send_message(JSRuntime *rt, const char *message, size_t message_len,
-                        JSValue *result) {
+static int check_message_response_timeout(ThreadState *ts) {
+  struct timespec now;
+  if (0 != clock_gettime(MONOTONIC_CLOCK, &now)) {
+    jsockd_log(LOG_ERROR,
+               "Error getting time in handle_line_3_parameter [2]\n");
+    return SEND_MESSAGE_ERR_TIME;
+  }
+  int64_t delta_ns = ns_time_diff(&now, &ts->last_js_execution_start);
+  if (delta_ns > 0 &&
+      (uint64_t)delta_ns > g_cmd_args.max_command_runtime_us * 1000ULL) {
+    jsockd_logf(LOG_WARN,
+                "Command runtime of %lli us exceeded %" PRIu64
+                "us while waiting for %.*s message response; interrupting\n",
+                delta_ns / 1000LL, g_cmd_args.max_command_runtime_us,
+                (int)ts->current_uuid_len, ts->current_uuid);
+    return SEND_MESSAGE_ERR_TIMEOUT;
+  }
+  if (command_deadline_passed(ts, &now)) {
+    jsockd_logf(LOG_WARN,
+                "Command deadline passed while waiting for %.*s message "
+                "response; interrupting\n",
+                (int)ts->current_uuid_len, ts->current_uuid);
+    return SEND_MESSAGE_ERR_TIMEOUT;
+  }
+  return 0;
+}
+
+// In shared-listener mode, the dispatcher thread reads the message response
+// from the socket (along with any pipelined commands that precede it) and
+// passes it over via the record's mailbox.
+static int wait_for_dispatched_response(ThreadState *ts, Record *record,
+                                        int polling_interval_ms,
+                                        size_t *total_read,
+                                        bool more_expected) {
+  for (;;) {
+    switch (record_wait_for_reply(record, ts->input_buf, INPUT_BUF_BYTES - 1,
+                                  total_read, polling_interval_ms,
+                                  more_expected)) {
+    case REPLY_RECEIVED:
+      return 0;
+    case REPLY_TOO_BIG:
+      return SEND_MESSAGE_ERR_TOO_BIG;
+    case REPLY_AWAITED:
+      break;
+    case REPLY_EOF:
+    case REPLY_NONE:
+      jsockd_logf(LOG_ERROR,
+                  "Connection fd=%i closed while waiting for message "
+                  "response\n",
+                  record->conn->fd);
+      return SEND_MESSAGE_ERR_IO;
+    }
+
+    if (atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire)) {
+      record_cancel_reply(record);
+      return SEND_MESSAGE_ERR_INTERRUPTED;
+    }
+    int timeout_r = check_message_response_timeout(ts);
+    if (timeout_r != 0) {
+      record_cancel_reply(record);
+      return timeout_r;
+    }
+  }
+}
+
+// 1us = 1000ns, so this sets the polling interval to be 1% of the max command
+// runtime, with a minimum of 1ns.
+static uint64_t message_polling_interval_ns(void) {
+  return MAX(1, g_cmd_args.max_command_runtime_us * 10ULL);
+}
+
+// 'type' is the response type with surrounding spaces (" message " or
+// " messages ").
+static int send_message(JSRuntime *rt, const char *type, const char *message,
+                        size_t message_len, JSValue *result) {
   const char term = '\n';
   ThreadState *ts = get_runtime_thread_state(rt);
 
   *result = JS_UNDEFINED;
 
+  // The response may arrive as soon as the message is written, so it must be
+  // expected before then.
+  Record *record = ts->socket_state->record;
+  if (record)
+    record_expect_reply(record, ts->current_uuid, ts->current_uuid_len);
+
   struct iovec msgvecs[] = {
       {.iov_base = (void *)ts->current_uuid, .iov_len = ts->current_uuid_len},
-      STRCONST_IOVEC(" message "),
+      {.iov_base = (void *)type, .iov_len = strlen(type)},
       {.iov_base = (void *)message, .iov_len = message_len},
       {.iov_base = (void *)&term, .iov_len = sizeof(char)},
   };
-  if (writev_all(ts->socket_state->streamfd, msgvecs,
-                 sizeof(msgvecs) / sizeof(msgvecs[0])) < 0) {
+  if (record)
+    mutex_lock(&record->conn->write_mutex);
+  int wr = writev_all(ts->socket_state->streamfd, msgvecs,
+                      sizeof(msgvecs) / sizeof(msgvecs[0]));
+  if (record)
+    mutex_unlock(&record->conn->write_mutex);
+  if (wr < 0) {
     jsockd_logf(LOG_ERROR, "Error writing message to socket: %s\n",
                 strerror(errno));
+    if (record)
+      record_cancel_reply(record);
     return SEND_MESSAGE_ERR_IO;
   }
 
   size_t total_read = 0;
   bool too_big = false;
 
-  // 1us = 1000ns, so this sets the polling interval to be 1% of the max command
-  // runtime, with a minimum of 1ns.
-  uint64_t polling_interval_ns =
-      MAX(1, g_cmd_args.max_command_runtime_us * 10ULL);
+  uint64_t polling_interval_ns = message_polling_interval_ns();
   struct timespec polling_interval = {
       .tv_sec = polling_interval_ns / (1000000ULL * 1000ULL),
       .tv_nsec = MAX(1, polling_interval_ns % (1000000ULL * 1000ULL))};
 
+  if (record) {
+    int r = wait_for_dispatched_response(
+        ts, record, MAX(1, (int)(polling_interval_ns / 1000000ULL)),
+        &total_read, false);
+    if (r != 0)
+      return r;
+    goto read_done;
+  }
+
   for (;;) {
   read_loop:
     switch (ppoll_fd(ts->socket_state->streamfd, &polling_interval)) {
@@ -111,23 +207,9 @@ static int send_message(JSRuntime *rt, const char *message, size_t message_len,
     } break;
     }
 
-    // check for timeout condition
-    struct timespec now;
-    if (0 != clock_gettime(MONOTONIC_CLOCK, &now)) {
-      jsockd_log(LOG_ERROR,
-                 "Error getting time in handle_line_3_parameter [2]\n");
-      return SEND_MESSAGE_ERR_TIME;
-    }
-    int64_t delta_ns = ns_time_diff(&now, &ts->last_js_execution_start);
-    if (delta_ns > 0 &&
-        (uint64_t)delta_ns > g_cmd_args.max_command_runtime_us * 1000ULL) {
-      jsockd_logf(LOG_WARN,
-                  "Command runtime of %lli us exceeded %" PRIu64
-                  "us while waiting for %.*s message response; interrupting\n",
-                  delta_ns / 1000LL, g_cmd_args.max_command_runtime_us,
-                  (int)ts->current_uuid_len, ts->current_uuid);
-      return SEND_MESSAGE_ERR_TIMEOUT;
-    }
+    int timeout_r = check_message_response_timeout(ts);
+    if (timeout_r != 0)
+      return timeout_r;
   }
 
 read_done:
@@ -185,6 +267,269 @@ read_done:
   return 0;
 }
 
+// Messages sent by JSockD.sendMessageAsync have the form
+//
+//     <id> async_message <n> <json>
+//
+// where <n> identifies the message within the command. The client may send
+// the responses in any order, each with '<id> <n>' as its first line.
+static int send_async_message(ThreadState *ts, uint32_t n,
+                              const char *message, size_t message_len) {
+  const char term = '\n';
+  char n_str[16];
+  int n_len = snprintf(n_str, sizeof(n_str), " %" PRIu32 " ", n);
+
+  Record *record = ts->socket_state->record;
+  if (record)
+    record_expect_reply(record, ts->current_uuid, ts->current_uuid_len);
+
+  struct iovec msgvecs[] = {
+      {.iov_base = (void *)ts->current_uuid, .iov_len = ts->current_uuid_len},
+      STRCONST_IOVEC(" async_message"),
+      {.iov_base = (void *)n_str, .iov_len = (size_t)n_len},
+      {.iov_base = (void *)message, .iov_len = message_len},
+      {.iov_base = (void *)&term, .iov_len = sizeof(char)},
+  };
+  if (record)
+    mutex_lock(&record->conn->write_mutex);
+  int wr = writev_all(ts->socket_state->streamfd, msgvecs,
+                      sizeof(msgvecs) / sizeof(msgvecs[0]));
+  if (record)
+    mutex_unlock(&record->conn->write_mutex);
+  if (wr < 0) {
+    jsockd_logf(LOG_ERROR, "Error writing async message to socket: %s\n",
+                strerror(errno));
+    return SEND_MESSAGE_ERR_IO;
+  }
+  return 0;
+}
+
+static int parse_async_message_n(ThreadState *ts, const char *id,
+                                 size_t id_len, uint32_t *n) {
+  size_t uuid_len = ts->current_uuid_len;
+  if (id_len < uuid_len + 2 || id[uuid_len] != ' ' ||
+      0 != memcmp(id, ts->current_uuid, uuid_len))
+    return -1;
+  uint64_t v = 0;
+  for (size_t i = uuid_len + 1; i < id_len; ++i) {
+    if (id[i] < '0' || id[i] > '9')
+      return -1;
+    v = v * 10 + (uint64_t)(id[i] - '0');
+    if (v > UINT32_MAX)
+      return -1;
+  }
+  *n = (uint32_t)v;
+  return 0;
+}
+
+// Resolves (or rejects) the promise of the async message that 'id' ('<id>
+// <n>') refers to. 'json' is followed by a separator byte, which is
+// temporarily overwritten.
+static int settle_async_message(ThreadState *ts, const char *id,
+                                size_t id_len, char *json, size_t json_len) {
+  uint32_t n;
+  int i = 0;
+  if (0 == parse_async_message_n(ts, id, id_len, &n)) {
+    for (; i < ts->n_async_messages; ++i) {
+      if (ts->async_messages[i].n == n)
+        break;
+    }
+  }
+  if (i == ts->n_async_messages) {
+    jsockd_logf(LOG_DEBUG,
+                "Error parsing async message response, unexpected ID %.*s\n",
+                (int)id_len, id);
+    return SEND_MESSAGE_ERR_BAD_MESSAGE;
+  }
+
+  JSContext *ctx = ts->ctx;
+  AsyncMessage *m = &ts->async_messages[i];
+  JSValue val;
+  bool ok = false;
+  if (json_len == strlen("internal_error") &&
+      0 == memcmp(json, "internal_error", json_len)) {
+    JS_ThrowInternalError(ctx, "Error sending message via JSockD: %s",
+                          send_message_error_to_string(
+                              SEND_MESSAGE_ERR_HANDLER_INTERNAL_ERROR));
+    val = JS_GetException(ctx);
+  } else {
+    char saved = json[json_len];
+    json[json_len] = '\0';
+    val = JS_ParseJSON(ctx, json, json_len, "<message>");
+    json[json_len] = saved;
+    if (JS_IsException(val))
+      val = JS_GetException(ctx);
+    else
+      ok = true;
+  }
+  JSValue r = JS_Call(ctx, m->resolving_funcs[ok ? 0 : 1], JS_UNDEFINED, 1,
+                      &val);
+  JS_FreeValue(ctx, r);
+  JS_FreeValue(ctx, val);
+  JS_FreeValue(ctx, m->resolving_funcs[0]);
+  JS_FreeValue(ctx, m->resolving_funcs[1]);
+  *m = ts->async_messages[--ts->n_async_messages];
+  return 0;
+}
+
+// Settles the async messages whose responses are complete in 'buf'. Sets
+// '*consumed' to the number of bytes used.
+static int settle_async_messages(ThreadState *ts, char *buf, size_t len,
+                                 size_t *consumed) {
+  const char sep = g_cmd_args.socket_sep_char;
+  size_t pos = 0;
+  for (;;) {
+    char *id = buf + pos;
+    char *id_end = memchr(id, sep, len - pos);
+    if (!id_end)
+      break;
+    char *json = id_end + 1;
+    char *json_end = memchr(json, sep, (size_t)(buf + len - json));
+    if (!json_end)
+      break;
+    int r = settle_async_message(ts, id, (size_t)(id_end - id), json,
+                                 (size_t)(json_end - json));
+    if (r != 0)
+      return r;
+    pos = (size_t)(json_end + 1 - buf);
+  }
+  *consumed = pos;
+  return 0;
+}
+
+static int read_async_responses(ThreadState *ts) {
+  uint64_t polling_interval_ns = message_polling_interval_ns();
+  struct timespec polling_interval = {
+      .tv_sec = polling_interval_ns / (1000000ULL * 1000ULL),
+      .tv_nsec = MAX(1, polling_interval_ns % (1000000ULL * 1000ULL))};
+
+  for (;;) {
+    switch (ppoll_fd(ts->socket_state->streamfd, &polling_interval)) {
+    case GO_AROUND:
+      break;
+    case SIG_INTERRUPT_OR_ERROR:
+      return SEND_MESSAGE_ERR_INTERRUPTED;
+    case READY: {
+      if (ts->async_response_bytes == INPUT_BUF_BYTES - 1)
+        return SEND_MESSAGE_ERR_TOO_BIG;
+      ssize_t r = read(ts->socket_state->streamfd,
+                       ts->input_buf + ts->async_response_bytes,
+                       INPUT_BUF_BYTES - 1 - ts->async_response_bytes);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0) {
+        jsockd_logf(LOG_ERROR,
+                    "Error reading from socket fd=%i in async message "
+                    "handler (%zi): %s\n",
+                    ts->socket_state->streamfd, r, strerror(errno));
+        return SEND_MESSAGE_ERR_IO;
+      }
+      ts->async_response_bytes += (size_t)r;
+      return 0;
+    }
+    }
+
+    int timeout_r = check_message_response_timeout(ts);
+    if (timeout_r != 0)
+      return timeout_r;
+  }
+}
+
+// Waits for at least one async message response and settles the messages
+// whose responses have arrived.
+static int receive_async_responses(ThreadState *ts) {
+  Record *record = ts->socket_state->record;
+  size_t consumed;
+  if (record) {
+    size_t len = 0;
+    int r = wait_for_dispatched_response(
+        ts, record, MAX(1, (int)(message_polling_interval_ns() / 1000000ULL)),
+        &len, true);
+    if (r == 0)
+      r = settle_async_messages(ts, ts->input_buf, len, &consumed);
+    if (r == 0 && consumed != len)
+      r = SEND_MESSAGE_ERR_BAD_MESSAGE;
+    if (r == 0 && ts->n_async_messages == 0)
+      record_cancel_reply(record);
+    return r;
+  }
+
+  int r = read_async_responses(ts);
+  if (r == 0)
+    r = settle_async_messages(ts, ts->input_buf, ts->async_response_bytes,
+                              &consumed);
+  if (r != 0)
+    return r;
+  ts->async_response_bytes -= consumed;
+  memmove(ts->input_buf, ts->input_buf + consumed, ts->async_response_bytes);
+  if (ts->n_async_messages == 0 && ts->async_response_bytes != 0) {
+    jsockd_log(LOG_DEBUG,
+               "Unexpected input following the last async message response\n");
+    return SEND_MESSAGE_ERR_BAD_MESSAGE;
+  }
+  return 0;
+}
+
+// Runs pending jobs, receiving async message responses whenever no job is
+// pending, until no async message is outstanding.
+static int run_jobs_and_receive_async_responses(ThreadState *ts) {
+  for (;;) {
+    JSContext *ctx1;
+    int r = JS_ExecutePendingJob(ts->rt, &ctx1);
+    if (r < 0) {
+      JSValue exception = JS_GetException(ctx1);
+      log_error_with_prefix("Exception in pending job:\n", ctx1, exception);
+      JS_FreeValue(ctx1, exception);
+    }
+    if (r != 0)
+      continue;
+    if (ts->n_async_messages == 0)
+      return 0;
+    r = receive_async_responses(ts);
+    if (r != 0)
+      return r;
+  }
+}
+
+JSValue await_command_result(ThreadState *ts, JSValue obj) {
+  // If the command threw after sending async messages, the exception is set
+  // aside while their responses are received, and then rethrown.
+  bool threw = JS_IsException(obj);
+  JSValue exception = threw ? JS_GetException(ts->ctx) : JS_UNDEFINED;
+  int r = run_jobs_and_receive_async_responses(ts);
+  if (r == 0 && threw)
+    return JS_Throw(ts->ctx, exception);
+  if (r == 0) {
+    obj = js_std_await(ts->ctx, obj);
+    // The jobs run by js_std_await may have sent more async messages.
+    r = run_jobs_and_receive_async_responses(ts);
+    if (r == 0)
+      return obj;
+  }
+  jsockd_logf(LOG_DEBUG,
+              "Error receiving async message responses, error code=%i: %s\n",
+              r, send_message_error_to_string(r));
+  cancel_async_messages(ts);
+  JS_FreeValue(ts->ctx, exception);
+  JS_FreeValue(ts->ctx, obj);
+  return JS_ThrowInternalError(ts->ctx,
+                               "Error sending message via JSockD: %s",
+                               send_message_error_to_string(r));
+}
+
+void cancel_async_messages(ThreadState *ts) {
+  for (int i = 0; i < ts->n_async_messages; ++i) {
+    JS_FreeValue(ts->ctx, ts->async_messages[i].resolving_funcs[0]);
+    JS_FreeValue(ts->ctx, ts->async_messages[i].resolving_funcs[1]);
+  }
+  if (ts->n_async_messages > 0 && ts->socket_state &&
+      ts->socket_state->record)
+    record_cancel_reply(ts->socket_state->record);
+  ts->n_async_messages = 0;
+  ts->next_async_message_n = 0;
+  ts->async_response_bytes = 0;
+}
+
 static void jsockd_finalizer(JSRuntime *rt, JSValue val) {
   jsockd_log(LOG_DEBUG, "Finalizing global JSockD object...\n");
 }
@@ -204,6 +549,11 @@ static JSValue jsockd_send_message(JSContext *ctx, JSValueConst this_val,
              "and, optionally, 'replacer' and 'space' arguments to pass to "
              "JSON.stringify)");
   }
+  if (get_runtime_thread_state(JS_GetRuntime(ctx))->n_async_messages > 0) {
+    return JS_ThrowInternalError(
+        ctx, "JSockD.sendMessage can't be called while messages sent by "
+             "JSockD.sendMessageAsync are awaiting a response");
+  }
   JSValue message_val = argv[0];
   JSValue encoded_message_val =
       JS_JSONStringify(ctx, message_val, argc > 1 ? argv[1] : JS_UNDEFINED,
@@ -225,7 +575,8 @@ static JSValue jsockd_send_message(JSContext *ctx, JSValueConst this_val,
     return JS_ThrowInternalError(
         ctx, "Internal error while sending message via JSockD");
   }
-  int r = send_message(JS_GetRuntime(ctx), message_str, message_len, &res);
+  int r = send_message(JS_GetRuntime(ctx), " message ", message_str,
+                       message_len, &res);
   JS_FreeCString(ctx, message_str);
   if (r != 0) {
     JS_FreeValue(ctx, res);
@@ -238,8 +589,145 @@ static JSValue jsockd_send_message(JSContext *ctx, JSValueConst this_val,
   return res;
 }
 
+static int get_array_length(JSContext *ctx, JSValueConst array,
+                            int64_t *len) {
+  JSValue len_val = JS_GetPropertyStr(ctx, array, "length");
+  int r = JS_ToInt64(ctx, len, len_val);
+  JS_FreeValue(ctx, len_val);
+  return r;
+}
+
+// Sends an array of messages in one round trip. The client responds with an
+// array of responses of the same length.
+static JSValue jsockd_send_messages(JSContext *ctx, JSValueConst this_val,
+                                    int argc, JSValueConst *argv) {
+  if (argc < 1 || argc > 3) {
+    return JS_ThrowInternalError(
+        ctx, "JSockD.sendMessages requires 1-3 arguments (the array of "
+             "messages to send, and, optionally, 'replacer' and 'space' "
+             "arguments to pass to JSON.stringify)");
+  }
+  if (get_runtime_thread_state(JS_GetRuntime(ctx))->n_async_messages > 0) {
+    return JS_ThrowInternalError(
+        ctx, "JSockD.sendMessages can't be called while messages sent by "
+             "JSockD.sendMessageAsync are awaiting a response");
+  }
+  int64_t n_messages;
+  if (1 != JS_IsArray(ctx, argv[0]))
+    return JS_ThrowTypeError(ctx,
+                             "JSockD.sendMessages argument must be an array");
+  if (0 != get_array_length(ctx, argv[0], &n_messages))
+    return JS_EXCEPTION;
+  if (n_messages == 0)
+    return JS_NewArray(ctx);
+
+  JSValue encoded_messages_val =
+      JS_JSONStringify(ctx, argv[0], argc > 1 ? argv[1] : JS_UNDEFINED,
+                       argc > 2 ? argv[2] : JS_UNDEFINED);
+  if (JS_IsException(encoded_messages_val)) {
+    JS_FreeValue(ctx, encoded_messages_val);
+    return JS_ThrowTypeError(
+        ctx, "JSockD.sendMessages argument must be JSON serializable");
+  }
+
+  JSValue res;
+  size_t messages_len;
+  const char *messages_str =
+      JS_ToCStringLen(ctx, &messages_len, encoded_messages_val);
+  JS_FreeValue(ctx, encoded_messages_val);
+  if (!messages_str) {
+    jsockd_log(LOG_DEBUG,
+               "Error calling JS_ToCStringLen before sending messages");
+    return JS_ThrowInternalError(
+        ctx, "Internal error while sending message via JSockD");
+  }
+  int r = send_message(JS_GetRuntime(ctx), " messages ", messages_str,
+                       messages_len, &res);
+  JS_FreeCString(ctx, messages_str);
+  if (r != 0) {
+    JS_FreeValue(ctx, res);
+    jsockd_logf(LOG_DEBUG, "Error sending messages, error code=%i: %s\n", r,
+                send_message_error_to_string(r));
+    return JS_ThrowInternalError(ctx, "Error sending message via JSockD: %s",
+                                 send_message_error_to_string(r));
+  }
+
+  int64_t n_responses;
+  if (1 != JS_IsArray(ctx, res) ||
+      0 != get_array_length(ctx, res, &n_responses) ||
+      n_responses != n_messages) {
+    JS_FreeValue(ctx, res);
+    return JS_ThrowInternalError(
+        ctx, "Error sending message via JSockD: expected an array of %" PRIi64
+             " responses",
+        n_messages);
+  }
+  return res;
+}
+
+static JSValue jsockd_send_message_async(JSContext *ctx, JSValueConst this_val,
+                                         int argc, JSValueConst *argv) {
+  if (argc < 1 || argc > 3) {
+    return JS_ThrowInternalError(
+        ctx, "JSockD.sendMessageAsync requires 1-3 arguments (the message to "
+             "send, and, optionally, 'replacer' and 'space' arguments to pass "
+             "to JSON.stringify)");
+  }
+  ThreadState *ts = get_runtime_thread_state(JS_GetRuntime(ctx));
+  if (ts->n_async_messages == MAX_ASYNC_MESSAGES) {
+    return JS_ThrowInternalError(
+        ctx, "Too many messages sent by JSockD.sendMessageAsync are awaiting "
+             "a response (max %i)",
+        MAX_ASYNC_MESSAGES);
+  }
+  JSValue encoded_message_val =
+      JS_JSONStringify(ctx, argv[0], argc > 1 ? argv[1] : JS_UNDEFINED,
+                       argc > 2 ? argv[2] : JS_UNDEFINED);
+  if (JS_IsException(encoded_message_val)) {
+    JS_FreeValue(ctx, encoded_message_val);
+    return JS_ThrowTypeError(
+        ctx, "JSockD.sendMessageAsync argument must be JSON serializable");
+  }
+
+  size_t message_len;
+  const char *message_str =
+      JS_ToCStringLen(ctx, &message_len, encoded_message_val);
+  JS_FreeValue(ctx, encoded_message_val);
+  if (!message_str) {
+    jsockd_log(LOG_DEBUG,
+               "Error calling JS_ToCStringLen before sending async message");
+    return JS_ThrowInternalError(
+        ctx, "Internal error while sending message via JSockD");
+  }
+
+  AsyncMessage *m = &ts->async_messages[ts->n_async_messages];
+  JSValue promise = JS_NewPromiseCapability(ctx, m->resolving_funcs);
+  if (JS_IsException(promise)) {
+    JS_FreeCString(ctx, message_str);
+    return promise;
+  }
+  m->n = ts->next_async_message_n++;
+  ts->n_async_messages++;
+
+  int r = send_async_message(ts, m->n, message_str, message_len);
+  JS_FreeCString(ctx, message_str);
+  if (r != 0) {
+    JS_FreeValue(ctx, promise);
+    ts->n_async_messages--;
+    JS_FreeValue(ctx, m->resolving_funcs[0]);
+    JS_FreeValue(ctx, m->resolving_funcs[1]);
+    if (ts->n_async_messages == 0 && ts->socket_state->record)
+      record_cancel_reply(ts->socket_state->record);
+    return JS_ThrowInternalError(ctx, "Error sending message via JSockD: %s",
+                                 send_message_error_to_string(r));
+  }
+  return promise;
+}
+
 static const JSCFunctionListEntry jsockd_function_list[] = {
     JS_CFUNC_DEF("sendMessage", 1, jsockd_send_message),
+    JS_CFUNC_DEF("sendMessages", 1, jsockd_send_messages),
+    JS_CFUNC_DEF("sendMessageAsync", 1, jsockd_send_message_async),
 };
 
 static JSValue jsockd_ctor(JSContext *ctx, JSValueConst this_val, int argc,
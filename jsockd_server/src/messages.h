@@ -3,6 +3,16 @@
 
 #include "quickjs.h"
 
+struct ThreadState;
+
 int add_intrinsic_jsockd(JSContext *cx, JSValueConst global);
+// Like js_std_await, but also receives the responses to messages sent by
+// JSockD.sendMessageAsync, resolving their promises. Returns once the value
+// is settled and every async message has had its response, so that a late
+// response can't be mistaken for the next command.
+JSValue await_command_result(struct ThreadState *ts, JSValue obj);
+// Frees the state of any async messages still awaiting a response (e.g. after
+// an error).
+void cancel_async_messages(struct ThreadState *ts);
 
 #endif
@@ -1,6 +1,7 @@
 #include "modcompiler.h"
 #include "config.h"
 #include "hex.h"
+#include "named_commands.h"
 #include "quickjs-libc.h"
 #include "quickjs.h"
 #include "verify_bytecode.h"
@@ -12,6 +13,7 @@
 
 // The module file format:
 //     raw QuickJS bytecode
+//     named commands, if any (see named_commands.c)
 //     128 byte version string, null-terminated, right padded with zeros
 //     64 byte ed25519 signature of bytecode + version string
 
@@ -24,13 +26,131 @@ static void extract_public_key(const unsigned char *private_key,
   ge_p3_tobytes(public_key, &A);
 }
 
+static void free_named_commands_compiled(JSContext *ctx, NamedCommand *commands,
+                                        int n_commands) {
+  for (int i = 0; i < n_commands; ++i) {
+    JS_FreeCString(ctx, commands[i].name);
+    js_free(ctx, (void *)commands[i].bytecode);
+  }
+  free(commands);
+}
+
+// The manifest is a JSON object mapping each command's name to its source.
+// Each command is compiled in the same way as the server compiles commands
+// sent as source.
+static int compile_named_commands(JSContext *ctx, const char *manifest_filename,
+                                  NamedCommand **out_commands,
+                                  int *out_n_commands) {
+  int ret = -1;
+  uint8_t *buf = NULL;
+  JSValue manifest = JS_UNDEFINED;
+  JSPropertyEnum *props = NULL;
+  uint32_t n_props = 0;
+  NamedCommand *commands = NULL;
+  int n_commands = 0;
+
+  size_t buf_len;
+  buf = js_load_file(ctx, &buf_len, manifest_filename);
+  if (!buf) {
+    fprintf(stderr, "Could not load '%s'\n", manifest_filename);
+    goto end;
+  }
+  manifest = JS_ParseJSON(ctx, (const char *)buf, buf_len, manifest_filename);
+  if (JS_IsException(manifest)) {
+    fprintf(stderr, "Error parsing named commands manifest '%s':\n",
+            manifest_filename);
+    js_std_dump_error(ctx);
+    goto end;
+  }
+  if (!JS_IsObject(manifest) ||
+      0 != JS_GetOwnPropertyNames(ctx, &props, &n_props, manifest,
+                                  JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY)) {
+    fprintf(stderr,
+            "Named commands manifest '%s' must be a JSON object mapping "
+            "names to command source\n",
+            manifest_filename);
+    goto end;
+  }
+  commands = calloc(n_props ? n_props : 1, sizeof(NamedCommand));
+  if (!commands) {
+    fprintf(stderr, "Error allocating named commands\n");
+    goto end;
+  }
+
+  for (uint32_t i = 0; i < n_props; ++i) {
+    NamedCommand *c = &commands[n_commands];
+    c->name = JS_AtomToCString(ctx, props[i].atom);
+    if (!c->name) {
+      js_std_dump_error(ctx);
+      goto end;
+    }
+    ++n_commands;
+    c->name_len = strlen(c->name);
+    if (!named_command_name_is_valid(c->name, c->name_len)) {
+      fprintf(stderr,
+              "Invalid named command name '%s' (must be 1 to %i characters "
+              "from A-Z, a-z, 0-9, '_', '.', ':', '/' and '-')\n",
+              c->name, NAMED_COMMAND_NAME_MAX_BYTES);
+      goto end;
+    }
+
+    JSValue source = JS_GetProperty(ctx, manifest, props[i].atom);
+    if (!JS_IsString(source)) {
+      fprintf(stderr, "The source of named command '%s' must be a string\n",
+              c->name);
+      JS_FreeValue(ctx, source);
+      goto end;
+    }
+    size_t source_len;
+    const char *source_str = JS_ToCStringLen(ctx, &source_len, source);
+    JS_FreeValue(ctx, source);
+    if (!source_str) {
+      js_std_dump_error(ctx);
+      goto end;
+    }
+    JSValue func = JS_Eval(ctx, source_str, source_len, c->name,
+                           JS_EVAL_FLAG_ASYNC | JS_EVAL_FLAG_COMPILE_ONLY);
+    JS_FreeCString(ctx, source_str);
+    if (JS_IsException(func)) {
+      fprintf(stderr, "Error compiling named command '%s':\n", c->name);
+      js_std_dump_error(ctx);
+      goto end;
+    }
+    c->bytecode =
+        JS_WriteObject(ctx, &c->bytecode_size, func, JS_WRITE_OBJ_BYTECODE);
+    JS_FreeValue(ctx, func);
+    if (!c->bytecode) {
+      fprintf(stderr, "Error writing bytecode for named command '%s'\n",
+              c->name);
+      goto end;
+    }
+  }
+
+  *out_commands = commands;
+  *out_n_commands = n_commands;
+  commands = NULL;
+  ret = 0;
+
+end:
+  if (commands)
+    free_named_commands_compiled(ctx, commands, n_commands);
+  if (props)
+    JS_FreePropertyEnum(ctx, props, n_props);
+  JS_FreeValue(ctx, manifest);
+  js_free(ctx, buf);
+  return ret;
+}
+
 int compile_module_file(const char *module_filename,
                         const char *privkey_filename,
+                        const char *commands_manifest_filename,
                         const char *output_filename, const char *version,
                         int qjsc_strip_flags) {
   int ret = EXIT_SUCCESS;
   uint8_t *buf = NULL;
   uint8_t *out_buf = NULL;
+  NamedCommand *commands = NULL;
+  int n_commands = 0;
   JSValue obj = JS_UNDEFINED;
   JSRuntime *rt = NULL;
   JSContext *ctx = NULL;
@@ -75,9 +195,20 @@ int compile_module_file(const char *module_filename,
     goto end;
   }
 
+  if (commands_manifest_filename &&
+      0 != compile_named_commands(ctx, commands_manifest_filename, &commands,
+                                  &n_commands)) {
+    ret = EXIT_FAILURE;
+    goto end;
+  }
+
   size_t out_buf_len;
   out_buf = JS_WriteObject(ctx, &out_buf_len, obj, JS_WRITE_OBJ_BYTECODE);
-  out_buf = js_realloc(ctx, out_buf, out_buf_len + VERSION_STRING_SIZE);
+  size_t commands_size = named_commands_section_size(commands, n_commands);
+  out_buf = js_realloc(ctx, out_buf,
+                       out_buf_len + commands_size + VERSION_STRING_SIZE);
+  write_named_commands_section(out_buf + out_buf_len, commands, n_commands);
+  out_buf_len += commands_size;
   memset(out_buf + out_buf_len, 0, VERSION_STRING_SIZE);
   strcpy((char *)(out_buf + out_buf_len), version);
   out_buf_len += VERSION_STRING_SIZE;
@@ -140,6 +271,8 @@ end:
   if (mf)
     fclose(mf);
   if (ctx) {
+    if (commands)
+      free_named_commands_compiled(ctx, commands, n_commands);
     js_free(ctx, out_buf);
     js_free(ctx, buf);
     JS_FreeValue(ctx, obj);
@@ -0,0 +1,79 @@
+#include "mpmc_queue.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+int mpmc_queue_init(MpmcQueue *q, size_t capacity) {
+  assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+  q->cells = malloc(sizeof(MpmcQueueCell) * capacity);
+  if (!q->cells)
+    return -1;
+  q->mask = capacity - 1;
+  for (size_t i = 0; i < capacity; ++i) {
+    atomic_init(&q->cells[i].seq, i);
+    q->cells[i].data = NULL;
+  }
+  atomic_init(&q->enqueue_pos, 0);
+  atomic_init(&q->dequeue_pos, 0);
+  return 0;
+}
+
+void mpmc_queue_destroy(MpmcQueue *q) {
+  free(q->cells);
+  q->cells = NULL;
+}
+
+bool mpmc_queue_push(MpmcQueue *q, void *data) {
+  size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+  for (;;) {
+    MpmcQueueCell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      // The cell is free for this position; try to claim it.
+      if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->data = data;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return true;
+      }
+      // 'pos' was updated by the failed CAS.
+    } else if (diff < 0) {
+      // The cell still holds an item from the previous lap.
+      return false;
+    } else {
+      pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+void *mpmc_queue_pop(MpmcQueue *q) {
+  size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+  for (;;) {
+    MpmcQueueCell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        void *data = cell->data;
+        // Mark the cell free for the producer one lap ahead.
+        atomic_store_explicit(&cell->seq, pos + q->mask + 1,
+                              memory_order_release);
+        return data;
+      }
+    } else if (diff < 0) {
+      // Nothing has been pushed to this cell yet.
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+bool mpmc_queue_is_empty(MpmcQueue *q) {
+  return atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed) ==
+         atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+}
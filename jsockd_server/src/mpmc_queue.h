@@ -0,0 +1,38 @@
+#ifndef MPMC_QUEUE_H_
+#define MPMC_QUEUE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A bounded lock-free multi-producer multi-consumer FIFO of pointers (Dmitry
+// Vyukov's array-based queue). Each cell carries a sequence number which tells
+// a producer or consumer whether the cell is ready for it, so a push or pop
+// is a single CAS on the shared position in the uncontended case.
+
+typedef struct {
+  atomic_size_t seq;
+  void *data;
+} MpmcQueueCell;
+
+typedef struct {
+  MpmcQueueCell *cells;
+  size_t mask;
+  // The positions are written by different threads, so keep them on separate
+  // cache lines.
+  _Alignas(64) atomic_size_t enqueue_pos;
+  _Alignas(64) atomic_size_t dequeue_pos;
+} MpmcQueue;
+
+// 'capacity' must be a power of 2.
+int mpmc_queue_init(MpmcQueue *q, size_t capacity);
+void mpmc_queue_destroy(MpmcQueue *q);
+// Returns false if the queue is full.
+bool mpmc_queue_push(MpmcQueue *q, void *data);
+// Returns NULL if the queue is empty.
+void *mpmc_queue_pop(MpmcQueue *q);
+// The result may be out of date by the time it's returned if other threads are
+// pushing or popping concurrently.
+bool mpmc_queue_is_empty(MpmcQueue *q);
+
+#endif
@@ -0,0 +1,243 @@
+#include "named_commands.h"
+#include "log.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The section follows the module bytecode (integers are little-endian):
+//
+//   for each command, in order of name:
+//     name length       4 bytes
+//     name              name length bytes
+//     bytecode size     4 bytes
+//     bytecode          bytecode size bytes
+//   number of commands  4 bytes
+//   section size        8 bytes (of everything above)
+//   magic               8 bytes ("JSOCKDNC")
+//
+// A module file without named commands has no section at all, so module files
+// compiled before named commands existed are still valid.
+
+#define NAMED_COMMANDS_MAGIC "JSOCKDNC"
+#define NAMED_COMMANDS_MAGIC_SIZE 8
+#define NAMED_COMMANDS_TRAILER_SIZE (4 + 8 + NAMED_COMMANDS_MAGIC_SIZE)
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; ++i)
+    p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; ++i)
+    v |= (uint32_t)p[i] << (i * 8);
+  return v;
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i)
+    p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; ++i)
+    v |= (uint64_t)p[i] << (i * 8);
+  return v;
+}
+
+static int compare_names(const char *a, size_t a_len, const char *b,
+                         size_t b_len) {
+  int r = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (r != 0)
+    return r;
+  return (a_len > b_len) - (a_len < b_len);
+}
+
+static int compare_named_commands(const void *a, const void *b) {
+  const NamedCommand *ca = (const NamedCommand *)a;
+  const NamedCommand *cb = (const NamedCommand *)b;
+  return compare_names(ca->name, ca->name_len, cb->name, cb->name_len);
+}
+
+bool named_command_name_is_valid(const char *name, size_t name_len) {
+  if (name_len == 0 || name_len > NAMED_COMMAND_NAME_MAX_BYTES)
+    return false;
+  for (size_t i = 0; i < name_len; ++i) {
+    char c = name[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') || c == '_' || c == '.' || c == ':' ||
+          c == '/' || c == '-'))
+      return false;
+  }
+  return true;
+}
+
+size_t named_commands_section_size(const NamedCommand *commands,
+                                   int n_commands) {
+  if (n_commands == 0)
+    return 0;
+  size_t size = NAMED_COMMANDS_TRAILER_SIZE;
+  for (int i = 0; i < n_commands; ++i)
+    size += 4 + commands[i].name_len + 4 + commands[i].bytecode_size;
+  return size;
+}
+
+void write_named_commands_section(uint8_t *out, NamedCommand *commands,
+                                  int n_commands) {
+  if (n_commands == 0)
+    return;
+  qsort(commands, n_commands, sizeof(NamedCommand), compare_named_commands);
+  uint8_t *p = out;
+  for (int i = 0; i < n_commands; ++i) {
+    put_u32(p, (uint32_t)commands[i].name_len);
+    p += 4;
+    memcpy(p, commands[i].name, commands[i].name_len);
+    p += commands[i].name_len;
+    put_u32(p, (uint32_t)commands[i].bytecode_size);
+    p += 4;
+    memcpy(p, commands[i].bytecode, commands[i].bytecode_size);
+    p += commands[i].bytecode_size;
+  }
+  put_u32(p, (uint32_t)n_commands);
+  p += 4;
+  put_u64(p, (uint64_t)(p - out));
+  p += 8;
+  memcpy(p, NAMED_COMMANDS_MAGIC, NAMED_COMMANDS_MAGIC_SIZE);
+}
+
+// Returns the size of the section, or 0 if there isn't one.
+static size_t section_size(const uint8_t *module_bytecode, size_t size) {
+  if (size < NAMED_COMMANDS_TRAILER_SIZE ||
+      0 != memcmp(module_bytecode + size - NAMED_COMMANDS_MAGIC_SIZE,
+                  NAMED_COMMANDS_MAGIC, NAMED_COMMANDS_MAGIC_SIZE))
+    return 0;
+  uint64_t entries_size = get_u64(module_bytecode + size -
+                                  NAMED_COMMANDS_MAGIC_SIZE - 8);
+  if (entries_size < 4 || entries_size > size - 8 - NAMED_COMMANDS_MAGIC_SIZE)
+    return 0;
+  return (size_t)entries_size + 8 + NAMED_COMMANDS_MAGIC_SIZE;
+}
+
+size_t named_commands_module_size(const uint8_t *module_bytecode,
+                                  size_t size) {
+  if (!module_bytecode)
+    return size;
+  return size - section_size(module_bytecode, size);
+}
+
+int parse_named_commands(const uint8_t *module_bytecode, size_t size,
+                         NamedCommands *out) {
+  out->commands = NULL;
+  out->n_commands = 0;
+  if (!module_bytecode)
+    return 0;
+  size_t ss = section_size(module_bytecode, size);
+  if (ss == 0)
+    return 0;
+
+  const uint8_t *p = module_bytecode + size - ss;
+  const uint8_t *end = module_bytecode + size - NAMED_COMMANDS_TRAILER_SIZE;
+  uint32_t n = get_u32(end);
+  // Each command takes at least 10 bytes (a one byte name and some bytecode).
+  if (n == 0 || n > (size_t)(end - p) / 10) {
+    jsockd_log(LOG_ERROR, "Invalid named commands section in module file\n");
+    return -1;
+  }
+  NamedCommand *commands = calloc(n, sizeof(NamedCommand));
+  if (!commands) {
+    jsockd_log(LOG_ERROR, "Error allocating named commands\n");
+    return -1;
+  }
+  for (uint32_t i = 0; i < n; ++i) {
+    NamedCommand *c = &commands[i];
+    if (end - p < 4)
+      goto invalid;
+    c->name_len = get_u32(p);
+    p += 4;
+    if ((size_t)(end - p) < c->name_len)
+      goto invalid;
+    c->name = (const char *)p;
+    p += c->name_len;
+    if (!named_command_name_is_valid(c->name, c->name_len))
+      goto invalid;
+    if (i > 0 && compare_named_commands(&commands[i - 1], c) >= 0)
+      goto invalid;
+    if (end - p < 4)
+      goto invalid;
+    c->bytecode_size = get_u32(p);
+    p += 4;
+    if (c->bytecode_size == 0 || (size_t)(end - p) < c->bytecode_size)
+      goto invalid;
+    c->bytecode = p;
+    p += c->bytecode_size;
+  }
+  if (p != end)
+    goto invalid;
+
+  out->commands = commands;
+  out->n_commands = (int)n;
+  return 0;
+
+invalid:
+  jsockd_log(LOG_ERROR, "Invalid named commands section in module file\n");
+  free(commands);
+  return -1;
+}
+
+const NamedCommand *find_named_command(const NamedCommands *nc,
+                                       const char *name, size_t name_len) {
+  int lo = 0;
+  int hi = nc->n_commands - 1;
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    const NamedCommand *c = &nc->commands[mid];
+    int r = compare_names(name, name_len, c->name, c->name_len);
+    if (r == 0)
+      return c;
+    if (r < 0)
+      hi = mid - 1;
+    else
+      lo = mid + 1;
+  }
+  return NULL;
+}
+
+void free_named_commands(NamedCommands *nc) {
+  free(nc->commands);
+  nc->commands = NULL;
+  nc->n_commands = 0;
+}
+
+NamedCommandsSet *new_named_commands_set(NamedCommands *nc,
+                                         const void *mapping,
+                                         size_t mapping_size) {
+  NamedCommandsSet *set = malloc(sizeof(NamedCommandsSet));
+  if (!set) {
+    jsockd_log(LOG_ERROR, "Error allocating named commands\n");
+    return NULL;
+  }
+  atomic_init(&set->refcount, 1);
+  set->nc = *nc;
+  set->mapping = mapping;
+  set->mapping_size = mapping_size;
+  nc->commands = NULL;
+  nc->n_commands = 0;
+  return set;
+}
+
+NamedCommandsSet *ref_named_commands_set(NamedCommandsSet *set) {
+  if (set)
+    atomic_fetch_add_explicit(&set->refcount, 1, memory_order_relaxed);
+  return set;
+}
+
+void unref_named_commands_set(NamedCommandsSet *set) {
+  if (!set ||
+      1 != atomic_fetch_sub_explicit(&set->refcount, 1, memory_order_acq_rel))
+    return;
+  free_named_commands(&set->nc);
+  if (set->mapping)
+    munmap_or_warn(set->mapping, set->mapping_size);
+  free(set);
+}
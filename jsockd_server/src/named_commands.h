@@ -0,0 +1,74 @@
+#ifndef NAMED_COMMANDS_H_
+#define NAMED_COMMANDS_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Named commands are compiled ahead of time by 'jsockd -c' (see -cm) and
+// stored in the module file after the module bytecode. A client runs one by
+// sending NAMED_COMMAND_PREFIX followed by its name in place of the command
+// source.
+
+#define NAMED_COMMAND_PREFIX '@'
+#define NAMED_COMMAND_NAME_MAX_BYTES 64
+
+typedef struct {
+  const char *name;
+  size_t name_len;
+  const uint8_t *bytecode;
+  size_t bytecode_size;
+} NamedCommand;
+
+typedef struct {
+  // Sorted by name, and pointing into the module file.
+  NamedCommand *commands;
+  int n_commands;
+} NamedCommands;
+
+// The named commands of one version of the module, which point into the
+// module file's mapping. The set owns the mapping, and unmaps it when the last
+// reference goes. Each runtime holds a reference to the set for the module it
+// loaded (see init_thread_state), so that a runtime still running the old
+// module after a reload runs the old module's commands.
+typedef struct NamedCommandsSet {
+  atomic_int refcount;
+  NamedCommands nc;
+  const void *mapping;
+  size_t mapping_size;
+} NamedCommandsSet;
+
+// Names are non-empty and at most NAMED_COMMAND_NAME_MAX_BYTES of
+// [A-Za-z0-9_.:/-].
+bool named_command_name_is_valid(const char *name, size_t name_len);
+
+// Writing the section (for the module compiler). 'commands' are sorted in
+// place, and must have distinct names.
+size_t named_commands_section_size(const NamedCommand *commands,
+                                   int n_commands);
+void write_named_commands_section(uint8_t *out, NamedCommand *commands,
+                                  int n_commands);
+
+// Reading the section. 'module_bytecode' is the module file without its
+// version string and signature. A module file without named commands is
+// valid, and yields no commands.
+int parse_named_commands(const uint8_t *module_bytecode, size_t size,
+                         NamedCommands *out);
+// Returns the size of the module bytecode without the named commands section.
+size_t named_commands_module_size(const uint8_t *module_bytecode, size_t size);
+const NamedCommand *find_named_command(const NamedCommands *nc,
+                                       const char *name, size_t name_len);
+void free_named_commands(NamedCommands *nc);
+
+// Returns a set with a single reference, which takes over 'nc' (parsed from
+// the module file in 'mapping') and the mapping, or NULL if allocation fails,
+// in which case the caller still owns both. 'mapping' may be NULL.
+NamedCommandsSet *new_named_commands_set(NamedCommands *nc,
+                                         const void *mapping,
+                                         size_t mapping_size);
+// Both accept NULL, for a runtime without a module.
+NamedCommandsSet *ref_named_commands_set(NamedCommandsSet *set);
+void unref_named_commands_set(NamedCommandsSet *set);
+
+#endif
@@ -0,0 +1,287 @@
+#include "prefork.h"
+#include "config.h"
+#include "globals.h"
+#include "log.h"
+#include "utils.h"
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  pid_t pid; // 0 if the worker isn't running
+  bool ready;
+} Worker;
+
+static Worker g_workers[MAX_THREADS];
+// Workers write their index to the ready pipe once they're ready, and the
+// SIGCHLD handler writes to the child pipe to wake the parent.
+static int g_ready_pipe[2] = {-1, -1};
+static int g_child_pipe[2] = {-1, -1};
+// In a worker process, the worker's index.
+static int g_worker_index = -1;
+
+static void SIGCHLD_handler(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  // EAGAIN just means that the parent hasn't yet reaped the earlier children.
+  const char c = 0;
+  while (-1 == write(g_child_pipe[1], &c, sizeof(c)) && errno == EINTR)
+    ;
+  errno = saved_errno;
+}
+
+static void close_pipe(int fds[2]) {
+  for (int i = 0; i < 2; ++i) {
+    if (fds[i] >= 0)
+      close(fds[i]);
+    fds[i] = -1;
+  }
+}
+
+static void drain_pipe(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+static int start_worker(const PreforkConfig *config, int worker_index) {
+  // Anything still buffered would otherwise be written by both processes.
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid < 0) {
+    jsockd_logf(LOG_ERROR, "Error forking worker %i: %s\n", worker_index,
+                strerror(errno));
+    return -1;
+  }
+
+  if (pid == 0) {
+    g_worker_index = worker_index;
+    struct sigaction sa = {.sa_handler = SIG_DFL};
+    sigaction(SIGCHLD, &sa, NULL);
+    close_pipe(g_child_pipe);
+    close(g_ready_pipe[0]);
+    g_ready_pipe[0] = -1;
+    // The shutdown pipe is shared with the parent and the other workers, so
+    // the worker needs its own in order to shut down on its own.
+    close_pipe(g_shutdown_pipe);
+    int status = EXIT_FAILURE;
+    if (0 != shutdown_pipe_init())
+      jsockd_logf(LOG_ERROR, "Error creating shutdown pipe in worker %i: %s\n",
+                  worker_index, strerror(errno));
+    else
+      status = config->run_worker(worker_index, config->data);
+    fflush(NULL);
+    _exit(status);
+  }
+
+  g_workers[worker_index].pid = pid;
+  g_workers[worker_index].ready = false;
+  jsockd_logf(LOG_DEBUG, "Started worker %i (pid %i)\n", worker_index,
+              (int)pid);
+  return 0;
+}
+
+void prefork_worker_ready(void) {
+  assert(g_worker_index >= 0);
+  // Writes of less than PIPE_BUF bytes are atomic, so the parent always reads
+  // whole indices.
+  const int i = g_worker_index;
+  while (-1 == write(g_ready_pipe[1], &i, sizeof(i)) && errno == EINTR)
+    ;
+}
+
+// Returns true if every worker has become ready.
+static bool read_ready_pipe(int n_workers) {
+  int indices[MAX_THREADS];
+  ssize_t r;
+  while ((r = read(g_ready_pipe[0], indices, sizeof(indices))) > 0) {
+    for (size_t i = 0; i < (size_t)r / sizeof(indices[0]); ++i) {
+      if (indices[i] >= 0 && indices[i] < n_workers)
+        g_workers[indices[i]].ready = true;
+    }
+  }
+  for (int i = 0; i < n_workers; ++i) {
+    if (!g_workers[i].ready)
+      return false;
+  }
+  return true;
+}
+
+static int find_worker(int n_workers, pid_t pid) {
+  for (int i = 0; i < n_workers; ++i) {
+    if (g_workers[i].pid == pid)
+      return i;
+  }
+  return -1;
+}
+
+// Reaps exited workers and forks their replacements. Returns 0 to carry on, 1
+// if the server should shut down cleanly, or -1 on error.
+static int reap_workers(const PreforkConfig *config) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    int i = find_worker(config->n_workers, pid);
+    if (i < 0)
+      continue;
+    g_workers[i].pid = 0;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      jsockd_logf(LOG_DEBUG, "Worker %i exited; shutting down\n", i);
+      return 1;
+    }
+    if (!g_workers[i].ready) {
+      jsockd_logf(LOG_ERROR, "Worker %i exited before becoming ready\n", i);
+      return -1;
+    }
+    if (WIFSIGNALED(status))
+      jsockd_logf(LOG_WARN, "Worker %i killed by signal %i; restarting\n", i,
+                  WTERMSIG(status));
+    else
+      jsockd_logf(LOG_WARN, "Worker %i exited with status %i; restarting\n", i,
+                  WEXITSTATUS(status));
+    if (0 != start_worker(config, i))
+      return -1;
+  }
+  return 0;
+}
+
+static int stop_workers(int n_workers) {
+  int r = 0;
+  for (int i = 0; i < n_workers; ++i) {
+    if (g_workers[i].pid != 0 && 0 != kill(g_workers[i].pid, SIGTERM))
+      jsockd_logf(LOG_WARN, "Error sending SIGTERM to worker %i: %s\n", i,
+                  strerror(errno));
+  }
+  for (int i = 0; i < n_workers; ++i) {
+    if (g_workers[i].pid == 0)
+      continue;
+    int status;
+    pid_t pid;
+    while (-1 == (pid = waitpid(g_workers[i].pid, &status, 0)) &&
+           errno == EINTR)
+      ;
+    g_workers[i].pid = 0;
+    if (pid < 0) {
+      jsockd_logf(LOG_ERROR, "Error waiting for worker %i: %s\n", i,
+                  strerror(errno));
+      r = -1;
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+      jsockd_logf(LOG_WARN, "Worker %i exited with status %i\n", i,
+                  WEXITSTATUS(status));
+      r = -1;
+    } else if (WIFSIGNALED(status) && WTERMSIG(status) != SIGTERM) {
+      jsockd_logf(LOG_WARN, "Worker %i killed by signal %i\n", i,
+                  WTERMSIG(status));
+      r = -1;
+    }
+  }
+  return r;
+}
+
+// Returns the poll timeout while waiting for the workers to become ready.
+static int ready_timeout_ms(const PreforkConfig *config,
+                            const struct timespec *start) {
+  struct timespec now;
+  if (0 != clock_gettime(MONOTONIC_CLOCK, &now))
+    return 0;
+  int64_t remaining_ms =
+      config->ready_timeout_ms - ns_time_diff(&now, start) / 1000000;
+  return remaining_ms < 0 ? 0 : (int)remaining_ms;
+}
+
+int prefork_run(const PreforkConfig *config) {
+  int n_workers = config->n_workers;
+  assert(n_workers > 0 && n_workers <= MAX_THREADS);
+
+  if (0 != self_pipe_init(g_ready_pipe) || 0 != self_pipe_init(g_child_pipe)) {
+    jsockd_logf(LOG_ERROR, "Error creating prefork pipes: %s\n",
+                strerror(errno));
+    close_pipe(g_ready_pipe);
+    close_pipe(g_child_pipe);
+    return -1;
+  }
+  struct sigaction sa = {.sa_handler = SIGCHLD_handler,
+                         .sa_flags = SA_RESTART | SA_NOCLDSTOP};
+  struct sigaction old_sa;
+  sigaction(SIGCHLD, &sa, &old_sa);
+
+  int r = 0;
+  memset(g_workers, 0, sizeof(g_workers));
+  for (int i = 0; i < n_workers && r == 0; ++i)
+    r = start_worker(config, i);
+
+  struct timespec start;
+  if (0 != clock_gettime(MONOTONIC_CLOCK, &start)) {
+    jsockd_logf(LOG_ERROR, "Error getting time: %s\n", strerror(errno));
+    r = -1;
+  }
+
+  bool all_ready = false;
+  while (r == 0 &&
+         !atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire)) {
+    struct pollfd pfds[] = {{.fd = g_shutdown_pipe[0], .events = POLLIN},
+                            {.fd = g_ready_pipe[0], .events = POLLIN},
+                            {.fd = g_child_pipe[0], .events = POLLIN},
+                            {.fd = config->reload_fd, .events = POLLIN}};
+    int n_pfds = config->reload_fd >= 0 ? 4 : 3;
+    int pr =
+        poll(pfds, n_pfds, all_ready ? -1 : ready_timeout_ms(config, &start));
+    if (atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire))
+      break;
+    if (pr < 0) {
+      if (errno == EINTR)
+        continue;
+      jsockd_logf(LOG_ERROR, "poll failed in prefork parent: %s\n",
+                  strerror(errno));
+      r = -1;
+      break;
+    }
+
+    // A worker writes to the ready pipe before it can exit, so the ready pipe
+    // is read before any workers are reaped.
+    if (read_ready_pipe(n_workers) && !all_ready) {
+      all_ready = true;
+      config->on_ready(config->data);
+    }
+    if (pr == 0 && !all_ready) {
+      jsockd_log(LOG_ERROR, "Timeout waiting for workers to be ready\n");
+      r = -1;
+      break;
+    }
+
+    if (pfds[2].revents & POLLIN) {
+      drain_pipe(g_child_pipe[0]);
+      int rr = reap_workers(config);
+      if (rr != 0) {
+        r = rr < 0 ? -1 : 0;
+        break;
+      }
+    }
+
+    if (n_pfds > 3 && (pfds[3].revents & POLLIN)) {
+      drain_pipe(config->reload_fd);
+      bool reloaded = 0 == config->on_reload(config->data);
+      for (int i = 0; reloaded && i < n_workers; ++i) {
+        if (g_workers[i].pid != 0 && 0 != kill(g_workers[i].pid, SIGHUP))
+          jsockd_logf(LOG_WARN, "Error sending SIGHUP to worker %i: %s\n", i,
+                      strerror(errno));
+      }
+    }
+  }
+
+  if (0 != stop_workers(n_workers))
+    r = -1;
+  sigaction(SIGCHLD, &old_sa, NULL);
+  close_pipe(g_ready_pipe);
+  close_pipe(g_child_pipe);
+  return r;
+}
@@ -0,0 +1,35 @@
+#ifndef PREFORK_H_
+#define PREFORK_H_
+
+// Prefork mode (see -f). The parent process initializes a runtime once and
+// then forks a worker process for each socket, so that the workers share the
+// initialized heap copy-on-write. The parent supervises the workers, forking
+// a replacement for any worker that crashes.
+
+typedef struct {
+  int n_workers;
+  // Runs in the worker process, which exits with the returned status. Called
+  // with only the calling thread running.
+  int (*run_worker)(int worker_index, void *data);
+  // Called in the parent once every worker has called prefork_worker_ready
+  // for the first time.
+  void (*on_ready)(void *data);
+  // Called in the parent when 'reload_fd' becomes readable (after the pipe has
+  // been drained). Each worker is then sent SIGHUP if it returns 0.
+  int (*on_reload)(void *data);
+  int reload_fd;
+  // The maximum time for every worker to call prefork_worker_ready.
+  int ready_timeout_ms;
+  void *data;
+} PreforkConfig;
+
+// Forks the workers and supervises them until the server is shut down, either
+// by set_interrupted_or_error in the parent or by a worker exiting with status
+// 0 (e.g. following ?quit). A worker that exits with any other status, or is
+// killed by a signal, is replaced, unless it hadn't yet become ready, in which
+// case the server is shut down. Returns 0 on a clean shutdown or -1 on error.
+int prefork_run(const PreforkConfig *config);
+// Called by a worker once it's ready to accept connections.
+void prefork_worker_ready(void);
+
+#endif
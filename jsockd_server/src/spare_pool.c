@@ -0,0 +1,164 @@
+#include "spare_pool.h"
+#include "config.h"
+#include "globals.h"
+#include "log.h"
+#include "quickjs.h"
+#include "threadstate.h"
+#include "utils.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  pthread_mutex_t mutex;
+  // Signalled when a spare is taken, on a reload, and on stop.
+  pthread_cond_t cond;
+  ThreadState *spares[MAX_SPARE_RUNTIMES];
+  int n_spares;
+  int target;
+  bool stop;
+  bool started;
+  pthread_t thread;
+} SparePool;
+
+static SparePool g_spare_pool = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                                 .cond = PTHREAD_COND_INITIALIZER};
+
+static bool is_stale(const ThreadState *spare) {
+  return spare->module_generation !=
+         atomic_load_explicit(&g_module_generation, memory_order_acquire);
+}
+
+// The runtime may have been created on another thread.
+static void free_spare(ThreadState *spare) {
+  JS_UpdateStackTop(spare->rt);
+  cleanup_thread_state(spare);
+  free(spare);
+}
+
+static ThreadState *create_spare(void) {
+  ThreadState *spare = calloc(1, sizeof(ThreadState));
+  if (!spare)
+    return NULL;
+  if (0 != init_thread_state(spare, NULL, 0)) {
+    cleanup_thread_state(spare);
+    free(spare);
+    return NULL;
+  }
+  jsockd_log(LOG_DEBUG, "Created spare runtime\n");
+  return spare;
+}
+
+static void *spare_pool_thread_func(void *data) {
+  SparePool *p = (SparePool *)data;
+  ThreadState *stale[MAX_SPARE_RUNTIMES];
+
+  mutex_lock(&p->mutex);
+  while (!p->stop) {
+    // Move any spares created before a reload out of the pool, so that they
+    // can be freed without holding the lock.
+    int n_stale = 0;
+    int j = 0;
+    for (int i = 0; i < p->n_spares; ++i) {
+      if (is_stale(p->spares[i]))
+        stale[n_stale++] = p->spares[i];
+      else
+        p->spares[j++] = p->spares[i];
+    }
+    p->n_spares = j;
+    bool wanted = p->n_spares < p->target;
+    if (n_stale == 0 && !wanted) {
+      pthread_cond_wait(&p->cond, &p->mutex);
+      continue;
+    }
+    mutex_unlock(&p->mutex);
+
+    for (int i = 0; i < n_stale; ++i)
+      free_spare(stale[i]);
+    ThreadState *spare = wanted ? create_spare() : NULL;
+
+    mutex_lock(&p->mutex);
+    if (wanted && !spare) {
+      // Runtime threads can still create their own runtimes, so this isn't
+      // fatal, but there's no point in trying again.
+      jsockd_log(LOG_ERROR, "Error creating spare runtime; no more spares "
+                            "will be created\n");
+      p->target = 0;
+    } else if (spare && p->n_spares < p->target) {
+      p->spares[p->n_spares++] = spare;
+    } else if (spare) {
+      mutex_unlock(&p->mutex);
+      free_spare(spare);
+      mutex_lock(&p->mutex);
+    }
+  }
+  mutex_unlock(&p->mutex);
+  return NULL;
+}
+
+int spare_pool_start(int n_spares) {
+  SparePool *p = &g_spare_pool;
+  p->target = n_spares < MAX_SPARE_RUNTIMES ? n_spares : MAX_SPARE_RUNTIMES;
+  p->n_spares = 0;
+  p->stop = false;
+
+  // Creating a spare loads the module, which needs as much stack as it does on
+  // a runtime thread.
+  pthread_attr_t attr;
+  if (0 != pthread_attr_init(&attr)) {
+    jsockd_logf(LOG_ERROR, "pthread_attr_init failed: %s\n", strerror(errno));
+    return -1;
+  }
+  int r = pthread_attr_setstacksize(&attr, QUICKS_THREAD_STACK_SIZE);
+  if (r == 0)
+    r = pthread_create(&p->thread, &attr, spare_pool_thread_func, p);
+  pthread_attr_destroy(&attr); // can fail, but no point in checking
+  if (r != 0) {
+    jsockd_logf(LOG_ERROR, "Error creating spare runtime thread: %s\n",
+                strerror(r));
+    return -1;
+  }
+  p->started = true;
+  return 0;
+}
+
+ThreadState *spare_pool_take(void) {
+  SparePool *p = &g_spare_pool;
+  ThreadState *spare = NULL;
+  mutex_lock(&p->mutex);
+  // Spares are added in order, so if the newest one is stale then they all
+  // are.
+  if (p->n_spares > 0 && !is_stale(p->spares[p->n_spares - 1]))
+    spare = p->spares[--p->n_spares];
+  // Either way, the pool's thread has a spare to create or replace.
+  pthread_cond_signal(&p->cond);
+  mutex_unlock(&p->mutex);
+  return spare;
+}
+
+void spare_pool_refresh(void) {
+  SparePool *p = &g_spare_pool;
+  mutex_lock(&p->mutex);
+  pthread_cond_signal(&p->cond);
+  mutex_unlock(&p->mutex);
+}
+
+void spare_pool_stop(void) {
+  SparePool *p = &g_spare_pool;
+  if (!p->started)
+    return;
+  mutex_lock(&p->mutex);
+  p->stop = true;
+  pthread_cond_signal(&p->cond);
+  mutex_unlock(&p->mutex);
+  if (0 != pthread_join(p->thread, NULL))
+    jsockd_logf(LOG_ERROR, "Error joining spare runtime thread: %s\n",
+                strerror(errno));
+  p->started = false;
+  for (int i = 0; i < p->n_spares; ++i)
+    free_spare(p->spares[i]);
+  p->n_spares = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef SPARE_POOL_H_
+#define SPARE_POOL_H_
+
+#include "threadstate.h"
+
+// A pool of spare runtimes (see -p), kept topped up by a background thread. A
+// runtime thread that needs a new runtime, because its runtime was shut down
+// after being idle or is being replaced following a memory increase or a
+// reload, takes a spare rather than paying the cost of creating the runtime
+// (and loading the module) while a command waits.
+//
+// Spares are created by init_thread_state with no socket state, and must be
+// bound to a runtime thread with rebind_thread_state before use.
+
+int spare_pool_start(int n_spares);
+// Returns NULL if the pool is empty, or if the spares were created before the
+// most recent reload. The caller takes ownership of the returned thread state,
+// which was allocated with malloc.
+ThreadState *spare_pool_take(void);
+// Wakes the pool's thread so that it replaces spares created before a reload.
+void spare_pool_refresh(void);
+// Stops the pool's thread and frees the spares. Safe to call if the pool was
+// never started.
+void spare_pool_stop(void);
+
+#endif
@@ -7,6 +7,7 @@
 #include "inttypes.h"
 #include "log.h"
 #include "messages.h"
+#include "named_commands.h"
 #include "quickjs-libc.h"
 #include "quickjs.h"
 #include "textencodedecode.h"
@@ -14,6 +15,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdatomic.h>
+#include <string.h>
 
 static int new_custom_context(JSRuntime *rt, JSContext **out_ctx) {
   JSContext *ctx;
@@ -80,6 +82,12 @@ static int interrupt_handler(JSRuntime *rt, void *opaque) {
                   delta_ns / 1000LL, g_cmd_args.max_command_runtime_us);
       return 1;
     }
+    if (command_deadline_passed(state, &now)) {
+      jsockd_logf(LOG_WARN,
+                  "Command deadline passed after %lli us, interrupting\n",
+                  delta_ns / 1000LL);
+      return 1;
+    }
   }
   return (int)atomic_load_explicit(&g_interrupted_or_error,
                                    memory_order_acquire);
@@ -89,21 +97,25 @@ static void write_to_wbuf_wrapper(void *opaque, const char *inp, size_t size) {
   write_to_wbuf((WBuf *)opaque, inp, size);
 }
 
-int init_thread_state(ThreadState *ts, SocketState *socket_state,
-                      int thread_index) {
+static int init_thread_state_fields(ThreadState *ts, SocketState *socket_state,
+                                    int thread_index) {
   assert(thread_index < MAX_THREADS);
 
-  jsockd_logf(LOG_DEBUG, "Calling init_thread_state for thread %i\n",
-              thread_index);
-
   ts->thread_index = thread_index;
   ts->socket_state = socket_state;
   // set to nonzero if program should eventually exit with non-zero exit code
   ts->exit_status = 0;
   ts->line_n = 0;
   ts->compiled_query = JS_UNDEFINED;
+  ts->command_error = NULL;
+  ts->command_unknown = false;
   ts->last_js_execution_start.tv_sec = 0;
   ts->last_js_execution_start.tv_nsec = 0;
+  ts->command_deadline.tv_sec = 0;
+  ts->command_deadline.tv_nsec = 0;
+  ts->n_async_messages = 0;
+  ts->next_async_message_n = 0;
+  ts->async_response_bytes = 0;
   ts->input_buf = g_thread_state_input_buffers[thread_index];
   ts->current_uuid[0] = '\0';
   ts->current_uuid_len = 0;
@@ -116,7 +128,15 @@ int init_thread_state(ThreadState *ts, SocketState *socket_state,
   ts->my_replacement = NULL;
   ts->dangling_bytecode = NULL;
   ts->cached_function_in_use = NULL;
+  ts->named_commands = NULL;
   ts->sourcemap_str = JS_UNDEFINED;
+  memset(&ts->init_timing, 0, sizeof(ts->init_timing));
+  for (int i = 0; i < LIVE_FUNCTION_CACHE_SIZE; ++i) {
+    ts->live_functions[i].uid = 0;
+    ts->live_functions[i].func = JS_UNDEFINED;
+    ts->live_functions[i].last_used = 0;
+  }
+  ts->live_function_clock = 0;
   atomic_init(&ts->replacement_thread_state, REPLACEMENT_THREAD_STATE_NONE);
 
   if (0 != clock_gettime(MONOTONIC_CLOCK, &ts->last_active_time)) {
@@ -126,6 +146,53 @@ int init_thread_state(ThreadState *ts, SocketState *socket_state,
     return -1;
   }
 
+  return 0;
+}
+
+// Timing is best effort, so a lap that can't be timed counts as zero.
+static void start_lap(struct timespec *t) {
+  if (0 != clock_gettime(MONOTONIC_CLOCK, t))
+    memset(t, 0, sizeof(*t));
+}
+
+// Returns the microseconds elapsed since '*t' and sets '*t' to the current
+// time.
+static int64_t lap_us(struct timespec *t) {
+  struct timespec now;
+  if ((t->tv_sec == 0 && t->tv_nsec == 0) ||
+      0 != clock_gettime(MONOTONIC_CLOCK, &now))
+    return 0;
+  int64_t us = ns_time_diff(&now, t) / 1000;
+  *t = now;
+  return us;
+}
+
+int init_thread_state_without_runtime(ThreadState *ts,
+                                      SocketState *socket_state,
+                                      int thread_index) {
+  jsockd_logf(LOG_DEBUG,
+              "Calling init_thread_state_without_runtime for thread %i\n",
+              thread_index);
+  ts->rt = NULL;
+  ts->ctx = NULL;
+  ts->compiled_module = JS_UNDEFINED;
+  ts->backtrace_module = JS_UNDEFINED;
+  ts->module_generation =
+      atomic_load_explicit(&g_module_generation, memory_order_relaxed);
+  return init_thread_state_fields(ts, socket_state, thread_index);
+}
+
+// Creates the runtime and loads the built-in modules.
+static int init_runtime(ThreadState *ts, SocketState *socket_state,
+                        int thread_index) {
+  jsockd_logf(LOG_DEBUG, "Calling init_thread_state for thread %i\n",
+              thread_index);
+
+  if (0 != init_thread_state_fields(ts, socket_state, thread_index))
+    return -1;
+
+  struct timespec t;
+  start_lap(&t);
   ts->rt = JS_NewRuntime();
   if (!ts->rt) {
     jsockd_log(LOG_ERROR | LOG_INTERACTIVE, "Failed to create JS runtime\n");
@@ -167,6 +234,7 @@ int init_thread_state(ThreadState *ts, SocketState *socket_state,
 
   JS_SetModuleLoaderFunc2(ts->rt, NULL, jsockd_js_module_loader,
                           js_module_check_attributes, NULL);
+  ts->init_timing.runtime_us = lap_us(&t);
 
   JSValue shims_module = load_binary_module(ts->ctx, g_shims_module_bytecode,
                                             g_shims_module_bytecode_size);
@@ -177,6 +245,7 @@ int init_thread_state(ThreadState *ts, SocketState *socket_state,
   }
   assert(!JS_IsException(shims_module));
   JS_FreeValue(ts->ctx, shims_module); // imported just for side effects
+  ts->init_timing.shims_us = lap_us(&t);
 
   ts->backtrace_module = load_binary_module(
       ts->ctx, g_backtrace_module_bytecode, g_backtrace_module_bytecode_size);
@@ -187,11 +256,21 @@ int init_thread_state(ThreadState *ts, SocketState *socket_state,
     JS_FreeValue(ts->ctx, exception);
   }
   assert(!JS_IsException(ts->backtrace_module));
+  ts->init_timing.backtrace_us = lap_us(&t);
 
-  // Load the precompiled module.
-  if (g_module_bytecode)
-    ts->compiled_module =
-        load_binary_module(ts->ctx, g_module_bytecode, g_module_bytecode_size);
+  return 0;
+}
+
+static int load_module(ThreadState *ts, const uint8_t *module_bytecode,
+                       size_t module_bytecode_size) {
+  struct timespec t;
+  start_lap(&t);
+
+  // Load the precompiled module, which may be followed by named commands.
+  if (module_bytecode)
+    ts->compiled_module = load_binary_module(
+        ts->ctx, module_bytecode,
+        named_commands_module_size(module_bytecode, module_bytecode_size));
   else
     ts->compiled_module = JS_UNDEFINED;
   if (JS_IsException(ts->compiled_module)) {
@@ -222,6 +301,7 @@ int init_thread_state(ThreadState *ts, SocketState *socket_state,
   }
 
   JS_SetInterruptHandler(ts->rt, interrupt_handler, ts);
+  ts->init_timing.module_us = lap_us(&t);
 
 #ifdef CMAKE_BUILD_TYPE_DEBUG
   ts->manually_trigger_thread_state_reset = false;
@@ -230,23 +310,129 @@ int init_thread_state(ThreadState *ts, SocketState *socket_state,
   return 0;
 }
 
+int init_thread_state(ThreadState *ts, SocketState *socket_state,
+                      int thread_index) {
+  if (0 != init_runtime(ts, socket_state, thread_index))
+    return -1;
+
+  // Hold the lock so that a reload can't unmap the bytecode while the module
+  // is loading. Loading copies the bytecode, so the runtime doesn't need the
+  // mapping afterwards. At startup, main() holds the lock for writing while it
+  // verifies the module bytecode, so the runtime threads create their runtimes
+  // in the meantime and then wait here.
+  struct timespec t;
+  start_lap(&t);
+  rwlock_rdlock(&g_module_bytecode_lock);
+  ts->init_timing.module_wait_us = lap_us(&t);
+  int r = -1;
+  if (g_cmd_args.es6_module_bytecode_file && !g_module_bytecode)
+    jsockd_logf(LOG_DEBUG, "No module bytecode to load on thread %i\n",
+                thread_index);
+  else
+    r = load_module(ts, g_module_bytecode, g_module_bytecode_size);
+  ts->module_generation =
+      atomic_load_explicit(&g_module_generation, memory_order_relaxed);
+  ts->named_commands = ref_named_commands_set(g_named_commands);
+  rwlock_unlock(&g_module_bytecode_lock);
+  return r;
+}
+
+int init_thread_state_with_module(ThreadState *ts, SocketState *socket_state,
+                                  int thread_index,
+                                  const uint8_t *module_bytecode,
+                                  size_t module_bytecode_size) {
+  if (0 != init_runtime(ts, socket_state, thread_index))
+    return -1;
+  return load_module(ts, module_bytecode, module_bytecode_size);
+}
+
 void register_thread_state_runtime(JSRuntime *rt, ThreadState *ts) {
   JS_SetRuntimeOpaque2(rt, (void *)ts);
+  // The runtime may have been created for a different ThreadState struct (see
+  // rebind_thread_state and the swap in handle_line_1_message_uid).
+  JS_SetInterruptHandler(rt, interrupt_handler, ts);
+}
+
+void rebind_thread_state(ThreadState *ts, SocketState *socket_state,
+                         int thread_index) {
+  assert(thread_index < MAX_THREADS);
+  ts->thread_index = thread_index;
+  ts->socket_state = socket_state;
+  ts->input_buf = g_thread_state_input_buffers[thread_index];
+  register_thread_state_runtime(ts->rt, ts);
+  // Otherwise the runtime could be shut down for being idle as soon as it's
+  // been taken from the pool.
+  if (0 != clock_gettime(MONOTONIC_CLOCK, &ts->last_active_time))
+    jsockd_logf(LOG_ERROR, "Error getting time while binding thread %i: %s\n",
+                thread_index, strerror(errno));
 }
 
 ThreadState *get_runtime_thread_state(JSRuntime *rt) {
   return (ThreadState *)JS_GetRuntimeOpaque2(rt);
 }
 
+JSValue get_live_function(ThreadState *ts, HashCacheUid uid) {
+  if (uid == 0)
+    return JS_UNDEFINED;
+  for (int i = 0; i < LIVE_FUNCTION_CACHE_SIZE; ++i) {
+    LiveFunction *lf = &ts->live_functions[i];
+    if (lf->uid == uid) {
+      lf->last_used = ++ts->live_function_clock;
+      return JS_DupValue(ts->ctx, lf->func);
+    }
+  }
+  return JS_UNDEFINED;
+}
+
+void add_live_function(ThreadState *ts, HashCacheUid uid, JSValue func) {
+  if (uid == 0)
+    return;
+  LiveFunction *victim = &ts->live_functions[0];
+  for (int i = 0; i < LIVE_FUNCTION_CACHE_SIZE; ++i) {
+    LiveFunction *lf = &ts->live_functions[i];
+    if (lf->uid == 0) {
+      victim = lf;
+      break;
+    }
+    // Compared as a difference so that the clock can wrap around.
+    if ((int32_t)(lf->last_used - victim->last_used) < 0)
+      victim = lf;
+  }
+  JS_FreeValue(ts->ctx, victim->func);
+  victim->uid = uid;
+  victim->func = JS_DupValue(ts->ctx, func);
+  victim->last_used = ++ts->live_function_clock;
+}
+
+static void free_live_functions(ThreadState *ts) {
+  for (int i = 0; i < LIVE_FUNCTION_CACHE_SIZE; ++i) {
+    JS_FreeValue(ts->ctx, ts->live_functions[i].func);
+    ts->live_functions[i].uid = 0;
+    ts->live_functions[i].func = JS_UNDEFINED;
+  }
+}
+
 void cleanup_command_state(ThreadState *ts) {
   JS_FreeValue(ts->ctx, ts->compiled_query);
   free(ts->dangling_bytecode);
   ts->dangling_bytecode = NULL;
   ts->compiled_query = JS_UNDEFINED;
+  ts->command_error = NULL;
+  ts->command_unknown = false;
   if (ts->cached_function_in_use) {
     decrement_hash_cache_bucket_refcount(&ts->cached_function_in_use->bucket);
     ts->cached_function_in_use = NULL;
   }
+  cancel_async_messages(ts);
+  ts->command_deadline.tv_sec = 0;
+  ts->command_deadline.tv_nsec = 0;
+}
+
+bool command_deadline_passed(const ThreadState *ts,
+                             const struct timespec *now) {
+  if (ts->command_deadline.tv_sec == 0 && ts->command_deadline.tv_nsec == 0)
+    return false;
+  return ns_time_diff(now, &ts->command_deadline) > 0;
 }
 
 void cleanup_thread_state(ThreadState *ts) {
@@ -254,6 +440,9 @@ void cleanup_thread_state(ThreadState *ts) {
     return;
 
   cleanup_command_state(ts);
+  free_live_functions(ts);
+  unref_named_commands_set(ts->named_commands);
+  ts->named_commands = NULL;
 
   js_std_free_handlers(ts->rt);
 
@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include "hash_cache.h"
+#include "named_commands.h"
 #include "quickjs.h"
 #include <pthread.h>
 #include <stdatomic.h>
@@ -13,6 +14,10 @@
 typedef struct {
   const uint8_t *bytecode;
   size_t bytecode_size;
+  // Non-NULL if the bytecode was loaded from the on-disk command cache, in
+  // which case it lies within this mapping rather than being malloc'd.
+  const uint8_t *mapping;
+  size_t mapping_size;
 } CachedFunction;
 
 typedef struct {
@@ -29,14 +34,50 @@ enum {
   REPLACEMENT_THREAD_STATE_CLEANUP_COMPLETE
 };
 
+struct Conn;
+struct Record;
+struct ReloadRequest;
+
+// A message sent by JSockD.sendMessageAsync, which is awaiting a response.
+typedef struct {
+  uint32_t n;
+  JSValue resolving_funcs[2];
+} AsyncMessage;
+
 typedef struct {
   const char *unix_socket_filename;
   int sockfd;
   int streamfd;
   int stream_io_err;
   struct sockaddr_un addr;
+  // The connection (see dispatch.h) whose command is executing.
+  struct Conn *conn;
+  // In shared-listener mode, the record (see dispatch.h) whose command is
+  // executing. Message responses are then read by the dispatcher thread rather
+  // than directly from 'streamfd'.
+  struct Record *record;
+  // A ?reload command, which is handed to the reload thread together with
+  // 'record' once the runtime thread is done with the record.
+  struct ReloadRequest *reload_request;
 } SocketState;
 
+// How long each phase of creating a runtime took, in microseconds (see
+// ?startup).
+typedef struct {
+  int64_t runtime_us;     // creating the runtime and context
+  int64_t shims_us;       // evaluating the shims module
+  int64_t backtrace_us;   // loading the backtrace module
+  int64_t module_wait_us; // waiting for the module bytecode to be verified
+  int64_t module_us;      // evaluating the module bytecode
+} RuntimeInitTiming;
+
+// A command function evaluated in a runtime (see get_live_function).
+typedef struct {
+  HashCacheUid uid; // 0 if the entry is unused
+  JSValue func;
+  uint32_t last_used;
+} LiveFunction;
+
 // The state for each thread which runs a QuickJS VM.
 typedef struct ThreadState {
   int thread_index;
@@ -47,8 +88,16 @@ typedef struct ThreadState {
   int line_n;
   JSValue compiled_module;
   JSValue compiled_query;
+  // If compiled_query is JS_EXCEPTION because the command can't be run (rather
+  // than because it failed to compile), the JSON-encoded reason.
+  const char *command_error;
+  // Set with command_error if the command was sent by hash and isn't in the
+  // command cache, so that the client knows to send its source instead.
+  bool command_unknown;
   JSValue backtrace_module;
   struct timespec last_js_execution_start;
+  // When the current command's budget (if it has one) runs out, or zero.
+  struct timespec command_deadline;
   char *input_buf;
   char current_uuid[MESSAGE_UUID_MAX_BYTES + 1 /*zeroterm*/];
   size_t current_uuid_len;
@@ -59,12 +108,28 @@ typedef struct ThreadState {
   bool truncated;
   JSValue sourcemap_str;
   int64_t last_command_exec_time_ns;
+  AsyncMessage async_messages[MAX_ASYNC_MESSAGES];
+  int n_async_messages;
+  uint32_t next_async_message_n;
+  // The length of a partially read async message response at the start of
+  // 'input_buf' (not used in shared-listener mode).
+  size_t async_response_bytes;
+  // The value of g_module_generation when the runtime's module was loaded.
+  int module_generation;
+  // A reference to the named commands of that module (NULL without a
+  // runtime).
+  NamedCommandsSet *named_commands;
   struct ThreadState *my_replacement;
   atomic_int replacement_thread_state;
   pthread_t replacement_thread;
   struct timespec last_active_time;
   uint8_t *dangling_bytecode;
   CachedFunctionBucket *cached_function_in_use;
+  RuntimeInitTiming init_timing;
+  // The runtime's most recently used command functions. They belong to the
+  // runtime, so they go with it when it's replaced.
+  LiveFunction live_functions[LIVE_FUNCTION_CACHE_SIZE];
+  uint32_t live_function_clock;
 #ifdef CMAKE_BUILD_TYPE_DEBUG
   bool manually_trigger_thread_state_reset;
 #endif
@@ -72,9 +137,33 @@ typedef struct ThreadState {
 
 int init_thread_state(ThreadState *ts, SocketState *socket_state,
                       int thread_index);
+// As init_thread_state, but loads the given module bytecode rather than
+// g_module_bytecode.
+int init_thread_state_with_module(ThreadState *ts, SocketState *socket_state,
+                                  int thread_index,
+                                  const uint8_t *module_bytecode,
+                                  size_t module_bytecode_size);
+// Leaves the thread state as cleanup_thread_state would, with no QuickJS
+// runtime. The runtime is created when the thread needs it.
+int init_thread_state_without_runtime(ThreadState *ts,
+                                      SocketState *socket_state,
+                                      int thread_index);
 void register_thread_state_runtime(JSRuntime *rt, ThreadState *ts);
+// Binds a thread state created for the spare pool (see spare_pool.h) to the
+// runtime thread with the given socket state and thread index, and registers
+// its runtime.
+void rebind_thread_state(ThreadState *ts, SocketState *socket_state,
+                         int thread_index);
 ThreadState *get_runtime_thread_state(JSRuntime *rt);
+// Returns a new reference to the command function with the given UID if it has
+// been evaluated in the runtime, or JS_UNDEFINED.
+JSValue get_live_function(ThreadState *ts, HashCacheUid uid);
+// Keeps a reference to an evaluated command function, replacing the least
+// recently used function if the cache is full.
+void add_live_function(ThreadState *ts, HashCacheUid uid, JSValue func);
 void cleanup_command_state(ThreadState *ts);
+// True if the current command has a deadline and 'now' is past it.
+bool command_deadline_passed(const ThreadState *ts, const struct timespec *now);
 void cleanup_thread_state(ThreadState *ts);
 
 #endif
@@ -2,6 +2,7 @@
 #include "globals.h"
 #include "log.h"
 #include <errno.h>
+#include <fcntl.h>
 #ifdef __linux__
 #define _GNU_SOURCE // make ppoll available
 #endif
@@ -22,6 +23,19 @@ void mutex_lock_(pthread_mutex_t *m, const char *file, int line) {
   }
 }
 
+// Returns false if the mutex is already locked.
+bool mutex_trylock_(pthread_mutex_t *m, const char *file, int line) {
+  int r = pthread_mutex_trylock(m);
+  if (r == EBUSY)
+    return false;
+  if (r != 0) {
+    fprintf(stderr, "Failed to lock mutex at %s:%i: %s\n", file, line,
+            strerror(r));
+    exit(1);
+  }
+  return true;
+}
+
 void mutex_unlock_(pthread_mutex_t *m, const char *file, int line) {
   int r;
   if (0 != (r = pthread_mutex_unlock(m))) {
@@ -40,6 +54,77 @@ void mutex_init_(pthread_mutex_t *m, const char *file, int line) {
   }
 }
 
+void rwlock_rdlock_(pthread_rwlock_t *l, const char *file, int line) {
+  int r;
+  if (0 != (r = pthread_rwlock_rdlock(l))) {
+    fprintf(stderr, "Failed to read-lock rwlock at %s:%i: %s\n", file, line,
+            strerror(r));
+    exit(1);
+  }
+}
+
+void rwlock_wrlock_(pthread_rwlock_t *l, const char *file, int line) {
+  int r;
+  if (0 != (r = pthread_rwlock_wrlock(l))) {
+    fprintf(stderr, "Failed to write-lock rwlock at %s:%i: %s\n", file, line,
+            strerror(r));
+    exit(1);
+  }
+}
+
+void rwlock_unlock_(pthread_rwlock_t *l, const char *file, int line) {
+  int r;
+  if (0 != (r = pthread_rwlock_unlock(l))) {
+    fprintf(stderr, "Failed to unlock rwlock at %s:%i: %s\n", file, line,
+            strerror(r));
+    exit(1);
+  }
+}
+
+int cond_init_monotonic(pthread_cond_t *c) {
+  // Don't need a monotonic clock on Mac because we use
+  // pthread_cond_timedwait_relative_np in cond_timedwait_ms.
+#ifdef __APPLE__
+  return pthread_cond_init(c, NULL);
+#else
+  pthread_condattr_t attr;
+  if (0 != pthread_condattr_init(&attr))
+    return -1;
+  if (0 != pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) {
+    pthread_condattr_destroy(&attr);
+    return -1;
+  }
+  if (0 != pthread_cond_init(c, &attr)) {
+    pthread_condattr_destroy(&attr);
+    return -1;
+  }
+  return pthread_condattr_destroy(&attr);
+#endif
+}
+
+// Waits on a condition variable initialized with cond_init_monotonic. The
+// caller must hold the mutex. Returns 0 if woken (possibly spuriously),
+// ETIMEDOUT on timeout, or another non-zero value on error. A negative
+// 'timeout_ms' waits indefinitely.
+int cond_timedwait_ms(pthread_cond_t *c, pthread_mutex_t *m, int timeout_ms) {
+  if (timeout_ms < 0)
+    return pthread_cond_wait(c, m);
+#ifdef __APPLE__
+  struct timespec relative_time = {.tv_sec = timeout_ms / 1000,
+                                   .tv_nsec = (timeout_ms % 1000) * 1000000L};
+  return pthread_cond_timedwait_relative_np(c, m, &relative_time);
+#else
+  struct timespec abstime;
+  if (0 != clock_gettime(CLOCK_MONOTONIC, &abstime))
+    return -1;
+  abstime.tv_sec += timeout_ms / 1000;
+  abstime.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  abstime.tv_sec += abstime.tv_nsec / 1000000000;
+  abstime.tv_nsec %= 1000000000;
+  return pthread_cond_timedwait(c, m, &abstime);
+#endif
+}
+
 int write_all(int fd, const char *buf, size_t len) {
   while (len > 0) {
     int n = write(fd, buf, len);
@@ -180,9 +265,38 @@ void log_error_with_prefix(const char *prefix, JSContext *ctx,
   jsockd_logf(LOG_ERROR, "%s%.*s\n", prefix, (int)wbuf.index, wbuf.buf);
 }
 
+int self_pipe_init(int fds[2]) {
+  if (0 != pipe(fds))
+    return -1;
+  for (int i = 0; i < 2; ++i) {
+    int flags = fcntl(fds[i], F_GETFL);
+    if (flags == -1 || -1 == fcntl(fds[i], F_SETFL, flags | O_NONBLOCK) ||
+        -1 == fcntl(fds[i], F_SETFD, FD_CLOEXEC))
+      return -1;
+  }
+  return 0;
+}
+
+int shutdown_pipe_init(void) { return self_pipe_init(g_shutdown_pipe); }
+
+void set_interrupted_or_error(void) {
+  int saved_errno = errno;
+  atomic_store_explicit(&g_interrupted_or_error, true, memory_order_release);
+  // The pipe is never drained, so one byte is enough to wake every thread.
+  // EAGAIN just means that the pipe is full.
+  const char c = 0;
+  if (g_shutdown_pipe[1] >= 0) {
+    while (-1 == write(g_shutdown_pipe[1], &c, sizeof(c)) && errno == EINTR)
+      ;
+  }
+  errno = saved_errno;
+}
+
 PollFdResult poll_fd(int fd, int timeout_ms) {
-  struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLPRI};
-  if (0 == poll(&pfd, 1, timeout_ms)) {
+  struct pollfd pfds[] = {{.fd = fd, .events = POLLIN | POLLPRI},
+                          {.fd = g_shutdown_pipe[0], .events = POLLIN}};
+  int r = poll(pfds, 2, timeout_ms);
+  if (r == 0 || (r > 0 && !pfds[0].revents)) {
     if (atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire))
       return SIG_INTERRUPT_OR_ERROR;
     return GO_AROUND;
@@ -198,11 +312,13 @@ PollFdResult ppoll_fd(int fd, const struct timespec *timeout) {
       MAX(1, (int)timeout->tv_sec * 1000 + (int)timeout->tv_nsec / 1000000);
   return poll_fd(fd, ms);
 #else
-  struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLPRI};
+  struct pollfd pfds[] = {{.fd = fd, .events = POLLIN | POLLPRI},
+                          {.fd = g_shutdown_pipe[0], .events = POLLIN}};
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wimplicit-function-declaration"
-  if (0 == ppoll(&pfd, 1, timeout, NULL)) {
+  int r = ppoll(pfds, 2, timeout, NULL);
 #pragma GCC diagnostic pop
+  if (r == 0 || (r > 0 && !pfds[0].revents)) {
     if (atomic_load_explicit(&g_interrupted_or_error, memory_order_acquire))
       return SIG_INTERRUPT_OR_ERROR;
     return GO_AROUND;
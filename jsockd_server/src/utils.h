@@ -11,8 +11,12 @@
 #define STRCONST_IOVEC(s) {.iov_base = (void *)(s), .iov_len = STRCONST_LEN(s)}
 
 void mutex_lock_(pthread_mutex_t *m, const char *file, int line);
+bool mutex_trylock_(pthread_mutex_t *m, const char *file, int line);
 void mutex_unlock_(pthread_mutex_t *m, const char *file, int line);
 void mutex_init_(pthread_mutex_t *m, const char *file, int line);
+void rwlock_rdlock_(pthread_rwlock_t *l, const char *file, int line);
+void rwlock_wrlock_(pthread_rwlock_t *l, const char *file, int line);
+void rwlock_unlock_(pthread_rwlock_t *l, const char *file, int line);
 void munmap_or_warn(const void *addr, size_t length);
 int64_t ns_time_diff(const struct timespec *t1, const struct timespec *t2);
 void memswap_small(void *m1, void *m2, size_t size);
@@ -22,14 +26,33 @@ void timespec_to_iso8601(const struct timespec *ts, char *buf, size_t buflen);
 void print_value_to_stdout(void *opaque, const char *buf, size_t size);
 char *read_all_stdin(size_t *out_size);
 
+int cond_init_monotonic(pthread_cond_t *c);
+int cond_timedwait_ms(pthread_cond_t *c, pthread_mutex_t *m, int timeout_ms);
+
 #define mutex_lock(m) mutex_lock_((m), __FILE__, __LINE__)
+#define mutex_trylock(m) mutex_trylock_((m), __FILE__, __LINE__)
 #define mutex_unlock(m) mutex_unlock_((m), __FILE__, __LINE__)
 #define mutex_init(m) mutex_init_((m), __FILE__, __LINE__)
+#define rwlock_rdlock(l) rwlock_rdlock_((l), __FILE__, __LINE__)
+#define rwlock_wrlock(l) rwlock_wrlock_((l), __FILE__, __LINE__)
+#define rwlock_unlock(l) rwlock_unlock_((l), __FILE__, __LINE__)
 
 int write_all(int fd, const char *buf, size_t len);
 int writev_all(int fildes, struct iovec *iov, int iovcnt);
 
+// Creates a non-blocking, close-on-exec pipe whose write end can be written
+// to from a signal handler to wake a thread polling the read end.
+int self_pipe_init(int fds[2]);
+// Creates g_shutdown_pipe.
+int shutdown_pipe_init(void);
+// Sets g_interrupted_or_error and wakes every thread polling the shutdown
+// pipe. Async-signal-safe.
+void set_interrupted_or_error(void);
+
 typedef enum { READY, SIG_INTERRUPT_OR_ERROR, GO_AROUND } PollFdResult;
+// The shutdown pipe is polled along with 'fd', so SIG_INTERRUPT_OR_ERROR is
+// returned as soon as the server starts to shut down. A negative 'timeout_ms'
+// waits indefinitely.
 PollFdResult poll_fd(int fd, int timeout_ms);
 PollFdResult ppoll_fd(int fd, const struct timespec *timeout);
 
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+set -e
+
+export JSOCKD_BYTECODE_MODULE_PUBLIC_KEY=dangerously_allow_invalid_signatures
+export JSOCKD_COMMAND_CACHE_KEY=000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f
+
+cd jsockd_server
+
+./mk.sh Debug
+
+cat <<END >/tmp/jsockd_command_cache_dir_test_module.mjs
+export const double = (x) => x * 2;
+END
+
+build_Debug/jsockd -c /tmp/jsockd_command_cache_dir_test_module.mjs /tmp/jsockd_command_cache_dir_test_module.qjsb
+
+rm -rf /tmp/jsockd_command_cache_dir_test_cache
+rm -f /tmp/jsockd_command_cache_dir_test_sock
+
+run_server() {
+    ./build_Debug/jsockd -cd /tmp/jsockd_command_cache_dir_test_cache -m /tmp/jsockd_command_cache_dir_test_module.qjsb -s /tmp/jsockd_command_cache_dir_test_sock > /tmp/jsockd_command_cache_dir_test_server_output 2>&1 &
+    server_pid=$!
+    i=0
+    while ! grep -q '^READY 1 ' /tmp/jsockd_command_cache_dir_test_server_output && [ $i -lt 15 ]; do
+      echo "Waiting for server to start"
+      sleep 1
+      i=$(($i + 1))
+    done
+}
+
+fail() {
+    echo "$1"
+    echo "Server output:"
+    cat /tmp/jsockd_command_cache_dir_test_server_output
+    kill $server_pid 2>/dev/null || true
+    exit 1
+}
+
+run_server
+grep -q 'Loaded 0 commands from the command cache' /tmp/jsockd_command_cache_dir_test_server_output || fail "Expected an empty command cache"
+{ printf 'a\n(m, p) => m.double(p)\n1\n'; sleep 1; echo '?quit'; } | ( nc -U /tmp/jsockd_command_cache_dir_test_sock > /tmp/jsockd_command_cache_dir_test_output || true )
+wait $server_pid || fail "Server exited with an error"
+grep -q '^a ok 2$' /tmp/jsockd_command_cache_dir_test_output || fail "Expected a response"
+[ "$(ls /tmp/jsockd_command_cache_dir_test_cache | wc -l)" -eq 1 ] || fail "Expected one file in the command cache directory"
+
+# The restarted server loads the command rather than compiling it.
+run_server
+grep -q 'Loaded 1 commands from the command cache' /tmp/jsockd_command_cache_dir_test_server_output || fail "Expected the command to be loaded from the cache"
+{ printf 'b\n(m, p) => m.double(p)\n2\n'; sleep 1; echo '?quit'; } | ( nc -U /tmp/jsockd_command_cache_dir_test_sock > /tmp/jsockd_command_cache_dir_test_output || true )
+wait $server_pid || fail "Server exited with an error"
+grep -q '^b ok 4$' /tmp/jsockd_command_cache_dir_test_output || fail "Expected a response"
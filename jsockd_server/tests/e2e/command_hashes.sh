@@ -0,0 +1,59 @@
+#!/bin/sh
+
+set -e
+
+cd jsockd_server
+
+./mk.sh Debug
+
+rm -f /tmp/jsockd_command_hashes_test_sock /tmp/jsockd_command_hashes_test_input
+./build_Debug/jsockd -s /tmp/jsockd_command_hashes_test_sock > /tmp/jsockd_command_hashes_test_server_output 2>&1 &
+server_pid=$!
+
+fail() {
+    echo "$1"
+    echo "Server output:"
+    cat /tmp/jsockd_command_hashes_test_server_output
+    echo "Client output:"
+    cat /tmp/jsockd_command_hashes_test_output
+    kill $server_pid 2>/dev/null || true
+    exit 1
+}
+
+i=0
+while ! grep -q '^READY 1 ' /tmp/jsockd_command_hashes_test_server_output && [ $i -lt 15 ]; do
+  echo "Waiting for server to start"
+  sleep 1
+  i=$(($i + 1))
+done
+
+# The hash depends on the platform, so it's read from the server's response
+# before the command is sent again by hash.
+mkfifo /tmp/jsockd_command_hashes_test_input
+( nc -U /tmp/jsockd_command_hashes_test_sock < /tmp/jsockd_command_hashes_test_input > /tmp/jsockd_command_hashes_test_output || true ) &
+exec 3>/tmp/jsockd_command_hashes_test_input
+
+printf 'a\n(m, p) => p + 1\n1\n' >&3
+printf '?commandhashes\n' >&3
+printf 'b\n(m, p) => p + 1\n2\n' >&3
+i=0
+while ! grep -q '^b ok 3$' /tmp/jsockd_command_hashes_test_output && [ $i -lt 15 ]; do
+  sleep 1
+  i=$(($i + 1))
+done
+hash=$(sed -n 's/^b command_hash \([0-9a-f]*\)$/\1/p' /tmp/jsockd_command_hashes_test_output)
+
+printf 'c\n#%s\n3\n' "$hash" >&3
+printf 'd\n#0123\n4\n' >&3
+sleep 1
+printf '?quit\n' >&3
+exec 3>&-
+wait $server_pid || fail "Server exited with an error"
+rm -f /tmp/jsockd_command_hashes_test_input
+
+grep -q '^a ok 2$' /tmp/jsockd_command_hashes_test_output || fail "Expected a response to a"
+grep -q '^a command_hash ' /tmp/jsockd_command_hashes_test_output && fail "Expected no hash before ?commandhashes"
+grep -q '^commandhashes$' /tmp/jsockd_command_hashes_test_output || fail "Expected a response to ?commandhashes"
+[ -n "$hash" ] || fail "Expected a hash for b"
+grep -q '^c ok 4$' /tmp/jsockd_command_hashes_test_output || fail "Expected c to run by hash"
+grep -q '^d unknown_command "command not in cache"$' /tmp/jsockd_command_hashes_test_output || fail "Expected an unknown command"
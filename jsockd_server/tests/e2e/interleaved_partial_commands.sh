@@ -0,0 +1,59 @@
+#!/bin/sh
+
+set -e
+
+cd jsockd_server
+
+./mk.sh Debug
+
+rm -f /tmp/jsockd_interleaved_test_sock /tmp/jsockd_interleaved_test_input_a /tmp/jsockd_interleaved_test_input_b
+./build_Debug/jsockd -s /tmp/jsockd_interleaved_test_sock > /tmp/jsockd_interleaved_test_server_output 2>&1 &
+server_pid=$!
+
+fail() {
+    echo "$1"
+    echo "Server output:"
+    cat /tmp/jsockd_interleaved_test_server_output
+    echo "Client A output:"
+    cat /tmp/jsockd_interleaved_test_output_a
+    echo "Client B output:"
+    cat /tmp/jsockd_interleaved_test_output_b
+    kill $server_pid 2>/dev/null || true
+    exit 1
+}
+
+wait_for_output() {
+  i=0
+  while ! grep -q "$2" "$1" && [ $i -lt 15 ]; do
+    sleep 1
+    i=$(($i + 1))
+  done
+  grep -q "$2" "$1"
+}
+
+wait_for_output /tmp/jsockd_interleaved_test_server_output '^READY 1 ' || fail "Server didn't start"
+
+# Two connections on the same socket, both served by the same thread.
+mkfifo /tmp/jsockd_interleaved_test_input_a /tmp/jsockd_interleaved_test_input_b
+( nc -U /tmp/jsockd_interleaved_test_sock < /tmp/jsockd_interleaved_test_input_a > /tmp/jsockd_interleaved_test_output_a || true ) &
+exec 3>/tmp/jsockd_interleaved_test_input_a
+( nc -U /tmp/jsockd_interleaved_test_sock < /tmp/jsockd_interleaved_test_input_b > /tmp/jsockd_interleaved_test_output_b || true ) &
+exec 4>/tmp/jsockd_interleaved_test_input_b
+
+# A partial command on one connection mustn't hold up the other.
+printf 'a\n(m, p) => p + 1\n' >&3
+sleep 1
+printf 'b\n(m, p) => p * 2\n' >&4
+sleep 1
+printf '5\nc\n' >&4
+wait_for_output /tmp/jsockd_interleaved_test_output_b '^b ok 10$' || fail "Expected a response to b while a was incomplete"
+printf '1\n' >&3
+wait_for_output /tmp/jsockd_interleaved_test_output_a '^a ok 2$' || fail "Expected a response to a once it was complete"
+printf '(m, p) => p - 1\n3\n' >&4
+wait_for_output /tmp/jsockd_interleaved_test_output_b '^c ok 2$' || fail "Expected a response to c once it was complete"
+
+exec 3>&-
+printf '?quit\n' >&4
+exec 4>&-
+wait $server_pid || fail "Server exited with an error"
+rm -f /tmp/jsockd_interleaved_test_input_a /tmp/jsockd_interleaved_test_input_b
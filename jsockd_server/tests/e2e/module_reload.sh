@@ -0,0 +1,81 @@
+#!/bin/sh
+
+set -e
+
+export JSOCKD_BYTECODE_MODULE_PUBLIC_KEY=dangerously_allow_invalid_signatures
+
+cd jsockd_server
+
+./mk.sh Debug
+
+cat <<END >/tmp/jsockd_module_reload_test_module_v1.mjs
+export const version = () => "v1";
+END
+cat <<END >/tmp/jsockd_module_reload_test_module_v2.mjs
+export const version = () => "v2";
+END
+cat <<END >/tmp/jsockd_module_reload_test_module_broken.mjs
+throw new Error("broken module");
+END
+
+# Compile the example modules to QuickJS bytecode.
+for v in v1 v2 broken; do
+    build_Debug/jsockd -c /tmp/jsockd_module_reload_test_module_$v.mjs /tmp/jsockd_module_reload_test_module_$v.qjsb
+done
+
+# A reload of the broken module is rejected, and the server carries on with
+# v1. After the reload of v2, commands switch to v2 once the replacement
+# runtime is ready, without any command being dropped.
+{
+    echo "before"
+    echo "(m, p) => m.version()"
+    echo "null"
+    echo "?reload /tmp/jsockd_module_reload_test_module_broken.qjsb"
+    echo "?reload /tmp/jsockd_module_reload_test_module_v2.qjsb"
+    i=0
+    while [ $i -lt 50 ]; do
+        echo "after$i"
+        echo "(m, p) => m.version()"
+        echo "null"
+        i=$(($i + 1))
+    done
+    echo "?quit"
+} > /tmp/jsockd_module_reload_test_input
+
+rm -f /tmp/jsockd_module_reload_test_sock
+./build_Debug/jsockd -m /tmp/jsockd_module_reload_test_module_v1.qjsb -s /tmp/jsockd_module_reload_test_sock > /tmp/jsockd_module_reload_test_server_output 2>&1 &
+server_pid=$!
+
+i=0
+while ! [ -e /tmp/jsockd_module_reload_test_sock ] && [ $i -lt 15 ]; do
+  echo "Waiting for server to start"
+  sleep 1
+  i=$(($i + 1))
+done
+sleep 1
+
+echo "Sending input to server..."
+# Pause between lines so that the replacement runtime has time to initialize
+# before the last command.
+perl -e 'use Time::HiRes qw(usleep); while (<>) { print; usleep(20000); }' < /tmp/jsockd_module_reload_test_input | ( nc -U /tmp/jsockd_module_reload_test_sock > /tmp/jsockd_module_reload_test_output || true )
+
+echo "Waiting for server to exit..."
+wait $server_pid
+
+fail() {
+    echo "$1"
+    echo "Client output:"
+    cat /tmp/jsockd_module_reload_test_output
+    echo "Server output:"
+    cat /tmp/jsockd_module_reload_test_server_output
+    exit 1
+}
+
+grep -q '^before ok "v1"$' /tmp/jsockd_module_reload_test_output || fail "Expected v1 before the reload"
+grep -q '^error: reload failed$' /tmp/jsockd_module_reload_test_output || fail "Expected the broken module to be rejected"
+grep -q '^reload$' /tmp/jsockd_module_reload_test_output || fail "Expected the v2 reload to succeed"
+grep -q '^after49 ok "v2"$' /tmp/jsockd_module_reload_test_output || fail "Expected v2 after the reload"
+n_ok=$(grep -c '^after[0-9]* ok "v[12]"$' /tmp/jsockd_module_reload_test_output)
+if [ "$n_ok" -ne 50 ]; then
+    fail "Expected 50 responses after the reload, got $n_ok"
+fi
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+set -e
+
+export JSOCKD_BYTECODE_MODULE_PUBLIC_KEY=dangerously_allow_invalid_signatures
+
+cd jsockd_server
+
+./mk.sh Debug
+
+cat <<END >/tmp/jsockd_named_commands_test_module.mjs
+export const double = (x) => x * 2;
+END
+cat <<END >/tmp/jsockd_named_commands_test_commands.json
+{"double": "(m, p) => m.double(p)", "util/identity": "(m, p) => p"}
+END
+
+build_Debug/jsockd -c /tmp/jsockd_named_commands_test_module.mjs /tmp/jsockd_named_commands_test_module.qjsb -cm /tmp/jsockd_named_commands_test_commands.json
+
+rm -f /tmp/jsockd_named_commands_test_sock
+./build_Debug/jsockd -nc -m /tmp/jsockd_named_commands_test_module.qjsb -s /tmp/jsockd_named_commands_test_sock > /tmp/jsockd_named_commands_test_server_output 2>&1 &
+server_pid=$!
+
+fail() {
+    echo "$1"
+    echo "Server output:"
+    cat /tmp/jsockd_named_commands_test_server_output
+    kill $server_pid 2>/dev/null || true
+    exit 1
+}
+
+i=0
+while ! grep -q '^READY 1 ' /tmp/jsockd_named_commands_test_server_output && [ $i -lt 15 ]; do
+  echo "Waiting for server to start"
+  sleep 1
+  i=$(($i + 1))
+done
+
+{
+  printf 'a\n@double\n21\n'
+  printf 'b\n@util/identity\n"x"\n'
+  printf 'c\n@missing\n1\n'
+  printf 'd\n(m, p) => p\n1\n'
+  sleep 1
+  echo '?quit'
+} | ( nc -U /tmp/jsockd_named_commands_test_sock > /tmp/jsockd_named_commands_test_output || true )
+wait $server_pid || fail "Server exited with an error"
+
+grep -q '^a ok 42$' /tmp/jsockd_named_commands_test_output || fail "Expected a response to @double"
+grep -q '^b ok "x"$' /tmp/jsockd_named_commands_test_output || fail "Expected a response to @util/identity"
+grep -q '^c exception "unknown named command"$' /tmp/jsockd_named_commands_test_output || fail "Expected an unknown named command"
+grep -q '^d exception "only named commands may be run"$' /tmp/jsockd_named_commands_test_output || fail "Expected inline source to be rejected with -nc"
@@ -0,0 +1,56 @@
+#!/bin/sh
+
+set -e
+
+export JSOCKD_BYTECODE_MODULE_PUBLIC_KEY=dangerously_allow_invalid_signatures
+
+cd jsockd_server
+
+./mk.sh Debug
+
+cat <<END >/tmp/jsockd_prefork_test_module.mjs
+export const double = (x) => x * 2;
+END
+
+build_Debug/jsockd -c /tmp/jsockd_prefork_test_module.mjs /tmp/jsockd_prefork_test_module.qjsb
+
+rm -f /tmp/jsockd_prefork_test_sock0 /tmp/jsockd_prefork_test_sock1
+./build_Debug/jsockd -f -m /tmp/jsockd_prefork_test_module.qjsb -s /tmp/jsockd_prefork_test_sock0 /tmp/jsockd_prefork_test_sock1 > /tmp/jsockd_prefork_test_server_output 2>&1 &
+server_pid=$!
+
+fail() {
+    echo "$1"
+    echo "Server output:"
+    cat /tmp/jsockd_prefork_test_server_output
+    kill $server_pid 2>/dev/null || true
+    exit 1
+}
+
+i=0
+while ! grep -q '^READY 2 ' /tmp/jsockd_prefork_test_server_output && [ $i -lt 15 ]; do
+  echo "Waiting for server to start"
+  sleep 1
+  i=$(($i + 1))
+done
+
+n_workers=$(pgrep -P $server_pid | wc -l)
+[ "$n_workers" -eq 2 ] || fail "Expected 2 worker processes, got $n_workers"
+
+# A worker that crashes is replaced, and the server carries on.
+kill -9 "$(pgrep -P $server_pid | head -n 1)"
+sleep 1
+kill -0 $server_pid || fail "Server exited after a worker was killed"
+n_workers=$(pgrep -P $server_pid | wc -l)
+[ "$n_workers" -eq 2 ] || fail "Expected the killed worker to be replaced, got $n_workers workers"
+
+# Both sockets are served, and ?quit on one of them shuts the server down.
+{ printf 'a\n(m, p) => m.double(p)\n1\n'; sleep 3; } | ( nc -U /tmp/jsockd_prefork_test_sock0 > /tmp/jsockd_prefork_test_output0 || true ) &
+{ printf 'b\n(m, p) => m.double(p)\n2\n'; sleep 1; echo '?quit'; } | ( nc -U /tmp/jsockd_prefork_test_sock1 > /tmp/jsockd_prefork_test_output1 || true )
+
+server_exit_code=0
+wait $server_pid || server_exit_code=$?
+wait
+
+grep -q '^a ok 2$' /tmp/jsockd_prefork_test_output0 || fail "Expected a response on the first socket"
+grep -q '^b ok 4$' /tmp/jsockd_prefork_test_output1 || fail "Expected a response on the second socket"
+[ "$server_exit_code" -eq 0 ] || fail "Server exited with code $server_exit_code"
@@ -0,0 +1,31 @@
+#!/bin/sh
+
+set -e
+
+cd jsockd_server
+
+./mk.sh Debug
+
+cat <<END >/tmp/jsockd_bad_signature_test_module.mjs
+export const hello = () => "hello";
+END
+
+# Compiled without a private key, so the module is unsigned.
+build_Debug/jsockd -c /tmp/jsockd_bad_signature_test_module.mjs /tmp/jsockd_bad_signature_test_module.qjsb
+
+# The runtime threads start creating their runtimes while the module is
+# verified, so they must all be shut down cleanly when verification fails.
+export JSOCKD_BYTECODE_MODULE_PUBLIC_KEY=0000000000000000000000000000000000000000000000000000000000000000
+server_exit_code=0
+./build_Debug/jsockd -m /tmp/jsockd_bad_signature_test_module.qjsb -s /tmp/jsockd_bad_signature_test_sock1 /tmp/jsockd_bad_signature_test_sock2 /tmp/jsockd_bad_signature_test_sock3 /tmp/jsockd_bad_signature_test_sock4 > /tmp/jsockd_bad_signature_test_output 2>&1 || server_exit_code=$?
+
+if [ "$server_exit_code" -eq 0 ]; then
+    echo "Expected the server to exit with an error"
+    cat /tmp/jsockd_bad_signature_test_output
+    exit 1
+fi
+if grep -q '^READY' /tmp/jsockd_bad_signature_test_output; then
+    echo "Expected the server not to print READY"
+    cat /tmp/jsockd_bad_signature_test_output
+    exit 1
+fi
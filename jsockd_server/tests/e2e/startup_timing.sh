@@ -0,0 +1,43 @@
+#!/bin/sh
+
+set -e
+
+export JSOCKD_BYTECODE_MODULE_PUBLIC_KEY=dangerously_allow_invalid_signatures
+
+cd jsockd_server
+
+./mk.sh Debug
+
+cat <<END >/tmp/jsockd_startup_timing_test_module.mjs
+export const hello = () => "hello";
+END
+
+build_Debug/jsockd -c /tmp/jsockd_startup_timing_test_module.mjs /tmp/jsockd_startup_timing_test_module.qjsb
+
+rm -f /tmp/jsockd_startup_timing_test_sock0 /tmp/jsockd_startup_timing_test_sock1
+./build_Debug/jsockd -m /tmp/jsockd_startup_timing_test_module.qjsb -s /tmp/jsockd_startup_timing_test_sock0 /tmp/jsockd_startup_timing_test_sock1 > /tmp/jsockd_startup_timing_test_server_output 2>&1 &
+server_pid=$!
+
+fail() {
+    echo "$1"
+    echo "Server output:"
+    cat /tmp/jsockd_startup_timing_test_server_output
+    kill $server_pid 2>/dev/null || true
+    exit 1
+}
+
+i=0
+while ! grep -q '^READY 2 ' /tmp/jsockd_startup_timing_test_server_output && [ $i -lt 15 ]; do
+  echo "Waiting for server to start"
+  sleep 1
+  i=$(($i + 1))
+done
+
+{ echo '?startup'; sleep 1; echo '?quit'; } | ( nc -U /tmp/jsockd_startup_timing_test_sock0 > /tmp/jsockd_startup_timing_test_output || true )
+wait $server_pid || fail "Server exited with an error"
+
+grep -q 'Startup timing: {"ready_us":' /tmp/jsockd_startup_timing_test_server_output || fail "Expected the startup timing report to be logged"
+report=$(head -n 1 /tmp/jsockd_startup_timing_test_output)
+echo "$report" | grep -q '^{"ready_us":[0-9]*,"module_load_us":[0-9]*,"runtimes":\[' || fail "Unexpected ?startup response: $report"
+echo "$report" | grep -q '{"thread":0,"runtime_us":[0-9]*,"shims_us":[0-9]*,"backtrace_us":[0-9]*,"module_wait_us":[0-9]*,"module_us":[0-9]*}' || fail "Expected timing for thread 0: $report"
+echo "$report" | grep -q '{"thread":1,' || fail "Expected timing for thread 1: $report"
@@ -3,21 +3,36 @@
 // to test that this is too big of a problem.
 
 #include "../../src/cmdargs.h"
+#include "../../src/disk_cache.h"
+#include "../../src/dispatch.h"
+#include "../../src/globals.h"
 #include "../../src/hash_cache.h"
 #include "../../src/hex.h"
 #include "../../src/line_buf.h"
+#include "../../src/mmap_file.h"
 #include "../../src/modcompiler.h"
+#include "../../src/mpmc_queue.h"
+#include "../../src/named_commands.h"
+#include "../../src/prefork.h"
+#include "../../src/spare_pool.h"
+#include "../../src/threadstate.h"
 #include "../../src/utils.h"
 #include "../../src/verify_bytecode.h"
 #include "../../src/wait_group.h"
 #include "lib/acutest.h"
 #include "lib/pcg.h"
 #include <assert.h>
+#include <dirent.h>
 #include <ed25519/ed25519.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #define snprintf_nowarn(...) (snprintf(__VA_ARGS__) < 0 ? abort() : (void)0)
 
@@ -175,6 +190,125 @@ static void TEST_hash_cash_fuzz(void) {
   }
 }
 
+static void TEST_hash_cache_gives_recently_used_entries_a_second_chance(void) {
+  MyHashCacheBucket buckets[8] = {0};
+  int payload = 55;
+
+  // All in bucket 1, so they fill the four buckets within reach.
+  for (uint64_t i = 0; i < 4; ++i) {
+    MyHashCacheBucket *b = add_to_hash_cache(
+        buckets, 3, (HashCacheUid)((i << 48) | 1), &payload, NULL);
+    TEST_ASSERT(b);
+    decrement_hash_cache_bucket_refcount(&b->bucket);
+  }
+  MyHashCacheBucket *b = get_hash_cache_entry(buckets, 3, (HashCacheUid)1);
+  TEST_ASSERT(b);
+  decrement_hash_cache_bucket_refcount(&b->bucket);
+
+  // The first entry was used, so the second is replaced.
+  b = add_to_hash_cache(buckets, 3, (HashCacheUid)(((uint64_t)4 << 48) | 1),
+                        &payload, NULL);
+  TEST_ASSERT(b);
+  decrement_hash_cache_bucket_refcount(&b->bucket);
+  b = get_hash_cache_entry(buckets, 3, (HashCacheUid)1);
+  TEST_ASSERT(b);
+  decrement_hash_cache_bucket_refcount(&b->bucket);
+  TEST_ASSERT(NULL == get_hash_cache_entry(
+                          buckets, 3, (HashCacheUid)(((uint64_t)1 << 48) | 1)));
+}
+
+static void TEST_hash_cache_evicts_unused_entries(void) {
+  MyHashCacheBucket buckets[8] = {0};
+  int payload = 66;
+  atomic_size_t hand = 0;
+  hash_cache_bucket_cleanup_call_count = 0;
+
+  MyHashCacheBucket *in_use = add_to_hash_cache(buckets, 3, (HashCacheUid)1,
+                                                &payload,
+                                                hash_cache_bucket_cleanup);
+  TEST_ASSERT(in_use);
+  for (uint64_t uid = 2; uid <= 3; ++uid) {
+    MyHashCacheBucket *b = add_to_hash_cache(
+        buckets, 3, (HashCacheUid)uid, &payload, hash_cache_bucket_cleanup);
+    TEST_ASSERT(b);
+    decrement_hash_cache_bucket_refcount(&b->bucket);
+  }
+  MyHashCacheBucket *b = get_hash_cache_entry(buckets, 3, (HashCacheUid)2);
+  TEST_ASSERT(b);
+  decrement_hash_cache_bucket_refcount(&b->bucket);
+
+  // The unused entry goes first, then the recently used one, and the entry in
+  // use is never evicted.
+  TEST_ASSERT(evict_from_hash_cache(buckets, 3, &hand,
+                                    hash_cache_bucket_cleanup));
+  TEST_ASSERT(NULL == get_hash_cache_entry(buckets, 3, (HashCacheUid)3));
+  TEST_ASSERT(evict_from_hash_cache(buckets, 3, &hand,
+                                    hash_cache_bucket_cleanup));
+  TEST_ASSERT(NULL == get_hash_cache_entry(buckets, 3, (HashCacheUid)2));
+  // With nothing left to evict, the hand goes round once.
+  size_t hand_before = atomic_load(&hand);
+  TEST_ASSERT(!evict_from_hash_cache(buckets, 3, &hand,
+                                     hash_cache_bucket_cleanup));
+  TEST_ASSERT(8 == atomic_load(&hand) - hand_before);
+  TEST_ASSERT(2 == hash_cache_bucket_cleanup_call_count);
+  TEST_ASSERT(in_use == get_hash_cache_entry(buckets, 3, (HashCacheUid)1));
+}
+
+static void TEST_hash_cache_finds_other_entries_for_uid(void) {
+  MyHashCacheBucket buckets[8] = {0};
+  int payload = 77;
+  MyHashCacheBucket *b1 =
+      add_to_hash_cache(buckets, 3, (HashCacheUid)1, &payload, NULL);
+  TEST_ASSERT(b1);
+  TEST_ASSERT(
+      !hash_cache_has_other_entry(buckets, 3, (HashCacheUid)1, &b1->bucket));
+
+  // Two threads compiling the same command at once can each add it.
+  MyHashCacheBucket *b2 =
+      add_to_hash_cache(buckets, 3, (HashCacheUid)1, &payload, NULL);
+  TEST_ASSERT(b2 && b2 != b1);
+  TEST_ASSERT(
+      hash_cache_has_other_entry(buckets, 3, (HashCacheUid)1, &b1->bucket));
+  TEST_ASSERT(
+      hash_cache_has_other_entry(buckets, 3, (HashCacheUid)1, &b2->bucket));
+  TEST_ASSERT(
+      !hash_cache_has_other_entry(buckets, 3, (HashCacheUid)9, &b1->bucket));
+}
+
+static void TEST_parse_hash_cache_uid_round_trips(void) {
+  const char *commands[] = {"(m, p) => p", "(m, p) => m.foo(p)", ""};
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i) {
+    HashCacheUid uid = get_hash_cache_uid(commands[i], strlen(commands[i]));
+    char hex[sizeof(HashCacheUid) * 2 + 1];
+    snprintf(hex, sizeof(hex), HASH_CACHE_UID_FORMAT_SPECIFIER,
+             HASH_CACHE_UID_FORMAT_ARGS(uid));
+    HashCacheUid parsed = 0;
+    TEST_ASSERT(parse_hash_cache_uid(hex, strlen(hex), &parsed));
+    TEST_ASSERT(parsed == uid);
+  }
+
+  char upper[sizeof(HashCacheUid) * 2 + 1];
+  memset(upper, 'F', sizeof(upper) - 1);
+  upper[sizeof(upper) - 1] = '\0';
+  HashCacheUid parsed = 0;
+  TEST_ASSERT(parse_hash_cache_uid(upper, strlen(upper), &parsed));
+  TEST_ASSERT(parsed == (HashCacheUid)-1);
+}
+
+static void TEST_parse_hash_cache_uid_rejects_malformed_hashes(void) {
+  char hex[sizeof(HashCacheUid) * 2 + 2];
+  memset(hex, '0', sizeof(hex) - 1);
+  hex[sizeof(hex) - 1] = '\0';
+  HashCacheUid parsed = 0;
+  // Too long, too short and empty.
+  TEST_ASSERT(!parse_hash_cache_uid(hex, strlen(hex), &parsed));
+  TEST_ASSERT(!parse_hash_cache_uid(hex, strlen(hex) - 2, &parsed));
+  TEST_ASSERT(!parse_hash_cache_uid(hex, 0, &parsed));
+  // Not hex.
+  hex[3] = 'g';
+  TEST_ASSERT(!parse_hash_cache_uid(hex, strlen(hex) - 1, &parsed));
+}
+
 enum {
   HASH_CACHE_STRESS_TEST_N_BITS = 6,
   HASH_CACHE_STRESS_TEST_N_THREADS = 100,
@@ -935,6 +1069,25 @@ static void TEST_cmdargs_dash_c_can_be_combined_with_dash_sd(void) {
   TEST_ASSERT(r == 0);
 }
 
+static void TEST_cmdargs_dash_c_can_be_combined_with_dash_cm(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd",   "-c",  "module.mjs", "out.qjsbc",
+                  "-pk",      "key", "-cm",        "commands.json"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(!strcmp(cmdargs.commands_manifest_file, "commands.json"));
+}
+
+static void TEST_cmdargs_dash_cm_must_be_combined_with_dash_c(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "-cm", "commands.json"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r != 0);
+  TEST_ASSERT(strstr(cmdargs_errlog_buf, "-cm "));
+}
+
 static void TEST_cmdargs_dash_ss_must_be_combined_with_dash_c(void) {
   CmdArgs cmdargs = {0};
   char *argv[] = {"jsockd", "-ss"};
@@ -1012,6 +1165,1444 @@ static void TEST_cmdargs_dash_e_error_if_dash_sm_without_dash_m(void) {
       strstr(cmdargs_errlog_buf, "-e (eval) can only be used with -m and -sm"));
 }
 
+static void TEST_cmdargs_dash_r(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "my_socket", "-r", "8"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(cmdargs.n_sockets == 1);
+  TEST_ASSERT(cmdargs.n_shared_runtimes == 8);
+  TEST_ASSERT(cmdargs.max_shared_runtimes == 8);
+}
+
+static void TEST_cmdargs_dash_r_error_on_0(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "my_socket", "-r", "0"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r != 0);
+  TEST_ASSERT(strstr(cmdargs_errlog_buf, "-r requires a valid integer"));
+}
+
+static void TEST_cmdargs_dash_r_error_on_more_than_MAX_THREADS(void) {
+  CmdArgs cmdargs = {0};
+  char n[32];
+  snprintf_nowarn(n, sizeof(n), "%i", MAX_THREADS + 1);
+  char *argv[] = {"jsockd", "-s", "my_socket", "-r", n};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r != 0);
+  TEST_ASSERT(strstr(cmdargs_errlog_buf, "-r requires a valid integer"));
+}
+
+static void TEST_cmdargs_dash_r_error_on_double_flag(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "my_socket", "-r", "2", "-r", "3"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r != 0);
+  TEST_ASSERT(strstr(cmdargs_errlog_buf, "-r can be specified at most once"));
+}
+
+static void TEST_cmdargs_dash_r_range(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "my_socket", "-r", "2:16"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(cmdargs.n_shared_runtimes == 2);
+  TEST_ASSERT(cmdargs.max_shared_runtimes == 16);
+}
+
+static void TEST_cmdargs_dash_r_range_error_on_max_less_than_min(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "my_socket", "-r", "4:2"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r != 0);
+  TEST_ASSERT(strstr(cmdargs_errlog_buf, "-r requires a valid integer"));
+}
+
+static void TEST_cmdargs_dash_a_cpu_list(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "my_socket", "-a", "0,2,4-6"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(!cmdargs.cpu_affinity_auto);
+  TEST_ASSERT(cmdargs.n_cpu_affinity == 5);
+  TEST_ASSERT(cmdargs.cpu_affinity[0] == 0);
+  TEST_ASSERT(cmdargs.cpu_affinity[1] == 2);
+  TEST_ASSERT(cmdargs.cpu_affinity[2] == 4);
+  TEST_ASSERT(cmdargs.cpu_affinity[4] == 6);
+}
+
+static void TEST_cmdargs_dash_a_auto(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "my_socket", "-a", "auto"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(cmdargs.cpu_affinity_auto);
+  TEST_ASSERT(cmdargs.n_cpu_affinity == 0);
+}
+
+static void TEST_cmdargs_dash_a_error_on_bad_list(void) {
+  const char *lists[] = {"", "1,", "3-1", "a", "1-2-3", "-1"};
+  for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i) {
+    CmdArgs cmdargs = {0};
+    char *argv[] = {"jsockd", "-s", "my_socket", "-a", (char *)lists[i]};
+    int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv,
+                           cmdargs_errlog, &cmdargs);
+    TEST_ASSERT(r != 0);
+    TEST_ASSERT(strstr(cmdargs_errlog_buf, "-a requires 'auto' or"));
+  }
+}
+
+static void TEST_cmdargs_dash_w(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "s2", "-r", "4", "-w", "8:2,1"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(cmdargs.n_class_weights == 2);
+  TEST_ASSERT(cmdargs.class_weight[0] == 8);
+  TEST_ASSERT(cmdargs.class_reserved[0] == 2);
+  TEST_ASSERT(cmdargs.class_weight[1] == 1);
+  TEST_ASSERT(cmdargs.class_reserved[1] == 0);
+}
+
+static void TEST_cmdargs_dash_w_error_without_dash_r(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "s2", "-w", "8,1"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r != 0);
+  TEST_ASSERT(strstr(cmdargs_errlog_buf, "-w can only be used with -r"));
+}
+
+static void TEST_cmdargs_dash_w_error_on_reserving_all_runtimes(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "s2", "-r", "2:8", "-w", "1:1,1:1"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r != 0);
+  TEST_ASSERT(strstr(cmdargs_errlog_buf, "reserved by -w must total less"));
+}
+
+static void TEST_cmdargs_dash_q_and_dash_qt(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "-r", "4", "-q", "100", "-qt", "5000"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(cmdargs.max_queued_commands == 100);
+  TEST_ASSERT(cmdargs.max_queue_wait_us == 5000);
+}
+
+static void TEST_cmdargs_dash_q_error_without_dash_r(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "-q", "100"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r != 0);
+  TEST_ASSERT(
+      strstr(cmdargs_errlog_buf, "-q and -qt can only be used with -r"));
+}
+
+static void TEST_cmdargs_dash_p(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "s2", "-p", "2"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(cmdargs.n_spare_runtimes == 2);
+}
+
+static void TEST_cmdargs_dash_p_error_on_out_of_range(void) {
+  const char *values[] = {"0", "-1", "x", "17"};
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+    CmdArgs cmdargs = {0};
+    char *argv[] = {"jsockd", "-s", "s1", "-p", (char *)values[i]};
+    int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv,
+                           cmdargs_errlog, &cmdargs);
+    TEST_ASSERT(r != 0);
+  }
+}
+
+static void TEST_cmdargs_dash_cn_and_dash_cb(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "-cn", "5000", "-cb", "1048576"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(cmdargs.max_cached_commands == 5000);
+  TEST_ASSERT(cmdargs.max_cached_bytecode_bytes == 1048576);
+}
+
+static void TEST_cmdargs_dash_cn_and_dash_cb_error_on_out_of_range(void) {
+  const char *options[] = {"-cn", "-cn", "-cn", "-cb", "-cb"};
+  const char *values[] = {"0", "x", "1048577", "0", "-1"};
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+    CmdArgs cmdargs = {0};
+    char *argv[] = {"jsockd", "-s", "s1", (char *)options[i],
+                    (char *)values[i]};
+    int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv,
+                           cmdargs_errlog, &cmdargs);
+    TEST_ASSERT(r != 0);
+  }
+}
+
+static void TEST_cmdargs_dash_cd(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "-cd", "/tmp/cache"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(!strcmp(cmdargs.command_cache_dir, "/tmp/cache"));
+  char *argv2[] = {"jsockd", "-s", "s1", "-cd", "/tmp/a", "-cd", "/tmp/b"};
+  CmdArgs cmdargs2 = {0};
+  r = parse_cmd_args(sizeof(argv2) / sizeof(argv2[0]), argv2, cmdargs_errlog,
+                     &cmdargs2);
+  TEST_ASSERT(r != 0);
+}
+
+static void TEST_cmdargs_dash_nc(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "-m", "mod.qjsbc", "-nc"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(cmdargs.named_commands_only);
+  char *argv2[] = {"jsockd", "-s", "s1", "-nc"};
+  CmdArgs cmdargs2 = {0};
+  r = parse_cmd_args(sizeof(argv2) / sizeof(argv2[0]), argv2, cmdargs_errlog,
+                     &cmdargs2);
+  TEST_ASSERT(r != 0);
+}
+
+static void TEST_cmdargs_dash_f(void) {
+  CmdArgs cmdargs = {0};
+  char *argv[] = {"jsockd", "-s", "s1", "s2", "-f"};
+  int r = parse_cmd_args(sizeof(argv) / sizeof(argv[0]), argv, cmdargs_errlog,
+                         &cmdargs);
+  TEST_ASSERT(r == 0);
+  TEST_ASSERT(cmdargs.prefork);
+}
+
+static void TEST_cmdargs_dash_f_error_with_shared_runtimes_or_spares(void) {
+  CmdArgs cmdargs = {0};
+  char *argv1[] = {"jsockd", "-s", "s1", "-f", "-r", "2"};
+  int r = parse_cmd_args(sizeof(argv1) / sizeof(argv1[0]), argv1,
+                         cmdargs_errlog, &cmdargs);
+  TEST_ASSERT(r != 0);
+  char *argv2[] = {"jsockd", "-s", "s1", "-p", "1", "-f"};
+  r = parse_cmd_args(sizeof(argv2) / sizeof(argv2[0]), argv2, cmdargs_errlog,
+                     &cmdargs);
+  TEST_ASSERT(r != 0);
+}
+
+/******************************************************************************
+    Tests for mpmc_queue
+******************************************************************************/
+
+static void TEST_mpmc_queue_fifo_full_and_empty(void) {
+  MpmcQueue q;
+  TEST_ASSERT(0 == mpmc_queue_init(&q, 4));
+  int items[5];
+  TEST_ASSERT(NULL == mpmc_queue_pop(&q));
+  for (int i = 0; i < 4; ++i)
+    TEST_ASSERT(mpmc_queue_push(&q, &items[i]));
+  TEST_ASSERT(!mpmc_queue_push(&q, &items[4]));
+  TEST_ASSERT(&items[0] == mpmc_queue_pop(&q));
+  TEST_ASSERT(mpmc_queue_push(&q, &items[4]));
+  for (int i = 1; i < 5; ++i)
+    TEST_ASSERT(&items[i] == mpmc_queue_pop(&q));
+  TEST_ASSERT(NULL == mpmc_queue_pop(&q));
+  mpmc_queue_destroy(&q);
+}
+
+#define MPMC_QUEUE_TEST_N_THREADS 4
+#define MPMC_QUEUE_TEST_N_ITEMS 100000
+
+typedef struct {
+  MpmcQueue *q;
+  atomic_int *n_popped;
+  atomic_llong *sum;
+  int thread_index;
+} MpmcQueueTestThreadData;
+
+static void *mpmc_queue_test_producer(void *data) {
+  MpmcQueueTestThreadData *td = (MpmcQueueTestThreadData *)data;
+  for (intptr_t i = 1; i <= MPMC_QUEUE_TEST_N_ITEMS; ++i) {
+    while (!mpmc_queue_push(td->q, (void *)i))
+      cpu_relax_no_barrier();
+  }
+  return NULL;
+}
+
+static void *mpmc_queue_test_consumer(void *data) {
+  MpmcQueueTestThreadData *td = (MpmcQueueTestThreadData *)data;
+  while (atomic_load(td->n_popped) <
+         MPMC_QUEUE_TEST_N_THREADS * MPMC_QUEUE_TEST_N_ITEMS) {
+    void *item = mpmc_queue_pop(td->q);
+    if (!item) {
+      cpu_relax_no_barrier();
+      continue;
+    }
+    atomic_fetch_add(td->sum, (intptr_t)item);
+    atomic_fetch_add(td->n_popped, 1);
+  }
+  return NULL;
+}
+
+static void TEST_mpmc_queue_multiple_producers_and_consumers(void) {
+  MpmcQueue q;
+  TEST_ASSERT(0 == mpmc_queue_init(&q, 64));
+  atomic_int n_popped = 0;
+  atomic_llong sum = 0;
+  pthread_t producers[MPMC_QUEUE_TEST_N_THREADS];
+  pthread_t consumers[MPMC_QUEUE_TEST_N_THREADS];
+  MpmcQueueTestThreadData td = {.q = &q, .n_popped = &n_popped, .sum = &sum};
+  for (int i = 0; i < MPMC_QUEUE_TEST_N_THREADS; ++i) {
+    TEST_ASSERT(0 ==
+                pthread_create(&producers[i], NULL, mpmc_queue_test_producer,
+                               &td));
+    TEST_ASSERT(0 ==
+                pthread_create(&consumers[i], NULL, mpmc_queue_test_consumer,
+                               &td));
+  }
+  for (int i = 0; i < MPMC_QUEUE_TEST_N_THREADS; ++i) {
+    pthread_join(producers[i], NULL);
+    pthread_join(consumers[i], NULL);
+  }
+  const long long n = MPMC_QUEUE_TEST_N_ITEMS;
+  TEST_ASSERT(atomic_load(&sum) ==
+              MPMC_QUEUE_TEST_N_THREADS * (n * (n + 1) / 2));
+  TEST_ASSERT(NULL == mpmc_queue_pop(&q));
+  mpmc_queue_destroy(&q);
+}
+
+/******************************************************************************
+    Tests for dispatch
+******************************************************************************/
+
+static void *dispatcher_pthread_func(void *data) {
+  dispatcher_run((Dispatcher *)data);
+  return NULL;
+}
+
+static Record *take_with_retries(Dispatcher *d) {
+  for (int i = 0; i < 100; ++i) {
+    Record *r = dispatcher_take(d, 10);
+    if (r)
+      return r;
+  }
+  return NULL;
+}
+
+typedef struct {
+  char lines[8][64];
+  int n_lines;
+} CollectedLines;
+
+static int collect_line(const char *line, size_t len, void *data,
+                        bool truncated) {
+  (void)truncated;
+  CollectedLines *cl = (CollectedLines *)data;
+  TEST_ASSERT(cl->n_lines < 8 && len < 64);
+  memcpy(cl->lines[cl->n_lines], line, len);
+  cl->lines[cl->n_lines][len] = '\0';
+  cl->n_lines++;
+  return 0;
+}
+
+static void write_str(int fd, const char *str) {
+  TEST_ASSERT((ssize_t)strlen(str) == write(fd, str, strlen(str)));
+}
+
+static void read_expected_str(int fd, const char *expected) {
+  char buf[256];
+  size_t len = strlen(expected);
+  TEST_ASSERT(len < sizeof(buf));
+  for (size_t n = 0; n < len;) {
+    ssize_t r = read(fd, buf + n, len - n);
+    TEST_ASSERT(r > 0);
+    n += (size_t)r;
+  }
+  buf[len] = '\0';
+  TEST_ASSERT(!strcmp(buf, expected));
+}
+
+static void TEST_dispatcher_hands_over_complete_records(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+
+  int sv1[2], sv2[2];
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv1));
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv2));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv1[0], 0));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv2[0], 0));
+
+  // An incomplete command isn't handed over.
+  write_str(sv2[1], "id1\n(m, p) => p\n");
+  TEST_ASSERT(NULL == dispatcher_take(&d, 20));
+  write_str(sv2[1], "99\n");
+  Record *r = take_with_retries(&d);
+  TEST_ASSERT(r && r->conn->fd == sv2[0]);
+  CollectedLines cl = {0};
+  TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+  TEST_ASSERT(cl.n_lines == 3);
+  TEST_ASSERT(!strcmp(cl.lines[0], "id1"));
+  TEST_ASSERT(!strcmp(cl.lines[1], "(m, p) => p"));
+  TEST_ASSERT(!strcmp(cl.lines[2], "99"));
+  dispatcher_return(&d, r);
+
+  // A '?' command is a record by itself. Commands pipelined behind a command
+  // that's executing are read ahead, but aren't handed over until the
+  // record is handed back, so that responses stay in order.
+  write_str(sv1[1], "?exectime\nid2\n");
+  r = take_with_retries(&d);
+  TEST_ASSERT(r && r->conn->fd == sv1[0]);
+  cl = (CollectedLines){0};
+  TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+  TEST_ASSERT(cl.n_lines == 1);
+  TEST_ASSERT(!strcmp(cl.lines[0], "?exectime"));
+  write_str(sv1[1], "(m, p) => p\n?memusage\n\"x\"\n");
+  TEST_ASSERT(NULL == dispatcher_take(&d, 20));
+  dispatcher_return(&d, r);
+  r = take_with_retries(&d);
+  TEST_ASSERT(r && r->conn->fd == sv1[0]);
+  cl = (CollectedLines){0};
+  TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+  TEST_ASSERT(cl.n_lines == 4);
+  TEST_ASSERT(!strcmp(cl.lines[0], "id2"));
+  TEST_ASSERT(!strcmp(cl.lines[2], "?memusage"));
+  TEST_ASSERT(!strcmp(cl.lines[3], "\"x\""));
+  dispatcher_return(&d, r);
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  // The dispatcher owns the fds of the connections added to it.
+  dispatcher_destroy(&d);
+  close(sv1[1]);
+  close(sv2[1]);
+}
+
+// Without a dispatcher thread, as when a runtime thread serves the
+// connections on its own socket.
+static void TEST_conn_frame_input_keeps_partial_commands_per_connection(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  int sv1[2], sv2[2];
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv1));
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv2));
+  Conn *c1 = conn_new(sv1[0], 0);
+  Conn *c2 = conn_new(sv2[0], 0);
+  TEST_ASSERT(c1 && c2);
+
+  write_str(sv1[1], "id1\n(m, p) => p\n");
+  TEST_ASSERT(0 == conn_frame_input(c1));
+  TEST_ASSERT(NULL == conn_take_record(c1));
+  write_str(sv2[1], "id2\n(m, p) => p + 1\n");
+  TEST_ASSERT(0 == conn_frame_input(c2));
+  TEST_ASSERT(NULL == conn_take_record(c2));
+  write_str(sv2[1], "2\nid3\n");
+  TEST_ASSERT(0 == conn_frame_input(c2));
+  Record *r = conn_take_record(c2);
+  TEST_ASSERT(r && NULL == conn_take_record(c2));
+  CollectedLines cl = {0};
+  TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+  TEST_ASSERT(cl.n_lines == 3);
+  TEST_ASSERT(!strcmp(cl.lines[0], "id2"));
+  TEST_ASSERT(!strcmp(cl.lines[2], "2"));
+  conn_recycle_record(c2, r);
+
+  write_str(sv1[1], "1\n");
+  TEST_ASSERT(0 == conn_frame_input(c1));
+  r = conn_take_record(c1);
+  TEST_ASSERT(r);
+  cl = (CollectedLines){0};
+  TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+  TEST_ASSERT(cl.n_lines == 3);
+  TEST_ASSERT(!strcmp(cl.lines[0], "id1"));
+  TEST_ASSERT(!strcmp(cl.lines[1], "(m, p) => p"));
+  TEST_ASSERT(!strcmp(cl.lines[2], "1"));
+  conn_recycle_record(c1, r);
+
+  write_str(sv2[1], "(m, p) => p\n3\n");
+  TEST_ASSERT(0 == conn_frame_input(c2));
+  r = conn_take_record(c2);
+  TEST_ASSERT(r);
+  cl = (CollectedLines){0};
+  TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+  TEST_ASSERT(cl.n_lines == 3);
+  TEST_ASSERT(!strcmp(cl.lines[0], "id3"));
+  conn_recycle_record(c2, r);
+
+  close(sv1[1]);
+  TEST_ASSERT(LINE_BUF_READ_EOF == conn_frame_input(c1));
+  conn_close(c1);
+  conn_close(c2);
+  close(sv2[1]);
+}
+
+static ReplyState wait_for_reply_with_retries(Record *r, char *buf,
+                                              size_t buf_size, size_t *len) {
+  ReplyState state = REPLY_AWAITED;
+  for (int i = 0; i < 100 && state == REPLY_AWAITED; ++i)
+    state = record_wait_for_reply(r, buf, buf_size, len, 10, false);
+  return state;
+}
+
+static void TEST_dispatcher_routes_message_responses_past_pipelined_commands(
+    void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+  int sv[2];
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv[0], 0));
+
+  write_str(sv[1], "id1\n(m, p) => p\n1\n");
+  Record *r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL);
+  record_expect_reply(r, "id1", 3);
+  // The client pipelines another command before it sees the message and
+  // sends the response.
+  write_str(sv[1], "id2\n(m, p) => p\n2\nid1\n{\"a\":1}\n");
+  char buf[64];
+  size_t len = 0;
+  TEST_ASSERT(REPLY_RECEIVED ==
+              wait_for_reply_with_retries(r, buf, sizeof(buf), &len));
+  TEST_ASSERT(len == strlen("id1\n{\"a\":1}\n"));
+  TEST_ASSERT(!memcmp(buf, "id1\n{\"a\":1}\n", len));
+  dispatcher_return(&d, r);
+
+  r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL);
+  CollectedLines cl = {0};
+  TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+  TEST_ASSERT(cl.n_lines == 3);
+  TEST_ASSERT(!strcmp(cl.lines[0], "id2"));
+  TEST_ASSERT(!strcmp(cl.lines[2], "2"));
+
+  // If the client goes away, the waiting runtime thread is told.
+  record_expect_reply(r, "id2", 3);
+  close(sv[1]);
+  TEST_ASSERT(REPLY_EOF ==
+              wait_for_reply_with_retries(r, buf, sizeof(buf), &len));
+  dispatcher_return(&d, r);
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  dispatcher_destroy(&d);
+}
+
+static void TEST_dispatcher_collects_async_message_responses(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+  int sv[2];
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv[0], 0));
+
+  write_str(sv[1], "id1\n(m, p) => p\n1\n");
+  Record *r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL);
+  record_expect_reply(r, "id1", 3);
+  // Responses to async messages may arrive in any order, and may be
+  // interleaved with pipelined commands.
+  write_str(sv[1], "id1 1\n\"b\"\nid2\n(m, p) => p\n2\nid1 0\n\"a\"\n");
+  const char *expected = "id1 1\n\"b\"\nid1 0\n\"a\"\n";
+  char buf[64];
+  size_t total = 0;
+  for (int i = 0; i < 100 && total < strlen(expected); ++i) {
+    size_t len = 0;
+    ReplyState state = record_wait_for_reply(
+        r, buf + total, sizeof(buf) - total, &len, 10, true);
+    TEST_ASSERT(state == REPLY_RECEIVED || state == REPLY_AWAITED);
+    if (state == REPLY_RECEIVED)
+      total += len;
+  }
+  TEST_ASSERT(total == strlen(expected));
+  TEST_ASSERT(!memcmp(buf, expected, total));
+  record_cancel_reply(r);
+  dispatcher_return(&d, r);
+
+  r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL);
+  CollectedLines cl = {0};
+  TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+  TEST_ASSERT(cl.n_lines == 3);
+  TEST_ASSERT(!strcmp(cl.lines[0], "id2"));
+  dispatcher_return(&d, r);
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  dispatcher_destroy(&d);
+  close(sv[1]);
+}
+
+static void TEST_dispatcher_executes_multiplexed_commands_concurrently(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+  int sv[2];
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv[0], 0));
+
+  // The line handler sets 'multiplexed' when it executes ?multiplex.
+  write_str(sv[1], "?multiplex\nid1\n(m, p) => p\n1\nid2\n(m, p) => p\n2\n");
+  Record *r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL);
+  TEST_ASSERT(NULL == dispatcher_take(&d, 20));
+  r->conn->multiplexed = true;
+  dispatcher_return(&d, r);
+
+  // Both commands are handed over without waiting for either to complete,
+  // and a message response is routed to the command that's waiting for it.
+  Record *r1 = take_with_retries(&d);
+  Record *r2 = take_with_retries(&d);
+  TEST_ASSERT(r1 && r2 && r1 != r2);
+  CollectedLines cl1 = {0}, cl2 = {0};
+  TEST_ASSERT(0 == record_replay(r1, collect_line, &cl1));
+  TEST_ASSERT(0 == record_replay(r2, collect_line, &cl2));
+  TEST_ASSERT(!strcmp(cl1.lines[0], "id1"));
+  TEST_ASSERT(!strcmp(cl2.lines[0], "id2"));
+  record_expect_reply(r2, "id2", 3);
+  write_str(sv[1], "id2\n\"b\"\n");
+  char buf[64];
+  size_t len = 0;
+  TEST_ASSERT(REPLY_RECEIVED ==
+              wait_for_reply_with_retries(r2, buf, sizeof(buf), &len));
+  TEST_ASSERT(len == strlen("id2\n\"b\"\n"));
+
+  // A '?' command waits until the commands before it have completed, and
+  // commands after it wait for it.
+  write_str(sv[1], "?exectime\nid3\n(m, p) => p\n3\n");
+  dispatcher_return(&d, r2);
+  TEST_ASSERT(NULL == dispatcher_take(&d, 20));
+  dispatcher_return(&d, r1);
+  r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL);
+  CollectedLines cl = {0};
+  TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+  TEST_ASSERT(cl.n_lines == 1 && !strcmp(cl.lines[0], "?exectime"));
+  TEST_ASSERT(NULL == dispatcher_take(&d, 20));
+  dispatcher_return(&d, r);
+  r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL);
+  cl = (CollectedLines){0};
+  TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+  TEST_ASSERT(!strcmp(cl.lines[0], "id3"));
+  dispatcher_return(&d, r);
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  dispatcher_destroy(&d);
+  close(sv[1]);
+}
+
+static void TEST_dispatcher_grows_and_shrinks_elastic_pool(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  dispatcher_set_pool_size(&d, 1, 2);
+  TEST_ASSERT(!dispatcher_try_retire(&d));
+  TEST_ASSERT(!dispatcher_park(&d, 0));
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+  int sv1[2], sv2[2];
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv1));
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv2));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv1[0], 0));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv2[0], 0));
+
+  // A command is left waiting while the only active runtime is busy, so a
+  // parked runtime is asked to start.
+  write_str(sv1[1], "id1\n(m, p) => p\n1\n");
+  write_str(sv2[1], "id2\n(m, p) => p\n2\n");
+  usleep(DISPATCH_POOL_GROW_WAIT_US * 2);
+  Record *r1 = take_with_retries(&d);
+  TEST_ASSERT(r1 != NULL);
+  TEST_ASSERT(dispatcher_park(&d, 1000));
+  dispatcher_runtime_started(&d);
+  TEST_ASSERT(atomic_load(&d.n_active_runtimes) == 2);
+  Record *r2 = take_with_retries(&d);
+  TEST_ASSERT(r2 != NULL);
+  dispatcher_return(&d, r1);
+  dispatcher_return(&d, r2);
+
+  // Idle runtimes retire down to the minimum.
+  TEST_ASSERT(dispatcher_try_retire(&d));
+  TEST_ASSERT(!dispatcher_try_retire(&d));
+  TEST_ASSERT(atomic_load(&d.n_active_runtimes) == 1);
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  dispatcher_destroy(&d);
+  close(sv1[1]);
+  close(sv2[1]);
+}
+
+static void TEST_dispatcher_schedules_classes_by_weight(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  dispatcher_set_pool_size(&d, 1, 1);
+  TEST_ASSERT(0 == dispatcher_set_classes(&d, (int[]){2, 1}, (int[]){0, 0}, 2));
+
+  // Three commands for each class, all queued before the dispatcher starts
+  // running.
+  int sv[6][2];
+  for (int i = 0; i < 6; ++i) {
+    TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]));
+    TEST_ASSERT(0 == dispatcher_add_conn(&d, sv[i][0], i / 3));
+    write_str(sv[i][1], i / 3 == 0 ? "a\n(m, p) => p\n1\n"
+                                   : "b\n(m, p) => p\n1\n");
+  }
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+
+  // With a single runtime, records are handed over one at a time.
+  char order[7] = {0};
+  for (int i = 0; i < 6; ++i) {
+    Record *r = take_with_retries(&d);
+    TEST_ASSERT(r != NULL);
+    TEST_ASSERT(NULL == dispatcher_take(&d, 0));
+    CollectedLines cl = {0};
+    TEST_ASSERT(0 == record_replay(r, collect_line, &cl));
+    order[i] = cl.lines[0][0];
+    dispatcher_return(&d, r);
+  }
+  TEST_ASSERT(!strcmp(order, "aababb"));
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  dispatcher_destroy(&d);
+  for (int i = 0; i < 6; ++i)
+    close(sv[i][1]);
+}
+
+static void TEST_dispatcher_keeps_reserved_runtimes_for_their_class(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  dispatcher_set_pool_size(&d, 2, 2);
+  TEST_ASSERT(0 == dispatcher_set_classes(&d, (int[]){1, 1}, (int[]){1, 0}, 2));
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+  int sv[3][2];
+  for (int i = 0; i < 3; ++i) {
+    TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]));
+    TEST_ASSERT(0 == dispatcher_add_conn(&d, sv[i][0], i < 2 ? 1 : 0));
+  }
+
+  // Class 1 can't use the runtime reserved for class 0.
+  write_str(sv[0][1], "b1\n(m, p) => p\n1\n");
+  write_str(sv[1][1], "b2\n(m, p) => p\n1\n");
+  Record *b = take_with_retries(&d);
+  TEST_ASSERT(b != NULL);
+  TEST_ASSERT(NULL == dispatcher_take(&d, 20));
+  write_str(sv[2][1], "a1\n(m, p) => p\n1\n");
+  Record *a = take_with_retries(&d);
+  TEST_ASSERT(a != NULL && a->conn->fd == sv[2][0]);
+  dispatcher_return(&d, a);
+  dispatcher_return(&d, b);
+  b = take_with_retries(&d);
+  TEST_ASSERT(b != NULL && b->conn->fd != sv[2][0]);
+  dispatcher_return(&d, b);
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  dispatcher_destroy(&d);
+  for (int i = 0; i < 3; ++i)
+    close(sv[i][1]);
+}
+
+static void TEST_dispatcher_rejects_commands_when_too_many_are_queued(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  dispatcher_set_pool_size(&d, 1, 1);
+  dispatcher_set_limits(&d, 1, 0);
+
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+
+  // With one idle runtime and room for one more command in the queue, the
+  // third command is rejected.
+  int sv[3][2];
+  const char *cmds[] = {"a\n(m, p) => p\n1\n", "b\n(m, p) => p\n1\n",
+                        "c\n(m, p) => p\n1\n"};
+  for (int i = 0; i < 3; ++i) {
+    TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]));
+    TEST_ASSERT(0 == dispatcher_add_conn(&d, sv[i][0], 0));
+    write_str(sv[i][1], cmds[i]);
+    // Wait for the dispatcher to queue the command.
+    while (i < 2 && atomic_load(&d.n_queued) != i + 1)
+      usleep(1000);
+  }
+  read_expected_str(sv[2][1], "c overloaded \"too many commands queued\"\n");
+  for (int i = 0; i < 2; ++i) {
+    Record *r = take_with_retries(&d);
+    TEST_ASSERT(r != NULL && r->conn->fd != sv[2][0]);
+    dispatcher_return(&d, r);
+  }
+
+  // ?load is answered without a runtime.
+  write_str(sv[0][1], "?load\n");
+  read_expected_str(sv[0][1],
+                    "{\"queued\":0,\"executing\":0,\"runtimes\":1,"
+                    "\"max_runtimes\":1,\"rejected\":1}\n");
+  TEST_ASSERT(NULL == dispatcher_take(&d, 0));
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  dispatcher_destroy(&d);
+  for (int i = 0; i < 3; ++i)
+    close(sv[i][1]);
+}
+
+static void TEST_dispatcher_rejects_commands_that_wait_too_long(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  dispatcher_set_pool_size(&d, 1, 1);
+  dispatcher_set_limits(&d, 0, 200000);
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+  int sv[2];
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv[0], 0));
+
+  // '?' commands are never rejected.
+  write_str(sv[1], "a\n(m, p) => p\n1\n?reset\n");
+  usleep(300000);
+  Record *r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL && r->barrier);
+  read_expected_str(sv[1], "a overloaded \"queued for too long\"\n");
+  dispatcher_return(&d, r);
+
+  write_str(sv[1], "b\n(m, p) => p\n1\n");
+  r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL && !r->barrier);
+  dispatcher_return(&d, r);
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  dispatcher_destroy(&d);
+  close(sv[1]);
+}
+
+static void TEST_dispatcher_isnt_blocked_by_a_multiplexed_conn(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  dispatcher_set_pool_size(&d, 1, 1);
+  dispatcher_set_limits(&d, 1, 0);
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+  int sv1[2], sv2[2];
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv1));
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv2));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv1[0], 0));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv2[0], 0));
+  // Fail rather than hang if the dispatcher stops answering.
+  struct timeval tv = {.tv_sec = 5};
+  TEST_ASSERT(0 == setsockopt(sv2[1], SOL_SOCKET, SO_RCVTIMEO, &tv,
+                              sizeof(tv)));
+
+  write_str(sv1[1], "?multiplex\n");
+  Record *r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL);
+  r->conn->multiplexed = true;
+  dispatcher_return(&d, r);
+
+  // A runtime thread holds the write mutex while it's blocked writing to a
+  // client that isn't reading. The third command would be rejected, but the
+  // response can't be written yet.
+  write_str(sv1[1], "a\n(m, p) => p\n1\n");
+  Record *ra = take_with_retries(&d);
+  TEST_ASSERT(ra != NULL);
+  mutex_lock(&ra->conn->write_mutex);
+  write_str(sv1[1], "b\n(m, p) => p\n1\nc\n(m, p) => p\n1\n");
+  while (atomic_load(&d.n_queued) != 1)
+    usleep(1000);
+
+  // The dispatcher still answers the other connection.
+  write_str(sv2[1], "?load\n");
+  read_expected_str(sv2[1], "{\"queued\":1,\"executing\":1,\"runtimes\":1,"
+                            "\"max_runtimes\":1,\"rejected\":0}\n");
+
+  // Once the first command has completed, there's room for the third.
+  mutex_unlock(&ra->conn->write_mutex);
+  dispatcher_return(&d, ra);
+  for (int i = 0; i < 2; ++i) {
+    r = take_with_retries(&d);
+    TEST_ASSERT(r != NULL && !r->barrier);
+    dispatcher_return(&d, r);
+  }
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  dispatcher_destroy(&d);
+  close(sv1[1]);
+  close(sv2[1]);
+}
+
+static void TEST_dispatcher_defers_rejection_while_a_response_is_written(void) {
+  g_cmd_args.socket_sep_char = '\n';
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  dispatcher_set_pool_size(&d, 1, 1);
+  dispatcher_set_limits(&d, 1, 0);
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+  int sv[2];
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  TEST_ASSERT(0 == dispatcher_add_conn(&d, sv[0], 0));
+
+  write_str(sv[1], "?multiplex\n");
+  Record *r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL);
+  r->conn->multiplexed = true;
+  dispatcher_return(&d, r);
+
+  write_str(sv[1], "a1\n(m, p) => p\n1\na2\n(m, p) => p\n1\n");
+  Record *ra1 = take_with_retries(&d);
+  Record *ra2 = take_with_retries(&d);
+  TEST_ASSERT(ra1 && ra2);
+
+  // The rejection of the last command waits until the runtime thread writing
+  // to the connection is done with it.
+  mutex_lock(&ra1->conn->write_mutex);
+  write_str(sv[1], "b\n(m, p) => p\n1\nc\n(m, p) => p\n1\n");
+  while (atomic_load(&d.n_queued) != 1)
+    usleep(1000);
+  usleep(20000);
+  TEST_ASSERT(0 == atomic_load(&d.n_rejected));
+  mutex_unlock(&ra1->conn->write_mutex);
+  dispatcher_return(&d, ra1);
+  read_expected_str(sv[1], "c overloaded \"too many commands queued\"\n");
+
+  dispatcher_return(&d, ra2);
+  r = take_with_retries(&d);
+  TEST_ASSERT(r != NULL);
+  dispatcher_return(&d, r);
+  write_str(sv[1], "?load\n");
+  read_expected_str(sv[1], "{\"queued\":0,\"executing\":0,\"runtimes\":1,"
+                           "\"max_runtimes\":1,\"rejected\":1}\n");
+
+  dispatcher_stop(&d);
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  dispatcher_destroy(&d);
+  close(sv[1]);
+}
+
+static void TEST_dispatcher_take_returns_null_after_stop(void) {
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  dispatcher_stop(&d);
+  TEST_ASSERT(NULL == dispatcher_take(&d, 1000));
+  dispatcher_destroy(&d);
+}
+
+static void TEST_dispatcher_and_poll_fd_wake_on_shutdown(void) {
+  TEST_ASSERT(0 == shutdown_pipe_init());
+  Dispatcher d;
+  TEST_ASSERT(0 == dispatcher_init(&d, NULL, 0));
+  pthread_t dispatcher_thread;
+  TEST_ASSERT(0 == pthread_create(&dispatcher_thread, NULL,
+                                  dispatcher_pthread_func, &d));
+  int sv[2];
+  TEST_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  TEST_ASSERT(GO_AROUND == poll_fd(sv[0], 0));
+  usleep(20000);
+
+  // Neither the dispatcher nor poll_fd has a timeout here, so they would never
+  // return if the shutdown pipe didn't wake them.
+  set_interrupted_or_error();
+  TEST_ASSERT(0 == pthread_join(dispatcher_thread, NULL));
+  TEST_ASSERT(SIG_INTERRUPT_OR_ERROR == poll_fd(sv[0], -1));
+
+  dispatcher_destroy(&d);
+  close(sv[0]);
+  close(sv[1]);
+  atomic_store_explicit(&g_interrupted_or_error, false, memory_order_release);
+  close(g_shutdown_pipe[0]);
+  close(g_shutdown_pipe[1]);
+  g_shutdown_pipe[0] = g_shutdown_pipe[1] = -1;
+}
+
+/******************************************************************************
+    Tests for prefork
+******************************************************************************/
+
+typedef struct {
+  // In memory shared with the worker processes.
+  atomic_int worker_0_runs;
+  atomic_int worker_1_ready;
+  int n_on_ready_calls;
+} PreforkTestState;
+
+static PreforkTestState *new_prefork_test_state(void) {
+  PreforkTestState *s = mmap(NULL, sizeof(PreforkTestState),
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                             -1, 0);
+  TEST_ASSERT(s != MAP_FAILED);
+  atomic_init(&s->worker_0_runs, 0);
+  atomic_init(&s->worker_1_ready, 0);
+  s->n_on_ready_calls = 0;
+  return s;
+}
+
+static void prefork_test_on_ready(void *data) {
+  ++((PreforkTestState *)data)->n_on_ready_calls;
+}
+
+static int prefork_test_on_reload(void *data) {
+  (void)data;
+  return 0;
+}
+
+// Worker 0 crashes the first time it runs, once worker 1 is ready, and quits
+// the second time. Worker 1 runs until it's stopped.
+static int prefork_test_worker(int worker_index, void *data) {
+  PreforkTestState *s = (PreforkTestState *)data;
+  prefork_worker_ready();
+  if (worker_index == 1) {
+    atomic_store_explicit(&s->worker_1_ready, 1, memory_order_release);
+    for (;;)
+      pause();
+  }
+  if (0 != atomic_fetch_add_explicit(&s->worker_0_runs, 1,
+                                     memory_order_acq_rel))
+    return 0;
+  while (!atomic_load_explicit(&s->worker_1_ready, memory_order_acquire))
+    usleep(1000);
+  return 1;
+}
+
+static void TEST_prefork_restarts_crashed_worker_and_stops_on_quit(void) {
+  PreforkTestState *s = new_prefork_test_state();
+  PreforkConfig config = {.n_workers = 2,
+                          .run_worker = prefork_test_worker,
+                          .on_ready = prefork_test_on_ready,
+                          .on_reload = prefork_test_on_reload,
+                          .reload_fd = -1,
+                          .ready_timeout_ms = 10000,
+                          .data = s};
+  TEST_ASSERT(0 == prefork_run(&config));
+  TEST_ASSERT(2 == atomic_load(&s->worker_0_runs));
+  TEST_ASSERT(1 == s->n_on_ready_calls);
+  munmap(s, sizeof(*s));
+}
+
+static int prefork_test_failing_worker(int worker_index, void *data) {
+  (void)worker_index;
+  (void)data;
+  return 1;
+}
+
+static void TEST_prefork_fails_if_worker_exits_before_ready(void) {
+  PreforkTestState *s = new_prefork_test_state();
+  PreforkConfig config = {.n_workers = 1,
+                          .run_worker = prefork_test_failing_worker,
+                          .on_ready = prefork_test_on_ready,
+                          .on_reload = prefork_test_on_reload,
+                          .reload_fd = -1,
+                          .ready_timeout_ms = 10000,
+                          .data = s};
+  TEST_ASSERT(-1 == prefork_run(&config));
+  TEST_ASSERT(0 == s->n_on_ready_calls);
+  munmap(s, sizeof(*s));
+}
+
+/******************************************************************************
+    Tests for disk_cache
+******************************************************************************/
+
+static const char DISK_CACHE_TEST_KEY[] =
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F";
+
+typedef struct {
+  int n;
+  HashCacheUid uid;
+  uint8_t bytecode[64];
+  size_t bytecode_size;
+} DiskCacheTestLoaded;
+
+static bool disk_cache_test_add(HashCacheUid uid, const uint8_t *mapping,
+                                size_t mapping_size, const uint8_t *bytecode,
+                                size_t bytecode_size, void *data) {
+  DiskCacheTestLoaded *loaded = (DiskCacheTestLoaded *)data;
+  ++loaded->n;
+  loaded->uid = uid;
+  TEST_ASSERT(bytecode_size <= sizeof(loaded->bytecode));
+  memcpy(loaded->bytecode, bytecode, bytecode_size);
+  loaded->bytecode_size = bytecode_size;
+  munmap((void *)mapping, mapping_size);
+  return true;
+}
+
+static int disk_cache_test_n_files(const char *dir) {
+  DIR *d = opendir(dir);
+  TEST_ASSERT(d);
+  int n = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)))
+    n += ent->d_name[0] != '.';
+  closedir(d);
+  return n;
+}
+
+static void disk_cache_test_remove_dir(const char *dir) {
+  DIR *d = opendir(dir);
+  TEST_ASSERT(d);
+  struct dirent *ent;
+  while ((ent = readdir(d))) {
+    char path[2048];
+    if (ent->d_name[0] == '.')
+      continue;
+    snprintf_nowarn(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    unlink(path);
+  }
+  closedir(d);
+  rmdir(dir);
+}
+
+static void TEST_disk_cache_round_trip(void) {
+  char tmpdir[1024];
+  TEST_ASSERT(0 == make_temp_dir(tmpdir, sizeof(tmpdir),
+                                 "jsockd_TEST_disk_cache_XXXXXX"));
+  const uint8_t module[] = "module";
+  const uint8_t bytecode[] = "some command bytecode";
+
+  DiskCache dc;
+  TEST_ASSERT(0 == disk_cache_init(&dc, tmpdir, DISK_CACHE_TEST_KEY, "1.0.0"));
+  disk_cache_set_module(&dc, module, sizeof(module));
+  TEST_ASSERT(0 == disk_cache_write(&dc, 42, bytecode, sizeof(bytecode)));
+  TEST_ASSERT(1 == disk_cache_test_n_files(tmpdir));
+
+  DiskCacheTestLoaded loaded = {0};
+  TEST_ASSERT(1 == disk_cache_load(&dc, disk_cache_test_add, &loaded));
+  TEST_ASSERT(loaded.n == 1);
+  TEST_ASSERT(loaded.uid == 42);
+  TEST_ASSERT(loaded.bytecode_size == sizeof(bytecode));
+  TEST_ASSERT(0 == memcmp(loaded.bytecode, bytecode, sizeof(bytecode)));
+
+  disk_cache_test_remove_dir(tmpdir);
+}
+
+static void TEST_disk_cache_rejects_tampered_and_stale_files(void) {
+  char tmpdir[1024];
+  TEST_ASSERT(0 == make_temp_dir(tmpdir, sizeof(tmpdir),
+                                 "jsockd_TEST_disk_cache_XXXXXX"));
+  const uint8_t module[] = "module";
+  const uint8_t other_module[] = "other module";
+  const uint8_t bytecode[] = "some command bytecode";
+
+  DiskCache dc;
+  TEST_ASSERT(0 == disk_cache_init(&dc, tmpdir, DISK_CACHE_TEST_KEY, "1.0.0"));
+  disk_cache_set_module(&dc, module, sizeof(module));
+  TEST_ASSERT(0 == disk_cache_write(&dc, 42, bytecode, sizeof(bytecode)));
+
+  // Flip a bit of the bytecode.
+  char path[2048];
+  snprintf_nowarn(path, sizeof(path),
+                  "%s/" HASH_CACHE_UID_FORMAT_SPECIFIER DISK_CACHE_FILE_SUFFIX,
+                  tmpdir, HASH_CACHE_UID_FORMAT_ARGS((HashCacheUid)42));
+  FILE *f = fopen(path, "r+");
+  TEST_ASSERT(f);
+  TEST_ASSERT(0 == fseek(f, -64 - 2, SEEK_END));
+  int c = fgetc(f);
+  TEST_ASSERT(c != EOF);
+  TEST_ASSERT(0 == fseek(f, -64 - 2, SEEK_END));
+  TEST_ASSERT(EOF != fputc(c ^ 1, f));
+  fclose(f);
+
+  DiskCacheTestLoaded loaded = {0};
+  TEST_ASSERT(0 == disk_cache_load(&dc, disk_cache_test_add, &loaded));
+  TEST_ASSERT(loaded.n == 0);
+  TEST_ASSERT(0 == disk_cache_test_n_files(tmpdir));
+
+  // A file written with a different module, or by a different version, is
+  // ignored.
+  TEST_ASSERT(0 == disk_cache_write(&dc, 42, bytecode, sizeof(bytecode)));
+  disk_cache_set_module(&dc, other_module, sizeof(other_module));
+  TEST_ASSERT(0 == disk_cache_load(&dc, disk_cache_test_add, &loaded));
+  TEST_ASSERT(0 == disk_cache_write(&dc, 42, bytecode, sizeof(bytecode)));
+  DiskCache dc2;
+  TEST_ASSERT(0 == disk_cache_init(&dc2, tmpdir, DISK_CACHE_TEST_KEY, "2.0.0"));
+  disk_cache_set_module(&dc2, other_module, sizeof(other_module));
+  TEST_ASSERT(0 == disk_cache_load(&dc2, disk_cache_test_add, &loaded));
+  TEST_ASSERT(loaded.n == 0);
+
+  // So is a file written with a different key.
+  TEST_ASSERT(0 == disk_cache_write(&dc, 42, bytecode, sizeof(bytecode)));
+  DiskCache dc3;
+  TEST_ASSERT(0 == disk_cache_init(&dc3, tmpdir,
+                                   "FF0102030405060708090A0B0C0D0E0F10111213141"
+                                   "5161718191A1B1C1D1E1F",
+                                   "1.0.0"));
+  disk_cache_set_module(&dc3, other_module, sizeof(other_module));
+  TEST_ASSERT(0 == disk_cache_load(&dc3, disk_cache_test_add, &loaded));
+  TEST_ASSERT(loaded.n == 0);
+
+  TEST_ASSERT(-1 == disk_cache_init(&dc3, tmpdir, "0011", "1.0.0"));
+
+  disk_cache_test_remove_dir(tmpdir);
+}
+
+static bool disk_cache_test_reject(HashCacheUid uid, const uint8_t *mapping,
+                                   size_t mapping_size,
+                                   const uint8_t *bytecode,
+                                   size_t bytecode_size, void *data) {
+  (void)uid;
+  (void)mapping;
+  (void)mapping_size;
+  (void)bytecode;
+  (void)bytecode_size;
+  ++*(int *)data;
+  return false;
+}
+
+static void TEST_disk_cache_queues_updates(void) {
+  char tmpdir[1024];
+  TEST_ASSERT(0 == make_temp_dir(tmpdir, sizeof(tmpdir),
+                                 "jsockd_TEST_disk_cache_XXXXXX"));
+  const uint8_t module[] = "module";
+  const uint8_t bytecode[] = "some command bytecode";
+
+  DiskCache dc;
+  TEST_ASSERT(0 == disk_cache_init(&dc, tmpdir, DISK_CACHE_TEST_KEY, "1.0.0"));
+  disk_cache_set_module(&dc, module, sizeof(module));
+
+  // Nothing is written until the queue is flushed.
+  disk_cache_queue_write(&dc, 1, bytecode, sizeof(bytecode));
+  disk_cache_queue_write(&dc, 2, bytecode, sizeof(bytecode));
+  disk_cache_queue_remove(&dc, 1);
+  TEST_ASSERT(0 == disk_cache_test_n_files(tmpdir));
+  disk_cache_flush(&dc);
+  TEST_ASSERT(1 == disk_cache_test_n_files(tmpdir));
+
+  // The writer thread carries out the rest before it's joined.
+  TEST_ASSERT(0 == disk_cache_start_writer(&dc));
+  disk_cache_queue_write(&dc, 3, bytecode, sizeof(bytecode));
+  disk_cache_queue_remove(&dc, 2);
+  disk_cache_queue_remove(&dc, 4);
+  disk_cache_stop_writer(&dc);
+  TEST_ASSERT(1 == disk_cache_test_n_files(tmpdir));
+
+  DiskCacheTestLoaded loaded = {0};
+  TEST_ASSERT(1 == disk_cache_load(&dc, disk_cache_test_add, &loaded));
+  TEST_ASSERT(loaded.uid == 3);
+
+  // A file that doesn't fit in the command cache is removed.
+  int n_offered = 0;
+  TEST_ASSERT(0 == disk_cache_load(&dc, disk_cache_test_reject, &n_offered));
+  TEST_ASSERT(n_offered == 1);
+  TEST_ASSERT(0 == disk_cache_test_n_files(tmpdir));
+
+  disk_cache_test_remove_dir(tmpdir);
+}
+
+/******************************************************************************
+    Tests for named_commands
+******************************************************************************/
+
+static void TEST_named_commands_round_trip(void) {
+  const uint8_t module[] = "module bytecode";
+  NamedCommand commands[] = {
+      {.name = "zeta", .name_len = 4, .bytecode = (const uint8_t *)"z",
+       .bytecode_size = 1},
+      {.name = "alpha", .name_len = 5, .bytecode = (const uint8_t *)"aaa",
+       .bytecode_size = 3},
+      {.name = "al", .name_len = 2, .bytecode = (const uint8_t *)"bb",
+       .bytecode_size = 2},
+  };
+  const int n = sizeof(commands) / sizeof(commands[0]);
+  size_t section_size = named_commands_section_size(commands, n);
+  size_t size = sizeof(module) + section_size;
+  uint8_t *buf = malloc(size);
+  TEST_ASSERT(buf);
+  memcpy(buf, module, sizeof(module));
+  write_named_commands_section(buf + sizeof(module), commands, n);
+
+  TEST_ASSERT(named_commands_module_size(buf, size) == sizeof(module));
+  NamedCommands nc;
+  TEST_ASSERT(0 == parse_named_commands(buf, size, &nc));
+  TEST_ASSERT(nc.n_commands == n);
+  const NamedCommand *c = find_named_command(&nc, "alpha", 5);
+  TEST_ASSERT(c && c->bytecode_size == 3 && !memcmp(c->bytecode, "aaa", 3));
+  c = find_named_command(&nc, "al", 2);
+  TEST_ASSERT(c && c->bytecode_size == 2 && !memcmp(c->bytecode, "bb", 2));
+  c = find_named_command(&nc, "zeta", 4);
+  TEST_ASSERT(c && c->bytecode_size == 1 && !memcmp(c->bytecode, "z", 1));
+  TEST_ASSERT(!find_named_command(&nc, "a", 1));
+  TEST_ASSERT(!find_named_command(&nc, "beta", 4));
+  free_named_commands(&nc);
+
+  // A module without named commands has no section.
+  TEST_ASSERT(named_commands_module_size(module, sizeof(module)) ==
+              sizeof(module));
+  TEST_ASSERT(0 == parse_named_commands(module, sizeof(module), &nc));
+  TEST_ASSERT(nc.n_commands == 0);
+
+  // Corrupting a name length invalidates the section.
+  buf[sizeof(module)] ^= 0x40;
+  TEST_ASSERT(-1 == parse_named_commands(buf, size, &nc));
+  free(buf);
+}
+
+static void TEST_named_commands_set_owns_module_mapping(void) {
+  const uint8_t module[] = "module bytecode";
+  NamedCommand commands[] = {
+      {.name = "one", .name_len = 3, .bytecode = (const uint8_t *)"11",
+       .bytecode_size = 2},
+      {.name = "two", .name_len = 3, .bytecode = (const uint8_t *)"222",
+       .bytecode_size = 3},
+  };
+  size_t size = sizeof(module) + named_commands_section_size(commands, 2);
+  uint8_t *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  TEST_ASSERT(buf != MAP_FAILED);
+  memcpy(buf, module, sizeof(module));
+  write_named_commands_section(buf + sizeof(module), commands, 2);
+  NamedCommands nc;
+  TEST_ASSERT(0 == parse_named_commands(buf, size, &nc));
+  NamedCommandsSet *set = new_named_commands_set(&nc, buf, size);
+  TEST_ASSERT(set);
+  // The set has taken over the commands, so this is a no-op.
+  free_named_commands(&nc);
+
+  // The commands point into the mapping, which outlives the first reference
+  // (as it does a reload while a runtime still runs the old module).
+  TEST_ASSERT(set == ref_named_commands_set(set));
+  unref_named_commands_set(set);
+  const NamedCommand *c = find_named_command(&set->nc, "two", 3);
+  TEST_ASSERT(c && c->bytecode_size == 3 && !memcmp(c->bytecode, "222", 3));
+  TEST_ASSERT(c->bytecode > buf && c->bytecode < buf + size);
+  c = find_named_command(&set->nc, "one", 3);
+  TEST_ASSERT(c && c->bytecode_size == 2 && !memcmp(c->bytecode, "11", 2));
+
+  // The last reference unmaps it.
+  unref_named_commands_set(set);
+  TEST_ASSERT(-1 == msync(buf, size, MS_ASYNC) && errno == ENOMEM);
+
+  NamedCommands empty = {0};
+  set = new_named_commands_set(&empty, NULL, 0);
+  TEST_ASSERT(set && !find_named_command(&set->nc, "one", 3));
+  unref_named_commands_set(set);
+  unref_named_commands_set(NULL);
+}
+
+/******************************************************************************
+    Tests for spare_pool
+******************************************************************************/
+
+static ThreadState *take_spare_with_timeout(void) {
+  for (int i = 0; i < 500; ++i) {
+    ThreadState *spare = spare_pool_take();
+    if (spare)
+      return spare;
+    usleep(10000);
+  }
+  return NULL;
+}
+
+static void free_taken_spare(ThreadState *spare) {
+  JS_UpdateStackTop(spare->rt);
+  cleanup_thread_state(spare);
+  free(spare);
+}
+
+static void TEST_spare_pool_replaces_taken_and_stale_spares(void) {
+  TEST_ASSERT(NULL == spare_pool_take());
+  TEST_ASSERT(0 == spare_pool_start(1));
+
+  ThreadState *spare = take_spare_with_timeout();
+  TEST_ASSERT(spare && spare->rt);
+  TEST_ASSERT(spare->module_generation ==
+              atomic_load_explicit(&g_module_generation, memory_order_relaxed));
+  free_taken_spare(spare);
+
+  // Following a reload, spares created with the old module aren't handed out.
+  spare = take_spare_with_timeout();
+  TEST_ASSERT(spare);
+  free_taken_spare(spare);
+  atomic_fetch_add_explicit(&g_module_generation, 1, memory_order_relaxed);
+  spare_pool_refresh();
+  spare = take_spare_with_timeout();
+  TEST_ASSERT(spare && spare->rt);
+  TEST_ASSERT(spare->module_generation ==
+              atomic_load_explicit(&g_module_generation, memory_order_relaxed));
+  free_taken_spare(spare);
+
+  spare_pool_stop();
+  atomic_store_explicit(&g_module_generation, 0, memory_order_relaxed);
+}
+
+/******************************************************************************
+    Tests for live function cache
+******************************************************************************/
+
+static void TEST_live_function_cache_evicts_least_recently_used(void) {
+  ThreadState ts;
+  TEST_ASSERT(0 == init_thread_state_with_module(&ts, NULL, 0, NULL, 0));
+
+  JSValue funcs[LIVE_FUNCTION_CACHE_SIZE + 1];
+  for (int i = 0; i < LIVE_FUNCTION_CACHE_SIZE + 1; ++i)
+    funcs[i] = JS_NewObject(ts.ctx);
+  for (int i = 0; i < LIVE_FUNCTION_CACHE_SIZE; ++i)
+    add_live_function(&ts, (HashCacheUid)(i + 1), funcs[i]);
+
+  // Using the first function makes the second the least recently used.
+  JSValue f = get_live_function(&ts, 1);
+  TEST_ASSERT(JS_VALUE_GET_PTR(f) == JS_VALUE_GET_PTR(funcs[0]));
+  JS_FreeValue(ts.ctx, f);
+  add_live_function(&ts, LIVE_FUNCTION_CACHE_SIZE + 1,
+                    funcs[LIVE_FUNCTION_CACHE_SIZE]);
+
+  TEST_ASSERT(JS_IsUndefined(get_live_function(&ts, 2)));
+  for (int i = 0; i < LIVE_FUNCTION_CACHE_SIZE + 1; ++i) {
+    if (i == 1)
+      continue;
+    f = get_live_function(&ts, (HashCacheUid)(i + 1));
+    TEST_ASSERT(JS_VALUE_GET_PTR(f) == JS_VALUE_GET_PTR(funcs[i]));
+    JS_FreeValue(ts.ctx, f);
+  }
+  TEST_ASSERT(JS_IsUndefined(
+      get_live_function(&ts, (HashCacheUid)(LIVE_FUNCTION_CACHE_SIZE + 2))));
+
+  for (int i = 0; i < LIVE_FUNCTION_CACHE_SIZE + 1; ++i)
+    JS_FreeValue(ts.ctx, funcs[i]);
+  // This would fail an assertion in QuickJS if the cache leaked references.
+  cleanup_thread_state(&ts);
+}
+
 /******************************************************************************
     Tests for modcompiler
 ******************************************************************************/
@@ -1052,8 +2643,8 @@ static void TEST_compile_module_file(void) {
   fclose(keyf);
 
   TEST_ASSERT(EXIT_SUCCESS == compile_module_file(module_filename, key_filename,
-                                                  output_filename, "99.99.0",
-                                                  0));
+                                                  NULL, output_filename,
+                                                  "99.99.0", 0));
 
   FILE *outf = fopen(output_filename, "r");
   TEST_ASSERT(outf);
@@ -1110,7 +2701,7 @@ static void TEST_compile_module_file_without_key(void) {
 
   fclose(modulef);
 
-  TEST_ASSERT(EXIT_SUCCESS == compile_module_file(module_filename, NULL,
+  TEST_ASSERT(EXIT_SUCCESS == compile_module_file(module_filename, NULL, NULL,
                                                   output_filename, "99.99.0",
                                                   0));
 
@@ -1141,6 +2732,68 @@ static void TEST_compile_module_file_without_key(void) {
   rmdir(tmpdir);
 }
 
+static void TEST_compile_module_file_with_named_commands(void) {
+  char tmpdir[1024];
+  TEST_ASSERT(0 == make_temp_dir(
+                       tmpdir, sizeof(tmpdir),
+                       "jsockd_TEST_compile_module_file_with_named_XXXXXX"));
+
+  char module_filename[sizeof(tmpdir) + 128];
+  char manifest_filename[sizeof(tmpdir) + 128];
+  char output_filename[sizeof(tmpdir) + 128];
+  snprintf_nowarn(module_filename, sizeof(module_filename), "%s/mod.mjs",
+                  tmpdir);
+  snprintf_nowarn(manifest_filename, sizeof(manifest_filename),
+                  "%s/commands.json", tmpdir);
+  snprintf_nowarn(output_filename, sizeof(output_filename), "%s/out.qjsbc",
+                  tmpdir);
+
+  FILE *modulef = fopen(module_filename, "w");
+  FILE *manifestf = fopen(manifest_filename, "w");
+  TEST_ASSERT(modulef && manifestf);
+  TEST_ASSERT(0 <= fprintf(modulef, "export const foo = 17;\n"));
+  TEST_ASSERT(0 <= fprintf(manifestf, "{\"foo\": \"(m, p) => m.foo + p\", "
+                                      "\"bar/baz\": \"(m, p) => p\"}\n"));
+  fclose(modulef);
+  fclose(manifestf);
+
+  TEST_ASSERT(EXIT_SUCCESS == compile_module_file(module_filename, NULL,
+                                                  manifest_filename,
+                                                  output_filename, "99.99.0",
+                                                  0));
+
+  size_t size;
+  int mmap_errno;
+  const uint8_t *contents = mmap_file(output_filename, &size, &mmap_errno);
+  TEST_ASSERT(contents);
+  size_t bytecode_size = size - VERSION_STRING_SIZE - ED25519_SIGNATURE_SIZE;
+  NamedCommands nc;
+  TEST_ASSERT(0 == parse_named_commands(contents, bytecode_size, &nc));
+  TEST_ASSERT(nc.n_commands == 2);
+  TEST_ASSERT(find_named_command(&nc, "foo", 3));
+  TEST_ASSERT(find_named_command(&nc, "bar/baz", 7));
+  TEST_ASSERT(!find_named_command(&nc, "bar", 3));
+  TEST_ASSERT(named_commands_module_size(contents, bytecode_size) <
+              bytecode_size);
+  free_named_commands(&nc);
+  munmap((void *)contents, size);
+
+  // Names are restricted so that they can't contain the separator byte.
+  manifestf = fopen(manifest_filename, "w");
+  TEST_ASSERT(manifestf);
+  TEST_ASSERT(0 <= fprintf(manifestf, "{\"foo bar\": \"(m, p) => p\"}\n"));
+  fclose(manifestf);
+  TEST_ASSERT(EXIT_FAILURE == compile_module_file(module_filename, NULL,
+                                                  manifest_filename,
+                                                  output_filename, "99.99.0",
+                                                  0));
+
+  remove(module_filename);
+  remove(manifest_filename);
+  remove(output_filename);
+  rmdir(tmpdir);
+}
+
 static void TEST_output_key_file(void) {
   char tmpdir[1024];
   TEST_ASSERT(0 == make_temp_dir(tmpdir, sizeof(tmpdir),
@@ -1192,6 +2845,11 @@ TEST_LIST = {T(wait_group_inc_and_wait_basic_use_case),
              T(hash_cash_size_2_bucket_array),
              T(hash_cash_fuzz),
              T(hash_cash_stress_test),
+             T(hash_cache_gives_recently_used_entries_a_second_chance),
+             T(hash_cache_evicts_unused_entries),
+             T(hash_cache_finds_other_entries_for_uid),
+             T(parse_hash_cache_uid_round_trips),
+             T(parse_hash_cache_uid_rejects_malformed_hashes),
              T(line_buf_simple_case),
              T(line_buf_awkward_chunking),
              T(line_buf_truncation),
@@ -1245,12 +2903,62 @@ TEST_LIST = {T(wait_group_inc_and_wait_basic_use_case),
              T(cmdargs_dash_ss_must_be_combined_with_dash_c),
              T(cmdargs_dash_c_can_be_combined_with_dash_sd),
              T(cmdargs_dash_c_can_be_combined_with_dash_ss),
+             T(cmdargs_dash_c_can_be_combined_with_dash_cm),
+             T(cmdargs_dash_cm_must_be_combined_with_dash_c),
              T(compile_module_file),
              T(compile_module_file_without_key),
+             T(compile_module_file_with_named_commands),
              T(output_key_file),
              T(cmdargs_dash_e_stdin),
              T(cmdargs_dash_e_string),
              T(cmdargs_dash_e_error_on_missing_arg),
              T(cmdargs_dash_e_error_on_double_flag),
              T(cmdargs_dash_e_error_if_dash_sm_without_dash_m),
+             T(cmdargs_dash_r),
+             T(cmdargs_dash_r_error_on_0),
+             T(cmdargs_dash_r_error_on_more_than_MAX_THREADS),
+             T(cmdargs_dash_r_error_on_double_flag),
+             T(cmdargs_dash_r_range),
+             T(cmdargs_dash_r_range_error_on_max_less_than_min),
+             T(cmdargs_dash_a_cpu_list),
+             T(cmdargs_dash_a_auto),
+             T(cmdargs_dash_a_error_on_bad_list),
+             T(cmdargs_dash_w),
+             T(cmdargs_dash_w_error_without_dash_r),
+             T(cmdargs_dash_w_error_on_reserving_all_runtimes),
+             T(cmdargs_dash_q_and_dash_qt),
+             T(cmdargs_dash_q_error_without_dash_r),
+             T(cmdargs_dash_p),
+             T(cmdargs_dash_p_error_on_out_of_range),
+             T(cmdargs_dash_cn_and_dash_cb),
+             T(cmdargs_dash_cn_and_dash_cb_error_on_out_of_range),
+             T(cmdargs_dash_cd),
+             T(cmdargs_dash_nc),
+             T(cmdargs_dash_f),
+             T(cmdargs_dash_f_error_with_shared_runtimes_or_spares),
+             T(mpmc_queue_fifo_full_and_empty),
+             T(mpmc_queue_multiple_producers_and_consumers),
+             T(dispatcher_hands_over_complete_records),
+             T(conn_frame_input_keeps_partial_commands_per_connection),
+             T(dispatcher_routes_message_responses_past_pipelined_commands),
+             T(dispatcher_collects_async_message_responses),
+             T(dispatcher_executes_multiplexed_commands_concurrently),
+             T(dispatcher_grows_and_shrinks_elastic_pool),
+             T(dispatcher_schedules_classes_by_weight),
+             T(dispatcher_keeps_reserved_runtimes_for_their_class),
+             T(dispatcher_rejects_commands_when_too_many_are_queued),
+             T(dispatcher_rejects_commands_that_wait_too_long),
+             T(dispatcher_isnt_blocked_by_a_multiplexed_conn),
+             T(dispatcher_defers_rejection_while_a_response_is_written),
+             T(dispatcher_take_returns_null_after_stop),
+             T(dispatcher_and_poll_fd_wake_on_shutdown),
+             T(prefork_restarts_crashed_worker_and_stops_on_quit),
+             T(prefork_fails_if_worker_exits_before_ready),
+             T(disk_cache_round_trip),
+             T(disk_cache_rejects_tampered_and_stale_files),
+             T(disk_cache_queues_updates),
+             T(named_commands_round_trip),
+             T(named_commands_set_owns_module_mapping),
+             T(spare_pool_replaces_taken_and_stale_spares),
+             T(live_function_cache_evicts_least_recently_used),
              {NULL, NULL}};
@@ -22,6 +22,11 @@ awk 'BEGIN { for (i = 0; i < ARGV[1]; i++) { print i"\n(m) => { "i"; ({}).foo.ba
 # A command that does a bunch of allocation and then times out.
 printf "uniqueid\n() => { let a = []; for (let i = 0; i < 10; ++i) { a.push({}); } ; for (;;) ; }\n\"dummy_input4\"\n"
 
+# A command with a budget that it finishes within, and one whose budget runs out
+# while it's executing.
+printf "budget_ok 10000000\n(m) => 1\n\"dummy_input7\"\n"
+printf "budget_exceeded 1000\n() => { for (;;) ; }\n\"dummy_input8\"\n"
+
 # A command where the command id is truncated
 printf "?truncated\n(m) => 1\n\"dummy_input5\"\n"
 